@@ -0,0 +1,492 @@
+/***
+ * pstbench.c
+ * Part of the LibPST project
+ *
+ * Repeatable micro-benchmarks for the libpst hot paths, written as JSON
+ * so that runs can be compared mechanically. The kernels that need a
+ * file (index lookups, id2 trees and block parsing) run against the pst
+ * named on the command line; `make bench` generates one with pstgen.
+ */
+
+// pst_decrypt(), pst_build_id2() and pst_parse_block() are static, so the
+// benchmark is built from the library source rather than its public interface
+#include "libpst.c"
+#include "lzfu.h"
+
+#include <time.h>
+
+#define BENCH_BUFSIZE   8192    // one pst block
+#define BENCH_TEXTSIZE  65536   // a large message body
+#define BENCH_SAMPLES   4096    // blocks kept per parse_block category
+
+
+typedef size_t (*bench_fn)(void *arg);
+
+
+typedef struct bench_result {
+    uint64_t iterations;
+    double   seconds;
+    uint64_t bytes;
+} bench_result;
+
+
+typedef struct bench_buffer {
+    char    *data;
+    size_t   size;
+    uint64_t id;
+    int      type;
+} bench_buffer;
+
+
+typedef struct bench_block {
+    uint64_t      id;
+    size_t        size;
+    pst_id2_tree *i2_head;
+} bench_block;
+
+
+typedef struct bench_blocks {
+    bench_block *blocks;
+    size_t       count;
+    size_t       next;
+} bench_blocks;
+
+
+typedef struct bench_ids {
+    uint64_t *ids;
+    size_t    count;
+    size_t    next;
+} bench_ids;
+
+
+typedef struct bench_descs {
+    pst_index_ll **lists;
+    size_t         count;
+    size_t         next;
+} bench_descs;
+
+
+typedef struct bench_string {
+    const char *text;
+    int         mode;   // 0 for rfc2231, otherwise the rfc2047 needs_quote flag + 1
+} bench_string;
+
+
+static pst_file pstfile;
+static double   min_time = 0.2;
+static int      rounds   = 5;
+static const char *filter = NULL;
+static int      written  = 0;
+static uint64_t rng      = 1;
+
+
+static uint32_t bench_random(void) {
+    // xorshift, so the inputs are the same on every run
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint32_t)(rng >> 16);
+}
+
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void bench_loop(bench_fn fn, void *arg, uint64_t iterations, bench_result *r) {
+    uint64_t i;
+    double start = bench_now();
+    r->bytes = 0;
+    for (i = 0; i < iterations; i++) r->bytes += fn(arg);
+    r->seconds    = bench_now() - start;
+    r->iterations = iterations;
+}
+
+
+static int bench_compare(const void *a, const void *b) {
+    const bench_result *x = a, *y = b;
+    double dx = x->seconds / x->iterations;
+    double dy = y->seconds / y->iterations;
+    return (dx < dy) ? -1 : (dx > dy) ? 1 : 0;
+}
+
+
+/** time one kernel and write its JSON record
+ *
+ *  The iteration count is doubled until a single round takes at least
+ *  min_time, then that count is run rounds times and the median round
+ *  is reported.
+ */
+static void bench(const char *name, bench_fn fn, void *arg) {
+    bench_result *results, calib;
+    uint64_t n = 1;
+    int i;
+
+    if (filter && !strstr(name, filter)) return;
+    fn(arg);    // warm the caches and any lazily opened state
+    while (1) {
+        bench_loop(fn, arg, n, &calib);
+        if (calib.seconds >= min_time || n >= ((uint64_t)1 << 40)) break;
+        n *= 2;
+    }
+    results = pst_malloc(rounds * sizeof(bench_result));
+    for (i = 0; i < rounds; i++) bench_loop(fn, arg, n, &results[i]);
+    qsort(results, rounds, sizeof(bench_result), bench_compare);
+    bench_result *r = &results[rounds/2];
+
+    printf("%s\n    {\"name\": \"%s\", \"iterations\": %" PRIu64 ", \"rounds\": %d, \"ns_per_op\": %.1f",
+           (written++) ? "," : "", name, r->iterations, rounds, r->seconds * 1e9 / r->iterations);
+    if (r->bytes) printf(", \"bytes_per_op\": %.1f, \"bytes_per_sec\": %.0f",
+           (double)r->bytes / r->iterations, r->bytes / r->seconds);
+    printf("}");
+    fflush(stdout);
+    free(results);
+}
+
+
+static size_t bench_decrypt(void *arg) {
+    bench_buffer *b = arg;
+    // decrypting in place scrambles the buffer, which is fine for timing
+    pst_decrypt(b->id++, b->data, b->size, b->type);
+    return b->size;
+}
+
+
+static size_t bench_lzfu(void *arg) {
+    bench_buffer *b = arg;
+    size_t size;
+    char *out = pst_lzfu_decompress(b->data, b->size, &size);
+    free(out);
+    return size;
+}
+
+
+static size_t bench_base64(void *arg) {
+    bench_buffer *b = arg;
+    int line_count = 0;
+    char *out = pst_base64_encode_multiple(b->data, b->size, &line_count);
+    free(out);
+    return b->size;
+}
+
+
+static pst_vbuf *utf8_buf = NULL;
+
+
+static size_t bench_utf16(void *arg) {
+    bench_buffer *b = arg;
+    if (pst_vb_utf16to8(utf8_buf, b->data, b->size) == (size_t)-1) DIE(("utf16 conversion failed\n"));
+    return b->size;
+}
+
+
+static size_t bench_rfc(void *arg) {
+    bench_string *b = arg;
+    pst_item item;
+    pst_string str;
+    size_t n = strlen(b->text);
+    memset(&item, 0, sizeof(item));
+    str.str     = strdup(b->text);
+    str.is_utf8 = 1;
+    if (b->mode) pst_rfc2047(&item, &str, b->mode - 1);
+    else         pst_rfc2231(&str);
+    free(str.str);
+    return n;
+}
+
+
+static size_t bench_getid(void *arg) {
+    bench_ids *b = arg;
+    if (!pst_getID(&pstfile, b->ids[b->next])) DIE(("id %#" PRIx64 " not found\n", b->ids[b->next]));
+    if (++b->next == b->count) b->next = 0;
+    return 0;
+}
+
+
+static size_t bench_build_id2(void *arg) {
+    bench_descs *b = arg;
+    pst_index_ll *list = b->lists[b->next];
+    pst_free_id2(pst_build_id2(&pstfile, list));
+    if (++b->next == b->count) b->next = 0;
+    return list->size;
+}
+
+
+static size_t bench_parse_block(void *arg) {
+    bench_blocks *b = arg;
+    bench_block *k = &b->blocks[b->next];
+    pst_mapi_object *list = pst_parse_block(&pstfile, k->id, k->i2_head, 1);
+    if (!list) DIE(("cannot parse block %#" PRIx64 "\n", k->id));
+    pst_free_list(list);
+    if (++b->next == b->count) b->next = 0;
+    return k->size;
+}
+
+
+static const char words[] = "the quick brown fox jumps over the lazy dog \\par {\\b bold} \\'e9t\\'e9 ";
+
+
+static void fill_text(char *buf, size_t size) {
+    size_t i;
+    for (i = 0; i < size; i++) buf[i] = words[(i + bench_random() % 3) % (sizeof(words) - 1)];
+}
+
+
+static void put32(char *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+
+/** build a compressed rtf stream that mixes literals and dictionary
+ *  references, about two thirds of them references
+ */
+static void make_lzfu(bench_buffer *b, size_t raw_size) {
+    size_t cap = 16 + raw_size * 9 / 8 + 32;
+    char *out = pst_malloc(cap);
+    size_t in = 16, raw = 0;
+    uint32_t dict_length = 207;     // the length of the initial dictionary
+    while (raw < raw_size) {
+        size_t flag_pos = in++;
+        unsigned char flags = 0;
+        int bit;
+        for (bit = 0; bit < 8 && raw < raw_size; bit++) {
+            if (raw > 64 && bench_random() % 3) {
+                uint32_t length = 2 + bench_random() % 16;
+                uint32_t offset = (dict_length + 4096 - 1 - bench_random() % 1024) % 4096;
+                flags |= 1 << bit;
+                out[in++] = (char)(offset >> 4);
+                out[in++] = (char)(((offset & 0xf) << 4) | (length - 2));
+                dict_length = (dict_length + length) % 4096;
+                raw += length;
+            }
+            else {
+                out[in++] = words[bench_random() % (sizeof(words) - 1)];
+                dict_length = (dict_length + 1) % 4096;
+                raw++;
+            }
+        }
+        out[flag_pos] = flags;
+    }
+    put32(out,      in - 4);
+    put32(out + 4,  raw);
+    put32(out + 8,  0x75465a4c);    // LZFu
+    put32(out + 12, 0);
+    b->data = out;
+    b->size = in;
+}
+
+
+static void make_utf16(bench_buffer *b, size_t chars) {
+    size_t i;
+    b->size = 2 * (chars + 1);
+    b->data = pst_malloc(b->size);
+    for (i = 0; i < chars; i++) {
+        uint32_t r = bench_random() % 64;
+        uint16_t c = (r == 0) ? 0x00e9 :            // mostly ascii, some latin-1 and cjk
+                     (r == 1) ? 0x6f22 :
+                     (uint16_t)("Lorem ipsum dolor sit amet "[i % 27]);
+        b->data[2*i]   = (char)(c & 0xff);
+        b->data[2*i+1] = (char)(c >> 8);
+    }
+    b->data[2*chars] = b->data[2*chars+1] = 0;
+}
+
+
+static int block_category(uint64_t id) {
+    char *buf = NULL;
+    size_t size = pst_ff_getIDblock_dec(&pstfile, id, &buf);
+    int category = -1;
+    if (size >= 4) {
+        uint16_t index_offset = PST_LE_GET_UINT16(buf);
+        uint16_t type         = PST_LE_GET_UINT16(buf + 2);
+        if (index_offset == 0x0101) {
+            // only lists of 0xbcec or 0x7cec blocks, not the data trees of large values
+            pst_table3_rec table3_rec;
+            if (type && size >= 16) {
+                pst_decode_type3(&pstfile, &table3_rec, buf + 8);
+                if (block_category(table3_rec.id) > 0) category = 0;
+            }
+        }
+        else if (type == 0x7CEC)         category = 1;
+        else if (type == 0xBCEC)         category = 2;
+    }
+    if (buf) free(buf);
+    return category;
+}
+
+
+static void add_block(bench_blocks *cat, uint64_t id, pst_id2_tree *i2_head) {
+    pst_index_ll *ptr;
+    int c = block_category(id);
+    if (c < 0 || cat[c].count >= BENCH_SAMPLES) return;
+    if (!(ptr = pst_getID(&pstfile, id))) return;
+    cat[c].blocks[cat[c].count].id      = id;
+    cat[c].blocks[cat[c].count].size    = ptr->size;
+    cat[c].blocks[cat[c].count].i2_head = i2_head;
+    cat[c].count++;
+}
+
+
+static void bench_file(void) {
+    static const char *names[] = {"parse_block_0101", "parse_block_7cec", "parse_block_bcec"};
+    bench_ids ids;
+    bench_descs descs;
+    bench_blocks cat[3];
+    pst_id2_tree **trees;
+    size_t ntrees = 0, i;
+    pst_desc_tree *d;
+
+    // index lookups, in a fixed shuffled order so the bsearch paths vary
+    ids.count = pstfile.i_count;
+    ids.next  = 0;
+    ids.ids   = pst_malloc((ids.count + 1) * sizeof(uint64_t));
+    for (i = 0; i < ids.count; i++) ids.ids[i] = pstfile.i_table[i].i_id;
+    for (i = ids.count; i > 1; i--) {
+        size_t j = bench_random() % i;
+        uint64_t t = ids.ids[i-1]; ids.ids[i-1] = ids.ids[j]; ids.ids[j] = t;
+    }
+    if (ids.count) bench("getID", bench_getid, &ids);
+    free(ids.ids);
+
+    // every descriptor with an id2 tree, and a sample of each block type
+    descs.count = descs.next = 0;
+    descs.lists = NULL;
+    memset(cat, 0, sizeof(cat));
+    for (i = 0; i < 3; i++) cat[i].blocks = pst_malloc(BENCH_SAMPLES * sizeof(bench_block));
+    for (d = pstfile.d_head; d; d = pst_getNextDptr(d)) {
+        if (d->assoc_tree) descs.count++;
+    }
+    descs.lists = pst_malloc((descs.count + 1) * sizeof(pst_index_ll*));
+    trees       = pst_malloc((descs.count + 1) * sizeof(pst_id2_tree*));
+    descs.count = 0;
+    for (d = pstfile.d_head; d; d = pst_getNextDptr(d)) {
+        pst_id2_tree *i2_head = NULL, *i2;
+        if (d->assoc_tree) {
+            descs.lists[descs.count++] = d->assoc_tree;
+            i2_head = trees[ntrees++] = pst_build_id2(&pstfile, d->assoc_tree);
+        }
+        if (d->desc) add_block(cat, d->desc->i_id, i2_head);
+        for (i2 = i2_head; i2; i2 = i2->next) {
+            if (i2->id) add_block(cat, i2->id->i_id, i2->child);
+        }
+    }
+    if (descs.count) bench("build_id2", bench_build_id2, &descs);
+    for (i = 0; i < 3; i++) {
+        if (cat[i].count) bench(names[i], bench_parse_block, &cat[i]);
+        else if (!filter || strstr(names[i], filter))
+            fprintf(stderr, "pstbench: no blocks for %s in this file\n", names[i]);
+        free(cat[i].blocks);
+    }
+    for (i = 0; i < ntrees; i++) pst_free_id2(trees[i]);
+    free(trees);
+    free(descs.lists);
+}
+
+
+static void usage(void) {
+    printf("Usage: pstbench [options] [file.pst]\n");
+    printf("\trun the libpst micro-benchmarks and write the results as JSON\n");
+    printf("Options:\n");
+    printf("\t-k name\t- Only run kernels whose name contains this string\n");
+    printf("\t-r count\t- Rounds per kernel, the median is reported (default 5)\n");
+    printf("\t-t seconds\t- Minimum time per round (default 0.2)\n");
+    printf("\t-h\t- Help. This screen\n");
+}
+
+
+int main(int argc, char* const* argv) {
+    bench_buffer comp, high, lzfu, text, utf16;
+    bench_string rfc2047_plain  = {"Quarterly report for the board", 1};
+    bench_string rfc2047_quoted = {"Quarterly report for the board", 2};
+    bench_string rfc2047_coded  = {"Quarterly\treport\tfor the board \xc3\xa9t\xc3\xa9", 1};
+    bench_string rfc2231        = {"quarterly report for the board.pdf", 0};
+    const char *fname = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "hk:r:t:")) != -1) {
+        switch (c) {
+            case 'k':
+                filter = optarg;
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 't':
+                min_time = atof(optarg);
+                break;
+            case 'h':
+                usage();
+                exit(0);
+            default:
+                usage();
+                exit(1);
+        }
+    }
+    if (optind < argc) fname = argv[optind++];
+    if (optind != argc || rounds < 1 || min_time <= 0) {
+        usage();
+        exit(1);
+    }
+
+    DEBUG_INIT(NULL, NULL);
+    pst_unicode_init();
+    if (fname) {
+        if (pst_open(&pstfile, fname, NULL)) DIE(("Error opening File\n"));
+        if (pst_load_index(&pstfile)) DIE(("Index Error\n"));
+        pst_load_extended_attributes(&pstfile);
+    }
+
+    comp.size = high.size = BENCH_BUFSIZE;
+    comp.data = pst_malloc(BENCH_BUFSIZE);
+    high.data = pst_malloc(BENCH_BUFSIZE);
+    fill_text(comp.data, BENCH_BUFSIZE);
+    memcpy(high.data, comp.data, BENCH_BUFSIZE);
+    comp.id   = high.id = 0x100;
+    comp.type = PST_COMP_ENCRYPT;
+    high.type = PST_ENCRYPT;
+    make_lzfu(&lzfu, BENCH_TEXTSIZE);
+    text.size = BENCH_TEXTSIZE;
+    text.data = pst_malloc(BENCH_TEXTSIZE);
+    fill_text(text.data, BENCH_TEXTSIZE);
+    make_utf16(&utf16, BENCH_BUFSIZE);
+    utf8_buf = pst_vballoc(BENCH_BUFSIZE);
+
+    printf("{\n  \"file\": ");
+    if (fname) {
+        const char *p;
+        printf("\"");
+        for (p = fname; *p; p++) {
+            if (*p == '"' || *p == '\\') printf("\\");
+            if ((unsigned char)*p >= 32) printf("%c", *p);
+        }
+        printf("\"");
+    }
+    else printf("null");
+    printf(",\n  \"benchmarks\": [");
+
+    bench("decrypt_compress",  bench_decrypt, &comp);
+    bench("decrypt_high",      bench_decrypt, &high);
+    bench("lzfu_decompress",   bench_lzfu,    &lzfu);
+    bench("base64_encode",     bench_base64,  &text);
+    bench("utf16to8",          bench_utf16,   &utf16);
+    bench("rfc2047_plain",     bench_rfc,     &rfc2047_plain);
+    bench("rfc2047_quoted",    bench_rfc,     &rfc2047_quoted);
+    bench("rfc2047_base64",    bench_rfc,     &rfc2047_coded);
+    bench("rfc2231",           bench_rfc,     &rfc2231);
+    if (fname) bench_file();
+    printf("\n  ]\n}\n");
+
+    free(comp.data);
+    free(high.data);
+    free(lzfu.data);
+    free(text.data);
+    free(utf16.data);
+    free(utf8_buf->buf);
+    free(utf8_buf);
+    if (fname) pst_close(&pstfile);
+    DEBUG_CLOSE();
+    return 0;
+}
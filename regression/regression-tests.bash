@@ -100,6 +100,185 @@ function dopst()
 }
 
 
+function dodiff()
+{
+    # keep in the output, and show, any difference between two conversions
+    # of output$n that must be the same
+    n="$1"
+    if ! diff -r "output$n/$2" "output$n/$3" > "output$n/$2-$3.diff" 2>&1; then
+        echo "output$n/$2 and output$n/$3 differ"
+    fi
+}
+
+
+function dogunzip()
+{
+    # decompress the files of output$n/$3 that readpst compressed, those
+    # that output$n/$2 has without the .gz
+    n="$1"
+    (cd "output$n/$3" && find . -type f -name '*.gz') | while read -r a; do
+        [ -e "output$n/$2/$a" ] || gzip -d "output$n/$3/$a"
+    done
+}
+
+
+function dothreads()
+{
+    # the thread pool must write the same as a conversion in one process
+    n="$1"
+    fn="$2"
+    ba=$(basename "$fn" .pst)
+    size=$(stat -c %s "$fn")
+    rm -rf "output$n"
+    if [ 0 -eq "${#val[@]}" ] || [ "$size" -lt 100000000 ]; then
+        echo "$fn"
+        mkdir -p "output$n/serial" "output$n/threads"
+        "${val[@]}" ../src/readpst -j 0           -te -r -cv -o "output$n/serial"  "$fn" >  "$ba.threads.err" 2>&1
+        "${val[@]}" ../src/readpst -j 4 --threads -te -r -cv -o "output$n/threads" "$fn" >> "$ba.threads.err" 2>&1
+        dodiff "$n" serial threads
+    fi
+}
+
+
+function dogzip()
+{
+    # the mbox files written with --gzip and the message files written with
+    # --gzip-separate must decompress to what is written without them
+    n="$1"
+    fn="$2"
+    ba=$(basename "$fn" .pst)
+    size=$(stat -c %s "$fn")
+    jobs=()
+    [ "${#val[@]}" -gt 0 ] && jobs=(-j 0)
+    rm -rf "output$n"
+    if [ 0 -eq "${#val[@]}" ] || [ "$size" -lt 100000000 ]; then
+        echo "$fn"
+        mkdir -p "output$n/mbox" "output$n/mbox.gz" "output$n/separate" "output$n/separate.gz"
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r    -cv                 -o "output$n/mbox"        "$fn" >  "$ba.gzip.err" 2>&1
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r    -cv --gzip          -o "output$n/mbox.gz"     "$fn" >> "$ba.gzip.err" 2>&1
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -S -cv                 -o "output$n/separate"    "$fn" >> "$ba.gzip.err" 2>&1
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -S -cv --gzip-separate -o "output$n/separate.gz" "$fn" >> "$ba.gzip.err" 2>&1
+        dogunzip "$n" mbox mbox.gz
+        dogunzip "$n" separate separate.gz
+        dodiff "$n" mbox mbox.gz
+        dodiff "$n" separate separate.gz
+    fi
+}
+
+
+function dotar()
+{
+    # the archives written with --tar, and with --tar --gzip, must extract
+    # to what separate mode writes without them, and nothing may be written
+    # to the output directory
+    n="$1"
+    fn="$2"
+    ba=$(basename "$fn" .pst)
+    size=$(stat -c %s "$fn")
+    jobs=()
+    [ "${#val[@]}" -gt 0 ] && jobs=(-j 0)
+    rm -rf "output$n"
+    if [ 0 -eq "${#val[@]}" ] || [ "$size" -lt 100000000 ]; then
+        echo "$fn"
+        mkdir -p "output$n/separate" "output$n/none" "output$n/tar" "output$n/tar.gz"
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -S -cv                                    -o "output$n/separate" "$fn" >  "$ba.tar.err" 2>&1
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -S -cv        --tar "output$n/out.tar"    -o "output$n/none"     "$fn" >> "$ba.tar.err" 2>&1
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -S -cv --gzip --tar "output$n/out.tar.gz" -o "output$n/none"     "$fn" >> "$ba.tar.err" 2>&1
+        tar -xf  "output$n/out.tar"    -C "output$n/tar"
+        tar -xzf "output$n/out.tar.gz" -C "output$n/tar.gz"
+        rm -f "output$n/out.tar" "output$n/out.tar.gz"
+        dodiff "$n" separate tar
+        dodiff "$n" separate tar.gz
+    fi
+}
+
+
+function doresume()
+{
+    # a conversion killed after its first checkpoint and then resumed must
+    # write the same as one that was not stopped
+    n="$1"
+    fn="$2"
+    ba=$(basename "$fn" .pst)
+    size=$(stat -c %s "$fn")
+    rm -rf "output$n"
+    if [ 0 -eq "${#val[@]}" ] || [ "$size" -lt 100000000 ]; then
+        echo "$fn"
+        mkdir -p "output$n/whole" "output$n/resumed"
+        journal="output$n/resumed/.readpst-journal"
+        "${val[@]}" ../src/readpst -j 0 -te -r -cv -o "output$n/whole" "$fn" > "$ba.resume.err" 2>&1
+        "${val[@]}" ../src/readpst -j 0 -te -r -cv --checkpoint=10 -o "output$n/resumed" "$fn" >> "$ba.resume.err" 2>&1 &
+        pid=$!
+        while kill -0 "$pid" 2>/dev/null && ! grep -q '^P' "$journal" 2>/dev/null; do sleep 0.01; done
+        kill -9 "$pid" 2>/dev/null
+        { wait "$pid"; } 2>/dev/null
+        grep -q '^F' "$journal" && echo "$fn was converted before it could be stopped"
+        "${val[@]}" ../src/readpst -j 0 -te -r -cv --resume --checkpoint=10 -o "output$n/resumed" "$fn" >> "$ba.resume.err" 2>&1
+        rm -f "$journal"
+        dodiff "$n" whole resumed
+    fi
+}
+
+
+function dodedup()
+{
+    # separate mode with the attachments written once into .attachments
+    n="$1"
+    fn="$2"
+    ba=$(basename "$fn" .pst)
+    size=$(stat -c %s "$fn")
+    jobs=()
+    [ "${#val[@]}" -gt 0 ] && jobs=(-j 0)
+    rm -rf "output$n"
+    if [ 0 -eq "${#val[@]}" ] || [ "$size" -lt 100000000 ]; then
+        echo "$fn"
+        mkdir "output$n"
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -S -cv --dedup -o "output$n" "$fn" > "$ba.dedup.err" 2>&1
+    fi
+}
+
+
+function doincremental()
+{
+    # the second run with the state of the first one writes nothing
+    n="$1"
+    fn="$2"
+    ba=$(basename "$fn" .pst)
+    size=$(stat -c %s "$fn")
+    jobs=()
+    [ "${#val[@]}" -gt 0 ] && jobs=(-j 0)
+    rm -rf "output$n"
+    if [ 0 -eq "${#val[@]}" ] || [ "$size" -lt 100000000 ]; then
+        echo "$fn"
+        mkdir -p "output$n/1" "output$n/2"
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -cv --incremental "output$n/state" -o "output$n/1" "$fn" >  "$ba.incremental.err" 2>&1
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -cv --incremental "output$n/state" -o "output$n/2" "$fn" >> "$ba.incremental.err" 2>&1
+    fi
+}
+
+
+function dofilter()
+{
+    # a filtered run, and a filtered incremental run followed by an
+    # unfiltered one, which must still write the messages filtered out
+    n="$1"
+    fn="$2"
+    ex="$3"
+    ba=$(basename "$fn" .pst)
+    size=$(stat -c %s "$fn")
+    jobs=()
+    [ "${#val[@]}" -gt 0 ] && jobs=(-j 0)
+    rm -rf "output$n"
+    if [ 0 -eq "${#val[@]}" ] || [ "$size" -lt 100000000 ]; then
+        echo "$fn"
+        mkdir -p "output$n/1" "output$n/2" "output$n/3"
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -cv --filter "$ex" -o "output$n/1" "$fn" > "$ba.filter.err" 2>&1
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -cv --filter "$ex" --incremental "output$n/state" -o "output$n/2" "$fn" >> "$ba.filter.err" 2>&1
+        "${val[@]}" ../src/readpst "${jobs[@]}" -te -r -cv                --incremental "output$n/state" -o "output$n/3" "$fn" >> "$ba.filter.err" 2>&1
+    fi
+}
+
+
 #consistency
 #exit
 
@@ -108,6 +287,9 @@ pushd ..
 make || exit
 popd || exit
 
+# end to end timings against a stored baseline, see throughput-tests.py --help
+[ "$1" == "throughput" ] && shift && exec ./throughput-tests.py "$@"
+
 rm -rf output* ./*.err ./*.log
 
 v=(valgrind --leak-check=full)
@@ -155,6 +337,16 @@ $func  29 pstsample2.pst        # embedded image in rtf data
 $func  30 pstsample3.pst        # exports of rtf and html
 $func  31 Journal_Archives_08_29_2010.pst
 
+if [ "$func" == "dopst" ]; then
+    dodedup       32 paul.sheer.pst     # embedded rfc822 attachment
+    doincremental 33 ams.pst
+    dofilter      34 ams.pst after=2005-01-01,class=IPM.Note
+    dothreads     35 big_mail.pst
+    doresume      36 big_mail.pst
+    dogzip        37 paul.sheer.pst
+    dotar         38 paul.sheer.pst
+fi
+
 [ "${#val[@]}" -gt 0 ] && grep 'lost:' ./*err | grep -v 'lost: 0 '
 
 if [ "$regression" == "yes" ]; then
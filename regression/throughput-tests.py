@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+#
+# End to end throughput tests for the command line tools.
+#
+# Generates a fixed synthetic corpus with pstgen, runs readpst (normal, -r,
+# -S and -m), lspst, pst2ldif and pst2dii over it, and records wall time,
+# cpu time, peak rss, bytes read and files written for each run. Each run
+# is repeated, and the median of each metric is kept. The results are
+# compared against a stored baseline, and the script exits non-zero when
+# any of them regress by more than the tolerance, and the times also by
+# more than the floor.
+#
+#   ./throughput-tests.py --save        record the baseline on this machine
+#   ./throughput-tests.py               compare against it
+#
+# Timings are only comparable on the machine that recorded the baseline,
+# so the baseline is not kept in the source tree.
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+# name, pstgen arguments; -m is scaled by --scale
+corpus = [
+    ("unicode64",   ["-f", "64", "-d", "2", "-b", "4", "-m", "100", "-s", "4000", "-n", "1", "-z", "20000"]),
+    ("ansi32",      ["-f", "32", "-a", "-e", "compress", "-d", "2", "-b", "3", "-m", "100", "-s", "2000"]),
+    ("ost4k",       ["-f", "4k", "-O", "-e", "high", "-d", "3", "-b", "3", "-m", "40", "-s", "8000", "-n", "2", "-z", "50000"]),
+]
+
+# name, program, arguments; {out} is the output directory and {pst} the input
+modes = [
+    ("readpst",     "readpst",  ["-q", "-o", "{out}", "{pst}"]),
+    ("readpst-r",   "readpst",  ["-q", "-r", "-o", "{out}", "{pst}"]),
+    ("readpst-S",   "readpst",  ["-q", "-S", "-o", "{out}", "{pst}"]),
+    ("readpst-m",   "readpst",  ["-q", "-m", "-o", "{out}", "{pst}"]),
+    ("lspst",       "lspst",    ["{pst}"]),
+    ("pst2ldif",    "pst2ldif", ["-b", "o=example, c=US", "-c", "inetOrgPerson", "{pst}"]),
+    ("pst2dii",     "pst2dii",  ["-f", "{font}", "-B", "bates-", "-o", "{out}", "-O", "{out}/load.dii", "{pst}"]),
+]
+
+# the metrics, and whether a tolerance applies or they must match exactly
+metrics = [
+    ("wall_s",          True),
+    ("cpu_s",           True),
+    ("max_rss_kb",      True),
+    ("bytes_read",      True),
+    ("files_written",   False),
+]
+
+
+def io_counters(pid):
+    # the counters of a zombie still include all of its reaped children
+    counters = {}
+    with open("/proc/%d/io" % pid) as f:
+        for line in f:
+            k, v = line.split(":")
+            counters[k] = int(v)
+    return counters
+
+
+def subreaper():
+    # with the harness as subreaper, the tools can be started from a small
+    # shell rather than from python itself, whose resident size would
+    # otherwise be included in their peak rss
+    try:
+        import ctypes
+        return ctypes.CDLL(None, use_errno=True).prctl(36, 1, 0, 0, 0) == 0    # PR_SET_CHILD_SUBREAPER
+    except (OSError, AttributeError):
+        return False
+
+
+def run(argv, out, log, reaper):
+    with open(log, "wb") as logf:
+        actions = [
+            (os.POSIX_SPAWN_DUP2, logf.fileno(), 1),
+            (os.POSIX_SPAWN_DUP2, logf.fileno(), 2),
+            (os.POSIX_SPAWN_OPEN, 0, os.devnull, os.O_RDONLY, 0),
+        ]
+        start = time.monotonic()
+        if reaper:
+            sh = os.posix_spawn("/bin/sh", ["sh", "-c", '"$@" &', "sh"] + argv, os.environ, file_actions=actions)
+            os.waitpid(sh, 0)
+            pid = os.waitid(os.P_ALL, 0, os.WEXITED | os.WNOWAIT).si_pid
+        else:
+            pid = os.posix_spawn(argv[0], argv, os.environ, file_actions=actions)
+            os.waitid(os.P_PID, pid, os.WEXITED | os.WNOWAIT)
+        wall = time.monotonic() - start
+        io = io_counters(pid)
+        _, status, usage = os.wait4(pid, 0)
+    if status:
+        with open(log, "rb") as logf:
+            sys.stdout.buffer.write(logf.read()[-2000:])
+        sys.exit("%s failed with status %#x" % (" ".join(argv), status))
+    files = sum(len(f) for _, _, f in os.walk(out))
+    return {
+        "wall_s":        wall,
+        "cpu_s":         usage.ru_utime + usage.ru_stime,
+        "max_rss_kb":    usage.ru_maxrss,
+        "bytes_read":    io["rchar"],
+        "files_written": files,
+    }
+
+
+def make_corpus(bindir, directory, scale):
+    os.makedirs(directory, exist_ok=True)
+    files = []
+    for name, args in corpus:
+        args = list(args)
+        i = args.index("-m")
+        args[i+1] = str(max(1, int(int(args[i+1]) * scale)))
+        fn = os.path.join(directory, "%s-%s.pst" % (name, scale))
+        if not os.path.exists(fn):
+            subprocess.check_call([os.path.join(bindir, "pstgen")] + args + [fn], stdout=subprocess.DEVNULL)
+        files.append((name, fn))
+    return files
+
+
+def find_font():
+    try:
+        return subprocess.check_output(["fc-match", "--format", "%{file}", "Liberation Mono"],
+                                       stderr=subprocess.DEVNULL).decode()
+    except (OSError, subprocess.CalledProcessError):
+        return ""
+
+
+def median(values):
+    values = sorted(values)
+    n = len(values)
+    if n % 2:
+        return values[n // 2]
+    return (values[n // 2 - 1] + values[n // 2]) / 2
+
+
+def measure(opts):
+    font = find_font()
+    reaper = subreaper()
+    files = make_corpus(opts.bindir, opts.corpus, opts.scale)
+    results = {}
+    for mode, program, args in modes:
+        prog = os.path.join(opts.bindir, program)
+        if opts.only and mode not in opts.only:
+            continue
+        if not os.access(prog, os.X_OK):
+            print("%-12s skipped, %s is not built" % (mode, prog))
+            continue
+        if "{font}" in args and not font:
+            print("%-12s skipped, no font found" % mode)
+            continue
+        for name, fn in files:
+            runs = []
+            for _ in range(opts.repeat):
+                work = tempfile.mkdtemp(prefix="throughput-", dir=opts.tmpdir)
+                out = os.path.join(work, "out")
+                os.mkdir(out)
+                argv = [prog] + [a.format(out=out, pst=fn, font=font) for a in args]
+                runs.append(run(argv, out, os.path.join(work, "log"), reaper))
+                shutil.rmtree(work)
+            # the median of each metric, which one run disturbed by everything
+            # else on the machine does not move, as the fastest run would be
+            key = "%s/%s" % (mode, name)
+            r = dict((metric, median([x[metric] for x in runs])) for metric, _ in metrics)
+            results[key] = r
+            print("%-24s %8.3fs wall %8.3fs cpu %8d KB rss %12d read %6d files" % (
+                key, r["wall_s"], r["cpu_s"], r["max_rss_kb"], r["bytes_read"], r["files_written"]))
+    return results
+
+
+def compare(results, baseline, tolerance, floor):
+    failures = []
+    for key, r in sorted(results.items()):
+        b = baseline.get(key)
+        if not b:
+            print("%-24s no baseline" % key)
+            continue
+        for metric, tolerant in metrics:
+            new, old = r[metric], b[metric]
+            if not tolerant:
+                bad = new != old
+            elif metric in ("wall_s", "cpu_s"):
+                # ignore changes too small to measure reliably: short runs
+                # vary by more than the tolerance from one run to the next
+                bad = new > old * (1 + tolerance) and new - old > floor
+            else:
+                bad = new > old * (1 + tolerance)
+            if bad:
+                failures.append("%s %s: %s -> %s" % (key, metric, old, new))
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="libpst end to end throughput tests")
+    parser.add_argument("--bindir", default=os.path.join(here, "..", "src"),
+                        help="directory holding the built tools (default ../src)")
+    parser.add_argument("--corpus", default=os.path.join(here, "throughput-corpus"),
+                        help="directory for the generated pst files")
+    parser.add_argument("--baseline", default=os.path.join(here, "throughput-baseline.json"),
+                        help="baseline file to compare against or save to")
+    parser.add_argument("--output", help="also write the results of this run as json")
+    parser.add_argument("--save", action="store_true", help="save this run as the baseline")
+    parser.add_argument("--scale", type=float, default=1.0, help="multiply the number of messages")
+    parser.add_argument("--repeat", type=int, default=5, help="runs per measurement, the median is kept")
+    parser.add_argument("--tolerance", type=float, default=0.15,
+                        help="allowed relative regression (default 0.15)")
+    parser.add_argument("--floor", type=float, default=0.5,
+                        help="ignore time regressions smaller than this many seconds (default 0.5)")
+    parser.add_argument("--tmpdir", help="directory for the tool output")
+    parser.add_argument("only", nargs="*", help="only run these modes")
+    opts = parser.parse_args()
+
+    results = measure(opts)
+    if opts.output:
+        with open(opts.output, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+    if opts.save or not os.path.exists(opts.baseline):
+        baseline = {}
+        if os.path.exists(opts.baseline):
+            with open(opts.baseline) as f:
+                baseline = json.load(f)
+        baseline.update(results)
+        with open(opts.baseline, "w") as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+        print("baseline saved to %s" % opts.baseline)
+        return 0
+
+    with open(opts.baseline) as f:
+        baseline = json.load(f)
+    failures = compare(results, baseline, opts.tolerance, opts.floor)
+    for f in failures:
+        print("REGRESSION %s" % f)
+    if failures:
+        return 1
+    print("no regressions")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
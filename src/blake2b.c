@@ -0,0 +1,133 @@
+ /*
+	 This program is free software; you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation; either version 2 of the License, or
+	 (at your option) any later version.
+
+	 You should have received a copy of the GNU General Public License
+	 along with this program; if not, write to the Free Software Foundation,
+	 Inc., 59 Temple Place - Suite 330, Boston, MA	02111-1307, USA
+  */
+
+#include "define.h"
+#include "blake2b.h"
+
+// BLAKE2b as specified in RFC 7693, without a key
+
+
+static const uint64_t blake2b_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+
+static const unsigned char blake2b_sigma[12][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 }
+};
+
+
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define G(a, b, c, d, x, y) {           \
+    v[a] = v[a] + v[b] + (x);           \
+    v[d] = ROTR64(v[d] ^ v[a], 32);     \
+    v[c] = v[c] + v[d];                 \
+    v[b] = ROTR64(v[b] ^ v[c], 24);     \
+    v[a] = v[a] + v[b] + (y);           \
+    v[d] = ROTR64(v[d] ^ v[a], 16);     \
+    v[c] = v[c] + v[d];                 \
+    v[b] = ROTR64(v[b] ^ v[c], 63);     \
+}
+
+
+static uint64_t blake2b_get64(const unsigned char *p)
+{
+    return  (uint64_t)p[0]        | ((uint64_t)p[1] << 8)  |
+           ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+
+static void blake2b_compress(pst_blake2b_state *s, int last)
+{
+    uint64_t v[16], m[16];
+    int i;
+    for (i=0; i<8; i++) {
+        v[i]   = s->h[i];
+        v[i+8] = blake2b_iv[i];
+    }
+    v[12] ^= s->t[0];
+    v[13] ^= s->t[1];
+    if (last) v[14] = ~v[14];
+    for (i=0; i<16; i++) m[i] = blake2b_get64(s->buf + 8*i);
+    for (i=0; i<12; i++) {
+        const unsigned char *sg = blake2b_sigma[i];
+        G(0, 4,  8, 12, m[sg[ 0]], m[sg[ 1]]);
+        G(1, 5,  9, 13, m[sg[ 2]], m[sg[ 3]]);
+        G(2, 6, 10, 14, m[sg[ 4]], m[sg[ 5]]);
+        G(3, 7, 11, 15, m[sg[ 6]], m[sg[ 7]]);
+        G(0, 5, 10, 15, m[sg[ 8]], m[sg[ 9]]);
+        G(1, 6, 11, 12, m[sg[10]], m[sg[11]]);
+        G(2, 7,  8, 13, m[sg[12]], m[sg[13]]);
+        G(3, 4,  9, 14, m[sg[14]], m[sg[15]]);
+    }
+    for (i=0; i<8; i++) s->h[i] ^= v[i] ^ v[i+8];
+}
+
+
+void pst_blake2b_init(pst_blake2b_state *s, size_t outlen)
+{
+    int i;
+    memset(s, 0, sizeof(*s));
+    for (i=0; i<8; i++) s->h[i] = blake2b_iv[i];
+    // parameter block: digest length, no key, fanout and depth of 1
+    s->h[0] ^= 0x01010000ULL ^ (uint64_t)outlen;
+    s->outlen = outlen;
+}
+
+
+void pst_blake2b_update(pst_blake2b_state *s, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    while (len) {
+        size_t n;
+        // the last block is only compressed by pst_blake2b_final()
+        if (s->len == PST_BLAKE2B_BLOCK) {
+            s->t[0] += PST_BLAKE2B_BLOCK;
+            if (s->t[0] < PST_BLAKE2B_BLOCK) s->t[1]++;
+            blake2b_compress(s, 0);
+            s->len = 0;
+        }
+        n = PST_BLAKE2B_BLOCK - s->len;
+        if (n > len) n = len;
+        memcpy(s->buf + s->len, p, n);
+        s->len += n;
+        p      += n;
+        len    -= n;
+    }
+}
+
+
+void pst_blake2b_final(pst_blake2b_state *s, unsigned char *out)
+{
+    size_t i;
+    s->t[0] += s->len;
+    if (s->t[0] < s->len) s->t[1]++;
+    memset(s->buf + s->len, 0, PST_BLAKE2B_BLOCK - s->len);
+    blake2b_compress(s, 1);
+    for (i=0; i<s->outlen; i++) out[i] = (unsigned char)(s->h[i/8] >> (8*(i%8)));
+}
@@ -0,0 +1,43 @@
+#ifndef BLAKE2B_H
+#define BLAKE2B_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PST_BLAKE2B_BLOCK   128
+#define PST_BLAKE2B_MAX_OUT 64
+
+/** the state of a BLAKE2b hash, as in RFC 7693 */
+typedef struct pst_blake2b_state {
+    uint64_t h[8];
+    uint64_t t[2];
+    size_t   len;
+    size_t   outlen;
+    unsigned char buf[PST_BLAKE2B_BLOCK];
+} pst_blake2b_state;
+
+/** start an unkeyed hash.
+ * @param s      the state
+ * @param outlen bytes of digest wanted, 1 to PST_BLAKE2B_MAX_OUT
+ */
+void pst_blake2b_init(pst_blake2b_state *s, size_t outlen);
+
+/** add data to a hash.
+ * @param s    the state
+ * @param data the data
+ * @param len  its length
+ */
+void pst_blake2b_update(pst_blake2b_state *s, const void *data, size_t len);
+
+/** finish a hash.
+ * @param s   the state
+ * @param out receives outlen bytes of digest
+ */
+void pst_blake2b_final(pst_blake2b_state *s, unsigned char *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,34 +1,72 @@
 #include "define.h"
 
-
-struct pst_debug_func {
-    char * name;
-    struct pst_debug_func *next;
-};
+#ifndef HAVE_CLOCK_GETTIME
+    #include <sys/time.h>
+#endif
 
 
 #define NUM_COL 32
 #define MAX_DEPTH 32
-
-static struct pst_debug_func *func_head = NULL;
-static int func_depth = 0;
+#define MAX_STACK 256
+#define TRACE_BUF 65536
+#define TRACE_EVENT 512
+
+// the function stack is per thread, so threads sharing a pst_file do not
+// push and pop each other's entries. The level and the debug file are
+// set up once for the whole process. The names are the string literals
+// given to DEBUG_ENT, so nothing needs to be copied.
+static PST_THREAD_LOCAL const char *func_stack[MAX_STACK];
+static PST_THREAD_LOCAL int func_depth = 0;
 static int pst_debuglevel = 0;
+int pst_debug_minlevel = INT_MAX;
+int pst_debug_tracing = 0;
 static char indent[MAX_DEPTH*4+1];
 static FILE *debug_fp = NULL;
 #ifdef HAVE_SEMAPHORE_H
     static sem_t* debug_mutex = NULL;
 #endif
+#ifdef HAVE_PTHREAD_H
+    // used when the caller does not pass a semaphore to pst_debug_init()
+    static pthread_mutex_t debug_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// the trace is written in the chrome trace event format. Each thread
+// collects its events in its own buffer and appends them to the file with
+// one write() whenever its outermost span ends, so threads and forked
+// child processes can all write to the same file without locking. The
+// closing ] of the array is optional in that format, and is left out since
+// a child process may still be writing when the parent closes the file.
+static int trace_fd = -1;
+static pid_t trace_pid = 0;
+static int trace_threads = 0;
+static PST_THREAD_LOCAL char *trace_buf = NULL;
+static PST_THREAD_LOCAL size_t trace_len = 0;
+static PST_THREAD_LOCAL int trace_depth = 0;
+static PST_THREAD_LOCAL int trace_tid = 0;
+
+
+static void pst_debug_setminlevel()
+{
+    pst_debug_minlevel = (debug_fp) ? pst_debuglevel : INT_MAX;
+}
 
 
 void pst_debug_setlevel(int level)
 {
   pst_debuglevel = level;
+  pst_debug_setminlevel();
 }
 
 void pst_debug_lock()
 {
     #ifdef HAVE_SEMAPHORE_H
-        if (debug_mutex) sem_wait(debug_mutex);
+        if (debug_mutex) {
+            sem_wait(debug_mutex);
+            return;
+        }
+    #endif
+    #ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock(&debug_thread_mutex);
     #endif
 }
 
@@ -36,7 +74,13 @@ void pst_debug_lock()
 void pst_debug_unlock()
 {
     #ifdef HAVE_SEMAPHORE_H
-        if (debug_mutex) sem_post(debug_mutex);
+        if (debug_mutex) {
+            sem_post(debug_mutex);
+            return;
+        }
+    #endif
+    #ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock(&debug_thread_mutex);
     #endif
 }
 
@@ -47,37 +91,144 @@ void pst_debug_init(const char* fname, void* output_mutex) {
     #endif
     memset(indent, ' ', MAX_DEPTH*4);
     indent[MAX_DEPTH*4] = '\0';
-    if (debug_fp) pst_debug_close();
+    if (debug_fp) fclose(debug_fp);
+    debug_fp = NULL;
+    pst_debug_setminlevel();
     if (!fname) return;
     if ((debug_fp = fopen(fname, "wb")) == NULL) {
         fprintf(stderr, "Opening of file %s failed: %d: %s\n", fname, errno, strerror(errno));
         exit(1);
     }
+    pst_debug_setminlevel();
+}
+
+
+static void pst_trace_flush()
+{
+    size_t off = 0;
+    while (off < trace_len) {
+        ssize_t n = write(trace_fd, trace_buf + off, trace_len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += n;
+    }
+    trace_len = 0;
+}
+
+
+#ifdef HAVE_PTHREAD_H
+static void pst_trace_forked()
+{
+    // the events buffered so far, and the spans still open, belong to the
+    // parent, which writes and ends them itself
+    trace_pid   = getpid();
+    trace_len   = 0;
+    trace_depth = 0;
+}
+#endif
+
+
+static pid_t pst_trace_pid()
+{
+    #ifdef HAVE_PTHREAD_H
+        return trace_pid;
+    #else
+        return getpid();
+    #endif
+}
+
+
+static void pst_trace_event(char phase, const char *name, uint64_t id)
+{
+    struct timespec now;
+    uint64_t us;
+    int n;
+    #ifdef HAVE_CLOCK_GETTIME
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    #else
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        now.tv_sec  = tv.tv_sec;
+        now.tv_nsec = tv.tv_usec * 1000;
+    #endif
+    us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    if (!trace_buf) trace_buf = pst_malloc(TRACE_BUF);
+    if (!trace_tid) trace_tid = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+    if (phase == 'E')
+        n = snprintf(trace_buf + trace_len, TRACE_EVENT, "{\"ph\":\"E\",\"ts\":%" PRIu64 ".%03u,\"pid\":%d,\"tid\":%d},\n",
+                     us, (unsigned)(now.tv_nsec % 1000), (int)pst_trace_pid(), trace_tid);
+    else if (id)
+        n = snprintf(trace_buf + trace_len, TRACE_EVENT, "{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%" PRIu64 ".%03u,\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%" PRIu64 "}},\n",
+                     name, us, (unsigned)(now.tv_nsec % 1000), (int)pst_trace_pid(), trace_tid, id);
+    else
+        n = snprintf(trace_buf + trace_len, TRACE_EVENT, "{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%" PRIu64 ".%03u,\"pid\":%d,\"tid\":%d},\n",
+                     name, us, (unsigned)(now.tv_nsec % 1000), (int)pst_trace_pid(), trace_tid);
+    if (n > 0 && n < TRACE_EVENT) trace_len += n;
+    if (trace_len > TRACE_BUF - TRACE_EVENT) pst_trace_flush();
+}
+
+
+static void pst_trace_begin(const char *name, uint64_t id)
+{
+    pst_trace_event('B', name, id);
+    trace_depth++;
+}
+
+
+static void pst_trace_end()
+{
+    // spans that were open when tracing started, or when this process was
+    // forked, were never begun here
+    if (!trace_depth) return;
+    pst_trace_event('E', NULL, 0);
+    if (--trace_depth) return;
+    pst_trace_flush();
+    free(trace_buf);
+    trace_buf = NULL;
+}
+
+
+void pst_debug_trace(const char* fname) {
+    if (trace_fd >= 0) return;
+    if ((trace_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0666)) < 0) {
+        fprintf(stderr, "Opening of file %s failed: %d: %s\n", fname, errno, strerror(errno));
+        exit(1);
+    }
+    if (write(trace_fd, "[\n", 2) != 2) {
+        fprintf(stderr, "Writing to file %s failed: %d: %s\n", fname, errno, strerror(errno));
+        exit(1);
+    }
+    trace_pid = getpid();
+    #ifdef HAVE_PTHREAD_H
+        pthread_atfork(NULL, NULL, pst_trace_forked);
+    #endif
+    pst_debug_tracing = 1;
 }
 
 
 void pst_debug_func(int level, const char* function) {
+    if (pst_debug_tracing) pst_trace_begin(function, 0);
     if (pst_debuglevel > level) return;
-    struct pst_debug_func *func_ptr = pst_malloc (sizeof(struct pst_debug_func));
-    func_ptr->name = strdup(function);
-    func_ptr->next = func_head;
-    func_head = func_ptr;
+    if (func_depth < MAX_STACK) func_stack[func_depth] = function;
     func_depth++;
 }
 
 
 void pst_debug_func_ret(int level) {
+    if (pst_debug_tracing) pst_trace_end();
     if (pst_debuglevel > level) return;
-    //remove the head item
-    struct pst_debug_func *func_ptr = func_head;
-    if (func_head) {
-        func_head = func_head->next;
-        free(func_ptr->name);
-        free(func_ptr);
-        func_depth--;
-    } else {
-        DIE(("function list is empty!\n"));
-    }
+    // the stack may not have been pushed if logging started inside a function
+    if (func_depth) func_depth--;
+}
+
+
+void pst_debug_span(const char* name, uint64_t id) {
+    if (pst_debug_tracing) pst_trace_begin(name, id);
+}
+
+
+void pst_debug_span_end() {
+    if (pst_debug_tracing) pst_trace_end();
 }
 
 
@@ -86,7 +237,7 @@ static void pst_debug_info(int level, int line, const char* file) {
     if (pst_debuglevel > level) return;
     int le = (func_depth > MAX_DEPTH) ? MAX_DEPTH : func_depth;
     if (le > 0) le--;
-    char *func = (func_head ? func_head->name : "No Function");
+    const char *func = (func_depth ? func_stack[((func_depth > MAX_STACK) ? MAX_STACK : func_depth) - 1] : "No Function");
     pst_debug_lock();
     fprintf(debug_fp, "%06d %.*s%s %s(%d) ", getpid(), le*4, indent, func, file, line);
 }
@@ -155,14 +306,20 @@ void pst_debug_hexdumper(FILE *out, const char *buf, size_t size, int cols, int
 
 
 void pst_debug_close(void) {
-    while (func_head) {
-        struct pst_debug_func *func_ptr = func_head;
-        func_head = func_head->next;
-        free(func_ptr->name);
-        free(func_ptr);
-    }
+    func_depth = 0;
     if (debug_fp) fclose(debug_fp);
     debug_fp = NULL;
+    pst_debug_setminlevel();
+    if (trace_fd >= 0) {
+        // end the spans of this thread that are still open
+        pst_debug_tracing = 0;
+        while (trace_depth) pst_trace_end();
+        if (trace_buf) pst_trace_flush();
+        free(trace_buf);
+        trace_buf = NULL;
+        close(trace_fd);
+        trace_fd = -1;
+    }
 }
 
 
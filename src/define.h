@@ -129,6 +129,10 @@
     #define D_MKDIR(x) mkdir(x, PERM_DIRS)
 #endif
 
+#ifdef HAVE_FCNTL_H
+    #include <fcntl.h>
+#endif
+
 #ifdef HAVE_SYS_STAT_H
     #include <sys/stat.h>
 #endif
@@ -137,6 +141,10 @@
     #include <sys/types.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+    #include <sys/uio.h>
+#endif
+
 #ifdef HAVE_SYS_IPC_H
     #include <sys/ipc.h>
 #endif
@@ -157,6 +165,21 @@
     #include <semaphore.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+    #include <pthread.h>
+#endif
+
+#ifdef HAVE_GETOPT_H
+    #include <getopt.h>
+#endif
+
+// storage class for state that each thread needs its own copy of
+#if defined(HAVE_PTHREAD_H) && defined(__GNUC__)
+    #define PST_THREAD_LOCAL __thread
+#else
+    #define PST_THREAD_LOCAL
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -165,8 +188,11 @@ void  pst_debug_lock();
 void  pst_debug_unlock();
 void  pst_debug_setlevel(int level);
 void  pst_debug_init(const char* fname, void* output_mutex);
+void  pst_debug_trace(const char* fname);
 void  pst_debug_func(int level, const char* function);
 void  pst_debug_func_ret(int level);
+void  pst_debug_span(const char* name, uint64_t id);
+void  pst_debug_span_end();
 void  pst_debug(int level, int line, const char *file, const char *fmt, ...);
 void  pst_debug_hexdump(int level, int line, const char *file, const char* buf, size_t size, int cols, int delta);
 void  pst_debug_hexdumper(FILE* out, const char* buf, size_t size, int cols, int delta);
@@ -174,12 +200,30 @@ void  pst_debug_close();
 void* pst_malloc(size_t size);
 void *pst_realloc(void *ptr, size_t size);
 
+// the lowest level written to the debug file, above every level when there
+// is no debug file, and whether a trace file is being written. The macros
+// below test these before calling anything, so their arguments are not
+// even evaluated while nothing is being logged.
+extern int pst_debug_minlevel;
+extern int pst_debug_tracing;
+
+#ifdef NO_TRACING
+    // compiled out; the arguments are still seen by the compiler, so
+    // variables used only for logging do not become unused
+    #define PST_DEBUG_LOGGING(level)    0
+    #define PST_DEBUG_TRACING           0
+#else
+    #define PST_DEBUG_LOGGING(level)    ((level) >= pst_debug_minlevel)
+    #define PST_DEBUG_TRACING           pst_debug_tracing
+#endif
+
 #define DEBUG_INIT(fname,mutex) {pst_debug_init(fname,mutex);}
+#define DEBUG_TRACE(fname)      {pst_debug_trace(fname);}
 #define DEBUG_CLOSE()           {pst_debug_close();}
 
-#define MESSAGEPRINT1(...) pst_debug(1, __LINE__, __FILE__,  __VA_ARGS__)
-#define MESSAGEPRINT2(...) pst_debug(2, __LINE__, __FILE__,  __VA_ARGS__)
-#define MESSAGEPRINT3(...) pst_debug(3, __LINE__, __FILE__,  __VA_ARGS__)
+#define MESSAGEPRINT1(...) (PST_DEBUG_LOGGING(1) ? pst_debug(1, __LINE__, __FILE__,  __VA_ARGS__) : (void)0)
+#define MESSAGEPRINT2(...) (PST_DEBUG_LOGGING(2) ? pst_debug(2, __LINE__, __FILE__,  __VA_ARGS__) : (void)0)
+#define MESSAGEPRINT3(...) (PST_DEBUG_LOGGING(3) ? pst_debug(3, __LINE__, __FILE__,  __VA_ARGS__) : (void)0)
 
 #define WARN(x) {           \
     MESSAGEPRINT3 x;        \
@@ -197,21 +241,29 @@ void *pst_realloc(void *ptr, size_t size);
 
 #define DEBUG_WARN(x)           MESSAGEPRINT3 x
 #define DEBUG_INFO(x)           MESSAGEPRINT2 x
-#define DEBUG_HEXDUMP(x, s)     pst_debug_hexdump(1, __LINE__, __FILE__, (char*)x, s, 0x10, 0)
-#define DEBUG_HEXDUMPC(x, s, c) pst_debug_hexdump(1, __LINE__, __FILE__, (char*)x, s, c, 0)
+#define DEBUG_HEXDUMP(x, s)     (PST_DEBUG_LOGGING(1) ? pst_debug_hexdump(1, __LINE__, __FILE__, (char*)x, s, 0x10, 0) : (void)0)
+#define DEBUG_HEXDUMPC(x, s, c) (PST_DEBUG_LOGGING(1) ? pst_debug_hexdump(1, __LINE__, __FILE__, (char*)x, s, c, 0) : (void)0)
 
 
 #define DEBUG_ENT(x)                                            \
     {                                                           \
-      pst_debug_func(1, x);                                      \
-      pst_debug(1, __LINE__, __FILE__, "Entering function\n");   \
+      if (PST_DEBUG_LOGGING(1) || PST_DEBUG_TRACING) {          \
+        pst_debug_func(1, x);                                    \
+        MESSAGEPRINT1("Entering function\n");                    \
+      }                                                         \
     }
 #define DEBUG_RET()                                             \
     {                                                           \
-      pst_debug(1, __LINE__, __FILE__, "Leaving function\n");    \
-      pst_debug_func_ret(1);                     \
+      if (PST_DEBUG_LOGGING(1) || PST_DEBUG_TRACING) {          \
+        MESSAGEPRINT1("Leaving function\n");                     \
+        pst_debug_func_ret(1);                                   \
+      }                                                         \
     }
 
+// a span of the trace that is not a function, such as one item
+#define DEBUG_SPAN(name, id)    { if (PST_DEBUG_TRACING) pst_debug_span(name, id); }
+#define DEBUG_SPAN_END()        { if (PST_DEBUG_TRACING) pst_debug_span_end(); }
+
 #define RET_DERROR(res, ret_val, x) if (res) { DIE(x);}
 
 
@@ -0,0 +1,134 @@
+/***
+ * json.c
+ * Part of the LibPST project
+ *
+ * The JSON written for an item by readpst --json and by pstserve, kept in
+ * one place so that the two stay the same.
+ */
+
+#include "define.h"
+#include "json.h"
+
+// max size of the c_time char*. It will store the date of the email
+#define C_TIME_SIZE 500
+
+
+void json_escape(FILE *f, const char *s)
+{
+    // write s as a JSON string, in runs of the characters that need no escape
+    fputc('"', f);
+    while (*s) {
+        const char *run = s;
+        while (*s && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20) s++;
+        if (s > run) pst_fwrite(run, 1, s - run, f);
+        if (!*s) break;
+        if      (*s == '"')  fputs("\\\"", f);
+        else if (*s == '\\') fputs("\\\\", f);
+        else if (*s == '\n') fputs("\\n", f);
+        else if (*s == '\r') fputs("\\r", f);
+        else if (*s == '\t') fputs("\\t", f);
+        else fprintf(f, "\\u%04x", (unsigned char)*s);
+        s++;
+    }
+    fputc('"', f);
+}
+
+
+void json_string(FILE *f, const char *key, pst_item *item, pst_string *str)
+{
+    pst_convert_utf8_null(item, str);
+    if (!str->str) return;
+    fprintf(f, ",\"%s\":", key);
+    json_escape(f, str->str);
+}
+
+
+void json_date(FILE *f, const char *key, FILETIME *ft)
+{
+    char c_time[C_TIME_SIZE];
+    struct tm stm;
+    time_t t;
+    if (!ft) return;
+    t = pst_fileTimeToUnixTime(ft);
+    gmtime_r(&t, &stm);
+    strftime(c_time, C_TIME_SIZE, "%Y-%m-%dT%H:%M:%SZ", &stm);
+    fprintf(f, ",\"%s\":\"%s\"", key, c_time);
+}
+
+
+const char *json_item_type(pst_item *item)
+{
+    if (item->folder)                                              return "folder";
+    if (item->contact && item->type == PST_TYPE_CONTACT)           return "contact";
+    if (item->journal && item->type == PST_TYPE_JOURNAL)           return "journal";
+    if (item->appointment && item->type == PST_TYPE_APPOINTMENT)   return "appointment";
+    return "email";
+}
+
+
+void json_item_fields(FILE *f, pst_file *pf, pst_item *item, pst_desc_tree *d_ptr, int numbered)
+{
+    fprintf(f, "\"d_id\":%" PRIu64 ",\"folder_id\":%" PRIu64 ",\"type\":\"%s\"",
+            d_ptr->d_id, (d_ptr->parent) ? d_ptr->parent->d_id : (uint64_t)0, json_item_type(item));
+    if (item->ascii_type) {
+        fputs(",\"class\":", f);
+        json_escape(f, item->ascii_type);
+    }
+    json_string(f, "subject", item, &item->subject);
+    json_date(f, "created", item->create_date);
+    json_date(f, "modified", item->modify_date);
+    fprintf(f, ",\"flags\":%" PRIi32 ",\"size\":%" PRIi32, item->flags, item->message_size);
+
+    if (item->email) {
+        pst_item_email *email = item->email;
+        json_string(f, "message_id", item, &email->messageid);
+        json_string(f, "in_reply_to", item, &email->in_reply_to);
+        json_date(f, "sent", email->sent_date);
+        json_date(f, "received", email->arrival_date);
+        json_string(f, "from_name", item, &email->outlook_sender_name);
+        json_string(f, "from", item, &email->sender_address);
+        json_string(f, "to", item, &email->sentto_address);
+        json_string(f, "cc", item, &email->cc_address);
+        json_string(f, "bcc", item, &email->bcc_address);
+        json_string(f, "reply_to", item, &email->reply_to);
+        fprintf(f, ",\"read\":%s,\"importance\":%" PRIi32 ",\"priority\":%" PRIi32 ",\"sensitivity\":%" PRIi32,
+                (item->flags & 1) ? "true" : "false", email->importance, email->priority, email->sensitivity);
+    }
+    if (item->contact && item->type == PST_TYPE_CONTACT) {
+        json_string(f, "name", item, &item->contact->fullname);
+        json_string(f, "address", item, &item->contact->address1);
+        json_string(f, "company", item, &item->contact->company_name);
+    }
+    if (item->journal && item->type == PST_TYPE_JOURNAL) {
+        json_date(f, "start", item->journal->start);
+        json_date(f, "end", item->journal->end);
+        json_string(f, "journal_type", item, &item->journal->type);
+    }
+    if (item->appointment && item->type == PST_TYPE_APPOINTMENT) {
+        json_date(f, "start", item->appointment->start);
+        json_date(f, "end", item->appointment->end);
+        json_string(f, "location", item, &item->appointment->location);
+        fprintf(f, ",\"all_day\":%s,\"recurring\":%s",
+                (item->appointment->all_day) ? "true" : "false",
+                (item->appointment->is_recurring) ? "true" : "false");
+    }
+
+    if (item->attach) {
+        // the size comes from the block headers, the data is not read
+        pst_item_attach *attach;
+        int n = 0;
+        fputs(",\"attachments\":[", f);
+        for (attach = item->attach; attach; attach = attach->next) {
+            pst_string *name = (attach->filename2.str) ? &attach->filename2 : &attach->filename1;
+            fputs((n) ? ",{" : "{", f);
+            if (numbered) fprintf(f, "\"n\":%d,", n);
+            fprintf(f, "\"size\":%zu", pst_attach_size(pf, attach));
+            json_string(f, "name", item, name);
+            json_string(f, "mime", item, &attach->mimetype);
+            if (attach->method == 5) fputs(",\"embedded\":true", f);
+            fputc('}', f);
+            n++;
+        }
+        fputc(']', f);
+    }
+}
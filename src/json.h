@@ -0,0 +1,34 @@
+#ifndef JSON_H
+#define JSON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** write a string as a JSON string, with its quotes */
+void json_escape(FILE *f, const char *s);
+
+/** write ,"key":value for a string of an item, if it is set */
+void json_string(FILE *f, const char *key, pst_item *item, pst_string *str);
+
+/** write ,"key":value for a time as yyyy-mm-ddThh:mm:ssZ, if it is set */
+void json_date(FILE *f, const char *key, FILETIME *ft);
+
+/** the type of an item: folder, email, contact, journal or appointment */
+const char *json_item_type(pst_item *item);
+
+/** write the fields of an item shared by readpst --json and pstserve,
+ *  from "d_id" to "attachments", without the braces around them.
+ * @param f        where to write them
+ * @param pf       the pst file of the item
+ * @param item     the item
+ * @param d_ptr    its descriptor
+ * @param numbered non-zero to number the attachments from 0
+ */
+void json_item_fields(FILE *f, pst_file *pf, pst_item *item, pst_desc_tree *d_ptr, int numbered);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
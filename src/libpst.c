@@ -7,6 +7,10 @@
 
 #include "define.h"
 #include "zlib.h"
+#include <stddef.h>
+#ifndef HAVE_CLOCK_GETTIME
+    #include <sys/time.h>
+#endif
 
 
 // switch to maximal packing for our own internal structures
@@ -52,6 +56,71 @@
 #define PST_SIGNATURE 0x4E444221
 
 
+// the counters in pf->state are shared by every thread using the file
+#if defined(__GNUC__)
+    #define PST_STAT_ADD(pf, field, n) { if ((pf)->state) __atomic_fetch_add(&(pf)->state->stats.field, (uint64_t)(n), __ATOMIC_RELAXED); }
+#else
+    #define PST_STAT_ADD(pf, field, n) { if ((pf)->state) (pf)->state->stats.field += (uint64_t)(n); }
+#endif
+
+
+// what a read of the pst file was for, see pst_profile_reads()
+#define PST_READ_INDEX      0
+#define PST_READ_DESC       1
+#define PST_READ_ID2        2
+#define PST_READ_ITEM       3
+#define PST_READ_ATTACHMENT 4
+#define PST_READ_KINDS      5
+
+// what the reads made by this thread are for
+static PST_THREAD_LOCAL int pst_read_kind = PST_READ_ITEM;
+
+// one range of the pst file read while reads are being profiled
+typedef struct pst_read_range {
+    struct pst_read_range *next;    // in the same hash bucket
+    int64_t offset;
+    size_t  size;
+    int     readcount;
+    int     kinds;                  // bit mask of the PST_READ_ kinds
+} pst_read_range;
+
+struct pst_read_profile {
+    // hash table of the ranges read, by offset
+    pst_read_range **table;
+    size_t   buckets;
+    size_t   count;
+    // totals of each PST_READ_ kind
+    uint64_t reads[PST_READ_KINDS];
+    uint64_t bytes[PST_READ_KINDS];
+    uint64_t rereads[PST_READ_KINDS];
+    uint64_t reread_bytes[PST_READ_KINDS];
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t mutex;
+#endif
+};
+
+struct pst_progress_state {
+    pst_progress_cb cb;
+    void     *data;
+    uint64_t  interval_ns;
+    uint64_t  next_ns;          // when the callback is next due
+    uint64_t  items_total;
+    uint64_t  bytes_total;
+};
+
+
+// what libpst keeps for each open pst_file, out of the public structure so
+// that its layout stays the same as more is added here. This is NULL until
+// pst_open() has succeeded, so the reads it makes are not counted.
+struct pst_file_state {
+    pst_stats                  stats;
+    struct pst_read_profile   *profile;
+    struct pst_progress_state *progress;
+    pst_read_limit            *limit;
+    pst_filter                *filter;
+};
+
+
 typedef struct pst_block_offset {
     uint16_t from;
     uint16_t to;
@@ -285,17 +354,28 @@ static void             pst_free_xattrib(pst_x_attrib_ll *x);
 static size_t           pst_getAtPos(pst_file *pf, int64_t pos, void* buf, size_t size);
 static int              pst_getBlockOffsetPointer(pst_file *pf, pst_id2_tree *i2_head, pst_subblocks *subblocks, uint32_t offset, pst_block_offset_pointer *p);
 static int              pst_getBlockOffset(char *buf, size_t read_size, uint32_t i_offset, uint32_t offset, pst_block_offset *p);
-static pst_id2_tree*    pst_getID2(pst_id2_tree * ptr, uint64_t id);
+static pst_id2_tree*    pst_getID2(pst_file *pf, pst_id2_tree * ptr, uint64_t id);
 static pst_desc_tree*   pst_getDptr(pst_file *pf, uint64_t d_id);
 static uint64_t         pst_getIntAt(pst_file *pf, char *buf);
 static uint64_t         pst_getIntAtPos(pst_file *pf, int64_t pos);
-static pst_mapi_object* pst_parse_block(pst_file *pf, uint64_t block_id, pst_id2_tree *i2_head);
+static pst_mapi_object* pst_parse_block(pst_file *pf, uint64_t block_id, pst_id2_tree *i2_head, int utf16);
+static pst_item*        pst_parse_item_uncounted(pst_file *pf, pst_desc_tree *d_ptr, pst_id2_tree *m_head, int *filtered);
+static void             pst_convert_utf16(pst_file *pf, pst_mapi_element *element);
+static size_t           pst_utf16_to_8(pst_file *pf, char *data, size_t size, pst_vbuf *utf8buf);
+static int              pst_filter_match(pst_file *pf, pst_mapi_object *list);
 static void             pst_printDptr(pst_file *pf, pst_desc_tree *ptr);
 static void             pst_printID2ptr(pst_id2_tree *ptr);
 static int              pst_process(uint64_t block_id, pst_mapi_object *list, pst_item *item, pst_item_attach *attach);
 static size_t           pst_read_block_size(pst_file *pf, int64_t offset, size_t size, size_t inflated_size, char **buf);
+static size_t           pst_read_block_as(pst_file *pf, int kind, int64_t offset, size_t size, size_t inflated_size, char **buf);
+static int              pst_read_as(int kind);
+static void             pst_record_read(pst_file *pf, int64_t pos, size_t size);
+static void             pst_free_reads(pst_file *pf);
+static void             pst_progress_tick(pst_file *pf);
+static void             pst_read_wait(pst_file *pf, size_t size);
 static size_t           pst_read_raw_block_size(pst_file *pf, int64_t offset, size_t size, char **buf);
 static int              pst_decrypt(uint64_t i_id, char *buf, size_t size, unsigned char type);
+static void             pst_count_decrypt(pst_file *pf, size_t size);
 static int              pst_strincmp(char *a, char *b, size_t x);
 static char*            pst_wide_to_single(char *wt, size_t size);
 
@@ -315,8 +395,6 @@ static char *pst_getcwd(void) {
 int pst_open(pst_file *pf, const char *name, const char *charset) {
     uint32_t sig;
 
-    pst_unicode_init();
-
     DEBUG_ENT("pst_open");
 
     if (!pf) {
@@ -388,6 +466,8 @@ int pst_open(pst_file *pf, const char *name, const char *charset) {
 
     pf->cwd   = pst_getcwd();
     pf->fname = strdup(name);
+    pf->state = (struct pst_file_state*)pst_malloc(sizeof(struct pst_file_state));
+    memset(pf->state, 0, sizeof(struct pst_file_state));
     return 0;
 }
 
@@ -413,7 +493,6 @@ err:
 
 int pst_close(pst_file *pf) {
     DEBUG_ENT("pst_close");
-    pst_unicode_close();
     if (!pf) {
         DEBUG_RET();
         return 0;
@@ -432,11 +511,482 @@ int pst_close(pst_file *pf) {
     free(pf->i_table);
     pst_free_desc(pf->d_head);
     pst_free_xattrib(pf->x_head);
+    pst_free_reads(pf);
+    if (pf->state) free(pf->state->progress);
+    free(pf->state);
+    pf->state = NULL;
     DEBUG_RET();
     return 0;
 }
 
 
+static uint64_t pst_now_ns(void) {
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+
+static const struct {
+    const char *name;
+    size_t      offset;
+} pst_stats_fields[] = {
+    {"read_calls",              offsetof(pst_stats, read_calls)},
+    {"bytes_read",              offsetof(pst_stats, bytes_read)},
+    {"blocks_read",             offsetof(pst_stats, blocks_read)},
+    {"block_bytes",             offsetof(pst_stats, block_bytes)},
+    {"blocks_inflated",         offsetof(pst_stats, blocks_inflated)},
+    {"inflated_bytes",          offsetof(pst_stats, inflated_bytes)},
+    {"inflate_ns",              offsetof(pst_stats, inflate_ns)},
+    {"decrypt_compress_bytes",  offsetof(pst_stats, decrypt_compress_bytes)},
+    {"decrypt_high_bytes",      offsetof(pst_stats, decrypt_high_bytes)},
+    {"lzfu_bytes_in",           offsetof(pst_stats, lzfu_bytes_in)},
+    {"lzfu_bytes_out",          offsetof(pst_stats, lzfu_bytes_out)},
+    {"iconv_calls",             offsetof(pst_stats, iconv_calls)},
+    {"iconv_bytes",             offsetof(pst_stats, iconv_bytes)},
+    {"items_parsed",            offsetof(pst_stats, items_parsed)},
+    {"parse_failures",          offsetof(pst_stats, parse_failures)},
+    {"items_filtered",          offsetof(pst_stats, items_filtered)},
+    {"id_hits",                 offsetof(pst_stats, id_hits)},
+    {"id_misses",               offsetof(pst_stats, id_misses)},
+    {"id2_hits",                offsetof(pst_stats, id2_hits)},
+    {"id2_misses",              offsetof(pst_stats, id2_misses)},
+    {"load_index_ns",           offsetof(pst_stats, load_index_ns)},
+    {"read_wait_ns",            offsetof(pst_stats, read_wait_ns)},
+};
+#define PST_STATS_FIELD(s, i) (*(uint64_t*)((char*)(s) + pst_stats_fields[i].offset))
+
+
+void pst_get_stats(pst_file *pf, pst_stats *stats) {
+    size_t i;
+    memset(stats, 0, sizeof(*stats));
+    if (!pf || !pf->state) return;
+    for (i = 0; i < sizeof(pst_stats_fields)/sizeof(pst_stats_fields[0]); i++) {
+#if defined(__GNUC__)
+        PST_STATS_FIELD(stats, i) = __atomic_load_n(&PST_STATS_FIELD(&pf->state->stats, i), __ATOMIC_RELAXED);
+#else
+        PST_STATS_FIELD(stats, i) = PST_STATS_FIELD(&pf->state->stats, i);
+#endif
+    }
+}
+
+
+void pst_reset_stats(pst_file *pf) {
+    if (pf && pf->state) memset(&pf->state->stats, 0, sizeof(pst_stats));
+}
+
+
+void pst_add_stats(pst_stats *total, const pst_stats *stats) {
+    size_t i;
+    for (i = 0; i < sizeof(pst_stats_fields)/sizeof(pst_stats_fields[0]); i++) {
+        PST_STATS_FIELD(total, i) += PST_STATS_FIELD(stats, i);
+    }
+}
+
+
+void pst_print_stats(FILE *fp, const pst_stats *stats, int json) {
+    size_t i;
+    if (json) fprintf(fp, "{");
+    for (i = 0; i < sizeof(pst_stats_fields)/sizeof(pst_stats_fields[0]); i++) {
+        if (json) fprintf(fp, "%s\"%s\":%" PRIu64, (i) ? "," : "", pst_stats_fields[i].name, PST_STATS_FIELD(stats, i));
+        else      fprintf(fp, "%-24s %" PRIu64 "\n", pst_stats_fields[i].name, PST_STATS_FIELD(stats, i));
+    }
+    if (json) fprintf(fp, "}\n");
+}
+
+
+static void pst_progress_totals(pst_file *pf, uint64_t *items, uint64_t *bytes) {
+    pst_desc_tree *d;
+    size_t i;
+    *items = 0;
+    *bytes = 0;
+    for (d = pf->d_head; d; d = pst_getNextDptr(d)) (*items)++;
+    for (i = 0; i < pf->i_count; i++) *bytes += pf->i_table[i].size;
+}
+
+
+void pst_get_progress(pst_file *pf, pst_progress *progress) {
+    pst_stats stats;
+    memset(progress, 0, sizeof(*progress));
+    if (!pf) return;
+    pst_get_stats(pf, &stats);
+    progress->items_done = stats.items_parsed + stats.parse_failures + stats.items_filtered;
+    progress->bytes_done = stats.block_bytes;
+    if (pf->state && pf->state->progress) {
+        progress->items_total = pf->state->progress->items_total;
+        progress->bytes_total = pf->state->progress->bytes_total;
+    }
+    else {
+        pst_progress_totals(pf, &progress->items_total, &progress->bytes_total);
+    }
+}
+
+
+int pst_set_progress(pst_file *pf, pst_progress_cb cb, void *data, unsigned interval) {
+    struct pst_progress_state *s;
+    if (!pf || !pf->state) return -1;
+    if (!cb) {
+        free(pf->state->progress);
+        pf->state->progress = NULL;
+        return 0;
+    }
+    s = (struct pst_progress_state*)pst_malloc(sizeof(*s));
+    s->cb          = cb;
+    s->data        = data;
+    s->interval_ns = (uint64_t)interval * 1000000;
+    s->next_ns     = pst_now_ns() + s->interval_ns;
+    pst_progress_totals(pf, &s->items_total, &s->bytes_total);
+    free(pf->state->progress);
+    pf->state->progress = s;
+    return 0;
+}
+
+
+static void pst_progress_tick(pst_file *pf) {
+    struct pst_progress_state *s = pf->state->progress;
+    pst_progress progress;
+    uint64_t now = pst_now_ns();
+#if defined(__GNUC__)
+    // of the threads that find the call due, only the one that moves the
+    // due time on makes it
+    uint64_t next = __atomic_load_n(&s->next_ns, __ATOMIC_RELAXED);
+    if (now < next) return;
+    if (!__atomic_compare_exchange_n(&s->next_ns, &next, now + s->interval_ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+#else
+    if (now < s->next_ns) return;
+    s->next_ns = now + s->interval_ns;
+#endif
+    pst_get_progress(pf, &progress);
+    s->cb(pf, &progress, s->data);
+}
+
+
+void pst_init_read_limit(pst_read_limit *limit, uint64_t bytes_per_sec, uint64_t reads_per_sec) {
+    memset(limit, 0, sizeof(*limit));
+    limit->bytes_per_sec = bytes_per_sec;
+    limit->reads_per_sec = reads_per_sec;
+}
+
+
+void pst_set_read_limit(pst_file *pf, pst_read_limit *limit) {
+    if (pf && pf->state) pf->state->limit = limit;
+}
+
+
+static int pst_filter_time(const char *s, time_t *t) {
+    // yyyy-mm-dd or yyyy-mm-ddThh:mm:ss in UTC
+    int y, m, d, hh = 0, mm = 0, ss = 0, n = 0;
+    int64_t days;
+    if (sscanf(s, "%4d-%2d-%2d%n", &y, &m, &d, &n) != 3) return -1;
+    s += n;
+    if (*s == 'T' || *s == ' ') {
+        if (sscanf(s+1, "%2d:%2d:%2d%n", &hh, &mm, &ss, &n) != 3) return -1;
+        s += n + 1;
+    }
+    if (*s || m < 1 || m > 12 || d < 1 || d > 31 || hh > 23 || mm > 59 || ss > 60) return -1;
+    // days since 1970-01-01 in the proleptic gregorian calendar
+    if (m <= 2) y--;
+    days = (int64_t)365 * y + y / 4 - y / 100 + y / 400 + (153 * ((m + 9) % 12) + 2) / 5 + d - 1 - 719468;
+    *t = (time_t)(days * 86400 + hh * 3600 + mm * 60 + ss);
+    return 0;
+}
+
+
+static int pst_filter_size(const char *s, uint64_t *size) {
+    char *end;
+    double n = strtod(s, &end);
+    if (end == s || n < 0) return -1;
+    if      (*end == 'k' || *end == 'K') { n *= 1024;               end++; }
+    else if (*end == 'm' || *end == 'M') { n *= 1024 * 1024;        end++; }
+    else if (*end == 'g' || *end == 'G') { n *= 1024 * 1024 * 1024; end++; }
+    if (*end) return -1;
+    *size = (uint64_t)n;
+    return 0;
+}
+
+
+int pst_parse_filter(pst_filter *filter, const char *expr) {
+    char *terms, *term, *next;
+    int rc = 0;
+    memset(filter, 0, sizeof(*filter));
+    if (!expr) return -1;
+    terms = strdup(expr);
+    for (term = terms; term && !rc; term = next) {
+        char *value;
+        next = strchr(term, ',');
+        if (next) *next++ = '\0';
+        if (!*term) continue;
+        value = strchr(term, '=');
+        if (!value || !value[1]) {
+            rc = -1;
+            break;
+        }
+        *value++ = '\0';
+        if      (!strcmp(term, "after"))   rc = pst_filter_time(value, &filter->after);
+        else if (!strcmp(term, "before"))  rc = pst_filter_time(value, &filter->before);
+        else if (!strcmp(term, "minsize")) rc = pst_filter_size(value, &filter->min_size);
+        else if (!strcmp(term, "maxsize")) rc = pst_filter_size(value, &filter->max_size);
+        else if (!strcmp(term, "from"))    { free(filter->from);          filter->from          = strdup(value); }
+        else if (!strcmp(term, "to"))      { free(filter->to);            filter->to            = strdup(value); }
+        else if (!strcmp(term, "class"))   { free(filter->message_class); filter->message_class = strdup(value); }
+        else rc = -1;
+    }
+    free(terms);
+    if (rc) pst_free_filter(filter);
+    return rc;
+}
+
+
+void pst_free_filter(pst_filter *filter) {
+    free(filter->from);
+    free(filter->to);
+    free(filter->message_class);
+    memset(filter, 0, sizeof(*filter));
+}
+
+
+void pst_set_filter(pst_file *pf, pst_filter *filter) {
+    if (pf && pf->state) pf->state->filter = filter;
+}
+
+
+// the reads that may go through at once, as a time
+#define PST_READ_BURST_NS 100000000
+
+
+static uint64_t pst_read_take(uint64_t *due, uint64_t cost, uint64_t now) {
+    // a token bucket kept as the time at which everything taken from it so
+    // far would have been allowed at the full rate. Returns how long to
+    // wait for this cost to be allowed.
+    uint64_t old, t;
+#if defined(__GNUC__)
+    old = __atomic_load_n(due, __ATOMIC_RELAXED);
+    do {
+        t = ((old > now) ? old : now) + cost;
+    } while (!__atomic_compare_exchange_n(due, &old, t, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#else
+    old = *due;
+    t = ((old > now) ? old : now) + cost;
+    *due = t;
+#endif
+    return (t > now + PST_READ_BURST_NS) ? t - now - PST_READ_BURST_NS : 0;
+}
+
+
+static void pst_read_wait(pst_file *pf, size_t size) {
+    pst_read_limit *l = pf->state->limit;
+    uint64_t now = pst_now_ns(), wait = 0, w;
+    struct timespec ts;
+    if (l->bytes_per_sec) {
+        w = pst_read_take(&l->bytes_due, (uint64_t)((double)size * 1e9 / l->bytes_per_sec), now);
+        if (w > wait) wait = w;
+    }
+    if (l->reads_per_sec) {
+        w = pst_read_take(&l->reads_due, 1000000000 / l->reads_per_sec, now);
+        if (w > wait) wait = w;
+    }
+    if (!wait) return;
+    PST_STAT_ADD(pf, read_wait_ns, wait);
+    ts.tv_sec  = wait / 1000000000;
+    ts.tv_nsec = wait % 1000000000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+
+static const char *pst_read_kinds[PST_READ_KINDS] = {"index", "desc", "id2", "item", "attachment"};
+
+
+static size_t pst_read_hash(int64_t pos, size_t buckets) {
+    return (size_t)(((uint64_t)pos * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & (buckets - 1);
+}
+
+
+static void pst_read_grow(struct pst_read_profile *r) {
+    size_t buckets = r->buckets * 2;
+    size_t i;
+    pst_read_range **table = (pst_read_range**)pst_malloc(buckets * sizeof(*table));
+    memset(table, 0, buckets * sizeof(*table));
+    for (i = 0; i < r->buckets; i++) {
+        while (r->table[i]) {
+            pst_read_range *p = r->table[i];
+            size_t h = pst_read_hash(p->offset, buckets);
+            r->table[i] = p->next;
+            p->next     = table[h];
+            table[h]    = p;
+        }
+    }
+    free(r->table);
+    r->table   = table;
+    r->buckets = buckets;
+}
+
+
+int pst_profile_reads(pst_file *pf) {
+    struct pst_read_profile *r;
+    if (!pf || !pf->state) return -1;
+    if (pf->state->profile) return 0;
+    r = (struct pst_read_profile*)pst_malloc(sizeof(*r));
+    memset(r, 0, sizeof(*r));
+    r->buckets = 1024;
+    r->table   = (pst_read_range**)pst_malloc(r->buckets * sizeof(*r->table));
+    memset(r->table, 0, r->buckets * sizeof(*r->table));
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&r->mutex, NULL);
+#endif
+    pf->state->profile = r;
+    return 0;
+}
+
+
+static void pst_record_read(pst_file *pf, int64_t pos, size_t size) {
+    struct pst_read_profile *r = pf->state->profile;
+    pst_read_range *p;
+    int kind = pst_read_kind;
+    size_t h;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&r->mutex);
+#endif
+    h = pst_read_hash(pos, r->buckets);
+    for (p = r->table[h]; p; p = p->next) {
+        if (p->offset == pos && p->size == size) break;
+    }
+    if (p) {
+        r->rereads[kind]++;
+        r->reread_bytes[kind] += size;
+    }
+    else {
+        if (r->count >= r->buckets) {
+            pst_read_grow(r);
+            h = pst_read_hash(pos, r->buckets);
+        }
+        p = (pst_read_range*)pst_malloc(sizeof(*p));
+        p->offset    = pos;
+        p->size      = size;
+        p->readcount = 0;
+        p->kinds     = 0;
+        p->next      = r->table[h];
+        r->table[h]  = p;
+        r->count++;
+    }
+    p->readcount++;
+    p->kinds |= 1 << kind;
+    r->reads[kind]++;
+    r->bytes[kind] += size;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&r->mutex);
+#endif
+}
+
+
+static void pst_free_reads(pst_file *pf) {
+    struct pst_read_profile *r = (pf->state) ? pf->state->profile : NULL;
+    size_t i;
+    if (!r) return;
+    for (i = 0; i < r->buckets; i++) {
+        while (r->table[i]) {
+            pst_read_range *p = r->table[i];
+            r->table[i] = p->next;
+            free(p);
+        }
+    }
+    free(r->table);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&r->mutex);
+#endif
+    free(r);
+    pf->state->profile = NULL;
+}
+
+
+static int pst_read_by_offset(const void *a, const void *b) {
+    const pst_read_range *x = *(const pst_read_range**)a;
+    const pst_read_range *y = *(const pst_read_range**)b;
+    if (x->offset != y->offset) return (x->offset < y->offset) ? -1 : 1;
+    if (x->size   != y->size)   return (x->size   < y->size)   ? -1 : 1;
+    return 0;
+}
+
+
+static int pst_read_by_rereads(const void *a, const void *b) {
+    const pst_read_range *x = *(const pst_read_range**)a;
+    const pst_read_range *y = *(const pst_read_range**)b;
+    uint64_t xb = (uint64_t)(x->readcount - 1) * x->size;
+    uint64_t yb = (uint64_t)(y->readcount - 1) * y->size;
+    if (xb != yb) return (xb > yb) ? -1 : 1;
+    return pst_read_by_offset(a, b);
+}
+
+
+void pst_print_reads(FILE *fp, pst_file *pf, int top) {
+    struct pst_read_profile *r;
+    pst_read_range **all;
+    uint64_t reads = 0, bytes = 0, rereads = 0, reread_bytes = 0, unique = 0;
+    int64_t end = 0;
+    size_t i, n = 0, ranges = 0;
+    int k;
+    if (!pf || !pf->state || !(r = pf->state->profile)) return;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&r->mutex);
+#endif
+    all = (pst_read_range**)pst_malloc((r->count + 1) * sizeof(*all));
+    for (i = 0; i < r->buckets; i++) {
+        pst_read_range *p;
+        for (p = r->table[i]; p; p = p->next) all[n++] = p;
+    }
+
+    // merge the overlapping ranges to find the bytes of the file read at all
+    qsort(all, n, sizeof(*all), pst_read_by_offset);
+    for (i = 0; i < n; i++) {
+        int64_t b = all[i]->offset, e = all[i]->offset + (int64_t)all[i]->size;
+        if (!i || b > end) {
+            ranges++;
+            unique += e - b;
+            end = e;
+        }
+        else if (e > end) {
+            unique += e - end;
+            end = e;
+        }
+    }
+
+    fprintf(fp, "reads of %s\n", pf->fname);
+    fprintf(fp, "%-12s %12s %16s %12s %16s\n", "kind", "reads", "bytes", "rereads", "reread bytes");
+    for (k = 0; k < PST_READ_KINDS; k++) {
+        fprintf(fp, "%-12s %12" PRIu64 " %16" PRIu64 " %12" PRIu64 " %16" PRIu64 "\n", pst_read_kinds[k],
+                r->reads[k], r->bytes[k], r->rereads[k], r->reread_bytes[k]);
+        reads        += r->reads[k];
+        bytes        += r->bytes[k];
+        rereads      += r->rereads[k];
+        reread_bytes += r->reread_bytes[k];
+    }
+    fprintf(fp, "%-12s %12" PRIu64 " %16" PRIu64 " %12" PRIu64 " %16" PRIu64 "\n", "total", reads, bytes, rereads, reread_bytes);
+    fprintf(fp, "%" PRIu64 " unique bytes in %zu ranges, %.2f bytes read per unique byte\n",
+            unique, ranges, (unique) ? (double)bytes / unique : 0.0);
+
+    qsort(all, n, sizeof(*all), pst_read_by_rereads);
+    if (top > 0 && n && all[0]->readcount > 1) {
+        fprintf(fp, "%-18s %10s %8s  %s\n", "offset", "size", "reads", "kinds");
+        for (i = 0; i < n && i < (size_t)top && all[i]->readcount > 1; i++) {
+            fprintf(fp, "%#-18" PRIx64 " %10zu %8d ", (uint64_t)all[i]->offset, all[i]->size, all[i]->readcount);
+            for (k = 0; k < PST_READ_KINDS; k++) {
+                if (all[i]->kinds & (1 << k)) fprintf(fp, " %s", pst_read_kinds[k]);
+            }
+            fprintf(fp, "\n");
+        }
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&r->mutex);
+#endif
+    free(all);
+}
+
+
 /**
  * add a pst descriptor node to a linked list of such nodes.
  *
@@ -588,7 +1138,9 @@ pst_binary pst_attach_to_mem(pst_file *pf, pst_item_attach *attach) {
     if ((!attach->data.data) && (attach->i_id != (uint64_t)-1)) {
         ptr = pst_getID(pf, attach->i_id);
         if (ptr) {
+            int kind = pst_read_as(PST_READ_ATTACHMENT);
             rc.size = pst_ff_getID2data(pf, ptr, &h);
+            pst_read_as(kind);
         } else {
             DEBUG_WARN(("Couldn't find ID pointer. Cannot handle attachment\n"));
         }
@@ -610,7 +1162,9 @@ size_t pst_attach_to_file(pst_file *pf, pst_item_attach *attach, FILE* fp) {
     if ((!attach->data.data) && (attach->i_id != (uint64_t)-1)) {
         ptr = pst_getID(pf, attach->i_id);
         if (ptr) {
+            int kind = pst_read_as(PST_READ_ATTACHMENT);
             size = pst_ff_getID2data(pf, ptr, &h);
+            pst_read_as(kind);
         } else {
             DEBUG_WARN(("Couldn't find ID pointer. Cannot save attachment to file\n"));
         }
@@ -634,7 +1188,9 @@ size_t pst_attach_to_file_base64(pst_file *pf, pst_item_attach *attach, FILE* fp
     if ((!attach->data.data) && (attach->i_id != (uint64_t)-1)) {
         ptr = pst_getID(pf, attach->i_id);
         if (ptr) {
+            int kind = pst_read_as(PST_READ_ATTACHMENT);
             size = pst_ff_getID2data(pf, ptr, &h);
+            pst_read_as(kind);
         } else {
             DEBUG_WARN(("Couldn't find ID pointer. Cannot save attachment to Base64\n"));
         }
@@ -654,14 +1210,54 @@ size_t pst_attach_to_file_base64(pst_file *pf, pst_item_attach *attach, FILE* fp
 }
 
 
+size_t pst_attach_size(pst_file *pf, pst_item_attach *attach) {
+    pst_index_ll *ptr;
+    size_t size = 0;
+    DEBUG_ENT("pst_attach_size");
+    if ((!attach->data.data) && (attach->i_id != (uint64_t)-1)) {
+        ptr = pst_getID(pf, attach->i_id);
+        if (!ptr) {
+            DEBUG_WARN(("Couldn't find ID pointer. Cannot find the attachment size\n"));
+        } else if (!(ptr->i_id & 0x02)) {
+            size = (ptr->inflated_size) ? ptr->inflated_size : ptr->size;
+        } else {
+            // the header of an indirection block has the total size of the
+            // data, without reading the blocks it points to
+            char *buf = NULL;
+            int kind = pst_read_as(PST_READ_ATTACHMENT);
+            size_t a = pst_ff_getIDblock(pf, ptr->i_id, &buf);
+            pst_read_as(kind);
+            if (a >= sizeof(pst_block_hdr)) {
+                pst_block_hdr block_hdr;
+                memcpy(&block_hdr, buf, sizeof(block_hdr));
+                LE16_CPU(block_hdr.index_offset);
+                LE32_CPU(block_hdr.offset);
+                if (block_hdr.index_offset == (uint16_t)0x0101 || block_hdr.index_offset == (uint16_t)0x0201) {
+                    size = block_hdr.offset;
+                } else {
+                    size = a;
+                }
+            }
+            if (buf) free(buf);
+        }
+    } else {
+        size = attach->data.size;
+    }
+    DEBUG_RET();
+    return size;
+}
+
+
 int pst_load_index (pst_file *pf) {
     int  x;
+    uint64_t start;
     DEBUG_ENT("pst_load_index");
     if (!pf) {
         DEBUG_WARN(("Cannot load index for a NULL pst_file\n"));
         DEBUG_RET();
         return -1;
     }
+    start = pst_now_ns();
 
     x = pst_build_id_ptr(pf, pf->index1, 0, pf->index1_back, 0, UINT64_MAX);
     DEBUG_INFO(("build id ptr returns %i\n", x));
@@ -670,6 +1266,7 @@ int pst_load_index (pst_file *pf) {
     DEBUG_INFO(("build desc ptr returns %i\n", x));
 
     pst_printDptr(pf, pf->d_head);
+    PST_STAT_ADD(pf, load_index_ns, pst_now_ns() - start);
 
     DEBUG_RET();
     return 0;
@@ -732,7 +1329,7 @@ int pst_load_extended_attributes(pst_file *pf) {
         DEBUG_WARN(("Have not been able to fetch any id2 values for d_id 0x61. Brace yourself!\n"));
     }
 
-    list = pst_parse_block(pf, p->desc->i_id, id2_head);
+    list = pst_parse_block(pf, p->desc->i_id, id2_head, 1);
     if (!list) {
         DEBUG_WARN(("Cannot process desc block for item 0x61. Not loading extended Attributes\n"));
         pst_free_id2(id2_head);
@@ -1047,7 +1644,7 @@ static int pst_build_id_ptr(pst_file *pf, int64_t offset, int32_t depth, uint64_
         return -1;
     }
     DEBUG_INFO(("Reading index block\n"));
-    if (pst_read_block_size(pf, offset, BLOCK_SIZE, BLOCK_SIZE, &buf) < BLOCK_SIZE) {
+    if (pst_read_block_as(pf, PST_READ_INDEX, offset, BLOCK_SIZE, BLOCK_SIZE, &buf) < BLOCK_SIZE) {
         DEBUG_WARN(("Failed to read %zu bytes\n", BLOCK_SIZE));
         if (buf) free(buf);
         DEBUG_RET();
@@ -1158,7 +1755,7 @@ static int pst_build_desc_ptr (pst_file *pf, int64_t offset, int32_t depth, uint
         return -1;
     }
     DEBUG_INFO(("Reading desc block\n"));
-    if (pst_read_block_size(pf, offset, DESC_BLOCK_SIZE, DESC_BLOCK_SIZE, &buf) < DESC_BLOCK_SIZE) {
+    if (pst_read_block_as(pf, PST_READ_DESC, offset, DESC_BLOCK_SIZE, DESC_BLOCK_SIZE, &buf) < DESC_BLOCK_SIZE) {
         DEBUG_WARN(("Failed to read %zu bytes\n", DESC_BLOCK_SIZE));
         if (buf) free(buf);
         DEBUG_RET();
@@ -1249,15 +1846,155 @@ static int pst_build_desc_ptr (pst_file *pf, int64_t offset, int32_t depth, uint
 }
 
 
+static int pst_filter_text(pst_file *pf, pst_mapi_element *element, const char *text, int prefix) {
+    // whether a string property contains text, or starts with it,
+    // ignoring case. Unicode strings have not been converted yet, so
+    // only the ones looked at here are.
+    pst_vbuf *buf = pst_vballoc((size_t)256);
+    size_t n = strlen(text);
+    int found = 0;
+    char *p;
+    if (element->type == 0x1f) {
+        if (pst_utf16_to_8(pf, element->data, element->size, buf) == (size_t)-1) pst_vbset(buf, "", (size_t)0);
+    }
+    else if (element->type == 0x1e) {
+        pst_vbset(buf, element->data, element->size);
+    }
+    pst_vbappend(buf, "\0", (size_t)1);
+    for (p = buf->b; *p; p++) {
+        size_t i = 0;
+        while (i < n && p[i] && toupper((unsigned char)p[i]) == toupper((unsigned char)text[i])) i++;
+        if (i == n) {
+            found = 1;
+            break;
+        }
+        if (prefix) break;
+    }
+    free(buf->buf);
+    free(buf);
+    return found;
+}
+
+
+static time_t pst_filter_filetime(pst_mapi_element *element) {
+    FILETIME ft;
+    if (element->type != 0x40 || element->size != sizeof(FILETIME)) return 0;
+    memcpy(&ft, element->data, sizeof(FILETIME));
+    LE32_CPU(ft.dwLowDateTime);
+    LE32_CPU(ft.dwHighDateTime);
+    return pst_fileTimeToUnixTime(&ft);
+}
+
+
+/** Test the properties of an item against the filter of the file, before
+ *  the rest of the item is processed.
+ *
+ *  @return non-zero if the item should be returned
+ */
+static int pst_filter_match(pst_file *pf, pst_mapi_object *list) {
+    pst_filter *f = pf->state->filter;
+    pst_mapi_element *message_class = NULL;
+    time_t delivered = 0, sent = 0, created = 0, t;
+    uint64_t size = 0;
+    int have_size = 0, from = 0, to = 0;
+    int32_t x;
+    DEBUG_ENT("pst_filter_match");
+    for (x = 0; x < list->count_elements; x++) {
+        pst_mapi_element *e = list->elements[x];
+        switch (e->mapi_id) {
+            case 0x001A: // PR_MESSAGE_CLASS
+                message_class = e;
+                break;
+            case 0x0E06: // PR_MESSAGE_DELIVERY_TIME
+                delivered = pst_filter_filetime(e);
+                break;
+            case 0x0039: // PR_CLIENT_SUBMIT_TIME
+                sent = pst_filter_filetime(e);
+                break;
+            case 0x3007: // PR_CREATION_TIME
+                created = pst_filter_filetime(e);
+                break;
+            case 0x0E08: // PR_MESSAGE_SIZE
+                if (e->type == 0x03) {
+                    uint32_t n;
+                    memcpy(&n, e->data, sizeof(n));
+                    LE32_CPU(n);
+                    size = n;
+                    have_size = 1;
+                }
+                break;
+            case 0x0042: // PR_SENT_REPRESENTING_NAME
+            case 0x0065: // PR_SENT_REPRESENTING_EMAIL_ADDRESS
+            case 0x0C1A: // PR_SENDER_NAME
+            case 0x0C1F: // PR_SENDER_EMAIL_ADDRESS
+                if (f->from && !from) from = pst_filter_text(pf, e, f->from, 0);
+                break;
+            case 0x0076: // PR_RECEIVED_BY_EMAIL_ADDRESS
+            case 0x0E02: // PR_DISPLAY_BCC
+            case 0x0E03: // PR_DISPLAY_CC
+            case 0x0E04: // PR_DISPLAY_TO
+                if (f->to && !to) to = pst_filter_text(pf, e, f->to, 0);
+                break;
+            default:
+                break;
+        }
+    }
+    // only messages have a message class, folders and the message store
+    // always pass
+    if (!message_class) {
+        DEBUG_RET();
+        return 1;
+    }
+    if (f->message_class && !pst_filter_text(pf, message_class, f->message_class, 1)) {
+        DEBUG_RET();
+        return 0;
+    }
+    if (f->after || f->before) {
+        t = (delivered) ? delivered : (sent) ? sent : created;
+        if (!t || (f->after && t < f->after) || (f->before && t >= f->before)) {
+            DEBUG_RET();
+            return 0;
+        }
+    }
+    if (f->min_size || f->max_size) {
+        if (!have_size || size < f->min_size || (f->max_size && size > f->max_size)) {
+            DEBUG_RET();
+            return 0;
+        }
+    }
+    DEBUG_RET();
+    return (!f->from || from) && (!f->to || to);
+}
+
+
 /** Process a high level object from the pst file.
  */
 pst_item* pst_parse_item(pst_file *pf, pst_desc_tree *d_ptr, pst_id2_tree *m_head) {
+    int filtered = 0;
+    pst_item *item = pst_parse_item_uncounted(pf, d_ptr, m_head, &filtered);
+    if (item) {
+        PST_STAT_ADD(pf, items_parsed, 1);
+    }
+    else if (filtered) {
+        PST_STAT_ADD(pf, items_filtered, 1);
+    }
+    else {
+        PST_STAT_ADD(pf, parse_failures, 1);
+    }
+    if (pf->state && pf->state->progress) pst_progress_tick(pf);
+    return item;
+}
+
+
+static pst_item* pst_parse_item_uncounted(pst_file *pf, pst_desc_tree *d_ptr, pst_id2_tree *m_head, int *filtered) {
     pst_mapi_object * list;
     pst_id2_tree *id2_head = m_head;
     pst_id2_tree *id2_ptr  = NULL;
     pst_item *item = NULL;
     pst_item_attach *attach = NULL;
     int32_t x;
+    // embedded messages go with the message they are attached to
+    int filter = (pf->state && pf->state->filter && !m_head);
     DEBUG_ENT("pst_parse_item");
     if (!d_ptr) {
         DEBUG_WARN(("you cannot pass me a NULL! I don't want it!\n"));
@@ -1280,13 +2017,31 @@ pst_item* pst_parse_item(pst_file *pf, pst_desc_tree *d_ptr, pst_id2_tree *m_hea
     }
     pst_printID2ptr(id2_head);
 
-    list = pst_parse_block(pf, d_ptr->desc->i_id, id2_head);
+    // with a filter, the unicode strings are only converted for the items
+    // that match it
+    list = pst_parse_block(pf, d_ptr->desc->i_id, id2_head, !filter);
     if (!list) {
         DEBUG_WARN(("pst_parse_block() returned an error for d_ptr->desc->i_id [%#" PRIx64 "]\n", d_ptr->desc->i_id));
         if (!m_head) pst_free_id2(id2_head);
         DEBUG_RET();
         return NULL;
     }
+    if (filter) {
+        pst_mapi_object *mo;
+        if (!pst_filter_match(pf, list)) {
+            DEBUG_INFO(("item [%#" PRIx64 "] does not match the filter\n", d_ptr->d_id));
+            *filtered = 1;
+            pst_free_list(list);
+            if (!m_head) pst_free_id2(id2_head);
+            DEBUG_RET();
+            return NULL;
+        }
+        for (mo = list; mo; mo = mo->next) {
+            for (x = 0; x < mo->count_elements; x++) {
+                if (mo->elements[x]->type == 0x1f && mo->elements[x]->data) pst_convert_utf16(pf, mo->elements[x]);
+            }
+        }
+    }
 
     item = (pst_item*) pst_malloc(sizeof(pst_item));
     memset(item, 0, sizeof(pst_item));
@@ -1302,10 +2057,10 @@ pst_item* pst_parse_item(pst_file *pf, pst_desc_tree *d_ptr, pst_id2_tree *m_hea
     }
     pst_free_list(list);
 
-    if ((id2_ptr = pst_getID2(id2_head, (uint64_t)0x692))) {
+    if ((id2_ptr = pst_getID2(pf, id2_head, (uint64_t)0x692))) {
         // DSN/MDN reports?
         DEBUG_INFO(("DSN/MDN processing\n"));
-        list = pst_parse_block(pf, id2_ptr->id->i_id, id2_ptr->child);
+        list = pst_parse_block(pf, id2_ptr->id->i_id, id2_ptr->child, 1);
         if (list) {
             for (x=0; x < list->count_objects; x++) {
                 attach = (pst_item_attach*) pst_malloc(sizeof(pst_item_attach));
@@ -1330,9 +2085,9 @@ pst_item* pst_parse_item(pst_file *pf, pst_desc_tree *d_ptr, pst_id2_tree *m_hea
         }
     }
 
-    if ((id2_ptr = pst_getID2(id2_head, (uint64_t)0x671))) {
+    if ((id2_ptr = pst_getID2(pf, id2_head, (uint64_t)0x671))) {
         DEBUG_INFO(("ATTACHMENT processing attachment\n"));
-        list = pst_parse_block(pf, id2_ptr->id->i_id, id2_ptr->child);
+        list = pst_parse_block(pf, id2_ptr->id->i_id, id2_ptr->child, 1);
         if (!list) {
             if (item->flags & PST_FLAG_HAS_ATTACHMENT) {
                 // Only report an error if we expected to see an attachment table and didn't.
@@ -1363,12 +2118,12 @@ pst_item* pst_parse_item(pst_file *pf, pst_desc_tree *d_ptr, pst_id2_tree *m_hea
         // each attachment
         for (attach = item->attach; attach; attach = attach->next) {
             DEBUG_WARN(("initial attachment id2 %#" PRIx64 "\n", attach->id2_val));
-            if ((id2_ptr = pst_getID2(id2_head, attach->id2_val))) {
+            if ((id2_ptr = pst_getID2(pf, id2_head, attach->id2_val))) {
                 DEBUG_WARN(("initial attachment id2 found id %#" PRIx64 "\n", id2_ptr->id->i_id));
                 // id2_ptr is a record describing the attachment
                 // we pass NULL instead of id2_head cause we don't want it to
                 // load all the extra stuff here.
-                list = pst_parse_block(pf, id2_ptr->id->i_id, NULL);
+                list = pst_parse_block(pf, id2_ptr->id->i_id, NULL, 1);
                 if (!list) {
                     DEBUG_WARN(("ERROR error processing an attachment record\n"));
                     continue;
@@ -1386,7 +2141,7 @@ pst_item* pst_parse_item(pst_file *pf, pst_desc_tree *d_ptr, pst_id2_tree *m_hea
                 pst_free_list(list);
                 // As per 2.4.6.2 in the spec, the attachment data is stored as a child of the
                 // attachment object, so we pass in id2_ptr as the head to search from.
-                id2_ptr = pst_getID2(id2_ptr->child, attach->id2_val);
+                id2_ptr = pst_getID2(pf, id2_ptr->child, attach->id2_val);
                 if (id2_ptr) {
                     DEBUG_WARN(("second pass attachment updating id2 %#" PRIx64 " found i_id %#" PRIx64 "\n", attach->id2_val, id2_ptr->id->i_id));
                     // i_id has been updated to the datablock containing the attachment data
@@ -1437,12 +2192,52 @@ static void freeall(pst_subblocks *subs, pst_block_offset_pointer *p1,
 }
 
 
+static size_t pst_utf16_to_8(pst_file *pf, char *data, size_t size, pst_vbuf *utf8buf) {
+    size_t rc;
+    pst_vbuf *utf16buf = pst_vballoc((size_t)1024);
+
+    //need UTF-16 zero-termination
+    pst_vbset(utf16buf, data, size);
+    pst_vbappend(utf16buf, "\0\0", (size_t)2);
+    DEBUG_INFO(("Iconv in:\n"));
+    DEBUG_HEXDUMPC(utf16buf->b, utf16buf->dlen, 0x10);
+    rc = pst_vb_utf16to8(utf8buf, utf16buf->b, utf16buf->dlen);
+    PST_STAT_ADD(pf, iconv_calls, 1);
+    PST_STAT_ADD(pf, iconv_bytes, utf16buf->dlen);
+    free(utf16buf->buf);
+    free(utf16buf);
+    return rc;
+}
+
+
+/** Convert a type 0x1f unicode string element to utf-8 in place.
+ */
+static void pst_convert_utf16(pst_file *pf, pst_mapi_element *element) {
+    pst_vbuf *utf8buf = pst_vballoc((size_t)1024);
+    if (pst_utf16_to_8(pf, element->data, element->size, utf8buf) == (size_t)-1) {
+        DEBUG_WARN(("Failed to convert utf-16 to utf-8\n"));
+    }
+    else {
+        free(element->data);
+        element->size = utf8buf->dlen;
+        element->data = pst_malloc(utf8buf->dlen);
+        memcpy(element->data, utf8buf->b, utf8buf->dlen);
+    }
+    DEBUG_INFO(("Iconv out:\n"));
+    DEBUG_HEXDUMPC(element->data, element->size, 0x10);
+    free(utf8buf->buf);
+    free(utf8buf);
+}
+
+
 /** Process a low level descriptor block (0x0101, 0xbcec, 0x7cec) into a
  *  list of MAPI objects, each of which contains a list of MAPI elements.
  *
+ *  @param utf16 non-zero to convert the unicode strings to utf-8, zero to
+ *               leave them for pst_convert_utf16().
  *  @return list of MAPI objects
  */
-static pst_mapi_object* pst_parse_block(pst_file *pf, uint64_t block_id, pst_id2_tree *i2_head) {
+static pst_mapi_object* pst_parse_block(pst_file *pf, uint64_t block_id, pst_id2_tree *i2_head, int utf16) {
     pst_mapi_object *mo_head = NULL;
     char  *buf       = NULL;
     size_t read_size = 0;
@@ -1863,33 +2658,9 @@ static pst_mapi_object* pst_parse_block(pst_file *pf, uint64_t block_id, pst_id2
                         mo_ptr->elements[x]->data = NULL;
                     }
                 }
-                if (table_rec.ref_type == (uint16_t)0x1f) {
+                if (table_rec.ref_type == (uint16_t)0x1f && utf16) {
                     // there is more to do for the type 0x1f unicode strings
-                    size_t rc;
-                    pst_vbuf *utf16buf = pst_vballoc((size_t)1024);
-                    pst_vbuf *utf8buf  = pst_vballoc((size_t)1024);
-
-                    //need UTF-16 zero-termination
-                    pst_vbset(utf16buf, mo_ptr->elements[x]->data, mo_ptr->elements[x]->size);
-                    pst_vbappend(utf16buf, "\0\0", (size_t)2);
-                    DEBUG_INFO(("Iconv in:\n"));
-                    DEBUG_HEXDUMPC(utf16buf->b, utf16buf->dlen, 0x10);
-                    rc = pst_vb_utf16to8(utf8buf, utf16buf->b, utf16buf->dlen);
-                    if (rc == (size_t)-1) {
-                        DEBUG_WARN(("Failed to convert utf-16 to utf-8\n"));
-                    }
-                    else {
-                        free(mo_ptr->elements[x]->data);
-                        mo_ptr->elements[x]->size = utf8buf->dlen;
-                        mo_ptr->elements[x]->data = pst_malloc(utf8buf->dlen);
-                        memcpy(mo_ptr->elements[x]->data, utf8buf->b, utf8buf->dlen);
-                    }
-                    DEBUG_INFO(("Iconv out:\n"));
-                    DEBUG_HEXDUMPC(mo_ptr->elements[x]->data, mo_ptr->elements[x]->size, 0x10);
-                    free(utf8buf->buf);
-                    free(utf8buf);
-                    free(utf16buf->buf);
-                    free(utf16buf);
+                    pst_convert_utf16(pf, mo_ptr->elements[x]);
                 }
                 if (mo_ptr->elements[x]->type == 0) mo_ptr->elements[x]->type = table_rec.ref_type;
             } else {
@@ -3300,6 +4071,28 @@ static void pst_free_xattrib(pst_x_attrib_ll *x) {
 }
 
 
+static size_t pst_desc_memory(pst_desc_tree *head) {
+    size_t r = 0;
+    while (head) {
+        r += sizeof(pst_desc_tree) + pst_desc_memory(head->child);
+        head = head->next;
+    }
+    return r;
+}
+
+
+/** */
+size_t pst_index_memory(pst_file *pf) {
+    size_t r;
+    pst_x_attrib_ll *x;
+    DEBUG_ENT("pst_index_memory");
+    r = pf->i_capacity * sizeof(pst_index_ll) + pst_desc_memory(pf->d_head);
+    for (x = pf->x_head; x; x = x->next) r += sizeof(pst_x_attrib_ll);
+    DEBUG_RET();
+    return r;
+}
+
+
 static pst_id2_tree * pst_build_id2(pst_file *pf, pst_index_ll* list) {
     pst_block_header block_head;
     pst_id2_tree *head = NULL, *tail = NULL;
@@ -3311,7 +4104,7 @@ static pst_id2_tree * pst_build_id2(pst_file *pf, pst_index_ll* list) {
     pst_id2_tree *i2_ptr = NULL;
     DEBUG_ENT("pst_build_id2");
 
-    if (pst_read_block_size(pf, list->offset, list->size, list->inflated_size, &buf) < list->size) {
+    if (pst_read_block_as(pf, PST_READ_ID2, list->offset, list->size, list->inflated_size, &buf) < list->size) {
         //an error occurred in block read
         DEBUG_WARN(("block read error occurred. offset = %#" PRIx64 ", size = %#" PRIx64 "\n", list->offset, list->size));
         if (buf) free(buf);
@@ -3699,14 +4492,14 @@ pst_index_ll* pst_getID(pst_file* pf, uint64_t i_id) {
 
     DEBUG_INFO(("Trying to find %#" PRIx64 "\n", i_id));
     ptr = bsearch(&i_id, pf->i_table, pf->i_count, sizeof *pf->i_table, pst_getID_compare);
-    if (ptr) {DEBUG_INFO(("Found Value %#" PRIx64 "\n", i_id));            }
-    else     {DEBUG_INFO(("ERROR: Value %#" PRIx64 " not found\n", i_id)); }
+    if (ptr) {DEBUG_INFO(("Found Value %#" PRIx64 "\n", i_id));            PST_STAT_ADD(pf, id_hits, 1);   }
+    else     {DEBUG_INFO(("ERROR: Value %#" PRIx64 " not found\n", i_id)); PST_STAT_ADD(pf, id_misses, 1); }
     DEBUG_RET();
     return ptr;
 }
 
 
-static pst_id2_tree *pst_getID2(pst_id2_tree *head, uint64_t id2) {
+static pst_id2_tree *pst_getID2(pst_file *pf, pst_id2_tree *head, uint64_t id2) {
     // the id2 values are only unique among siblings.
     // we must not recurse into children
     // the caller must supply the correct parent
@@ -3719,10 +4512,12 @@ static pst_id2_tree *pst_getID2(pst_id2_tree *head, uint64_t id2) {
     }
     if (ptr && ptr->id) {
         DEBUG_INFO(("Found value %#" PRIx64 "\n", ptr->id->i_id));
+        PST_STAT_ADD(pf, id2_hits, 1);
         DEBUG_RET();
         return ptr;
     }
     DEBUG_INFO(("ERROR Not Found\n"));
+    PST_STAT_ADD(pf, id2_misses, 1);
     DEBUG_RET();
     return NULL;
 }
@@ -3803,13 +4598,12 @@ static size_t pst_read_raw_block_size(pst_file *pf, int64_t offset, size_t size,
 
     rsize = pst_getAtPos(pf, offset, *buf, size);
     if (rsize != size) {
-        DEBUG_WARN(("Didn't read all the data. fread returned less [%zu instead of %zu]\n", rsize, size));
-        if (feof(pf->fp)) {
-            DEBUG_WARN(("We tried to read past the end of the file at [offset %#" PRIx64 ", size %#zx]\n", (uint64_t)offset, size));
-        } else if (ferror(pf->fp)) {
-            DEBUG_WARN(("Error is set on file stream.\n"));
+        int err = errno;
+        DEBUG_WARN(("Didn't read all the data. Read returned less [%zu instead of %zu]\n", rsize, size));
+        if (err) {
+            DEBUG_WARN(("Read error at [offset %#" PRIx64 ", size %#zx]: %s\n", (uint64_t)offset, size, strerror(err)));
         } else {
-            DEBUG_WARN(("I can't tell why it failed\n"));
+            DEBUG_WARN(("We tried to read past the end of the file at [offset %#" PRIx64 ", size %#zx]\n", (uint64_t)offset, size));
         }
     }
 
@@ -3820,6 +4614,8 @@ static size_t pst_read_raw_block_size(pst_file *pf, int64_t offset, size_t size,
 static size_t pst_read_block_size(pst_file *pf, int64_t offset, size_t size, size_t inflated_size, char **buf) {
     DEBUG_ENT("pst_read_block_size");
     DEBUG_INFO(("Reading block from %#" PRIx64 ", %#zx bytes, %#zx inflated\n", (uint64_t)offset, size, inflated_size));
+    PST_STAT_ADD(pf, blocks_read, 1);
+    PST_STAT_ADD(pf, block_bytes, size);
     if (inflated_size <= size) {
         // Not deflated.
         size_t ret = pst_read_raw_block_size(pf, offset, size, buf);
@@ -3836,7 +4632,12 @@ static size_t pst_read_block_size(pst_file *pf, int64_t offset, size_t size, siz
     }
     *buf = (char *) pst_malloc(inflated_size);
     uLongf result_size = inflated_size;
-    if (uncompress((Bytef *) *buf, &result_size, (Bytef *) zbuf, size) != Z_OK || ((size_t) result_size) != inflated_size) {
+    uint64_t start = pst_now_ns();
+    int zrc = uncompress((Bytef *) *buf, &result_size, (Bytef *) zbuf, size);
+    PST_STAT_ADD(pf, inflate_ns, pst_now_ns() - start);
+    PST_STAT_ADD(pf, blocks_inflated, 1);
+    PST_STAT_ADD(pf, inflated_bytes, result_size);
+    if (zrc != Z_OK || ((size_t) result_size) != inflated_size) {
         DEBUG_WARN(("Failed to uncompress %zu bytes to %zu bytes, got %zu\n", size, inflated_size, (size_t) result_size));
         if (zbuf) free(zbuf);
         DEBUG_RET();
@@ -3847,6 +4648,21 @@ static size_t pst_read_block_size(pst_file *pf, int64_t offset, size_t size, siz
 }
 
 
+static int pst_read_as(int kind) {
+    int old = pst_read_kind;
+    pst_read_kind = kind;
+    return old;
+}
+
+
+static size_t pst_read_block_as(pst_file *pf, int kind, int64_t offset, size_t size, size_t inflated_size, char **buf) {
+    int old = pst_read_as(kind);
+    size_t r = pst_read_block_size(pf, offset, size, inflated_size, buf);
+    pst_read_as(old);
+    return r;
+}
+
+
 
 /** Decrypt a block of data from the pst file.
  * @param i_id identifier of this block, needed as part of the key for the enigma cipher
@@ -3858,6 +4674,16 @@ static size_t pst_read_block_size(pst_file *pf, int64_t offset, size_t size, siz
     @li 2 PST_ENCRYPT, German enigma 3 rotor cipher with fixed key
  * @return 0 if ok, -1 if error (NULL buffer or unknown encryption type)
  */
+static void pst_count_decrypt(pst_file *pf, size_t size) {
+    if (pf->encryption == PST_COMP_ENCRYPT) {
+        PST_STAT_ADD(pf, decrypt_compress_bytes, size);
+    }
+    else if (pf->encryption == PST_ENCRYPT) {
+        PST_STAT_ADD(pf, decrypt_high_bytes, size);
+    }
+}
+
+
 static int pst_decrypt(uint64_t i_id, char *buf, size_t size, unsigned char type) {
     size_t x = 0;
     unsigned char y;
@@ -3906,6 +4732,55 @@ static int pst_decrypt(uint64_t i_id, char *buf, size_t size, unsigned char type
 }
 
 
+int pst_encrypt(uint64_t i_id, char *buf, size_t size, unsigned char type) {
+    unsigned char inv_enc[256], inv_high1[256], inv_high2[256];
+    size_t x;
+    unsigned char y;
+    DEBUG_ENT("pst_encrypt");
+    if (!buf) {
+        DEBUG_RET();
+        return -1;
+    }
+    if (type != PST_COMP_ENCRYPT && type != PST_ENCRYPT) {
+        DEBUG_WARN(("Unknown encryption: %hhu. Cannot encrypt\n", type));
+        DEBUG_RET();
+        return -1;
+    }
+
+    // the rotors run backwards, so their inverses are needed
+    for (x = 0; x < 256; x++) {
+        inv_enc[comp_enc[x]]     = (unsigned char)x;
+        inv_high1[comp_high1[x]] = (unsigned char)x;
+        inv_high2[comp_high2[x]] = (unsigned char)x;
+    }
+
+    if (type == PST_COMP_ENCRYPT) {
+        for (x = 0; x < size; x++) {
+            buf[x] = (char)inv_enc[(unsigned char)buf[x]];
+        }
+
+    } else {
+        uint16_t salt = (uint16_t) (((i_id & 0x00000000ffff0000) >> 16) ^ (i_id & 0x000000000000ffff));
+        for (x = 0; x < size; x++) {
+            uint8_t losalt = (salt & 0x00ff);
+            uint8_t hisalt = (salt & 0xff00) >> 8;
+            y = (unsigned char)buf[x];
+            y += losalt;
+            y = inv_enc[y];
+            y += hisalt;
+            y = inv_high2[y];
+            y -= hisalt;
+            y = inv_high1[y];
+            y -= losalt;
+            buf[x] = (char)y;
+            salt++;
+        }
+    }
+    DEBUG_RET();
+    return 0;
+}
+
+
 static uint64_t pst_getIntAt(pst_file *pf, char *buf) {
     uint64_t buf64;
     uint32_t buf32;
@@ -3944,43 +4819,87 @@ static uint64_t pst_getIntAtPos(pst_file *pf, int64_t pos ) {
  * @param pos  offset of the data in the pst file
  * @param buf  buffer to contain the data
  * @param size size of the buffer and the amount of data to be read
- * @return     actual read size, 0 if seek error
+ * @return     actual read size, 0 if seek error. When this is less than
+ *             size, errno is 0 if the end of the file was reached, or the
+ *             error of the failed read.
  */
 static size_t pst_getAtPos(pst_file *pf, int64_t pos, void* buf, size_t size) {
     size_t rc;
+    int err = 0;
     DEBUG_ENT("pst_getAtPos");
-//  pst_block_recorder **t = &pf->block_head;
-//  pst_block_recorder *p = pf->block_head;
-//  while (p && ((p->offset+p->size) <= pos)) {
-//      t = &p->next;
-//      p = p->next;
-//  }
-//  if (p && (p->offset <= pos) && (pos < (p->offset+p->size))) {
-//      // bump the count
-//      p->readcount++;
-//  } else {
-//      // add a new block
-//      pst_block_recorder *tail = *t;
-//      p = (pst_block_recorder*)pst_malloc(sizeof(*p));
-//      *t = p;
-//      p->next      = tail;
-//      p->offset    = pos;
-//      p->size      = size;
-//      p->readcount = 1;
-//  }
-//  DEBUG_INFO(("pst file old offset %#" PRIx64 " old size %#zx read count %i offset %" PRIi64 " size %#zx\n",
-//              (uint64_t)(p->offset), p->size, p->readcount, (uint64_t)pos, size));
-
+    if (pf->state && pf->state->limit) pst_read_wait(pf, size);
+#ifdef HAVE_PREAD
+    // pread() does not move a shared file position, so several threads
+    // can read the same pst_file at once
+    {
+        int fd = fileno(pf->fp);
+        rc = 0;
+        while (rc < size) {
+            ssize_t r = pread(fd, (char*)buf + rc, size - rc, (off_t)(pos + rc));
+            PST_STAT_ADD(pf, read_calls, 1);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) err = errno;
+            if (r <= 0) break;
+            rc += (size_t)r;
+        }
+        PST_STAT_ADD(pf, bytes_read, rc);
+    }
+#else
+    // the seek and read must not be split by another thread
+#ifdef HAVE_PTHREAD_H
+    flockfile(pf->fp);
+#endif
     if (fseeko(pf->fp, pos, SEEK_SET) == -1) {
+        err = errno;
+#ifdef HAVE_PTHREAD_H
+        funlockfile(pf->fp);
+#endif
         DEBUG_RET();
+        errno = err;
         return 0;
     }
     rc = fread(buf, (size_t)1, size, pf->fp);
+    if (rc < size && ferror(pf->fp)) {
+        err = (errno) ? errno : EIO;
+        clearerr(pf->fp);
+    }
+#ifdef HAVE_PTHREAD_H
+    funlockfile(pf->fp);
+#endif
+    PST_STAT_ADD(pf, read_calls, 1);
+    PST_STAT_ADD(pf, bytes_read, rc);
+#endif
+    if (pf->state && pf->state->profile && rc) pst_record_read(pf, pos, rc);
     DEBUG_RET();
+    errno = err;
     return rc;
 }
 
 
+static size_t pst_prefetch_block(pst_file *pf, pst_index_ll *ptr) {
+    if (!ptr || !ptr->size) return 0;
+#ifdef HAVE_POSIX_FADVISE
+    if (!posix_fadvise(fileno(pf->fp), (off_t)ptr->offset, (off_t)ptr->size, POSIX_FADV_WILLNEED)) return ptr->size;
+#endif
+    return 0;
+}
+
+
+/** */
+size_t pst_prefetch(pst_file *pf, pst_desc_tree *d_ptr) {
+    size_t r = 0;
+    DEBUG_ENT("pst_prefetch");
+    if (d_ptr && !(pf->state && pf->state->limit)) {
+        // only the top level blocks, the data blocks of an xblock are not
+        // known until the xblock itself has been read
+        r += pst_prefetch_block(pf, d_ptr->desc);
+        r += pst_prefetch_block(pf, d_ptr->assoc_tree);
+    }
+    DEBUG_RET();
+    return r;
+}
+
+
 /**
  * Get an ID block from file using pst_ff_getIDblock() and decrypt if necessary
  * @param pf   PST file structure
@@ -3997,6 +4916,7 @@ size_t pst_ff_getIDblock_dec(pst_file *pf, uint64_t i_id, char **buf) {
     r = pst_ff_getIDblock(pf, i_id, buf);
     if ((pf->encryption) && !(noenc)) {
         (void)pst_decrypt(i_id, *buf, r, pf->encryption);
+        pst_count_decrypt(pf, r);
     }
     DEBUG_HEXDUMPC(*buf, r, 16);
     DEBUG_RET();
@@ -4034,7 +4954,7 @@ static size_t pst_ff_getID2block(pst_file *pf, uint64_t id2, pst_id2_tree *id2_h
     pst_id2_tree* ptr;
     pst_holder h = {buf, NULL, 0, 0, 0};
     DEBUG_ENT("pst_ff_getID2block");
-    ptr = pst_getID2(id2_head, id2);
+    ptr = pst_getID2(pf, id2_head, id2);
 
     if (!ptr) {
         DEBUG_WARN(("Cannot find id2 value %#" PRIx64 "\n", id2));
@@ -4124,7 +5044,10 @@ static size_t pst_ff_compile_ID(pst_file *pf, uint64_t i_id, pst_holder *h, size
 
     if (block_hdr.index_offset != (uint16_t)0x0101) { //type 3
         DEBUG_WARN(("WARNING: not a type 0x0101 buffer, Treating as normal buffer\n"));
-        if (pf->encryption) (void)pst_decrypt(i_id, buf3, a, pf->encryption);
+        if (pf->encryption) {
+            (void)pst_decrypt(i_id, buf3, a, pf->encryption);
+            pst_count_decrypt(pf, a);
+        }
         size = pst_append_holder(h, size, &buf3, a);
         free(buf3);
         DEBUG_RET();
@@ -4572,6 +5495,10 @@ void pst_convert_utf8(pst_item *item, pst_string *str) {
     }
     pst_vbuf *newer = pst_vballoc(2);
     size_t rc = pst_vb_8bit2utf8(newer, str->str, strlen(str->str) + 1, charset);
+    if (item->pf) {
+        PST_STAT_ADD(item->pf, iconv_calls, 1);
+        PST_STAT_ADD(item->pf, iconv_bytes, strlen(str->str) + 1);
+    }
     if (rc == (size_t)-1) {
         free(newer->b);
         DEBUG_WARN(("Failed to convert %s to utf-8 - %s\n", charset, str->str));
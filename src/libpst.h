@@ -891,6 +891,137 @@ typedef struct pst_block_recorder {
 } pst_block_recorder;
 
 
+/** the private state of a pst file, see pst_file */
+struct pst_file_state;
+
+
+/** How far the work on a pst file has got, see pst_get_progress(). */
+typedef struct pst_progress {
+    /** calls to pst_parse_item() so far */
+    uint64_t items_done;
+    /** items in the descriptor tree */
+    uint64_t items_total;
+    /** bytes of the blocks read so far, as stored in the file */
+    uint64_t bytes_done;
+    /** bytes of all the blocks in the index */
+    uint64_t bytes_total;
+} pst_progress;
+
+
+/** Counters of the work done on an open pst file, see pst_get_stats().
+ *  Times are in nanoseconds.
+ */
+typedef struct pst_stats {
+    /** read system calls made on the file */
+    uint64_t read_calls;
+    /** bytes returned by those calls */
+    uint64_t bytes_read;
+    /** blocks read, including index nodes */
+    uint64_t blocks_read;
+    /** bytes of those blocks as stored in the file */
+    uint64_t block_bytes;
+    /** blocks that were zlib compressed, 4k page ost files only */
+    uint64_t blocks_inflated;
+    /** bytes of those blocks once inflated */
+    uint64_t inflated_bytes;
+    /** time spent in zlib inflating them */
+    uint64_t inflate_ns;
+    /** bytes decrypted with the PST_COMP_ENCRYPT cipher */
+    uint64_t decrypt_compress_bytes;
+    /** bytes decrypted with the PST_ENCRYPT cipher */
+    uint64_t decrypt_high_bytes;
+    /** compressed rtf bytes given to pst_lzfu_decompress(). libpst never
+     *  decompresses rtf itself, so these are only counted by callers. */
+    uint64_t lzfu_bytes_in;
+    /** bytes of rtf those produced */
+    uint64_t lzfu_bytes_out;
+    /** character set conversions done with iconv */
+    uint64_t iconv_calls;
+    /** bytes given to those conversions */
+    uint64_t iconv_bytes;
+    /** items returned by pst_parse_item() */
+    uint64_t items_parsed;
+    /** calls to pst_parse_item() that failed and returned NULL */
+    uint64_t parse_failures;
+    /** items passed over by pst_parse_item() for not matching the filter,
+     *  see pst_set_filter(). These are not counted as failures. */
+    uint64_t items_filtered;
+    /** block ids found in the index */
+    uint64_t id_hits;
+    /** block ids missing from the index */
+    uint64_t id_misses;
+    /** id2 values found in an id2 tree */
+    uint64_t id2_hits;
+    /** id2 values missing from their id2 tree */
+    uint64_t id2_misses;
+    /** time spent in pst_load_index() */
+    uint64_t load_index_ns;
+    /** time spent waiting for the read limit, see pst_set_read_limit() */
+    uint64_t read_wait_ns;
+} pst_stats;
+
+
+/** A limit on the rate of reads from one or more pst files, see
+ *  pst_set_read_limit(). It holds no pointers, so it may be placed in
+ *  memory shared between processes to limit all of them together.
+ */
+typedef struct pst_read_limit {
+    /** bytes per second, 0 for no limit */
+    uint64_t bytes_per_sec;
+    /** read calls per second, 0 for no limit */
+    uint64_t reads_per_sec;
+    /** the time, on the monotonic clock in nanoseconds, at which the
+     *  reads so far would have been allowed with no burst */
+    uint64_t bytes_due;
+    uint64_t reads_due;
+} pst_read_limit;
+
+
+/** Bounds on the messages returned by pst_parse_item(), see
+ *  pst_set_filter(). An item must be within all of the bounds that are
+ *  set. Folders, the message store and embedded messages are never
+ *  filtered.
+ */
+typedef struct pst_filter {
+    /** only items delivered at or after this time, 0 for no bound. Items
+     *  with no delivery time use the time they were sent, then the time
+     *  they were created, and items with none of these are not matched by
+     *  either time bound. */
+    time_t   after;
+    /** only items delivered before this time, 0 for no bound */
+    time_t   before;
+    /** only items with a message size of at least this many bytes */
+    uint64_t min_size;
+    /** only items with a message size of at most this many bytes, 0 for
+     *  no bound */
+    uint64_t max_size;
+    /** only items with a sender name or address containing this, ignoring
+     *  case, or NULL */
+    char    *from;
+    /** only items with a to, cc or bcc display name, or a received by
+     *  address, containing this, ignoring case, or NULL */
+    char    *to;
+    /** only items with a message class starting with this, ignoring case,
+     *  such as IPM.Note, or NULL */
+    char    *message_class;
+} pst_filter;
+
+
+/** An open pst file.
+ *
+ *  Thread safety: separate pst_file structures share no state, so any
+ *  number of them may be open and in use by different threads at once.
+ *  A single pst_file may also be shared between threads once pst_open(),
+ *  pst_load_index() and pst_load_extended_attributes() have returned.
+ *  After that pst_parse_item(), pst_getID(), pst_ff_getIDblock_dec(),
+ *  pst_prefetch() and the pst_attach_to_*() functions only read it, and
+ *  may be called concurrently. pst_reopen() and pst_close() must not be
+ *  called while another thread is using the same pst_file. A pst_item
+ *  belongs to the thread that parsed it, since pst_convert_utf8() and
+ *  friends update it in place. Character set conversion uses iconv
+ *  descriptors private to each thread. The debug level and debug file
+ *  set by pst_debug_init() are shared by the whole process.
+ */
 typedef struct pst_file {
     /** file pointer to opened PST file */
     FILE*   fp;
@@ -907,10 +1038,12 @@ typedef struct pst_file {
     pst_desc_tree  *d_head, *d_tail;
     /** the head of the extended attributes linked list */
     pst_x_attrib_ll *x_head;
-    /** the head of the block recorder, a debug artifact
-     *  used to detect cases where we might read the same
-     *  block multiple times while processing a pst file. */
-    pst_block_recorder *block_head;
+    /** state private to libpst, set up by pst_open() and freed by
+     *  pst_close(): the counters of pst_get_stats() and what has been set
+     *  with pst_profile_reads() and friends. This takes the place of the
+     *  block recorder pointer, so the layout of this structure is the same
+     *  as in earlier versions. */
+    struct pst_file_state *state;
 
     /** @li 0 is 32-bit pst file, pre Outlook 2003;
      *  @li 1 is 64-bit pst file, Outlook 2003 or later;
@@ -977,6 +1110,15 @@ int             pst_load_extended_attributes(pst_file *pf);
 int             pst_close(pst_file *pf);
 
 
+/** Find how much memory the indexes loaded by pst_load_index() and
+ *  pst_load_extended_attributes() use, so that a program working on
+ *  many pst files can keep the number it has open within a budget.
+ * @param pf   pointer to the pst_file structure setup by pst_open().
+ * @return number of bytes held by the indexes.
+ */
+size_t          pst_index_memory(pst_file *pf);
+
+
 /** Get the top of folders descriptor tree. This is the main descriptor tree
  *  that needs to be walked to look at every item in the pst file.
  * @param pf   pointer to the pst_file structure setup by pst_open().
@@ -1010,6 +1152,160 @@ size_t          pst_attach_to_file(pst_file *pf, pst_item_attach *attach, FILE*
 size_t          pst_attach_to_file_base64(pst_file *pf, pst_item_attach *attach, FILE* fp);
 
 
+/** Find the size of a binary attachment, without reading all of it.
+ * @param pf     pointer to the pst_file structure setup by pst_open().
+ * @param attach pointer to the attachment record
+ * @return       size of the attachment data in bytes
+ */
+size_t          pst_attach_size(pst_file *pf, pst_item_attach *attach);
+
+
+/** Encrypt a block of data the way it is stored in a pst file, the inverse
+ *  of the decryption done when blocks are read.
+ * @param i_id identifier of this block, needed as part of the key for the enigma cipher
+ * @param buf  pointer to the buffer to be encrypted in place
+ * @param size size of the buffer
+ * @param type PST_COMP_ENCRYPT or PST_ENCRYPT
+ * @return 0 if ok, -1 if error (NULL buffer or unknown encryption type)
+ */
+int             pst_encrypt(uint64_t i_id, char *buf, size_t size, unsigned char type);
+
+
+/** Get the counters of the work done on a pst file since it was opened.
+ *  This may be called while other threads are using the file.
+ * @param pf    pointer to the pst_file structure setup by pst_open().
+ * @param stats receives a copy of the counters.
+ */
+void            pst_get_stats(pst_file *pf, pst_stats *stats);
+
+
+/** Set the counters of a pst file back to zero, for example in a child
+ *  process that should only count its own work.
+ * @param pf    pointer to the pst_file structure setup by pst_open().
+ */
+void            pst_reset_stats(pst_file *pf);
+
+
+/** Add one set of counters to another, to total several files or processes.
+ * @param total the counters to add to.
+ * @param stats the counters to add.
+ */
+void            pst_add_stats(pst_stats *total, const pst_stats *stats);
+
+
+/** Write a set of counters, one per line, or as a single line of JSON.
+ * @param fp    where to write them.
+ * @param stats the counters.
+ * @param json  non-zero for JSON.
+ */
+void            pst_print_stats(FILE *fp, const pst_stats *stats, int json);
+
+
+/** Start recording every range read from the file, with the number of
+ *  times it was read and whether it was read for the index, the
+ *  descriptor tree, an id2 tree, an item or an attachment. This costs a
+ *  hash table lookup and a lock per read, and nothing when not called.
+ * @param pf pointer to the pst_file structure setup by pst_open().
+ * @return   0 if ok.
+ */
+int             pst_profile_reads(pst_file *pf);
+
+
+/** Write a report of the ranges recorded since pst_profile_reads(): the
+ *  total and unique bytes read, the reads of each kind and how many of
+ *  them read a range again, and the ranges read most often.
+ * @param fp  where to write it.
+ * @param pf  pointer to the pst_file structure setup by pst_open().
+ * @param top the number of ranges to list.
+ */
+void            pst_print_reads(FILE *fp, pst_file *pf, int top);
+
+
+/** Called by pst_parse_item() with the progress made on a pst file.
+ * @param pf       the pst file.
+ * @param progress how far the work on it has got.
+ * @param data     as given to pst_set_progress().
+ */
+typedef void (*pst_progress_cb)(pst_file *pf, const pst_progress *progress, void *data);
+
+
+/** Get the progress made on a pst file. The totals are found by walking
+ *  the index and the descriptor tree, which is only done once if
+ *  pst_set_progress() has been called.
+ * @param pf       pointer to the pst_file structure setup by pst_open()
+ *                 and pst_load_index().
+ * @param progress where to put it.
+ */
+void            pst_get_progress(pst_file *pf, pst_progress *progress);
+
+
+/** Have pst_parse_item() call a function with the progress made on the
+ *  file, at most once every interval. With several threads parsing the
+ *  same file, only one of them makes each call.
+ * @param pf       pointer to the pst_file structure setup by pst_open()
+ *                 and pst_load_index().
+ * @param cb       the function, or NULL to stop calling it.
+ * @param data     passed to the function.
+ * @param interval milliseconds between calls.
+ * @return         0 if ok.
+ */
+int             pst_set_progress(pst_file *pf, pst_progress_cb cb, void *data, unsigned interval);
+
+
+/** Set up a read limit.
+ * @param limit         the limit.
+ * @param bytes_per_sec bytes per second, 0 for no limit.
+ * @param reads_per_sec read calls per second, 0 for no limit.
+ */
+void            pst_init_read_limit(pst_read_limit *limit, uint64_t bytes_per_sec, uint64_t reads_per_sec);
+
+
+/** Make every read from a pst file wait until it fits within a limit.
+ *  The limit is a token bucket that lets a tenth of a second's worth of
+ *  reads through at once. Several files, threads and processes may share
+ *  one limit, which is then kept by all of them together. pst_prefetch()
+ *  does nothing while a limit is set, since the reads it asks for would
+ *  not be limited.
+ * @param pf    pointer to the pst_file structure setup by pst_open().
+ * @param limit the limit, which must last until the file is closed, or
+ *              NULL for none.
+ */
+void            pst_set_read_limit(pst_file *pf, pst_read_limit *limit);
+
+
+/** Set up a filter from an expression of comma separated terms:
+ *  @li after=date and before=date, where date is yyyy-mm-dd or
+ *      yyyy-mm-ddThh:mm:ss in UTC
+ *  @li from=text and to=text
+ *  @li class=prefix
+ *  @li minsize=n and maxsize=n, where n may end in k, M or G
+ *
+ *  For example "after=2019-01-01,before=2019-04-01,from=smith".
+ * @param filter the filter, to be freed with pst_free_filter().
+ * @param expr   the expression.
+ * @return       0 if ok, -1 if the expression could not be understood.
+ */
+int             pst_parse_filter(pst_filter *filter, const char *expr);
+
+
+/** Free the strings of a filter set up by pst_parse_filter().
+ * @param filter the filter.
+ */
+void            pst_free_filter(pst_filter *filter);
+
+
+/** Have pst_parse_item() return NULL for messages outside a filter. The
+ *  filter is tested on the item's own property block, before its unicode
+ *  strings are converted and before its recipient and attachment tables
+ *  are read, so a narrow filter saves most of the cost of the items it
+ *  passes over.
+ * @param pf     pointer to the pst_file structure setup by pst_open().
+ * @param filter the filter, which must last until the file is closed, or
+ *               NULL for none.
+ */
+void            pst_set_filter(pst_file *pf, pst_filter *filter);
+
+
 /** Walk the descriptor tree.
  * @param d pointer to the current item in the descriptor tree.
  * @return  pointer to the next item in the descriptor tree.
@@ -1023,6 +1319,8 @@ pst_desc_tree*  pst_getNextDptr(pst_desc_tree* d);
  * @param m_head normally NULL. This is only used when processing embedded
  *               attached rfc822 messages, in which case it is attach->id2_head.
  * @return pointer to the mapi object. Must be free'd by pst_freeItem().
+ *         NULL on error, or for a message outside the filter set by
+ *         pst_set_filter().
  */
 pst_item*       pst_parse_item (pst_file *pf, pst_desc_tree *d_ptr, pst_id2_tree *m_head);
 
@@ -1041,6 +1339,16 @@ void            pst_freeItem(pst_item *item);
 pst_index_ll*   pst_getID(pst_file* pf, uint64_t i_id);
 
 
+/** Tell the operating system that the desc and assoc_tree blocks of a
+ *  descriptor will be read soon, so that it can start reading them in
+ *  the background.
+ * @param pf     pointer to the pst_file structure setup by pst_open().
+ * @param d_ptr  the descriptor that will be parsed
+ * @return number of bytes hinted, 0 if the system has no way to hint.
+ */
+size_t          pst_prefetch(pst_file *pf, pst_desc_tree *d_ptr);
+
+
 /** Get an ID block from the file using pst_ff_getIDblock() and decrypt if necessary.
  * @param pf   pointer to the pst_file structure setup by pst_open().
  * @param i_id ID of block to retrieve
@@ -28,6 +28,11 @@ void version();
 
 // global settings
 pst_file pstfile;
+int      stats_mode = 0;    // have command line arg --stats, 2 for json
+int      read_profile = -1; // have command line arg --read-profile, the number of ranges to list
+
+#define OPT_STATS 256
+#define OPT_READ_PROFILE 257
 
 
 void create_enter_dir(struct file_ll* f, pst_item *item)
@@ -189,6 +194,8 @@ void usage(char *prog_name, char *defaultfmtdate) {
     printf("\t-f <date_format> \t- Select the date format in ctime format (by default \"%s\")\n", defaultfmtdate);
     printf("\t-h\t- Help. This screen\n");
     printf("\t-V\t- Version. Display program version\n");
+    printf("\t--stats[=json]\t- Write counters of the reads, decryption and parsing done to stderr on exit\n");
+    printf("\t--read-profile[=n]\t- Write the bytes read, and the n ranges read most often, to stderr on exit. Default 20\n");
     DEBUG_RET();
 }
 
@@ -218,8 +225,32 @@ int main(int argc, char* const* argv) {
     char *defaultfmtdate = "%F %T";
     o.date_format = defaultfmtdate;
 
+#ifdef HAVE_GETOPT_LONG
+    static struct option long_options[] = {
+        {"stats",   optional_argument, NULL, OPT_STATS},
+        {"read-profile", optional_argument, NULL, OPT_READ_PROFILE},
+        {NULL,      0,           NULL, 0}
+    };
+    while ((c = getopt_long(argc, argv, "d:f:lhV", long_options, NULL))!= -1) {
+#else
     while ((c = getopt(argc, argv, "d:f:lhV"))!= -1) {
+#endif
         switch (c) {
+            case OPT_STATS:
+                if      (!optarg)                 stats_mode = 1;
+                else if (!strcmp(optarg, "json")) stats_mode = 2;
+                else {
+                    usage(argv[0], defaultfmtdate);
+                    exit(1);
+                }
+            break;
+            case OPT_READ_PROFILE:
+                read_profile = (optarg) ? atoi(optarg) : 20;
+                if (read_profile < 0) {
+                    usage(argv[0], defaultfmtdate);
+                    exit(1);
+                }
+            break;
             case 'd':
                 d_log = optarg;
             break;
@@ -259,6 +290,7 @@ int main(int argc, char* const* argv) {
 
     // Open PST file
     if (pst_open(&pstfile, argv[optind], NULL)) DIE(("Error opening File\n"));
+    if (read_profile >= 0) pst_profile_reads(&pstfile);
 
     // Load PST index
     if (pst_load_index(&pstfile)) {
@@ -299,6 +331,16 @@ int main(int argc, char* const* argv) {
 
     process(item, d_ptr->child, o);    // do the children of TOPF
     pst_freeItem(item);
+    if (stats_mode) {
+        pst_stats stats;
+        pst_get_stats(&pstfile, &stats);
+        fflush(stdout);
+        pst_print_stats(stderr, &stats, stats_mode == 2);
+    }
+    if (read_profile >= 0) {
+        fflush(stdout);
+        pst_print_reads(stderr, &pstfile, read_profile);
+    }
     pst_close(&pstfile);
 
     DEBUG_RET();
@@ -0,0 +1,951 @@
+/***
+ * pstgen.c
+ * Part of the LibPST project
+ *
+ * Generate synthetic pst/ost files of arbitrary size and shape, so that
+ * scale and performance problems can be reproduced without access to
+ * private sample files. The output is laid out the way libpst reads it:
+ * a block b-tree (index1), a descriptor b-tree (index2), 0xbcec property
+ * blocks for the store, folders, messages and attachments, a 0x7cec
+ * attachment table, and id2 subnode blocks for large values.
+ */
+
+#include "define.h"
+
+#define FORMAT_32       0
+#define FORMAT_64       1
+#define FORMAT_4K       2
+
+#define NID_TYPE_NORMAL_FOLDER  0x02
+#define NID_TYPE_NORMAL_MESSAGE 0x04
+#define NID_TYPE_ATTACHMENT     0x05
+#define NID_TYPE_LTP            0x1f
+
+#define NID_MESSAGE_STORE       0x21
+#define NID_ROOT_FOLDER         0x122
+#define NID_TOP_OF_FOLDERS      0x2142
+#define NID_ATTACHMENT_TABLE    0x671
+
+#define HEAP_MAX_VALUE  1024    // larger property values go to id2 subnodes
+#define MAX_PROPS       32
+#define MAX_SUBNODES    320     // fits in one id2 block in every format
+
+
+typedef struct gen_index {
+    uint64_t id;
+    uint64_t offset;
+    uint16_t size;
+} gen_index;
+
+
+typedef struct gen_desc {
+    uint64_t d_id;
+    uint64_t desc_id;
+    uint64_t tree_id;
+    uint32_t parent_d_id;
+} gen_desc;
+
+
+typedef struct gen_subnode {
+    uint32_t id2;
+    uint64_t id;
+    uint64_t child_id;
+} gen_subnode;
+
+
+typedef struct gen_prop {
+    uint16_t    id;
+    uint16_t    type;
+    uint32_t    value;      // inline value, or an id2 reference
+    const char *data;       // otherwise, stored in the heap or a subnode
+    size_t      size;
+} gen_prop;
+
+
+/** a heap-on-node being assembled in memory, one block only */
+typedef struct gen_heap {
+    char     buf[8192];
+    size_t   len;
+    int      count;
+    uint16_t offs[512];
+} gen_heap;
+
+
+typedef struct gen_file {
+    FILE       *fp;
+    int         format;
+    int         ost;
+    int         unicode;
+    unsigned char encryption;
+    int64_t     pos;
+    uint64_t    next_bid;
+    uint32_t    next_nid;
+    gen_index  *i_table;
+    size_t      i_count, i_capacity;
+    gen_desc   *d_table;
+    size_t      d_count, d_capacity;
+    uint64_t    rng;
+    // statistics
+    uint64_t    folders, messages, attachments;
+} gen_file;
+
+
+// generation parameters
+static int      depth         = 2;
+static int      fanout        = 3;
+static int      msg_count     = 10;
+static size_t   body_size     = 2000;
+static int      attach_count  = 0;
+static size_t   attach_size   = 10000;
+
+
+static void put16(char *p, uint16_t v) {
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)(v >> 8);
+}
+
+
+static void put32(char *p, uint32_t v) {
+    put16(p, (uint16_t)(v & 0xffff));
+    put16(p+2, (uint16_t)(v >> 16));
+}
+
+
+static void put64(char *p, uint64_t v) {
+    put32(p, (uint32_t)(v & 0xffffffff));
+    put32(p+4, (uint32_t)(v >> 32));
+}
+
+
+static uint64_t get64(const char *p) {
+    uint64_t v = 0;
+    int i;
+    for (i = 7; i >= 0; i--) v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+
+/** put a 32 or 64 bit value, depending on the file format */
+static size_t putid(gen_file *g, char *p, uint64_t v) {
+    if (g->format == FORMAT_32) {
+        put32(p, (uint32_t)v);
+        return 4;
+    }
+    put64(p, v);
+    return 8;
+}
+
+
+static uint64_t gen_random(gen_file *g) {
+    // xorshift64, so that output is reproducible for a given seed
+    g->rng ^= g->rng << 13;
+    g->rng ^= g->rng >> 7;
+    g->rng ^= g->rng << 17;
+    return g->rng;
+}
+
+
+static size_t max_block_size(gen_file *g) {
+    // the limits libpst uses when walking 0x7cec rows across blocks
+    return (g->format == FORMAT_32) ? 0x1FF4 : 0x1FF0;
+}
+
+
+static uint32_t new_nid(gen_file *g, int type) {
+    return (g->next_nid++ << 5) | type;
+}
+
+
+/** write one block, recording it in the block index
+ *  @param internal non-zero for blocks that are never encrypted (id2 and
+ *                  indirection blocks), they get the 0x02 id bit
+ *  @return id of the new block
+ */
+static uint64_t write_block(gen_file *g, const char *data, size_t size, int internal) {
+    uint64_t id = g->next_bid;
+    g->next_bid += 4;
+    if (internal) id |= 2;
+
+    if (g->format == FORMAT_32 && (uint64_t)g->pos + size > UINT32_MAX) {
+        DIE(("32 bit pst files cannot be larger than 4GB, try -f 64\n"));
+    }
+    if (g->encryption && !internal) {
+        char *enc = pst_malloc(size);
+        memcpy(enc, data, size);
+        (void)pst_encrypt(id, enc, size, g->encryption);
+        if (fseeko(g->fp, g->pos, SEEK_SET) || fwrite(enc, 1, size, g->fp) != size) DIE(("write failed: %s\n", strerror(errno)));
+        free(enc);
+    }
+    else {
+        if (fseeko(g->fp, g->pos, SEEK_SET) || fwrite(data, 1, size, g->fp) != size) DIE(("write failed: %s\n", strerror(errno)));
+    }
+
+    if (g->i_count == g->i_capacity) {
+        g->i_capacity += (g->i_capacity >> 1) + 1024;
+        g->i_table = pst_realloc(g->i_table, g->i_capacity * sizeof(gen_index));
+    }
+    g->i_table[g->i_count].id     = id;
+    g->i_table[g->i_count].offset = g->pos;
+    g->i_table[g->i_count].size   = (uint16_t)size;
+    g->i_count++;
+
+    g->pos += (size + 63) & ~(int64_t)63;   // blocks are 64 byte aligned
+    return id;
+}
+
+
+/** write an arbitrary amount of data, splitting it across blocks with
+ *  0x0101 (and if needed 0x0201) indirection blocks
+ *  @return id of the data or of the top indirection block
+ */
+static uint64_t write_data(gen_file *g, const char *data, size_t size) {
+    size_t   chunk = max_block_size(g);
+    size_t   per_x = (chunk - 8) / ((g->format == FORMAT_32) ? 4 : 8);
+    size_t   count, i, level = 1;
+    uint64_t *ids;
+    char     *x;
+
+    if (size <= chunk) return write_block(g, data, size, 0);
+
+    count = (size + chunk - 1) / chunk;
+    ids   = pst_malloc(count * sizeof(uint64_t));
+    for (i = 0; i < count; i++) {
+        size_t n = (i == count-1) ? size - i*chunk : chunk;
+        ids[i] = write_block(g, data + i*chunk, n, 0);
+    }
+    x = pst_malloc(chunk);
+    while (count > 1) {
+        size_t groups = (count + per_x - 1) / per_x;
+        if (level > 2) DIE(("data too large for a single object\n"));
+        for (i = 0; i < groups; i++) {
+            size_t j, n = (i == groups-1) ? count - i*per_x : per_x;
+            char *p = x + 8;
+            x[0] = 0x01;
+            x[1] = (char)level;
+            put16(x+2, (uint16_t)n);
+            put32(x+4, (uint32_t)size);
+            for (j = 0; j < n; j++) p += putid(g, p, ids[i*per_x + j]);
+            ids[i] = write_block(g, x, (size_t)(p - x), 1);
+        }
+        if (count <= per_x) {
+            count = 1;
+            break;
+        }
+        count = groups;
+        level++;
+    }
+    free(x);
+    {
+        uint64_t id = ids[0];
+        free(ids);
+        return id;
+    }
+}
+
+
+static void heap_init(gen_heap *h) {
+    h->len   = 12;  // heap-on-node header
+    h->count = 0;
+}
+
+
+/** @return the heap id of the new allocation, 0 if it will not fit */
+static uint32_t heap_alloc(gen_heap *h, const char *data, size_t size, size_t limit) {
+    if (h->len + size + 2*(h->count + 3) + 4 > limit) return 0;
+    memcpy(h->buf + h->len, data, size);
+    h->offs[h->count++] = (uint16_t)h->len;
+    h->len += size;
+    return (uint32_t)h->count << 5;
+}
+
+
+/** append the page map and header, then write the heap as a block */
+static uint64_t heap_write(gen_file *g, gen_heap *h, unsigned char client_sig, uint32_t user_root) {
+    int i;
+    size_t map;
+    if (h->len & 1) h->buf[h->len++] = 0;
+    map = h->len;
+    put16(h->buf + map, (uint16_t)h->count);
+    put16(h->buf + map + 2, 0);
+    for (i = 0; i < h->count; i++) put16(h->buf + map + 4 + 2*i, h->offs[i]);
+    put16(h->buf + map + 4 + 2*h->count, (uint16_t)map);
+    h->len = map + 6 + 2*h->count;
+    put16(h->buf, (uint16_t)map);
+    h->buf[2] = (char)0xEC;
+    h->buf[3] = (char)client_sig;
+    put32(h->buf + 4, user_root);
+    put32(h->buf + 8, 0);
+    return write_block(g, h->buf, h->len, 0);
+}
+
+
+static void add_subnode(gen_subnode *subs, int *count, uint32_t id2, uint64_t id, uint64_t child_id) {
+    if (*count == MAX_SUBNODES) DIE(("too many subnodes in one object\n"));
+    subs[*count].id2      = id2;
+    subs[*count].id       = id;
+    subs[*count].child_id = child_id;
+    (*count)++;
+}
+
+
+/** write an id2 block listing the subnodes of one object
+ *  @return id of the block, 0 if there are no subnodes
+ */
+static uint64_t write_subnodes(gen_file *g, gen_subnode *subs, int count) {
+    char buf[8192];
+    char *p;
+    int i;
+    if (!count) return 0;
+    memset(buf, 0, sizeof(buf));
+    put16(buf, 0x0002);
+    put16(buf+2, (uint16_t)count);
+    p = buf + ((g->format == FORMAT_32) ? 4 : 8);
+    for (i = 0; i < count; i++) {
+        put32(p, subs[i].id2);
+        if (g->format == FORMAT_32) {
+            put32(p+4, (uint32_t)subs[i].id);
+            put32(p+8, (uint32_t)subs[i].child_id);
+            p += 12;
+        }
+        else {
+            put64(p+8, subs[i].id);
+            put64(p+16, subs[i].child_id);
+            p += 24;
+        }
+    }
+    return write_block(g, buf, (size_t)(p - buf), 1);
+}
+
+
+static int prop_compare(const void *a, const void *b) {
+    return (int)((const gen_prop*)a)->id - (int)((const gen_prop*)b)->id;
+}
+
+
+/** write a 0xbcec property block
+ *  @param subs  subnode list of the object, large values are added to it
+ *  @return id of the block
+ */
+static uint64_t write_properties(gen_file *g, gen_prop *props, int count, gen_subnode *subs, int *sub_count) {
+    gen_heap *h = pst_malloc(sizeof(gen_heap));
+    char     *recs = pst_malloc(8 * count);
+    uint32_t  hid;
+    uint64_t  id;
+    int       i;
+    char      b5[8];
+
+    qsort(props, count, sizeof(gen_prop), prop_compare);
+    memset(b5, 0, sizeof(b5));
+    heap_init(h);
+    // the b5 header is the first allocation, so that its hid is known
+    // before the records it points at
+    (void)heap_alloc(h, b5, sizeof(b5), max_block_size(g));
+    for (i = 0; i < count; i++) {
+        uint32_t value = props[i].value;
+        if (props[i].data) {
+            value = 0;
+            if (props[i].size && props[i].size <= HEAP_MAX_VALUE) {
+                value = heap_alloc(h, props[i].data, props[i].size, max_block_size(g) - 8*count - 16);
+            }
+            if (props[i].size && !value) {
+                uint32_t id2 = new_nid(g, NID_TYPE_LTP);
+                add_subnode(subs, sub_count, id2, write_data(g, props[i].data, props[i].size), 0);
+                value = id2;
+            }
+        }
+        put16(recs + 8*i,     props[i].id);
+        put16(recs + 8*i + 2, props[i].type);
+        put32(recs + 8*i + 4, value);
+    }
+    hid = heap_alloc(h, recs, 8 * count, max_block_size(g));
+    if (!hid) DIE(("property block overflow\n"));
+    put16(b5, 0x02B5);
+    put16(b5+2, 6);
+    put32(b5+4, hid);
+    memcpy(h->buf + h->offs[0], b5, sizeof(b5));
+    id = heap_write(g, h, 0xBC, 1 << 5);
+    free(recs);
+    free(h);
+    return id;
+}
+
+
+static void add_prop_int(gen_prop *props, int *count, uint16_t id, uint16_t type, uint32_t value) {
+    gen_prop *p = &props[(*count)++];
+    p->id    = id;
+    p->type  = type;
+    p->value = value;
+    p->data  = NULL;
+    p->size  = 0;
+}
+
+
+static void add_prop_bin(gen_prop *props, int *count, uint16_t id, uint16_t type, const char *data, size_t size) {
+    gen_prop *p = &props[(*count)++];
+    p->id    = id;
+    p->type  = type;
+    p->value = 0;
+    p->data  = data;
+    p->size  = size;
+}
+
+
+/** convert a utf-8 string into a property value, either utf-16le (0x1f)
+ *  or 8 bit (0x1e) depending on the file
+ *  @return malloc'd value, to be freed by the caller after writing
+ */
+static char *add_prop_str(gen_file *g, gen_prop *props, int *count, uint16_t id, const char *str) {
+    size_t len = strlen(str);
+    char *out;
+    if (!g->unicode) {
+        out = pst_malloc(len + 1);
+        memcpy(out, str, len + 1);
+        add_prop_bin(props, count, id, 0x1e, out, len);
+        return out;
+    }
+    else {
+        const unsigned char *s = (const unsigned char *)str;
+        size_t n = 0;
+        out = pst_malloc(2 * len + 2);
+        while (*s) {
+            uint32_t c = *s++;
+            if (c >= 0xe0 && s[0] && s[1]) {
+                c = ((c & 0x0f) << 12) | ((s[0] & 0x3f) << 6) | (s[1] & 0x3f);
+                s += 2;
+            }
+            else if (c >= 0xc0 && s[0]) {
+                c = ((c & 0x1f) << 6) | (s[0] & 0x3f);
+                s += 1;
+            }
+            put16(out + n, (uint16_t)c);
+            n += 2;
+        }
+        add_prop_bin(props, count, id, 0x1f, out, n);
+        return out;
+    }
+}
+
+
+static void add_desc(gen_file *g, uint32_t d_id, uint64_t desc_id, uint64_t tree_id, uint32_t parent_d_id) {
+    if (g->d_count == g->d_capacity) {
+        g->d_capacity += (g->d_capacity >> 1) + 1024;
+        g->d_table = pst_realloc(g->d_table, g->d_capacity * sizeof(gen_desc));
+    }
+    g->d_table[g->d_count].d_id        = d_id;
+    g->d_table[g->d_count].desc_id     = desc_id;
+    g->d_table[g->d_count].tree_id     = tree_id;
+    g->d_table[g->d_count].parent_d_id = parent_d_id;
+    g->d_count++;
+}
+
+
+static void free_strings(char **strs, int count) {
+    int i;
+    for (i = 0; i < count; i++) free(strs[i]);
+}
+
+
+/** fill buf with size bytes of printable text in lines of words */
+static void make_text(gen_file *g, char *buf, size_t size) {
+    static const char *words[] = {"the", "quarterly", "report", "is", "attached", "please", "review",
+                                  "before", "Friday", "and", "send", "comments", "to", "the", "team",
+                                  "budget", "meeting", "From", "schedule", "\xc3\xa9t\xc3\xa9"};
+    size_t n = 0, line = 0;
+    while (n < size) {
+        const char *w = words[gen_random(g) % (sizeof(words)/sizeof(words[0]))];
+        size_t wl = strlen(w);
+        if (!g->unicode && (unsigned char)w[0] >= 0x80) continue;
+        if (line && line + wl + 1 > 72) {
+            buf[n++] = '\n';
+            line = 0;
+            continue;
+        }
+        if (line && n < size) {
+            buf[n++] = ' ';
+            line++;
+        }
+        while (*w && n < size) {
+            buf[n++] = *w++;
+            line++;
+        }
+    }
+    // do not cut a utf-8 sequence in half
+    while (n && ((unsigned char)buf[n-1] & 0xc0) == 0x80) n--;
+    if (n && (unsigned char)buf[n-1] >= 0xc0) n--;
+    buf[n] = '\0';
+}
+
+
+/** write a 0x7cec attachment table with one row per attachment */
+static uint64_t write_attachment_table(gen_file *g, uint32_t *attach_id2, int count) {
+    // columns: attachment id2, row version, size, method
+    static const uint16_t cols[4] = {0x67F2, 0x67F3, 0x0E20, 0x3705};
+    const int ncols    = 4;
+    const int rec_size = 4*4 + 1;   // four 4 byte values and a one byte cell existence map
+    gen_heap *h = pst_malloc(sizeof(gen_heap));
+    char     *rows = pst_malloc(rec_size * count);
+    char     *index = pst_malloc(8 * count);
+    char      tc[22 + 8*4];
+    char      b5[8];
+    uint32_t  hid_tc, hid_b5, hid_index, hid_rows;
+    uint64_t  id;
+    int       i, c;
+
+    if ((size_t)(rec_size * count) > max_block_size(g) / 2) DIE(("too many attachments in one message\n"));
+    for (i = 0; i < count; i++) {
+        char *r = rows + i*rec_size;
+        put32(r,      attach_id2[i]);
+        put32(r + 4,  0);
+        put32(r + 8,  (uint32_t)attach_size);
+        put32(r + 12, 1);   // attach by value
+        r[16] = (char)0xF0;
+        put32(index + 8*i,     attach_id2[i]);
+        put32(index + 8*i + 4, (uint32_t)i);
+    }
+    memset(tc, 0, sizeof(tc));
+    memset(b5, 0, sizeof(b5));
+    heap_init(h);
+    hid_tc = heap_alloc(h, tc, sizeof(tc), max_block_size(g));
+    hid_b5 = heap_alloc(h, b5, sizeof(b5), max_block_size(g));
+    hid_index = heap_alloc(h, index, 8 * count, max_block_size(g));
+    hid_rows  = heap_alloc(h, rows, rec_size * count, max_block_size(g));
+    if (!hid_rows) DIE(("attachment table overflow\n"));
+
+    tc[0] = 0x7C;
+    tc[1] = (char)ncols;
+    put16(tc + 2, 16);          // end of the 4 byte values
+    put16(tc + 4, 16);          // end of the 2 byte values
+    put16(tc + 6, 16);          // end of the 1 byte values
+    put16(tc + 8, (uint16_t)rec_size);
+    put32(tc + 10, hid_b5);
+    put32(tc + 14, hid_rows);
+    for (c = 0; c < ncols; c++) {
+        char *cd = tc + 22 + 8*c;
+        put16(cd,     0x0003);
+        put16(cd + 2, cols[c]);
+        put16(cd + 4, (uint16_t)(4*c));
+        cd[6] = 4;
+        cd[7] = (char)c;
+    }
+    put16(b5, 0x04B5);
+    put16(b5 + 2, 4);
+    put32(b5 + 4, hid_index);
+    memcpy(h->buf + h->offs[0], tc, sizeof(tc));
+    memcpy(h->buf + h->offs[1], b5, sizeof(b5));
+    id = heap_write(g, h, 0x7C, hid_tc);
+    free(index);
+    free(rows);
+    free(h);
+    return id;
+}
+
+
+static void write_message(gen_file *g, uint32_t parent_d_id, const char *folder_name, int number) {
+    gen_prop    props[MAX_PROPS];
+    gen_subnode subs[MAX_SUBNODES];
+    char       *strs[MAX_PROPS];
+    int         nprops = 0, nsubs = 0, nstrs = 0, i;
+    uint32_t    d_id = new_nid(g, NID_TYPE_NORMAL_MESSAGE);
+    uint32_t    attach_id2[MAX_SUBNODES];
+    char        subject[200], sender[100], filetime[8];
+    uint64_t    when;
+    char       *body = pst_malloc(body_size + 1);
+    uint64_t    desc_id, tree_id;
+
+    snprintf(subject, sizeof(subject), "Message %d in %s%s", number, folder_name, (g->unicode) ? " \xe2\x82\xac" : "");
+    snprintf(sender, sizeof(sender), "user%d@example.com", (int)(gen_random(g) % 1000));
+    make_text(g, body, body_size);
+    // somewhere in 2010 to 2020, as a FILETIME
+    when = ((uint64_t)1262304000 + gen_random(g) % ((uint64_t)10*365*86400) + (uint64_t)11644473600) * 10000000;
+    put64(filetime, when);
+
+    strs[nstrs++] = add_prop_str(g, props, &nprops, 0x001A, "IPM.Note");
+    strs[nstrs++] = add_prop_str(g, props, &nprops, 0x0037, subject);
+    add_prop_bin(props, &nprops, 0x0039, 0x0040, filetime, sizeof(filetime));
+    strs[nstrs++] = add_prop_str(g, props, &nprops, 0x0042, "Synthetic Sender");
+    strs[nstrs++] = add_prop_str(g, props, &nprops, 0x0C1F, sender);
+    strs[nstrs++] = add_prop_str(g, props, &nprops, 0x0E04, "Synthetic Recipient");
+    add_prop_bin(props, &nprops, 0x0E06, 0x0040, filetime, sizeof(filetime));
+    add_prop_int(props, &nprops, 0x0E07, 0x0003, (attach_count) ? 0x11 : 0x01);
+    add_prop_int(props, &nprops, 0x0E08, 0x0003, (uint32_t)(body_size + attach_count*attach_size));
+    strs[nstrs++] = add_prop_str(g, props, &nprops, 0x1000, body);
+
+    if (attach_count) {
+        char *data = pst_malloc(attach_size ? attach_size : 1);
+        size_t k;
+        for (k = 0; k < attach_size; k++) data[k] = (char)(gen_random(g) & 0xff);
+        for (i = 0; i < attach_count; i++) {
+            gen_prop    aprops[MAX_PROPS];
+            gen_subnode asubs[2];
+            char       *astrs[4];
+            char        fname[40];
+            int         naprops = 0, nasubs = 0, nastrs = 0;
+            uint32_t    data_id2 = new_nid(g, NID_TYPE_LTP);
+            uint64_t    aid, atree;
+
+            attach_id2[i] = new_nid(g, NID_TYPE_ATTACHMENT);
+            snprintf(fname, sizeof(fname), "attach%d.bin", i);
+            add_subnode(asubs, &nasubs, data_id2, write_data(g, data, attach_size), 0);
+            add_prop_int(aprops, &naprops, 0x0E20, 0x0003, (uint32_t)attach_size);
+            add_prop_int(aprops, &naprops, 0x3701, 0x0102, data_id2);  // reference to the data subnode
+            add_prop_int(aprops, &naprops, 0x3705, 0x0003, 1);
+            astrs[nastrs++] = add_prop_str(g, aprops, &naprops, 0x3704, fname);
+            astrs[nastrs++] = add_prop_str(g, aprops, &naprops, 0x3707, fname);
+            astrs[nastrs++] = add_prop_str(g, aprops, &naprops, 0x370E, "application/octet-stream");
+            aid   = write_properties(g, aprops, naprops, asubs, &nasubs);
+            atree = write_subnodes(g, asubs, nasubs);
+            add_subnode(subs, &nsubs, attach_id2[i], aid, atree);
+            free_strings(astrs, nastrs);
+            g->attachments++;
+        }
+        add_subnode(subs, &nsubs, NID_ATTACHMENT_TABLE, write_attachment_table(g, attach_id2, attach_count), 0);
+        free(data);
+    }
+
+    desc_id = write_properties(g, props, nprops, subs, &nsubs);
+    tree_id = write_subnodes(g, subs, nsubs);
+    add_desc(g, d_id, desc_id, tree_id, parent_d_id);
+    free_strings(strs, nstrs);
+    free(body);
+    g->messages++;
+}
+
+
+static uint32_t write_folder_record(gen_file *g, uint32_t d_id, uint32_t parent_d_id, const char *name, int count, int subfolders) {
+    gen_prop    props[MAX_PROPS];
+    gen_subnode subs[4];
+    char       *strs[4];
+    int         nprops = 0, nsubs = 0, nstrs = 0;
+    uint64_t    desc_id;
+
+    strs[nstrs++] = add_prop_str(g, props, &nprops, 0x3001, name);
+    add_prop_int(props, &nprops, 0x3602, 0x0003, (uint32_t)count);
+    add_prop_int(props, &nprops, 0x3603, 0x0003, 0);
+    add_prop_int(props, &nprops, 0x360A, 0x000b, (subfolders) ? 1 : 0);
+    strs[nstrs++] = add_prop_str(g, props, &nprops, 0x3613, "IPF.Note");
+    desc_id = write_properties(g, props, nprops, subs, &nsubs);
+    add_desc(g, d_id, desc_id, write_subnodes(g, subs, nsubs), parent_d_id);
+    free_strings(strs, nstrs);
+    g->folders++;
+    return d_id;
+}
+
+
+static void write_folder(gen_file *g, uint32_t parent_d_id, const char *name, int level) {
+    uint32_t d_id = new_nid(g, NID_TYPE_NORMAL_FOLDER);
+    int i;
+    // the folder must sort before its children in the descriptor index
+    write_folder_record(g, d_id, parent_d_id, name, msg_count, level < depth);
+    for (i = 0; i < msg_count; i++) write_message(g, d_id, name, i);
+    if (level < depth) {
+        for (i = 0; i < fanout; i++) {
+            char sub[200];
+            snprintf(sub, sizeof(sub), "%s.%d", name, i);
+            write_folder(g, d_id, sub, level + 1);
+        }
+    }
+}
+
+
+static void write_message_store(gen_file *g) {
+    gen_prop    props[MAX_PROPS];
+    gen_subnode subs[4];
+    char       *strs[4];
+    char        record_key[16];
+    int         nprops = 0, nsubs = 0, nstrs = 0;
+    uint64_t    desc_id;
+
+    memset(record_key, 0x5a, sizeof(record_key));
+    add_prop_bin(props, &nprops, 0x0FF9, 0x0102, record_key, sizeof(record_key));
+    strs[nstrs++] = add_prop_str(g, props, &nprops, 0x3001, "Synthetic Personal Folders");
+    add_prop_int(props, &nprops, 0x35DF, 0x0003, 0x89);
+    desc_id = write_properties(g, props, nprops, subs, &nsubs);
+    add_desc(g, NID_MESSAGE_STORE, desc_id, 0, 0);
+    free_strings(strs, nstrs);
+}
+
+
+/** write one level of a b-tree
+ *  @param keys     first key of each entry
+ *  @param entries  the encoded entries, entry_size bytes each
+ *  @param leaf     non-zero for the bottom level
+ *  @return number of nodes written, their keys/entries replace the input
+ */
+static size_t write_tree_level(gen_file *g, uint64_t *keys, char *entries, size_t count, size_t entry_size, int level, unsigned char ptype) {
+    size_t node_size = (g->format == FORMAT_4K) ? 4096 : 512;
+    size_t space     = (g->format == FORMAT_4K) ? 0xfd8 : ((g->format == FORMAT_64) ? 0x1e8 : 0x1f0);
+    size_t max       = space / entry_size;
+    size_t table_size = (g->format == FORMAT_32) ? 12 : 24;
+    size_t nodes     = (count + max - 1) / max;
+    char  *node      = pst_malloc(node_size);
+    size_t i;
+
+    if (!nodes) nodes = 1;
+    for (i = 0; i < nodes; i++) {
+        size_t n = (i == nodes-1) ? count - i*max : max;
+        uint64_t bid = g->next_bid;
+        uint64_t key = (count) ? keys[i*max] : 0;
+        char *t;
+        g->next_bid += 4;
+        memset(node, 0, node_size);
+        memcpy(node, entries + i*max*entry_size, n*entry_size);
+        if (g->format == FORMAT_4K) {
+            put16(node + 0xfd8, (uint16_t)n);
+            put16(node + 0xfda, (uint16_t)max);
+            node[0xfdc] = (char)entry_size;
+            node[0xfdd] = (char)level;
+            put64(node + 0xff0, bid);
+        }
+        else if (g->format == FORMAT_64) {
+            node[0x1e8] = (char)n;
+            node[0x1e9] = (char)max;
+            node[0x1ea] = (char)entry_size;
+            node[0x1eb] = (char)level;
+            node[0x1f0] = node[0x1f1] = (char)ptype;
+            put64(node + 0x1f8, bid);
+        }
+        else {
+            node[0x1f0] = (char)n;
+            node[0x1f1] = (char)max;
+            node[0x1f2] = (char)entry_size;
+            node[0x1f3] = (char)level;
+            node[0x1f4] = node[0x1f5] = (char)ptype;
+            put32(node + 0x1f8, (uint32_t)bid);
+        }
+        if (fseeko(g->fp, g->pos, SEEK_SET) || fwrite(node, 1, node_size, g->fp) != node_size) DIE(("write failed: %s\n", strerror(errno)));
+        // replace the entries with a pointer to this node
+        keys[i] = key;
+        t = entries + i*table_size;
+        t += putid(g, t, key);
+        t += putid(g, t, bid);
+        (void)putid(g, t, (uint64_t)g->pos);
+        g->pos += node_size;
+    }
+    free(node);
+    return nodes;
+}
+
+
+/** write a complete b-tree from leaf entries sorted by key
+ *  @param root_bid set to the backlink of the root node
+ *  @return file offset of the root node
+ */
+static int64_t write_tree(gen_file *g, uint64_t *keys, char *entries, size_t count, size_t entry_size, unsigned char ptype, uint64_t *root_bid) {
+    size_t table_size = (g->format == FORMAT_32) ? 12 : 24;
+    int    level = 0;
+    int64_t root;
+    do {
+        count = write_tree_level(g, keys, entries, count, (level) ? table_size : entry_size, level, ptype);
+        level++;
+    } while (count > 1);
+    // the single remaining entry points at the root
+    if (g->format == FORMAT_32) {
+        *root_bid = get64(entries + 4) & 0xffffffff;
+        root      = (int64_t)(get64(entries + 8) & 0xffffffff);
+    }
+    else {
+        *root_bid = get64(entries + 8);
+        root      = (int64_t)get64(entries + 16);
+    }
+    return root;
+}
+
+
+static void write_indexes(gen_file *g) {
+    size_t   isize = (g->format == FORMAT_4K) ? 24 : ((g->format == FORMAT_64) ? 24 : 12);
+    size_t   dsize = (g->format == FORMAT_32) ? 16 : 32;
+    size_t   n = (g->i_count > g->d_count) ? g->i_count : g->d_count;
+    uint64_t *keys = pst_malloc((n + 1) * sizeof(uint64_t));
+    char     *entries = pst_malloc((n + 1) * 32);
+    char      header[0x400];
+    uint64_t  index1_back, index2_back;
+    int64_t   index1, index2;
+    size_t    i;
+
+    for (i = 0; i < g->i_count; i++) {
+        gen_index *x = &g->i_table[i];
+        char *e = entries + i*isize;
+        memset(e, 0, isize);
+        keys[i] = x->id;
+        if (g->format == FORMAT_32) {
+            put32(e,     (uint32_t)x->id);
+            put32(e + 4, (uint32_t)x->offset);
+            put16(e + 8, x->size);
+            put16(e + 10, 2);   // reference count
+        }
+        else {
+            put64(e,      x->id);
+            put64(e + 8,  (uint64_t)x->offset);
+            put16(e + 16, x->size);
+            if (g->format == FORMAT_4K) {
+                put16(e + 18, x->size); // not deflated
+                put16(e + 20, 2);
+            }
+            else {
+                put16(e + 18, 2);
+            }
+        }
+    }
+    index1 = write_tree(g, keys, entries, g->i_count, isize, 0x80, &index1_back);
+
+    for (i = 0; i < g->d_count; i++) {
+        gen_desc *d = &g->d_table[i];
+        char *e = entries + i*dsize;
+        memset(e, 0, dsize);
+        keys[i] = d->d_id;
+        if (g->format == FORMAT_32) {
+            put32(e,      (uint32_t)d->d_id);
+            put32(e + 4,  (uint32_t)d->desc_id);
+            put32(e + 8,  (uint32_t)d->tree_id);
+            put32(e + 12, d->parent_d_id);
+        }
+        else {
+            put64(e,      d->d_id);
+            put64(e + 8,  d->desc_id);
+            put64(e + 16, d->tree_id);
+            put32(e + 24, d->parent_d_id);
+        }
+    }
+    index2 = write_tree(g, keys, entries, g->d_count, dsize, 0x81, &index2_back);
+
+    memset(header, 0, sizeof(header));
+    put32(header, 0x4E444221);
+    header[8] = 'S';
+    header[9] = (g->ost) ? 'O' : 'M';
+    put16(header + 0x0a, (g->format == FORMAT_4K) ? 0x24 : ((g->format == FORMAT_64) ? 0x17 : 0x0e));
+    put16(header + 0x0c, 19);
+    header[0x0e] = header[0x0f] = 1;
+    if (g->format == FORMAT_32) {
+        put32(header + 0xA8, (uint32_t)g->pos);
+        put32(header + 0xB8, (uint32_t)index2_back);
+        put32(header + 0xBC, (uint32_t)index2);
+        put32(header + 0xC0, (uint32_t)index1_back);
+        put32(header + 0xC4, (uint32_t)index1);
+        header[0x1CD] = (char)g->encryption;
+    }
+    else {
+        put64(header + 0xB8, (uint64_t)g->pos);
+        put64(header + 0xD8, index2_back);
+        put64(header + 0xE0, (uint64_t)index2);
+        put64(header + 0xE8, index1_back);
+        put64(header + 0xF0, (uint64_t)index1);
+        header[0x201] = (char)g->encryption;
+    }
+    if (fseeko(g->fp, 0, SEEK_SET) || fwrite(header, 1, sizeof(header), g->fp) != sizeof(header)) DIE(("write failed: %s\n", strerror(errno)));
+    free(entries);
+    free(keys);
+}
+
+
+static void usage(void) {
+    printf("Usage: pstgen [options] output.pst\n");
+    printf("\twrite a synthetic pst file for testing\n");
+    printf("Options:\n");
+    printf("\t-f 32|64|4k\t- File format (default 64)\n");
+    printf("\t-e none|compress|high\t- Block encryption (default none)\n");
+    printf("\t-a\t- Use 8 bit (ANSI) strings rather than unicode\n");
+    printf("\t-O\t- Mark the file as an ost rather than a pst\n");
+    printf("\t-d depth\t- Levels of folders below the top (default 2)\n");
+    printf("\t-b count\t- Subfolders per folder (default 3)\n");
+    printf("\t-m count\t- Messages per folder (default 10)\n");
+    printf("\t-s bytes\t- Body size of each message (default 2000)\n");
+    printf("\t-n count\t- Attachments per message (default 0)\n");
+    printf("\t-z bytes\t- Size of each attachment (default 10000)\n");
+    printf("\t-r seed\t- Random seed (default 1)\n");
+    printf("\t-h\t- Help. This screen\n");
+}
+
+
+int main(int argc, char* const* argv) {
+    gen_file g;
+    int c, i;
+    char name[30];
+
+    memset(&g, 0, sizeof(g));
+    g.format   = FORMAT_64;
+    g.unicode  = 1;
+    g.rng      = 1;
+    while ((c = getopt(argc, argv, "ab:d:e:f:hm:n:Or:s:z:")) != -1) {
+        switch (c) {
+            case 'a':
+                g.unicode = 0;
+                break;
+            case 'b':
+                fanout = atoi(optarg);
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            case 'e':
+                if      (!strcmp(optarg, "none"))     g.encryption = PST_NO_ENCRYPT;
+                else if (!strcmp(optarg, "compress")) g.encryption = PST_COMP_ENCRYPT;
+                else if (!strcmp(optarg, "high"))     g.encryption = PST_ENCRYPT;
+                else {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'f':
+                if      (!strcmp(optarg, "32")) g.format = FORMAT_32;
+                else if (!strcmp(optarg, "64")) g.format = FORMAT_64;
+                else if (!strcmp(optarg, "4k")) g.format = FORMAT_4K;
+                else {
+                    usage();
+                    exit(1);
+                }
+                break;
+            case 'm':
+                msg_count = atoi(optarg);
+                break;
+            case 'n':
+                attach_count = atoi(optarg);
+                break;
+            case 'O':
+                g.ost = 1;
+                break;
+            case 'r':
+                g.rng = strtoull(optarg, NULL, 0);
+                if (!g.rng) g.rng = 1;
+                break;
+            case 's':
+                body_size = (size_t)strtoull(optarg, NULL, 0);
+                break;
+            case 'z':
+                attach_size = (size_t)strtoull(optarg, NULL, 0);
+                break;
+            case 'h':
+                usage();
+                exit(0);
+            default:
+                usage();
+                exit(1);
+        }
+    }
+    if (optind != argc-1 || depth < 0 || fanout < 0 || msg_count < 0 ||
+        attach_count < 0 || attach_count > (MAX_SUBNODES-2)/2) {
+        usage();
+        exit(1);
+    }
+    if (!(g.fp = fopen(argv[optind], "wb"))) {
+        DIE(("Cannot create %s: %s\n", argv[optind], strerror(errno)));
+    }
+
+    g.pos      = 0x400;     // after the header
+    g.next_bid = 0x100;
+    g.next_nid = (NID_TOP_OF_FOLDERS >> 5) + 1;
+    write_message_store(&g);
+    write_folder_record(&g, NID_ROOT_FOLDER, NID_ROOT_FOLDER, "", 0, 1);
+    write_folder_record(&g, NID_TOP_OF_FOLDERS, NID_ROOT_FOLDER, "Top of Personal Folders", 0, fanout > 0);
+    for (i = 0; i < fanout; i++) {
+        snprintf(name, sizeof(name), "Folder %d", i);
+        write_folder(&g, NID_TOP_OF_FOLDERS, name, 1);
+    }
+    write_indexes(&g);
+    if (fclose(g.fp)) DIE(("Cannot close %s: %s\n", argv[optind], strerror(errno)));
+
+    printf("%" PRIu64 " folders, %" PRIu64 " messages, %" PRIu64 " attachments, %" PRIu64 " bytes\n",
+           g.folders, g.messages, g.attachments, (uint64_t)g.pos);
+    free(g.i_table);
+    free(g.d_table);
+    return 0;
+}
@@ -0,0 +1,737 @@
+/***
+ * pstserve.c
+ * Part of the LibPST project
+ *
+ * A long running server that keeps pst files open, with their indexes
+ * loaded, and answers small requests about them on a unix domain socket.
+ * Each request and each response is one frame: a 4 byte length in network
+ * byte order, followed by that many bytes. A request is a command and its
+ * arguments separated by tabs, so that file names may contain spaces:
+ *
+ *   list   <pst> [<folder d_id> [<start> [<count>]]]
+ *   item   <pst> <d_id>
+ *   body   <pst> <d_id> [html]
+ *   attach <pst> <d_id> <n>
+ *   stores
+ *   close  <pst>
+ *
+ * A response starts with a line of "OK", or "ERR" and a message, and the
+ * data follows that line. list, item and stores answer with one line of
+ * JSON per entry, body with the text of the body in utf-8, and attach with
+ * the data of the n'th attachment, counting from 0.
+ */
+
+#include "define.h"
+#include "json.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+// the longest request accepted, requests are only a few file names long
+#define MAX_REQUEST 65536
+#define MAX_FIELDS  6
+
+// clients that stall in the middle of a frame are dropped after this long,
+// since one request is served at a time
+#define CLIENT_TIMEOUT 10
+
+// One open pst file. The stores are kept in order of last use, and the
+// least recently used are closed first.
+struct store {
+    struct store  *next;
+    struct store  *prev;
+    char          *name;        // as given in the requests
+    dev_t          dev;         // to notice when the file is replaced or changed
+    ino_t          ino;
+    off_t          size;
+    time_t         mtime;
+    pst_file       pf;
+    pst_item      *root;        // the message store item
+    pst_desc_tree *top;         // top of folders
+    pst_desc_tree **ids;        // open addressed hash of all the descriptors by d_id
+    size_t         id_mask;
+    size_t         memory;      // bytes held by the loaded indexes
+    uint64_t       requests;
+};
+
+struct client {
+    int   fd;
+    FILE *out;
+};
+
+void usage(char *prog_name);
+void version();
+
+// global settings
+char          *charset      = NULL;     // have command line arg -C
+int            max_stores   = 8;        // have command line arg -n
+size_t         memory_limit = 0;        // have command line arg --memory, in bytes
+struct store  *stores_head  = NULL;     // most recently used
+struct store  *stores_tail  = NULL;
+int            stores_open  = 0;
+size_t         stores_memory = 0;
+volatile sig_atomic_t stop  = 0;
+
+#define OPT_MEMORY 256
+
+
+static size_t id_hash(uint64_t d_id, size_t mask)
+{
+    return (size_t)((d_id * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+
+static void store_index_ids(struct store *s)
+{
+    // walk the whole descriptor tree twice, once to count it and once to
+    // fill the table, which is kept at most half full
+    pst_desc_tree *d;
+    size_t n = 0, buckets = 16;
+    for (d = s->pf.d_head; d; d = pst_getNextDptr(d)) n++;
+    while (buckets < n * 2) buckets *= 2;
+    s->ids = (pst_desc_tree **)calloc(buckets, sizeof(pst_desc_tree *));
+    if (!s->ids) DIE(("store_index_ids: Out Of memory [req: %zu]\n", buckets * sizeof(pst_desc_tree *)));
+    s->id_mask = buckets - 1;
+    for (d = s->pf.d_head; d; d = pst_getNextDptr(d)) {
+        size_t h = id_hash(d->d_id, s->id_mask);
+        while (s->ids[h]) {
+            if (s->ids[h]->d_id == d->d_id) break;  // the first one wins, as in pst_getDptr()
+            h = (h + 1) & s->id_mask;
+        }
+        if (!s->ids[h]) s->ids[h] = d;
+    }
+}
+
+
+static pst_desc_tree *store_find(struct store *s, uint64_t d_id)
+{
+    size_t h = id_hash(d_id, s->id_mask);
+    while (s->ids[h]) {
+        if (s->ids[h]->d_id == d_id) return s->ids[h];
+        h = (h + 1) & s->id_mask;
+    }
+    return NULL;
+}
+
+
+static void store_unlink(struct store *s)
+{
+    if (s->prev) s->prev->next = s->next;
+    else         stores_head   = s->next;
+    if (s->next) s->next->prev = s->prev;
+    else         stores_tail   = s->prev;
+    s->next = s->prev = NULL;
+}
+
+
+static void store_push(struct store *s)
+{
+    s->next = stores_head;
+    s->prev = NULL;
+    if (stores_head) stores_head->prev = s;
+    else             stores_tail = s;
+    stores_head = s;
+}
+
+
+static void store_close(struct store *s)
+{
+    DEBUG_INFO(("closing %s\n", s->name));
+    store_unlink(s);
+    stores_open--;
+    stores_memory -= s->memory;
+    if (s->root) pst_freeItem(s->root);
+    pst_close(&s->pf);
+    free(s->ids);
+    free(s->name);
+    free(s);
+}
+
+
+static struct store *store_open(const char *name, struct stat *st, const char **error)
+{
+    struct store *s = (struct store *)pst_malloc(sizeof(struct store));
+    memset(s, 0, sizeof(struct store));
+    DEBUG_INFO(("opening %s\n", name));
+    if (pst_open(&s->pf, name, charset)) {
+        free(s);
+        *error = "cannot open the pst file";
+        return NULL;
+    }
+    if (pst_load_index(&s->pf)) {
+        pst_close(&s->pf);
+        free(s);
+        *error = "cannot load the index of the pst file";
+        return NULL;
+    }
+    pst_load_extended_attributes(&s->pf);
+    s->root = pst_parse_item(&s->pf, s->pf.d_head, NULL);
+    if (s->root) s->top = pst_getTopOfFolders(&s->pf, s->root);
+    if (!s->top) {
+        if (s->root) pst_freeItem(s->root);
+        pst_close(&s->pf);
+        free(s);
+        *error = "top of folders record not found";
+        return NULL;
+    }
+    store_index_ids(s);
+    s->name   = strdup(name);
+    s->dev    = st->st_dev;
+    s->ino    = st->st_ino;
+    s->size   = st->st_size;
+    s->mtime  = st->st_mtime;
+    s->memory = pst_index_memory(&s->pf) + (s->id_mask + 1) * sizeof(pst_desc_tree *);
+    stores_open++;
+    stores_memory += s->memory;
+    store_push(s);
+    return s;
+}
+
+
+static struct store *store_get(const char *name, const char **error)
+{
+    // a store is reopened when the file has changed since it was loaded
+    struct store *s;
+    struct stat st;
+    if (stat(name, &st)) {
+        *error = strerror(errno);
+        return NULL;
+    }
+    for (s = stores_head; s; s = s->next) {
+        if (strcmp(s->name, name)) continue;
+        if (s->dev == st.st_dev && s->ino == st.st_ino && s->size == st.st_size && s->mtime == st.st_mtime) {
+            store_unlink(s);
+            store_push(s);
+            s->requests++;
+            return s;
+        }
+        DEBUG_INFO(("%s has changed\n", name));
+        store_close(s);
+        break;
+    }
+    s = store_open(name, &st, error);
+    if (!s) return NULL;
+    s->requests++;
+    // the store just opened is at the head, and is never closed here
+    while (stores_tail != s && (stores_open > max_stores || (memory_limit && stores_memory > memory_limit))) {
+        store_close(stores_tail);
+    }
+    return s;
+}
+
+
+static void list_entry(FILE *f, pst_item *item, pst_desc_tree *d_ptr)
+{
+    // enough of each entry to show it in a folder listing
+    fprintf(f, "{\"d_id\":%" PRIu64 ",\"type\":\"%s\"", d_ptr->d_id, json_item_type(item));
+    if (item->folder) {
+        json_string(f, "name", item, &item->file_as);
+        fprintf(f, ",\"items\":%" PRIi32 ",\"unread\":%" PRIi32 ",\"children\":%" PRIi32,
+                item->folder->item_count, item->folder->unseen_item_count, d_ptr->no_child);
+    } else {
+        pst_item_attach *attach;
+        int n = 0;
+        for (attach = item->attach; attach; attach = attach->next) n++;
+        if (item->ascii_type) {
+            fputs(",\"class\":", f);
+            json_escape(f, item->ascii_type);
+        }
+        json_string(f, "subject", item, &item->subject);
+        if (item->email) {
+            json_string(f, "from", item, &item->email->outlook_sender_name);
+            json_date(f, "received", item->email->arrival_date);
+        }
+        if (item->contact && item->type == PST_TYPE_CONTACT) json_string(f, "name", item, &item->contact->fullname);
+        if (item->appointment && item->type == PST_TYPE_APPOINTMENT) json_date(f, "start", item->appointment->start);
+        fprintf(f, ",\"size\":%" PRIi32 ",\"attachments\":%d", item->message_size, n);
+    }
+    fputs("}\n", f);
+}
+
+
+static void item_entry(FILE *f, struct store *s, pst_item *item, pst_desc_tree *d_ptr)
+{
+    // the same fields as readpst --json, with the attachments numbered,
+    // and whether there is a body to ask for
+    fputc('{', f);
+    json_item_fields(f, &s->pf, item, d_ptr, 1);
+    if (item->email) fprintf(f, ",\"html\":%s", (item->email->htmlbody.str) ? "true" : "false");
+    fprintf(f, ",\"body\":%s", (item->body.str) ? "true" : "false");
+    fputs("}\n", f);
+}
+
+
+static int send_frame(struct client *c, const char *data, size_t len)
+{
+    uint32_t n = htonl((uint32_t)len);
+    if (pst_fwrite(&n, 1, sizeof(n), c->out) != sizeof(n)) return -1;
+    if (len && pst_fwrite(data, 1, len, c->out) != len) return -1;
+    return fflush(c->out);
+}
+
+
+static int send_error(struct client *c, const char *error)
+{
+    char line[512];
+    int  n = snprintf(line, sizeof(line), "ERR %s\n", error);
+    if (n < 0 || n >= (int)sizeof(line)) n = sizeof(line) - 1;
+    DEBUG_INFO(("request failed: %s\n", error));
+    return send_frame(c, line, n);
+}
+
+
+static pst_item *request_item(struct client *c, char **field, int fields, struct store **sp, pst_desc_tree **dp)
+{
+    // find the store and parse the item that most requests start with,
+    // having sent the error when either cannot be found
+    const char *error = NULL;
+    struct store *s;
+    pst_desc_tree *d_ptr;
+    pst_item *item;
+    char *end;
+    uint64_t d_id;
+    if (fields < 3) {
+        send_error(c, "missing arguments");
+        return NULL;
+    }
+    if (!(s = store_get(field[1], &error))) {
+        send_error(c, error);
+        return NULL;
+    }
+    d_id = strtoull(field[2], &end, 0);
+    if (*end || !(d_ptr = store_find(s, d_id)) || !d_ptr->desc) {
+        send_error(c, "no such item");
+        return NULL;
+    }
+    if (!(item = pst_parse_item(&s->pf, d_ptr, NULL))) {
+        send_error(c, "cannot parse the item");
+        return NULL;
+    }
+    *sp = s;
+    *dp = d_ptr;
+    return item;
+}
+
+
+static int do_list(struct client *c, char **field, int fields)
+{
+    const char *error = NULL;
+    struct store *s;
+    pst_desc_tree *d_ptr;
+    char *buf = NULL, *end;
+    size_t len = 0;
+    long start = 0, count = -1;
+    FILE *f;
+    int rc;
+
+    if (fields < 2) return send_error(c, "missing arguments");
+    if (!(s = store_get(field[1], &error))) return send_error(c, error);
+    d_ptr = s->top;
+    if (fields > 2) {
+        d_ptr = store_find(s, strtoull(field[2], &end, 0));
+        if (*end || !d_ptr) return send_error(c, "no such folder");
+    }
+    if (fields > 3) start = strtol(field[3], NULL, 10);
+    if (fields > 4) count = strtol(field[4], NULL, 10);
+
+    if (!(f = open_memstream(&buf, &len))) return send_error(c, strerror(errno));
+    fputs("OK\n", f);
+    for (d_ptr = d_ptr->child; d_ptr && start > 0; d_ptr = d_ptr->next) start--;
+    for (; d_ptr && count; d_ptr = d_ptr->next) {
+        pst_item *item;
+        if (!d_ptr->desc || !(item = pst_parse_item(&s->pf, d_ptr, NULL))) {
+            fprintf(f, "{\"d_id\":%" PRIu64 ",\"type\":\"unknown\"}\n", d_ptr->d_id);
+        } else {
+            list_entry(f, item, d_ptr);
+            pst_freeItem(item);
+        }
+        if (count > 0) count--;
+    }
+    fclose(f);
+    rc = send_frame(c, buf, len);
+    free(buf);
+    return rc;
+}
+
+
+static int do_item(struct client *c, char **field, int fields)
+{
+    struct store *s;
+    pst_desc_tree *d_ptr;
+    pst_item *item;
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f;
+    int rc;
+
+    if (!(item = request_item(c, field, fields, &s, &d_ptr))) return 0;
+    if (!(f = open_memstream(&buf, &len))) {
+        pst_freeItem(item);
+        return send_error(c, strerror(errno));
+    }
+    fputs("OK\n", f);
+    item_entry(f, s, item, d_ptr);
+    fclose(f);
+    pst_freeItem(item);
+    rc = send_frame(c, buf, len);
+    free(buf);
+    return rc;
+}
+
+
+static int do_body(struct client *c, char **field, int fields)
+{
+    struct store *s;
+    pst_desc_tree *d_ptr;
+    pst_item *item;
+    pst_string *body;
+    char *buf;
+    size_t len;
+    int rc;
+
+    if (!(item = request_item(c, field, fields, &s, &d_ptr))) return 0;
+    if (fields > 3 && !strcmp(field[3], "html")) body = (item->email) ? &item->email->htmlbody : NULL;
+    else                                         body = &item->body;
+    if (body) pst_convert_utf8_null(item, body);
+    if (!body || !body->str) {
+        pst_freeItem(item);
+        return send_error(c, "no such body");
+    }
+    len = strlen(body->str);
+    buf = pst_malloc(len + 3);
+    memcpy(buf, "OK\n", 3);
+    memcpy(buf + 3, body->str, len);
+    pst_freeItem(item);
+    rc = send_frame(c, buf, len + 3);
+    free(buf);
+    return rc;
+}
+
+
+static int do_attach(struct client *c, char **field, int fields)
+{
+    // the data is written straight from the pst file to the socket, in a
+    // frame whose length comes from the block headers
+    struct store *s;
+    pst_desc_tree *d_ptr;
+    pst_item *item;
+    pst_item_attach *attach;
+    size_t size, written;
+    uint32_t n;
+    long i;
+
+    if (!(item = request_item(c, field, fields, &s, &d_ptr))) return 0;
+    i = (fields > 3) ? strtol(field[3], NULL, 10) : -1;
+    for (attach = item->attach; attach && i > 0; attach = attach->next) i--;
+    if (!attach || i < 0) {
+        pst_freeItem(item);
+        return send_error(c, "no such attachment");
+    }
+    size = pst_attach_size(&s->pf, attach);
+    n = htonl((uint32_t)(size + 3));
+    if (pst_fwrite(&n, 1, sizeof(n), c->out) != sizeof(n) || pst_fwrite("OK\n", 1, 3, c->out) != 3) {
+        pst_freeItem(item);
+        return -1;
+    }
+    written = pst_attach_to_file(&s->pf, attach, c->out);
+    pst_freeItem(item);
+    if (written != size) {
+        // the frame cannot be finished, so the client is dropped
+        DEBUG_WARN(("attachment wrote %zu bytes rather than %zu\n", written, size));
+        return -1;
+    }
+    return fflush(c->out);
+}
+
+
+static int do_stores(struct client *c)
+{
+    struct store *s;
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f;
+    int rc;
+
+    if (!(f = open_memstream(&buf, &len))) return send_error(c, strerror(errno));
+    fputs("OK\n", f);
+    for (s = stores_head; s; s = s->next) {
+        fputs("{\"name\":", f);
+        json_escape(f, s->name);
+        fprintf(f, ",\"size\":%" PRIu64 ",\"memory\":%zu,\"requests\":%" PRIu64 "}\n",
+                (uint64_t)s->size, s->memory, s->requests);
+    }
+    fclose(f);
+    rc = send_frame(c, buf, len);
+    free(buf);
+    return rc;
+}
+
+
+static int do_close(struct client *c, char **field, int fields)
+{
+    struct store *s;
+    if (fields < 2) return send_error(c, "missing arguments");
+    for (s = stores_head; s; s = s->next) {
+        if (!strcmp(s->name, field[1])) {
+            store_close(s);
+            return send_frame(c, "OK\n", 3);
+        }
+    }
+    return send_error(c, "not open");
+}
+
+
+static int read_full(int fd, char *buf, size_t len)
+{
+    while (len) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR && !stop) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static int serve_request(struct client *c)
+{
+    // read and answer one request, returning -1 when the client should be dropped
+    char *field[MAX_FIELDS];
+    char *request, *p;
+    uint32_t len;
+    int fields = 0, rc;
+
+    if (read_full(c->fd, (char *)&len, sizeof(len))) return -1;
+    len = ntohl(len);
+    if (len > MAX_REQUEST) {
+        DEBUG_WARN(("request of %" PRIu32 " bytes is too long\n", len));
+        return -1;
+    }
+    request = pst_malloc(len + 1);
+    if (read_full(c->fd, request, len)) {
+        free(request);
+        return -1;
+    }
+    request[len] = '\0';
+    DEBUG_INFO(("request %s\n", request));
+
+    for (p = request; p && fields < MAX_FIELDS; fields++) {
+        field[fields] = p;
+        if ((p = strchr(p, '\t'))) *p++ = '\0';
+    }
+    DEBUG_SPAN(field[0], 0);
+    if      (!strcmp(field[0], "list"))   rc = do_list(c, field, fields);
+    else if (!strcmp(field[0], "item"))   rc = do_item(c, field, fields);
+    else if (!strcmp(field[0], "body"))   rc = do_body(c, field, fields);
+    else if (!strcmp(field[0], "attach")) rc = do_attach(c, field, fields);
+    else if (!strcmp(field[0], "stores")) rc = do_stores(c);
+    else if (!strcmp(field[0], "close"))  rc = do_close(c, field, fields);
+    else                                  rc = send_error(c, "unknown request");
+    DEBUG_SPAN_END();
+    free(request);
+    return (rc) ? -1 : 0;
+}
+
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+    mode_t old;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) DIE(("socket path %s is too long\n", path));
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // a socket left behind by a server that is no longer running is removed
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) DIE(("socket: %s\n", strerror(errno)));
+    if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) DIE(("a server is already listening on %s\n", path));
+    close(fd);
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) DIE(("socket: %s\n", strerror(errno)));
+    // only the user running the server may connect to it
+    old = umask(077);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) DIE(("cannot bind to %s: %s\n", path, strerror(errno)));
+    umask(old);
+    if (listen(fd, 16)) DIE(("cannot listen on %s: %s\n", path, strerror(errno)));
+    return fd;
+}
+
+
+static void client_close(struct client *c)
+{
+    DEBUG_INFO(("client %d closed\n", c->fd));
+    fclose(c->out);
+    close(c->fd);
+}
+
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+
+void usage(char *prog_name) {
+    DEBUG_ENT("usage");
+    version();
+    printf("Usage: %s [OPTIONS] {SOCKET}\n", prog_name);
+    printf("OPTIONS:\n");
+    printf("\t-C charset\t- character set for items with an unspecified character set\n");
+    printf("\t-d <filename> \t- Debug to file.\n");
+    printf("\t-h\t- Help. This screen\n");
+    printf("\t-n <count>\t- Keep at most this many pst files open, closing the least recently used. Default 8\n");
+    printf("\t-V\t- Version. Display program version\n");
+    printf("\t--memory <MB>\t- Close the least recently used pst files while their indexes use more than this\n");
+    DEBUG_RET();
+}
+
+
+void version() {
+    DEBUG_ENT("version");
+    printf("pstserve / LibPST v%s\n", VERSION);
+#if BYTE_ORDER == BIG_ENDIAN
+    printf("Big Endian implementation being used.\n");
+#elif BYTE_ORDER == LITTLE_ENDIAN
+    printf("Little Endian implementation being used.\n");
+#else
+#   error "Byte order not supported by this library"
+#endif
+    DEBUG_RET();
+}
+
+
+int main(int argc, char* const* argv) {
+    struct client *clients = NULL;
+    struct pollfd *fds = NULL;
+    struct sigaction sa;
+    int  nclients = 0;
+    int  listen_fd;
+    int  c, i;
+    char *d_log = NULL;
+    const char *path;
+
+#ifdef HAVE_GETOPT_LONG
+    static struct option long_options[] = {
+        {"memory",  required_argument, NULL, OPT_MEMORY},
+        {NULL,      0,           NULL, 0}
+    };
+    while ((c = getopt_long(argc, argv, "C:d:hn:V", long_options, NULL))!= -1) {
+#else
+    while ((c = getopt(argc, argv, "C:d:hn:V"))!= -1) {
+#endif
+        switch (c) {
+            case OPT_MEMORY:
+                memory_limit = (size_t)atol(optarg) * 1024 * 1024;
+            break;
+            case 'C':
+                charset = optarg;
+            break;
+            case 'd':
+                d_log = optarg;
+            break;
+            case 'n':
+                max_stores = atoi(optarg);
+                if (max_stores < 1) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+            break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            break;
+            case 'V':
+                version();
+                exit(0);
+            break;
+            default:
+                usage(argv[0]);
+                exit(1);
+            break;
+        }
+    }
+
+    #ifdef DEBUG_ALL
+        // force a log file
+        if (!d_log) d_log = "pstserve.log";
+    #endif // defined DEBUG_ALL
+    DEBUG_INIT(d_log, NULL);
+    DEBUG_ENT("main");
+
+    if (argc != optind + 1) {
+        usage(argv[0]);
+        DEBUG_CLOSE();
+        exit(2);
+    }
+    path = argv[optind];
+    listen_fd = listen_on(path);
+
+    // a client going away in the middle of a response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT,  &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // the listening socket is fds[0], and client i is fds[i+1]
+    fds = (struct pollfd *)pst_malloc(sizeof(struct pollfd));
+    fds[0].fd     = listen_fd;
+    fds[0].events = POLLIN;
+    while (!stop) {
+        if (poll(fds, nclients + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            DIE(("poll: %s\n", strerror(errno)));
+        }
+        for (i = nclients - 1; i >= 0; i--) {
+            if (!fds[i+1].revents) continue;
+            if (!(fds[i+1].revents & POLLIN) || serve_request(&clients[i])) {
+                client_close(&clients[i]);
+                nclients--;
+                clients[i]  = clients[nclients];
+                fds[i+1]    = fds[nclients+1];
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            struct timeval tv;
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0) continue;
+            tv.tv_sec  = CLIENT_TIMEOUT;
+            tv.tv_usec = 0;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            clients = (struct client *)pst_realloc(clients, (nclients + 1) * sizeof(struct client));
+            fds     = (struct pollfd *)pst_realloc(fds, (nclients + 2) * sizeof(struct pollfd));
+            clients[nclients].fd  = fd;
+            clients[nclients].out = fdopen(dup(fd), "w");
+            if (!clients[nclients].out) {
+                close(fd);
+                continue;
+            }
+            fds[nclients+1].fd     = fd;
+            fds[nclients+1].events = POLLIN;
+            fds[nclients+1].revents = 0;
+            nclients++;
+            DEBUG_INFO(("client %d connected\n", fd));
+        }
+    }
+
+    for (i = 0; i < nclients; i++) client_close(&clients[i]);
+    free(clients);
+    free(fds);
+    close(listen_fd);
+    unlink(path);
+    while (stores_head) store_close(stores_head);
+
+    DEBUG_RET();
+    DEBUG_CLOSE();
+    return 0;
+}
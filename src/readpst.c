@@ -7,7 +7,18 @@
 
 #include "define.h"
 #include "lzfu.h"
+#include "blake2b.h"
+#include "json.h"
 #include "msg.h"
+#include "zlib.h"
+
+#ifndef HAVE_FDATASYNC
+#define fdatasync fsync
+#endif
+
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
 
 #define OUTPUT_TEMPLATE "%s.%s"
 #define OUTPUT_KMAIL_DIR_TEMPLATE ".%s.directory"
@@ -16,30 +27,110 @@
 // max size of the c_time char*. It will store the date of the email
 #define C_TIME_SIZE 500
 
+// One pst file to be converted. readpst can be given several, and then
+// writes each into its own subdirectory of the output directory.
+struct store {
+    char          *fname;       // absolute, so that it can be opened after chdir()
+    char          *dir;         // output subdirectory, "" for a single pst file
+    off_t          size;        // the largest files are started first
+    pst_file       pf;
+    pst_item      *root;        // the message store item
+    pst_desc_tree *top;         // top of folders
+    size_t         memory;      // bytes held by the loaded indexes
+    int            refs;        // pool tasks still using this file
+    int            failed;      // could not be opened
+    int            progress;    // pst_set_progress() has been called on pf
+    uint64_t       items_shown; // the progress of pf already added to the totals
+    uint64_t       bytes_shown;
+};
+
 struct file_ll {
     char *name[PST_TYPE_MAX];
     char *dname;
+    char *dir;          // output directory for this folder, relative to output_dir
     FILE * output[PST_TYPE_MAX];
     int32_t stored_count;
     int32_t item_count;
     int32_t skip_count;
 };
 
+// What the checkpoint journal of an earlier run says about one folder
+struct journal_folder {
+    struct journal_folder *next;
+    char       *parent;
+    uint64_t    id;
+    char       *dir;                    // NULL until the O line is seen
+    char       *name[PST_TYPE_MAX];
+    int32_t     done;                   // children done, in tree order
+    uint64_t    last;                   // id of the last of them
+    int32_t     item_count;
+    int32_t     skip_count;
+    off_t       offset[PST_TYPE_MAX];
+    int         complete;
+};
+
 int       grim_reaper();
 pid_t     try_fork(char* folder);
-void      process(pst_item *outeritem, pst_desc_tree *d_ptr);
-void      write_email_body(FILE *f, char *body);
+void      process(pst_item *outeritem, pst_desc_tree *d_ptr, char *parent_dir);
+pst_item* parse_child(pst_desc_tree *d_ptr);
+int       item_is_output(pst_item *item);
+int       process_item(struct file_ll *ff, pst_item *item, pst_desc_tree *d_ptr);
+void      add_store(const char *name, const char *cwd);
+void      read_manifest(const char *name, const char *cwd);
+int       compare_store_size(const void *a, const void *b);
+void      store_dirs();
+int       store_open(struct store *s);
+void      store_close(struct store *s);
+void      stats_add(pst_file *pf);
+void      stats_lzfu(size_t in, size_t out);
+void      stats_forked();
+void      stats_exit();
+void      progress_start();
+void      progress_open(struct store *s);
+void      progress_publish(pst_file *pf, int last);
+void      progress_forked();
+void      stats_report();
+void      store_export(struct store *s);
+void      write_email_body(FILE *f, char *body, size_t len);
 void      removeCR(char *c);
+size_t    prepare_body(char *body, int *base64);
 void      usage();
 void      version();
-void      mk_kmail_dir(char* fname);
-int       close_kmail_dir();
-void      mk_recurse_dir(char* dir);
-int       close_recurse_dir();
-void      mk_separate_dir(char *dir);
-int       close_separate_dir();
+char*     mk_path(const char *dir, const char *name);
+FILE*     output_open(const char *name, int flags);
+FILE*     output_reopen(const char *name, int flags, off_t offset);
+off_t     output_sync(FILE *f);
+void      output_sync_dir(const char *dir);
+int       output_close(FILE *f);
+void      output_forked();
+int       output_mkdir(const char *path);
+int       output_exists(const char *path);
+void      name_add(const char *path);
+char*     name_unique(const char *prefix, const char *name);
+void      name_forget(const char *dir);
+void      output_tar_close();
+void      output_tar_file(const char *name, const char *path);
+void      dedup_attachment(pst_file *pst, pst_item_attach *attach, const char *name);
+void      dedup_base64(pst_file *pst, pst_item_attach *attach, FILE *f_output);
+void      dedup_close();
+void      journal_open();
+struct journal_folder *journal_resume(const char *parent, uint64_t id);
+int       journal_leftover(const char *path);
+void      journal_enter_dir(struct file_ll *f, pst_item *item, struct journal_folder *j);
+void      journal_folder(struct file_ll *f, const char *parent, uint64_t id);
+void      journal_checkpoint(struct file_ll *f, const char *parent, uint64_t id, int32_t done, uint64_t last);
+void      journal_skip(struct file_ll *f, pst_desc_tree *d_ptr, uint64_t last);
+void      journal_finish(struct file_ll *f, const char *parent, uint64_t id);
+void      incremental_open();
+int       incremental_unchanged(pst_desc_tree *d_ptr);
+void      incremental_record(pst_desc_tree *d_ptr);
+void      incremental_close(int failed);
+char*     mk_kmail_dir(char *parent, char* fname);
+char*     mk_recurse_dir(char *parent, char* dir);
+char*     mk_separate_dir(char *parent, char *dir);
 void      mk_separate_file(struct file_ll *f, int32_t t, char *extension, int openit);
 void      close_separate_file(struct file_ll *f);
+void      write_separate_email(struct file_ll *f, pst_item *item);
 char*     my_stristr(char *haystack, char *needle);
 void      check_filename(char *fname);
 int       acceptable_ext(pst_item_attach* attach);
@@ -63,7 +154,10 @@ void      write_vcard(FILE* f_output, pst_item *item, pst_item_contact* contact,
 int       write_extra_categories(FILE* f_output, pst_item* item);
 void      write_journal(FILE* f_output, pst_item* item);
 void      write_appointment(FILE* f_output, pst_item *item);
-void      create_enter_dir(struct file_ll* f, pst_item *item);
+const char* json_folder_path(pst_desc_tree *d_ptr);
+void      json_enter_folder(pst_desc_tree *d_ptr, const char *name);
+void      write_json(FILE *f_output, pst_item *item, pst_desc_tree *d_ptr);
+void      create_enter_dir(struct file_ll* f, pst_item *item, char *parent_dir);
 void      close_enter_dir(struct file_ll *f);
 char*     quote_string(char *inp);
 
@@ -112,6 +206,30 @@ char*  output_dir = ".";
 #define OTMODE_JOURNAL      4
 #define OTMODE_CONTACT      8
 
+// long option values, beyond the range of the single character options
+#define OPT_THREADS  256
+#define OPT_PREFETCH 257
+#define OPT_MANIFEST 258
+#define OPT_MEMORY   259
+#define OPT_BUFFER   260
+#define OPT_DROP_CACHE 261
+#define OPT_GZIP     262
+#define OPT_GZIP_SEPARATE 263
+#define OPT_TAR      264
+#define OPT_DEDUP    265
+#define OPT_CHECKPOINT 266
+#define OPT_RESUME   267
+#define OPT_INCREMENTAL 268
+#define OPT_JSON     269
+#define OPT_STATS    270
+#define OPT_TRACE    271
+#define OPT_READ_PROFILE 272
+#define OPT_PROGRESS 273
+#define OPT_STATUS   274
+#define OPT_LIMIT_RATE 275
+#define OPT_LIMIT_READS 276
+#define OPT_FILTER   277
+
 // output settings for RTF bodies
 // filename for the attachment
 #define RTF_ATTACH_NAME "rtf-body.rtf"
@@ -133,11 +251,67 @@ int         overwrite = 0;
 int         prefer_utf8 = 0;
 int         save_rtf_body = 1;
 int         file_name_len = 10;     // enough room for MODE_SPEARATE file name
-pst_file    pstfile;
+PST_THREAD_LOCAL pst_file *pstfile = NULL;   // the pst file this thread is working on
 regex_t     meta_charset_pattern;
 char*       default_charset = NULL;
 char*       acceptable_extensions = NULL;
 
+struct store* stores      = NULL;   // the pst files to convert, largest first
+int         store_count   = 0;
+size_t      memory_budget = 0;      // have command line arg --memory, 0 for no limit
+size_t      output_buffer_size = 4*1024*1024;   // have command line arg --buffer
+int         output_drop_cache  = 0; // have command line arg --drop-cache
+int         gzip_level    = 0;      // have command line arg --gzip, 0 for no compression
+int         gzip_separate = 0;      // have command line arg --gzip-separate
+char*       tar_name  = NULL;       // have command line arg --tar
+#define     DEDUP_HARDLINK 1
+#define     DEDUP_SYMLINK  2
+#define     DEDUP_MANIFEST 3
+int         dedup_mode = 0;         // have command line arg --dedup
+int         tar_fd    = -1;         // the archive, -1 for files of their own
+int         tar_level = 0;          // gzip level of the archive, 0 for none
+time_t      tar_mtime = 0;
+#define     JOURNAL_NAME ".readpst-journal"
+int         checkpoint_interval = 0;// have command line arg --checkpoint, 0 for no journal
+int         resume = 0;             // have command line arg --resume
+int         journal_fd = -1;
+char*       incremental_name = NULL;// have command line arg --incremental
+int         incremental_fd = -1;
+#define     JSON_META 1
+#define     JSON_BODY 2
+int         json_mode = 0;          // have command line arg --json
+
+#define     STATS_TEXT 1
+#define     STATS_JSON 2
+int         stats_mode = 0;         // have command line arg --stats
+pst_stats   stats_total;            // counters of the pst files closed so far, and of rtf decompression
+pst_stats*  stats_shared = NULL;    // in shared memory, the counters of forked children that have exited
+int         read_profile = -1;      // have command line arg --read-profile, the number of ranges to list
+
+// The progress of the whole run, in shared memory when children are
+// forked. Each process adds what it has done since it last did so.
+struct progress {
+    uint64_t items_done;            // descriptors parsed
+    uint64_t items_total;           // descriptors of the pst files opened so far
+    uint64_t bytes_done;            // bytes of blocks read
+    uint64_t bytes_total;           // bytes of the blocks of the pst files opened so far, and the size of the others
+    uint64_t start_ns;
+    uint64_t next_ns;               // when the next line is due
+};
+int         progress_interval = 0;  // seconds between progress lines
+int         progress_stderr = 0;    // have command line arg --progress
+char*       status_name = NULL;     // have command line arg --status
+struct progress  progress_local;
+struct progress* progress_shared = &progress_local;
+
+double          limit_rate  = 0;    // have command line arg --limit-rate, MB per second
+double          limit_reads = 0;    // have command line arg --limit-reads, reads per second
+pst_read_limit  read_limit_local;
+pst_read_limit* read_limit = NULL;  // in shared memory when children are forked, so that they share it
+
+pst_filter      item_filter_local;
+pst_filter*     item_filter = NULL; // have command line arg --filter
+
 int         number_processors = 1;  // number of cpus we have
 int         max_children  = 0;      // based on number of cpus and command line args
 int         max_child_specified = 0;// have command line arg -j
@@ -207,6 +381,10 @@ pid_t try_fork(char *folder)
     // If children have called sem_post but not exited yet, we could have available > 0 but active_children == max_children
     if (available && active_children < max_children) {
         sem_wait(global_children);
+        // flush our stdio buffers, otherwise the child writes them out
+        // a second time when it exits
+        progress_publish(pstfile, 0);
+        fflush(NULL);
         pid_t child = fork();
         if (child < 0) {
             // fork failed, pretend it worked and we are the child
@@ -216,7 +394,10 @@ pid_t try_fork(char *folder)
             // fork worked, and we are the child, reinitialize *our* list of children
             active_children = 0;
             memset(child_processes, 0, sizeof(pid_t) * max_children);
-            pst_reopen(&pstfile);   // close and reopen the pst file to get an independent file position pointer
+            pst_reopen(pstfile);   // close and reopen the pst file to get an independent file position pointer
+            output_forked();
+            stats_forked();
+            progress_forked();
         }
         else {
             // fork worked, and we are the parent, record this child that we need to wait for
@@ -236,194 +417,1423 @@ pid_t try_fork(char *folder)
 }
 
 
-void process(pst_item *outeritem, pst_desc_tree *d_ptr)
+int         use_threads = 0;    // have command line arg --threads
+
+// The export runs as a pipeline: the blocks of the next descriptors are
+// fetched ahead of the parser, ranges are parsed and rendered, and the
+// rendered ranges are written in order. Each stage keeps counts of the
+// work that has passed through it and of how full it was, which are
+// reported at the end of a threaded run.
+#define STAGE_FETCH  0          // descriptors hinted ahead of the parser
+#define STAGE_PARSE  1          // ranges parsed and rendered
+#define STAGE_WRITE  2          // ranges written to the output
+#define STAGE_MAX    3
+
+struct pipe_stage {
+    const char *name;
+    uint64_t    items;          // items that have passed through the stage
+    uint64_t    bytes;          // bytes that have passed through the stage
+    uint64_t    occupied;       // sum of the queue depth found by each item
+    int         max_depth;      // deepest the queue has been
+    uint64_t    stalls;         // times the stage waited for the next one
+};
+
+struct pipe_stage pipe_stages[STAGE_MAX] = {
+    {"fetch", 0, 0, 0, 0, 0},
+    {"parse", 0, 0, 0, 0, 0},
+    {"write", 0, 0, 0, 0, 0},
+};
+
+// the fetch stage for one run of children, keeping hints outstanding for
+// the next prefetch_depth descriptors
+struct prefetch {
+    pst_desc_tree *next;        // next descriptor to be hinted
+    int            lead;        // descriptors hinted and not yet parsed
+    struct pipe_stage stage;    // counts, added to pipe_stages when done
+};
+
+int         prefetch_depth = 32;    // have command line arg --prefetch
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t stage_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+void stage_count(int stage, uint64_t bytes, int depth, int stalls)
 {
-    struct file_ll ff;
-    pst_item *item = NULL;
+    struct pipe_stage *s = &pipe_stages[stage];
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_lock(&stage_mutex);
+#endif
+    s->items++;
+    s->bytes    += bytes;
+    s->occupied += depth;
+    s->stalls   += stalls;
+    if (depth > s->max_depth) s->max_depth = depth;
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_unlock(&stage_mutex);
+#endif
+}
 
-    DEBUG_ENT("process");
-    create_enter_dir(&ff, outeritem);
 
-    for (; d_ptr; d_ptr = d_ptr->next) {
-        DEBUG_INFO(("New item record\n"));
-        if (!d_ptr->desc) {
-            ff.skip_count++;
-            DEBUG_WARN(("ERROR item's desc record is NULL\n"));
-            continue;
+void stage_report()
+{
+    int i;
+    DEBUG_ENT("stage_report");
+    for (i=0; i<STAGE_MAX; i++) {
+        struct pipe_stage *s = &pipe_stages[i];
+        double mean = (s->items) ? (double)s->occupied / s->items : 0;
+        DEBUG_INFO(("stage %s: %" PRIu64 " items, %" PRIu64 " bytes, mean depth %.1f, max depth %d, %" PRIu64 " stalls\n",
+                    s->name, s->items, s->bytes, mean, s->max_depth, s->stalls));
+        if (output_mode != OUTPUT_QUIET) {
+            printf("Stage %s: %" PRIu64 " items, %" PRIu64 " bytes, mean depth %.1f, max depth %d, %" PRIu64 " stalls.\n",
+                   s->name, s->items, s->bytes, mean, s->max_depth, s->stalls);
         }
-        DEBUG_INFO(("Desc Email ID %#" PRIx64 " [d_ptr->d_id = %#" PRIx64 "]\n", d_ptr->desc->i_id, d_ptr->d_id));
+    }
+    DEBUG_RET();
+}
 
-        item = pst_parse_item(&pstfile, d_ptr, NULL);
-        DEBUG_INFO(("About to process item\n"));
 
-        if (!item) {
-            ff.skip_count++;
-            DEBUG_INFO(("A NULL item was seen\n"));
-            continue;
+// --stats: the counters of each pst file are added to stats_total as it
+// is closed. A forked child starts counting from zero, and adds what it
+// did to stats_shared as it exits.
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+void stats_add(pst_file *pf)
+{
+    pst_stats s;
+    if (!stats_mode) return;
+    pst_get_stats(pf, &s);
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_lock(&stats_mutex);
+#endif
+    pst_add_stats(&stats_total, &s);
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_unlock(&stats_mutex);
+#endif
+}
+
+
+void stats_lzfu(size_t in, size_t out)
+{
+    // libpst does not see rtf decompression, so we count it here
+    if (!stats_mode) return;
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_lock(&stats_mutex);
+#endif
+    stats_total.lzfu_bytes_in  += in;
+    stats_total.lzfu_bytes_out += out;
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_unlock(&stats_mutex);
+#endif
+}
+
+
+void stats_forked()
+{
+    if (!stats_mode) return;
+    memset(&stats_total, 0, sizeof(stats_total));
+    pst_reset_stats(pstfile);
+}
+
+
+void stats_exit()
+{
+#ifdef HAVE_SEMAPHORE_H
+    if (!stats_mode || !stats_shared) return;
+    stats_add(pstfile);
+    sem_wait(output_mutex);
+        pst_add_stats(stats_shared, &stats_total);
+    sem_post(output_mutex);
+#endif
+}
+
+
+void stats_report()
+{
+    if (!stats_mode) return;
+    if (stats_shared) pst_add_stats(&stats_total, stats_shared);
+    fflush(stdout);
+    pst_print_stats(stderr, &stats_total, stats_mode == STATS_JSON);
+}
+
+
+uint64_t progress_now()
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+#endif
+}
+
+
+struct store *progress_store(pst_file *pf)
+{
+    int i;
+    for (i=0; i<store_count; i++) {
+        if (&stores[i].pf == pf) return &stores[i];
+    }
+    return NULL;
+}
+
+
+void progress_start()
+{
+    struct progress *p = progress_shared;
+    int i;
+    if (!progress_interval) return;
+    p->start_ns = progress_now();
+    p->next_ns  = p->start_ns + (uint64_t)progress_interval * 1000000000;
+    // until a file is opened, its size stands in for the bytes of its blocks
+    for (i=0; i<store_count; i++) p->bytes_total += stores[i].size;
+}
+
+
+void progress_line(struct progress *p, uint64_t now, int last)
+{
+    // called with the output locked
+    char line[512];
+    double elapsed = (double)(now - p->start_ns) / 1e9;
+    double done, eta = -1;
+    int n;
+    // the bytes are a better guide than the items, which vary in size
+    if (p->bytes_total) done = (double)p->bytes_done / p->bytes_total;
+    else                done = (p->items_total) ? (double)p->items_done / p->items_total : 0;
+    if (done > 1) done = 1;
+    if (last) eta = 0;
+    else if (done > 0) eta = elapsed * (1 - done) / done;
+    n = snprintf(line, sizeof(line), "{\"items_done\":%" PRIu64 ",\"items_total\":%" PRIu64
+                 ",\"bytes_done\":%" PRIu64 ",\"bytes_total\":%" PRIu64
+                 ",\"elapsed\":%.1f,\"items_per_sec\":%.1f,\"bytes_per_sec\":%.0f,\"eta\":%.0f,\"done\":%s}\n",
+                 p->items_done, p->items_total, p->bytes_done, p->bytes_total, elapsed,
+                 (elapsed > 0) ? p->items_done / elapsed : 0, (elapsed > 0) ? p->bytes_done / elapsed : 0,
+                 eta, (last) ? "true" : "false");
+    if (n < 0 || n >= (int)sizeof(line)) return;
+    if (progress_stderr) {
+        fflush(stdout);
+        fputs(line, stderr);
+    }
+    if (status_name) {
+        // replaced in one step, so a reader never sees half a line
+        char *temp = pst_malloc(strlen(status_name) + 5);
+        FILE *f;
+        sprintf(temp, "%s.tmp", status_name);
+        if ((f = fopen(temp, "w"))) {
+            fputs(line, f);
+            if (!fclose(f)) rename(temp, status_name);
         }
+        free(temp);
+    }
+}
 
-        if (item->subject.str) {
-            DEBUG_INFO(("item->subject = %s\n", item->subject.str));
+
+void progress_tick(pst_file *pf, const pst_progress *progress, void *data)
+{
+    progress_publish(pf, 0);
+}
+
+
+void progress_open(struct store *s)
+{
+    pst_progress p;
+    if (!progress_interval) return;
+    pst_set_progress(&s->pf, progress_tick, NULL, 1000);
+    s->progress = 1;
+    pst_get_progress(&s->pf, &p);
+    pst_debug_lock();
+        progress_shared->items_total += p.items_total;
+        progress_shared->bytes_total += p.bytes_total;
+        progress_shared->bytes_total -= (progress_shared->bytes_total > (uint64_t)s->size) ? (uint64_t)s->size : progress_shared->bytes_total;
+        // the index blocks read by pst_load_index() are not counted
+        s->items_shown = p.items_done;
+        s->bytes_shown = p.bytes_done;
+    pst_debug_unlock();
+}
+
+
+void progress_publish(pst_file *pf, int last)
+{
+    // add what this process has done on pf since the last call, and write
+    // a line if one is due
+    struct store *s = (pf) ? progress_store(pf) : NULL;
+    struct progress *p = progress_shared;
+    uint64_t now;
+    pst_progress pp;
+    if (!progress_interval) return;
+    pst_debug_lock();
+        if (s && s->progress) {
+            pst_get_progress(pf, &pp);
+            p->items_done += pp.items_done - s->items_shown;
+            p->bytes_done += pp.bytes_done - s->bytes_shown;
+            s->items_shown = pp.items_done;
+            s->bytes_shown = pp.bytes_done;
         }
+        now = progress_now();
+        if (last || now >= p->next_ns) {
+            p->next_ns = now + (uint64_t)progress_interval * 1000000000;
+            progress_line(p, now, last);
+        }
+    pst_debug_unlock();
+}
 
-        if (item->folder && item->file_as.str) {
-            DEBUG_INFO(("Processing Folder \"%s\"\n", item->file_as.str));
-            if (output_mode != OUTPUT_QUIET) {
-                pst_debug_lock();
-                    printf("Processing Folder \"%s\"\n", item->file_as.str);
-                    fflush(stdout);
-                pst_debug_unlock();
-            }
-            ff.item_count++;
-            if (d_ptr->child && (deleted_mode == DMODE_INCLUDE || strcasecmp(item->file_as.str, "Deleted Items"))) {
-                //if this is a non-empty folder other than deleted items, we want to recurse into it
-                pid_t parent = getpid();
-                pid_t child = try_fork(item->file_as.str);
-                if (child == 0) {
-                    // we are the child process, or the original parent if no children were available
-                    pid_t me = getpid();
-                    process(item, d_ptr->child);
-#ifdef HAVE_FORK
-#ifdef HAVE_SEMAPHORE_H
-                    if (me != parent) {
-                        // we really were a child, forked for the sole purpose of processing this folder
-                        // free my child count slot before really exiting, since
-                        // all I am doing here is waiting for my children to exit
-                        sem_post(global_children);
-                        grim_reaper(1); // wait for all my child processes to exit
-                        exit(0);        // really exit
-                    }
+
+void progress_forked()
+{
+    // what the parent had done on this file is already counted, and its
+    // counters may have been reset by stats_forked()
+    struct store *s = progress_store(pstfile);
+    pst_progress p;
+    if (!progress_interval || !s) return;
+    pst_get_progress(pstfile, &p);
+    s->items_shown = p.items_done;
+    s->bytes_shown = p.bytes_done;
+}
+
+
+void prefetch_init(struct prefetch *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+
+void prefetch_next(struct prefetch *p, pst_desc_tree *d_ptr, int32_t remaining)
+{
+    // d_ptr is about to be parsed, top up the hints so that the next
+    // prefetch_depth descriptors, but no more than remaining, are out
+    if (!prefetch_depth) return;
+    if (p->lead > 0) {
+        p->lead--;
+        p->stage.occupied += p->lead;
+    }
+    else {
+        p->next = d_ptr;
+    }
+    while (p->next && p->lead < prefetch_depth && p->lead < remaining) {
+        // an unchanged message of an incremental export is not read
+        if (incremental_fd < 0 || p->next->child || !incremental_unchanged(p->next)) {
+            p->stage.bytes += pst_prefetch(pstfile, p->next);
+        }
+        p->stage.items++;
+        p->next = p->next->next;
+        p->lead++;
+    }
+    if (p->lead > p->stage.max_depth) p->stage.max_depth = p->lead;
+}
+
+
+void prefetch_done(struct prefetch *p)
+{
+    struct pipe_stage *s = &pipe_stages[STAGE_FETCH];
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_lock(&stage_mutex);
 #endif
+    s->items    += p->stage.items;
+    s->bytes    += p->stage.bytes;
+    s->occupied += p->stage.occupied;
+    if (p->stage.max_depth > s->max_depth) s->max_depth = p->stage.max_depth;
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_unlock(&stage_mutex);
 #endif
-                }
-            }
+}
+
+
+// Thread pool engine, selected with --threads. Folders are queued as
+// tasks. A large folder is also split into ranges of its children, so
+// that one huge folder is not left to a single worker. In the modes that
+// write a whole folder to one file, each range is rendered into memory
+// and the ranges are appended to the file in folder order.
+// Each worker owns a deque, pushing and popping its own tasks at the
+// tail, and steals the oldest task from the head of another worker's
+// deque when its own is empty. All workers share the one pst_file.
+#define TASK_FOLDER  0          // process a folder
+#define TASK_RANGE   1          // parse the next range of a split folder
+#define TASK_WRITE   2          // write a range that has been parsed and numbered
+#define TASK_STORE   3          // open a pst file and process its top folders
+
+#define RANGE_SIZE   64         // children per range of a split folder
+
+struct pool_folder;
+
+struct pool_task {
+    struct pool_task *next;
+    struct pool_task *prev;
+    int            kind;        // TASK_FOLDER, TASK_RANGE, TASK_WRITE or TASK_STORE
+    struct store  *store;       // the pst file the task works on
+    pst_item      *item;        // the folder
+    pst_desc_tree *d_ptr;       // first child of the folder
+    char          *dir;         // output directory
+    struct pool_folder *folder; // the split folder for range tasks
+    int            range;       // range number for TASK_WRITE
+};
+
+#ifdef HAVE_PTHREAD_H
+struct pool_deque {
+    pthread_mutex_t   mutex;
+    struct pool_task *head;     // other workers steal from here
+    struct pool_task *tail;     // the owner pushes and pops here
+};
+
+// A slice of the children of a split folder. Ranges are parsed in any
+// order, but the output files in separate mode are numbered by position
+// in the folder, so each range is numbered once every range before it
+// has been parsed, and only then written. In the other modes a range is
+// rendered as soon as it is parsed, and appended to the folder output
+// once every range before it has been appended.
+struct pool_range {
+    pst_desc_tree *first;       // first child in this range
+    int32_t        count;       // number of children in this range
+    pst_item     **items;       // parsed children, NULL where parsing failed
+    int            parsed;      // parsed, and rendered if not separate mode
+    int            numbered;
+    int32_t        base;        // folder item count before this range
+    int32_t        outputs;     // items in this range that will be counted
+    int32_t        skipped;     // items in this range that were skipped
+    char          *buf[PST_TYPE_MAX];   // rendered output for each folder file
+    size_t         len[PST_TYPE_MAX];
+};
+
+struct pool_folder {
+    pthread_mutex_t    mutex;
+    pthread_cond_t     cond;    // signalled when next_number moves on
+    struct file_ll     ff;      // output state, closed by the last range written
+    struct pool_range *range;
+    int                ranges;
+    int                next_parse;  // next range to be parsed
+    int                next_number; // next range to be numbered or appended
+    int                writing;     // a thread is appending ranges
+    int                finished;    // ranges written
+};
+
+int                 pool_size    = 0;   // number of worker threads
+struct pool_deque*  pool_deques  = NULL;// one per worker, plus one for the main thread
+pthread_t*          pool_threads = NULL;
+pthread_mutex_t     pool_mutex   = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      pool_cond    = PTHREAD_COND_INITIALIZER;
+int                 pool_pending = 0;   // tasks queued or running
+int                 pool_queued  = 0;   // tasks queued
+int                 pool_done    = 0;   // main thread has no more tasks to add
+PST_THREAD_LOCAL int pool_self   = 0;   // index of the deque owned by this thread
+PST_THREAD_LOCAL struct store *pool_store = NULL;   // the pst file of the task this thread is running
+pthread_cond_t      store_cond   = PTHREAD_COND_INITIALIZER;
+int                 stores_open  = 0;   // pst files started and not yet closed
+int                 stores_loading = 0; // pst files whose indexes are being loaded
+size_t              store_memory = 0;   // bytes held by the indexes of the open pst files
+pthread_mutex_t     name_mutex   = PTHREAD_MUTEX_INITIALIZER;
+int                 pool_window  = 0;   // ranges of a folder in flight at once
+
+
+void output_name_lock()
+{
+    if (use_threads) pthread_mutex_lock(&name_mutex);
+}
+
+
+void output_name_unlock()
+{
+    if (use_threads) pthread_mutex_unlock(&name_mutex);
+}
+
+
+void pool_push(struct pool_task *t)
+{
+    struct pool_deque *q = &pool_deques[pool_self];
+    t->next = NULL;
+    if (!t->store) t->store = pool_store;
+
+    // count the task before it becomes visible, so that it cannot finish
+    // and be uncounted before it has been counted
+    pthread_mutex_lock(&pool_mutex);
+        pool_pending++;
+        pool_queued++;
+        t->store->refs++;
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_mutex_lock(&q->mutex);
+        t->prev = q->tail;
+        if (q->tail) q->tail->next = t;
+        else         q->head = t;
+        q->tail = t;
+    pthread_mutex_unlock(&q->mutex);
+
+    pthread_mutex_lock(&pool_mutex);
+        pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+
+void pool_queue_folder(pst_item *item, pst_desc_tree *d_ptr, char *dir)
+{
+    struct pool_task *t = (struct pool_task *)pst_malloc(sizeof(struct pool_task));
+    memset(t, 0, sizeof(*t));
+    t->kind  = TASK_FOLDER;
+    t->item  = item;
+    t->d_ptr = d_ptr;
+    t->dir   = strdup(dir);
+    pool_push(t);
+}
+
+
+void pool_queue_range(int kind, struct pool_folder *folder, int range)
+{
+    struct pool_task *t = (struct pool_task *)pst_malloc(sizeof(struct pool_task));
+    memset(t, 0, sizeof(*t));
+    t->kind   = kind;
+    t->folder = folder;
+    t->range  = range;
+    pool_push(t);
+}
+
+
+void pool_queue_store(struct store *s)
+{
+    struct pool_task *t;
+    // keep the indexes of the open pst files within the memory budget,
+    // and load no more of them at once than there are workers. The first
+    // file is always let in, however large it is.
+    pthread_mutex_lock(&pool_mutex);
+        while (stores_open && (stores_loading >= pool_size || (memory_budget && store_memory >= memory_budget))) {
+            pthread_cond_wait(&store_cond, &pool_mutex);
+        }
+        stores_open++;
+        stores_loading++;
+    pthread_mutex_unlock(&pool_mutex);
+    t = (struct pool_task *)pst_malloc(sizeof(struct pool_task));
+    memset(t, 0, sizeof(*t));
+    t->kind  = TASK_STORE;
+    t->store = s;
+    pool_push(t);
+}
+
+
+void store_loaded(struct store *s)
+{
+    if (!use_threads) return;
+    pthread_mutex_lock(&pool_mutex);
+        store_memory += s->memory;
+        stores_loading--;
+        pthread_cond_broadcast(&store_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+
+void store_release(struct store *s)
+{
+    int last;
+    pthread_mutex_lock(&pool_mutex);
+        last = !--s->refs;
+    pthread_mutex_unlock(&pool_mutex);
+    if (!last) return;
+    store_close(s);
+    pthread_mutex_lock(&pool_mutex);
+        store_memory -= s->memory;
+        stores_open--;
+        pthread_cond_broadcast(&store_cond);
+    pthread_mutex_unlock(&pool_mutex);
+}
 
-        } else if (item->contact && (item->type == PST_TYPE_CONTACT)) {
-            DEBUG_INFO(("Processing Contact\n"));
-            if (!(output_type_mode & OTMODE_CONTACT)) {
-                ff.skip_count++;
-                DEBUG_INFO(("skipping contact: not in output type list\n"));
+
+struct pool_task *pool_take()
+{
+    struct pool_task *t = NULL;
+    int i;
+    for (i=0; !t && i<=pool_size; i++) {
+        int n = (pool_self + i) % (pool_size + 1);
+        struct pool_deque *q = &pool_deques[n];
+        pthread_mutex_lock(&q->mutex);
+            if (n == pool_self) {
+                // our own deque, take the newest task
+                t = q->tail;
+                if (t) {
+                    q->tail = t->prev;
+                    if (q->tail) q->tail->next = NULL;
+                    else         q->head = NULL;
+                }
             }
             else {
-                ff.item_count++;
-                if (mode == MODE_SEPARATE) mk_separate_file(&ff, PST_TYPE_CONTACT, (mode_EX) ? ".vcf" : "", 1);
-                if (contact_mode == CMODE_VCARD) {
-                    pst_convert_utf8_null(item, &item->comment);
-                    write_vcard(ff.output[PST_TYPE_CONTACT], item, item->contact, item->comment.str);
-                }
-                else {
-                    pst_convert_utf8(item, &item->contact->fullname);
-                    pst_convert_utf8(item, &item->contact->address1);
-                    fprintf(ff.output[PST_TYPE_CONTACT], "%s <%s>\n", item->contact->fullname.str, item->contact->address1.str);
+                // steal the oldest task, which is likely to be the largest
+                t = q->head;
+                if (t) {
+                    q->head = t->next;
+                    if (q->head) q->head->prev = NULL;
+                    else         q->tail = NULL;
                 }
-                if (mode == MODE_SEPARATE) close_separate_file(&ff);
             }
+        pthread_mutex_unlock(&q->mutex);
+    }
+    if (t) {
+        pthread_mutex_lock(&pool_mutex);
+            pool_queued--;
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    return t;
+}
 
-        } else if (item->email && ((item->type == PST_TYPE_NOTE) || (item->type == PST_TYPE_SCHEDULE) || (item->type == PST_TYPE_REPORT))) {
-            DEBUG_INFO(("Processing Email\n"));
-            if (!(output_type_mode & OTMODE_EMAIL)) {
-                ff.skip_count++;
-                DEBUG_INFO(("skipping email: not in output type list\n"));
-            }
-            else {
-                char *extra_mime_headers = NULL;
-                ff.item_count++;
-                if (mode == MODE_SEPARATE) {
-                    // process this single email message, possibly forking
-                    pid_t parent = getpid();
-                    pid_t child = try_fork(item->file_as.str);
-                    if (child == 0) {
-                        // we are the child process, or the original parent if no children were available
-                        pid_t me = getpid();
-                        mk_separate_file(&ff, PST_TYPE_NOTE, (mode_EX) ? ".eml" : "", 1);
-                        write_normal_email(ff.output[PST_TYPE_NOTE], ff.name[PST_TYPE_NOTE], item, mode, mode_MH, &pstfile, save_rtf_body, PST_TYPE_NOTE, &extra_mime_headers);
-                        close_separate_file(&ff);
-                        if (mode_MSG) {
-                            mk_separate_file(&ff, PST_TYPE_NOTE, ".msg", 0);
-                            write_msg_email(ff.name[PST_TYPE_NOTE], item, &pstfile);
-                        }
-#ifdef HAVE_FORK
-#ifdef HAVE_SEMAPHORE_H
-                        if (me != parent) {
-                            // we really were a child, forked for the sole purpose of processing this message
-                            // free my child count slot before really exiting, since
-                            // all I am doing here is waiting for my children to exit
-                            sem_post(global_children);
-                            grim_reaper(1); // wait for all my child processes to exit - there should not be any
-                            exit(0);        // really exit
-                        }
-#endif
+
+int pool_split(struct file_ll *ff, pst_desc_tree *d_ptr)
+{
+    struct pool_folder *f;
+    int32_t count = 0;
+    int i;
+    pst_desc_tree *d;
+
+    if (d_ptr && d_ptr->parent) {
+        count = d_ptr->parent->no_child;
+    }
+    else {
+        for (d = d_ptr; d; d = d->next) count++;
+    }
+    if (count <= RANGE_SIZE) return 0;
+#ifndef HAVE_OPEN_MEMSTREAM
+    // no way to render the ranges into memory
+    if (mode != MODE_SEPARATE) return 0;
 #endif
-                    }
-                }
-                else {
-                    // process this single email message, cannot fork since not separate mode
-                    write_normal_email(ff.output[PST_TYPE_NOTE], ff.name[PST_TYPE_NOTE], item, mode, mode_MH, &pstfile, save_rtf_body, 0, &extra_mime_headers);
-                }
-            }
 
-        } else if (item->journal && (item->type == PST_TYPE_JOURNAL)) {
-            DEBUG_INFO(("Processing Journal Entry\n"));
-            if (!(output_type_mode & OTMODE_JOURNAL)) {
-                ff.skip_count++;
-                DEBUG_INFO(("skipping journal entry: not in output type list\n"));
-            }
-            else {
-                ff.item_count++;
-                if (mode == MODE_SEPARATE) mk_separate_file(&ff, PST_TYPE_JOURNAL, (mode_EX) ? ".ics" : "", 1);
-                write_journal(ff.output[PST_TYPE_JOURNAL], item);
-                fprintf(ff.output[PST_TYPE_JOURNAL], "\n");
-                if (mode == MODE_SEPARATE) close_separate_file(&ff);
-            }
+    DEBUG_ENT("pool_split");
+    f = (struct pool_folder *)pst_malloc(sizeof(struct pool_folder));
+    memset(f, 0, sizeof(*f));
+    pthread_mutex_init(&f->mutex, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->ff     = *ff;    // the ranges now own the folder output state
+    f->ranges = (count + RANGE_SIZE - 1) / RANGE_SIZE;
+    f->range  = (struct pool_range *)pst_malloc(sizeof(struct pool_range) * f->ranges);
+    memset(f->range, 0, sizeof(struct pool_range) * f->ranges);
+    for (i=0, d=d_ptr; i<f->ranges; i++) {
+        int32_t n;
+        f->range[i].first = d;
+        for (n=0; d && n<RANGE_SIZE; n++) d = d->next;
+        f->range[i].count = n;
+    }
+    DEBUG_INFO(("split folder %s with %" PRIi32 " children into %d ranges\n", f->ff.dname, count, f->ranges));
+    // range tasks take the next unparsed range when they run, so that
+    // ranges are parsed in folder order whichever worker runs them
+    for (i=0; i<f->ranges; i++) pool_queue_range(TASK_RANGE, f, 0);
+    DEBUG_RET();
+    return 1;
+}
 
-        } else if (item->appointment && (item->type == PST_TYPE_APPOINTMENT)) {
-            DEBUG_INFO(("Processing Appointment Entry\n"));
-            if (!(output_type_mode & OTMODE_APPOINTMENT)) {
-                ff.skip_count++;
-                DEBUG_INFO(("skipping appointment: not in output type list\n"));
-            }
-            else {
-                ff.item_count++;
-                if (mode == MODE_SEPARATE) mk_separate_file(&ff, PST_TYPE_APPOINTMENT, (mode_EX) ? ".ics" : "", 1);
-                write_schedule_part_data(ff.output[PST_TYPE_APPOINTMENT], item, NULL, NULL);
-                fprintf(ff.output[PST_TYPE_APPOINTMENT], "\n");
-                if (mode == MODE_SEPARATE) close_separate_file(&ff);
-            }
 
-        } else if (item->message_store) {
-            // there should only be one message_store, and we have already done it
-            ff.skip_count++;
-            DEBUG_WARN(("item with message store content, type %i %s, skipping it\n", item->type, item->ascii_type));
+void range_close(struct pool_folder *f)
+{
+    close_enter_dir(&f->ff);
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->mutex);
+    free(f->range);
+    free(f);
+}
 
-        } else {
+
+void range_write(struct pool_folder *f, int i)
+{
+    struct pool_range *r = &f->range[i];
+    struct file_ll ff;
+    pst_desc_tree *d = r->first;
+    int32_t j, x;
+    int last;
+
+    DEBUG_ENT("range_write");
+    memset(&ff, 0, sizeof(ff));
+    ff.dname      = f->ff.dname;
+    ff.dir        = f->ff.dir;
+    ff.item_count = r->base;
+    for (j=0; j<r->count; j++, d=d->next) {
+        if (!r->items[j]) {
             ff.skip_count++;
-            DEBUG_WARN(("Unknown item type %i (%s) name (%s)\n",
-                        item->type, item->ascii_type, item->file_as.str));
         }
-        pst_freeItem(item);
+        else if (!process_item(&ff, r->items[j], d)) {
+            pst_freeItem(r->items[j]);
+        }
+    }
+    if (ff.item_count - r->base != r->outputs) {
+        DEBUG_WARN(("range %d of %s numbered %" PRIi32 " items but wrote %" PRIi32 "\n", i, f->ff.dname, r->outputs, ff.item_count - r->base));
+    }
+    for (x=0; x<PST_TYPE_MAX; x++) {
+        if (ff.name[x]) free(ff.name[x]);
     }
-    close_enter_dir(&ff);
+    free(r->items);
+    r->items = NULL;
+    stage_count(STAGE_WRITE, 0, 0, 0);
+
+    pthread_mutex_lock(&f->mutex);
+        f->ff.skip_count += ff.skip_count;
+        last = (++f->finished == f->ranges);
+    pthread_mutex_unlock(&f->mutex);
+    if (last) range_close(f);
     DEBUG_RET();
 }
 
 
+#ifdef HAVE_OPEN_MEMSTREAM
+void range_render(struct pool_folder *f, int i)
+{
+    struct pool_range *r = &f->range[i];
+    struct file_ll ff;
+    pst_desc_tree *d;
+    pst_item *item;
+    struct prefetch pre;
+    int32_t j, t;
+
+    DEBUG_ENT("range_render");
+    prefetch_init(&pre);
+    memset(&ff, 0, sizeof(ff));
+    ff.dname = f->ff.dname;
+    ff.dir   = f->ff.dir;
+    for (t=0; t<PST_TYPE_MAX; t++) {
+        if (f->ff.output[t]) {
+            ff.name[t] = f->ff.name[t];
+            if (!(ff.output[t] = open_memstream(&r->buf[t], &r->len[t]))) {
+                DIE(("range_render: Could not open memory stream for \"%s\"\n", f->ff.name[t]));
+            }
+        }
+    }
+    for (j=0, d=r->first; j<r->count; j++, d=d->next) {
+        prefetch_next(&pre, d, r->count - j);
+        DEBUG_SPAN("item", d->d_id);
+        item = parse_child(d);
+        if (!item) {
+            ff.skip_count++;
+        }
+        else if (!process_item(&ff, item, d)) pst_freeItem(item);
+        DEBUG_SPAN_END();
+    }
+    for (t=0; t<PST_TYPE_MAX; t++) {
+        if (ff.output[t]) fclose(ff.output[t]);
+    }
+    prefetch_done(&pre);
+    r->outputs = ff.item_count;
+    r->skipped = ff.skip_count;
+    DEBUG_RET();
+}
 
-int main(int argc, char* const* argv) {
-    pst_item *item = NULL;
-    pst_desc_tree *d_ptr;
-    char * fname = NULL;
-    char *d_log  = NULL;
-    int c,x;
-    char *temp = NULL;               //temporary char pointer
-    prog_name = argv[0];
 
-    if (regcomp(&meta_charset_pattern, "<meta[^>]*content=\"[^>]*charset=([^>\";]*)[\";]", REG_ICASE | REG_EXTENDED)) {
-        printf("cannot compile regex pattern to find content charset in html bodies\n");
-        exit(3);
-    }
+void range_append(struct pool_folder *f, int i)
+{
+    int32_t t;
+    int last;
+
+    DEBUG_ENT("range_append");
+    pthread_mutex_lock(&f->mutex);
+        f->range[i].parsed = 1;
+        if (f->writing) {
+            // the thread that is appending will get to this range
+            pthread_mutex_unlock(&f->mutex);
+            DEBUG_RET();
+            return;
+        }
+        f->writing = 1;
+        while (f->next_number < f->ranges && f->range[f->next_number].parsed) {
+            struct pool_range *r = &f->range[f->next_number];
+            int waiting = 0;
+            size_t bytes = 0;
+            for (t=f->next_number; t<f->ranges && f->range[t].parsed; t++) waiting++;
+            pthread_mutex_unlock(&f->mutex);
+            for (t=0; t<PST_TYPE_MAX; t++) {
+                if (r->buf[t]) {
+                    if (r->len[t]) pst_fwrite(r->buf[t], 1, r->len[t], f->ff.output[t]);
+                    bytes += r->len[t];
+                    free(r->buf[t]);
+                    r->buf[t] = NULL;
+                }
+            }
+            stage_count(STAGE_WRITE, bytes, waiting, 0);
+            pthread_mutex_lock(&f->mutex);
+            f->ff.item_count += r->outputs;
+            f->ff.skip_count += r->skipped;
+            f->next_number++;
+            f->finished++;
+            pthread_cond_broadcast(&f->cond);
+        }
+        f->writing = 0;
+        last = (f->finished == f->ranges);
+    pthread_mutex_unlock(&f->mutex);
+    if (last) range_close(f);
+    DEBUG_RET();
+}
+#endif
 
-    // command-line option handling
+
+void range_parse(struct pool_folder *f)
+{
+    struct pool_range *r;
+    pst_desc_tree *d;
+    struct prefetch pre;
+    int32_t j;
+    int i, ready, depth, stalls = 0;
+
+    DEBUG_ENT("range_parse");
+    pthread_mutex_lock(&f->mutex);
+        i = f->next_parse++;
+        // bound the ranges parsed ahead of the writer. The range it is
+        // waiting for never waits here, so this cannot deadlock.
+        while (i - f->next_number >= pool_window) {
+            stalls++;
+            pthread_cond_wait(&f->cond, &f->mutex);
+        }
+        depth = i - f->next_number + 1;
+    pthread_mutex_unlock(&f->mutex);
+    stage_count(STAGE_PARSE, 0, depth, stalls);
+#ifdef HAVE_OPEN_MEMSTREAM
+    if (mode != MODE_SEPARATE) {
+        range_render(f, i);
+        range_append(f, i);
+        DEBUG_RET();
+        return;
+    }
+#endif
+    r = &f->range[i];
+    r->items = (pst_item **)pst_malloc(sizeof(pst_item *) * r->count);
+    prefetch_init(&pre);
+    for (j=0, d=r->first; j<r->count; j++, d=d->next) {
+        prefetch_next(&pre, d, r->count - j);
+        DEBUG_SPAN("item", d->d_id);
+        r->items[j] = parse_child(d);
+        if (r->items[j] && item_is_output(r->items[j])) r->outputs++;
+        DEBUG_SPAN_END();
+    }
+    prefetch_done(&pre);
+
+    pthread_mutex_lock(&f->mutex);
+        r->parsed = 1;
+        // number every range whose predecessors have all been parsed, and
+        // hand the others that we number to the pool to be written
+        while (f->next_number < f->ranges && f->range[f->next_number].parsed) {
+            int n = f->next_number++;
+            f->range[n].base     = f->ff.item_count;
+            f->range[n].numbered = 1;
+            f->ff.item_count    += f->range[n].outputs;
+            if (n != i) pool_queue_range(TASK_WRITE, f, n);
+            pthread_cond_broadcast(&f->cond);
+        }
+        ready = r->numbered;
+    pthread_mutex_unlock(&f->mutex);
+    // otherwise whoever numbers this range will queue it for writing
+    if (ready) range_write(f, i);
+    DEBUG_RET();
+}
+
+
+void pool_run(struct pool_task *t)
+{
+    DEBUG_ENT("pool_run");
+    pool_store = t->store;
+    pstfile    = &t->store->pf;
+    if (t->kind == TASK_STORE) {
+        store_export(t->store);
+    }
+    else if (t->kind == TASK_FOLDER) {
+        process(t->item, t->d_ptr, t->dir);
+        pst_freeItem(t->item);
+        free(t->dir);
+    }
+    else if (t->kind == TASK_RANGE) {
+        range_parse(t->folder);
+    }
+    else {
+        range_write(t->folder, t->range);
+    }
+    store_release(t->store);
+    pool_store = NULL;
+    pstfile    = NULL;
+    free(t);
+    DEBUG_RET();
+}
+
+
+void *pool_worker(void *arg)
+{
+    pool_self = (int)(intptr_t)arg;
+    while (1) {
+        struct pool_task *t = pool_take();
+        if (t) {
+            pool_run(t);
+            pthread_mutex_lock(&pool_mutex);
+                pool_pending--;
+                if (!pool_pending) pthread_cond_broadcast(&pool_cond);
+            pthread_mutex_unlock(&pool_mutex);
+            continue;
+        }
+        pthread_mutex_lock(&pool_mutex);
+            while (!pool_queued && !(pool_done && !pool_pending)) {
+                pthread_cond_wait(&pool_cond, &pool_mutex);
+            }
+            int finished = (!pool_queued && pool_done && !pool_pending);
+        pthread_mutex_unlock(&pool_mutex);
+        if (finished) break;
+    }
+    return NULL;
+}
+
+
+void pool_start(int workers)
+{
+    int i;
+    pool_size    = workers;
+    pool_deques  = (struct pool_deque *)pst_malloc(sizeof(struct pool_deque) * (pool_size + 1));
+    pool_threads = (pthread_t *)pst_malloc(sizeof(pthread_t) * pool_size);
+    for (i=0; i<=pool_size; i++) {
+        pthread_mutex_init(&pool_deques[i].mutex, NULL);
+        pool_deques[i].head = NULL;
+        pool_deques[i].tail = NULL;
+    }
+    pool_self = pool_size;      // the main thread queues into the last deque
+    pool_window = pool_size * 2;
+    for (i=0; i<pool_size; i++) {
+        if (pthread_create(&pool_threads[i], NULL, pool_worker, (void *)(intptr_t)i)) {
+            DIE(("pool_start: Cannot create worker thread %d\n", i));
+        }
+    }
+}
+
+
+void pool_finish()
+{
+    // wait for all queued tasks, and everything they queue, to complete
+    int i;
+    pthread_mutex_lock(&pool_mutex);
+        pool_done = 1;
+        pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+    for (i=0; i<pool_size; i++) {
+        pthread_join(pool_threads[i], NULL);
+    }
+    for (i=0; i<=pool_size; i++) {
+        pthread_mutex_destroy(&pool_deques[i].mutex);
+    }
+    free(pool_threads);
+    free(pool_deques);
+}
+#else
+// without pthreads --threads is refused, so none of these are used
+void output_name_lock()   {}
+void output_name_unlock() {}
+void pool_queue_folder(pst_item *item, pst_desc_tree *d_ptr, char *dir) {}
+void store_loaded(struct store *s) {}
+int  pool_split(struct file_ll *ff, pst_desc_tree *d_ptr) { return 0; }
+#endif
+
+
+pst_item *parse_child(pst_desc_tree *d_ptr)
+{
+    pst_item *item;
+    DEBUG_ENT("parse_child");
+    DEBUG_INFO(("New item record\n"));
+    if (!d_ptr->desc) {
+        DEBUG_WARN(("ERROR item's desc record is NULL\n"));
+        DEBUG_RET();
+        return NULL;
+    }
+    DEBUG_INFO(("Desc Email ID %#" PRIx64 " [d_ptr->d_id = %#" PRIx64 "]\n", d_ptr->desc->i_id, d_ptr->d_id));
+    if (incremental_fd >= 0 && !d_ptr->child && incremental_unchanged(d_ptr)) {
+        // a message of an incremental export that was written by an earlier
+        // run and has not changed since. It is carried over to the new state
+        // file, while the others are only added once process_item() has
+        // written them.
+        DEBUG_INFO(("Unchanged since the last run\n"));
+        incremental_record(d_ptr);
+        DEBUG_RET();
+        return NULL;
+    }
+
+    item = pst_parse_item(pstfile, d_ptr, NULL);
+    DEBUG_INFO(("About to process item\n"));
+
+    if (!item) {
+        DEBUG_INFO(("A NULL item was seen\n"));
+    }
+    else if (item->subject.str) {
+        DEBUG_INFO(("item->subject = %s\n", item->subject.str));
+    }
+    DEBUG_RET();
+    return item;
+}
+
+
+int item_is_output(pst_item *item)
+{
+    // whether process_item() will count this item as done, which is what
+    // numbers the output files in separate mode
+    if (item->folder && item->file_as.str)
+        return 1;
+    if (item->contact && (item->type == PST_TYPE_CONTACT))
+        return (output_type_mode & OTMODE_CONTACT) ? 1 : 0;
+    if (item->email && ((item->type == PST_TYPE_NOTE) || (item->type == PST_TYPE_SCHEDULE) || (item->type == PST_TYPE_REPORT)))
+        return (output_type_mode & OTMODE_EMAIL) ? 1 : 0;
+    if (item->journal && (item->type == PST_TYPE_JOURNAL))
+        return (output_type_mode & OTMODE_JOURNAL) ? 1 : 0;
+    if (item->appointment && (item->type == PST_TYPE_APPOINTMENT))
+        return (output_type_mode & OTMODE_APPOINTMENT) ? 1 : 0;
+    return 0;
+}
+
+
+int process_item(struct file_ll *ff, pst_item *item, pst_desc_tree *d_ptr)
+{
+    // returns non-zero if the item has been handed to the thread pool,
+    // otherwise the caller still owns it
+    int32_t written = ff->item_count;
+    DEBUG_ENT("process_item");
+    if (item->folder && item->file_as.str) {
+        DEBUG_INFO(("Processing Folder \"%s\"\n", item->file_as.str));
+        if (output_mode != OUTPUT_QUIET) {
+            pst_debug_lock();
+                printf("Processing Folder \"%s\"\n", item->file_as.str);
+                fflush(stdout);
+            pst_debug_unlock();
+        }
+        ff->item_count++;
+        if (d_ptr->child && (deleted_mode == DMODE_INCLUDE || strcasecmp(item->file_as.str, "Deleted Items"))) {
+            //if this is a non-empty folder other than deleted items, we want to recurse into it
+            if (use_threads) {
+                // hand the folder to the thread pool, which now owns the item
+                pool_queue_folder(item, d_ptr->child, ff->dir);
+                DEBUG_RET();
+                return 1;
+            }
+            pid_t parent = getpid();
+            pid_t child = try_fork(item->file_as.str);
+            if (child == 0) {
+                // we are the child process, or the original parent if no children were available
+                pid_t me = getpid();
+                process(item, d_ptr->child, ff->dir);
+#ifdef HAVE_FORK
+#ifdef HAVE_SEMAPHORE_H
+                if (me != parent) {
+                    // we really were a child, forked for the sole purpose of processing this folder
+                    // free my child count slot before really exiting, since
+                    // all I am doing here is waiting for my children to exit
+                    sem_post(global_children);
+                    grim_reaper(1); // wait for all my child processes to exit
+                    stats_exit();
+                    progress_publish(pstfile, 0);
+                    exit(0);        // really exit
+                }
+#endif
+#endif
+            }
+        }
+
+    } else if (json_mode && item_is_output(item)) {
+        DEBUG_INFO(("Processing Item as json\n"));
+        ff->item_count++;
+        write_json(ff->output[PST_TYPE_NOTE], item, d_ptr);
+
+    } else if (item->contact && (item->type == PST_TYPE_CONTACT)) {
+        DEBUG_INFO(("Processing Contact\n"));
+        if (!(output_type_mode & OTMODE_CONTACT)) {
+            ff->skip_count++;
+            DEBUG_INFO(("skipping contact: not in output type list\n"));
+        }
+        else {
+            ff->item_count++;
+            if (mode == MODE_SEPARATE) mk_separate_file(ff, PST_TYPE_CONTACT, (mode_EX) ? ".vcf" : "", 1);
+            if (contact_mode == CMODE_VCARD) {
+                pst_convert_utf8_null(item, &item->comment);
+                write_vcard(ff->output[PST_TYPE_CONTACT], item, item->contact, item->comment.str);
+            }
+            else {
+                pst_convert_utf8(item, &item->contact->fullname);
+                pst_convert_utf8(item, &item->contact->address1);
+                fprintf(ff->output[PST_TYPE_CONTACT], "%s <%s>\n", item->contact->fullname.str, item->contact->address1.str);
+            }
+            if (mode == MODE_SEPARATE) close_separate_file(ff);
+        }
+
+    } else if (item->email && ((item->type == PST_TYPE_NOTE) || (item->type == PST_TYPE_SCHEDULE) || (item->type == PST_TYPE_REPORT))) {
+        DEBUG_INFO(("Processing Email\n"));
+        if (!(output_type_mode & OTMODE_EMAIL)) {
+            ff->skip_count++;
+            DEBUG_INFO(("skipping email: not in output type list\n"));
+        }
+        else {
+            char *extra_mime_headers = NULL;
+            ff->item_count++;
+            if (mode == MODE_SEPARATE) {
+                // process this single email message, possibly forking
+                pid_t parent = getpid();
+                // with a journal the message must be written before the
+                // next checkpoint, so it is not left to a child process
+                pid_t child = (use_threads || journal_fd >= 0) ? 0 : try_fork(item->file_as.str);
+                if (child == 0) {
+                    // we are the child process, or the original parent if no children were available
+                    pid_t me = getpid();
+                    write_separate_email(ff, item);
+#ifdef HAVE_FORK
+#ifdef HAVE_SEMAPHORE_H
+                    if (me != parent) {
+                        // we really were a child, forked for the sole purpose of processing this message
+                        // free my child count slot before really exiting, since
+                        // all I am doing here is waiting for my children to exit
+                        sem_post(global_children);
+                        grim_reaper(1); // wait for all my child processes to exit - there should not be any
+                        stats_exit();
+                        progress_publish(pstfile, 0);
+                        exit(0);        // really exit
+                    }
+#endif
+#endif
+                }
+            }
+            else {
+                // process this single email message, cannot fork since not separate mode
+                write_normal_email(ff->output[PST_TYPE_NOTE], ff->name[PST_TYPE_NOTE], item, mode, mode_MH, pstfile, save_rtf_body, 0, &extra_mime_headers);
+            }
+        }
+
+    } else if (item->journal && (item->type == PST_TYPE_JOURNAL)) {
+        DEBUG_INFO(("Processing Journal Entry\n"));
+        if (!(output_type_mode & OTMODE_JOURNAL)) {
+            ff->skip_count++;
+            DEBUG_INFO(("skipping journal entry: not in output type list\n"));
+        }
+        else {
+            ff->item_count++;
+            if (mode == MODE_SEPARATE) mk_separate_file(ff, PST_TYPE_JOURNAL, (mode_EX) ? ".ics" : "", 1);
+            write_journal(ff->output[PST_TYPE_JOURNAL], item);
+            fprintf(ff->output[PST_TYPE_JOURNAL], "\n");
+            if (mode == MODE_SEPARATE) close_separate_file(ff);
+        }
+
+    } else if (item->appointment && (item->type == PST_TYPE_APPOINTMENT)) {
+        DEBUG_INFO(("Processing Appointment Entry\n"));
+        if (!(output_type_mode & OTMODE_APPOINTMENT)) {
+            ff->skip_count++;
+            DEBUG_INFO(("skipping appointment: not in output type list\n"));
+        }
+        else {
+            ff->item_count++;
+            if (mode == MODE_SEPARATE) mk_separate_file(ff, PST_TYPE_APPOINTMENT, (mode_EX) ? ".ics" : "", 1);
+            write_schedule_part_data(ff->output[PST_TYPE_APPOINTMENT], item, NULL, NULL);
+            fprintf(ff->output[PST_TYPE_APPOINTMENT], "\n");
+            if (mode == MODE_SEPARATE) close_separate_file(ff);
+        }
+
+    } else if (item->message_store) {
+        // there should only be one message_store, and we have already done it
+        ff->skip_count++;
+        DEBUG_WARN(("item with message store content, type %i %s, skipping it\n", item->type, item->ascii_type));
+
+    } else {
+        ff->skip_count++;
+        DEBUG_WARN(("Unknown item type %i (%s) name (%s)\n",
+                    item->type, item->ascii_type, item->file_as.str));
+    }
+    // a message that was written, rather than skipped, is now part of the
+    // incremental export
+    if (incremental_fd >= 0 && !item->folder && ff->item_count != written) incremental_record(d_ptr);
+    DEBUG_RET();
+    return 0;
+}
+
+
+void process(pst_item *outeritem, pst_desc_tree *d_ptr, char *parent_dir)
+{
+    struct file_ll ff;
+    struct prefetch pre;
+    pst_item *item = NULL;
+    struct journal_folder *j = NULL;
+    uint64_t id = (d_ptr && d_ptr->parent) ? d_ptr->parent->d_id : 0;
+    int32_t done;
+
+    DEBUG_ENT("process");
+    if (journal_fd >= 0) j = journal_resume(parent_dir, id);
+    if (j) {
+        journal_enter_dir(&ff, outeritem, j);
+    }
+    else {
+        create_enter_dir(&ff, outeritem, parent_dir);
+        if (journal_fd >= 0) journal_folder(&ff, parent_dir, id);
+    }
+
+    if (json_mode && d_ptr && d_ptr->parent) json_enter_folder(d_ptr->parent, ff.dname);
+
+    // a journal records the progress through a folder in tree order, which
+    // the ranges of a split folder would not keep to
+    if (use_threads && journal_fd < 0 && pool_split(&ff, d_ptr)) {
+        // the ranges of this folder now own ff, the last one closes it
+        DEBUG_RET();
+        return;
+    }
+
+    prefetch_init(&pre);
+    for (done = 0; d_ptr; d_ptr = d_ptr->next, done++) {
+        if (j && (j->complete || done < j->done)) {
+            journal_skip(&ff, d_ptr, (!j->complete && done+1 == j->done) ? j->last : 0);
+            continue;
+        }
+        prefetch_next(&pre, d_ptr, prefetch_depth);
+        DEBUG_SPAN("item", d_ptr->d_id);
+        item = parse_child(d_ptr);
+        if (!item) {
+            ff.skip_count++;
+        }
+        else if (!process_item(&ff, item, d_ptr)) pst_freeItem(item);
+        DEBUG_SPAN_END();
+        if (journal_fd >= 0 && !((done+1) % checkpoint_interval)) {
+            journal_checkpoint(&ff, parent_dir, id, done+1, d_ptr->d_id);
+        }
+    }
+    prefetch_done(&pre);
+    if (j && j->complete) {
+        // nothing was written, not even the counts
+        free(ff.dname);
+        free(ff.dir);
+    }
+    else {
+        if (journal_fd >= 0) journal_finish(&ff, parent_dir, id);
+        close_enter_dir(&ff);
+    }
+    DEBUG_RET();
+}
+
+
+
+void add_store(const char *name, const char *cwd)
+{
+    struct stat st;
+    struct store *s;
+    stores = (struct store *)pst_realloc(stores, sizeof(struct store) * (store_count + 1));
+    s = &stores[store_count++];
+    memset(s, 0, sizeof(*s));
+    if (name[0] == '/') {
+        s->fname = strdup(name);
+    }
+    else {
+        s->fname = pst_malloc(strlen(cwd) + strlen(name) + 2);
+        sprintf(s->fname, "%s/%s", cwd, name);
+    }
+    s->dir = strdup("");
+    if (!stat(s->fname, &st)) s->size = st.st_size;
+}
+
+
+void read_manifest(const char *name, const char *cwd)
+{
+    // one pst file name per line, blank lines and lines starting with # are ignored
+    char line[PATH_MAX+2];
+    FILE *f = (strcmp(name, "-")) ? fopen(name, "r") : stdin;
+    if (!f) {
+        DIE(("read_manifest: Could not open manifest \"%s\": %s\n", name, strerror(errno)));
+    }
+    while (fgets(line, sizeof(line), f)) {
+        size_t n = strlen(line);
+        while (n && (line[n-1] == '\n' || line[n-1] == '\r')) line[--n] = '\0';
+        if (!n || line[0] == '#') continue;
+        add_store(line, cwd);
+    }
+    if (f != stdin) fclose(f);
+}
+
+
+int compare_store_size(const void *a, const void *b)
+{
+    const struct store *x = (const struct store *)a;
+    const struct store *y = (const struct store *)b;
+    if (x->size != y->size) return (x->size > y->size) ? -1 : 1;
+    return strcmp(x->fname, y->fname);
+}
+
+
+void store_dirs()
+{
+    // with several pst files, each is written into a subdirectory of the
+    // output directory named after the file
+    int i, j, x;
+    if (store_count < 2) return;
+    DEBUG_ENT("store_dirs");
+    for (i=0; i<store_count; i++) {
+        char *name = strrchr(stores[i].fname, '/');
+        char *dot;
+        name = strdup((name) ? name+1 : stores[i].fname);
+        dot  = strrchr(name, '.');
+        if (dot && dot != name) *dot = '\0';
+        check_filename(name);
+        free(stores[i].dir);
+        stores[i].dir = pst_malloc(strlen(name)+12);
+        strcpy(stores[i].dir, name);
+        for (x=1, j=0; j<i; j++) {
+            if (!strcmp(stores[i].dir, stores[j].dir)) {
+                // two pst files with the same name, bump the number and check them all again
+                sprintf(stores[i].dir, "%s-%d", name, x++);
+                j = -1;
+            }
+        }
+        free(name);
+        if (output_mkdir(stores[i].dir) && errno != EEXIST) {
+            x = errno;
+            DIE(("store_dirs: Cannot create directory %s: %s\n", stores[i].dir, strerror(x)));
+        }
+    }
+    DEBUG_RET();
+}
+
+
+int store_open(struct store *s)
+{
+    char *temp;
+    DEBUG_ENT("store_open");
+    if (output_mode != OUTPUT_QUIET) {
+        pst_debug_lock();
+            if (store_count > 1) printf("Opening PST file %s and indexes...\n", s->fname);
+            else                 printf("Opening PST file and indexes...\n");
+            fflush(stdout);
+        pst_debug_unlock();
+    }
+    // with a single pst file any failure is fatal, otherwise carry on
+    // with the other files
+    if (pst_open(&s->pf, s->fname, default_charset)) {
+        if (store_count == 1) DIE(("Error opening File\n"));
+        WARN(("Error opening File %s\n", s->fname));
+        DEBUG_RET();
+        return -1;
+    }
+    if (read_profile >= 0) pst_profile_reads(&s->pf);
+    if (read_limit) pst_set_read_limit(&s->pf, read_limit);
+    if (item_filter) pst_set_filter(&s->pf, item_filter);
+    if (pst_load_index(&s->pf)) {
+        if (store_count == 1) DIE(("Index Error\n"));
+        WARN(("Index Error in %s\n", s->fname));
+        store_close(s);
+        DEBUG_RET();
+        return -1;
+    }
+
+    pst_load_extended_attributes(&s->pf);
+    s->memory = pst_index_memory(&s->pf);
+    progress_open(s);
+
+    s->root = pst_parse_item(&s->pf, s->pf.d_head, NULL);  // first record is main record
+    if (!s->root || !s->root->message_store) {
+        store_close(s);
+        if (store_count == 1) {
+            DEBUG_RET();
+            DIE(("Could not get root record\n"));
+        }
+        WARN(("Could not get root record of %s\n", s->fname));
+        DEBUG_RET();
+        return -1;
+    }
+
+    // default the file_as to the same as the main filename if it doesn't exist
+    if (!s->root->file_as.str) {
+        if (!(temp = strrchr(s->fname, '/')))
+            if (!(temp = strrchr(s->fname, '\\')))
+                temp = s->fname;
+            else
+                temp++; // get past the "\\"
+        else
+            temp++; // get past the "/"
+        s->root->file_as.str = (char*)pst_malloc(strlen(temp)+1);
+        strcpy(s->root->file_as.str, temp);
+        s->root->file_as.is_utf8 = 1;
+        DEBUG_INFO(("file_as was blank, so am using %s\n", s->root->file_as.str));
+    }
+    DEBUG_INFO(("Root Folder Name: %s\n", s->root->file_as.str));
+
+    s->top = pst_getTopOfFolders(&s->pf, s->root);
+    if (!s->top) {
+        store_close(s);
+        if (store_count == 1) {
+            DEBUG_RET();
+            DIE(("Top of folders record not found. Cannot continue\n"));
+        }
+        WARN(("Top of folders record not found in %s\n", s->fname));
+        DEBUG_RET();
+        return -1;
+    }
+    DEBUG_RET();
+    return 0;
+}
+
+
+void store_close(struct store *s)
+{
+    if (s->root) pst_freeItem(s->root);
+    s->root = NULL;
+    s->top  = NULL;
+    if (s->pf.fp) {
+        stats_add(&s->pf);
+        progress_publish(&s->pf, 0);
+        if (read_profile >= 0) {
+            pst_debug_lock();
+                pst_print_reads(stderr, &s->pf, read_profile);
+            pst_debug_unlock();
+        }
+        pst_close(&s->pf);
+    }
+    memset(&s->pf, 0, sizeof(s->pf));
+    s->progress = 0;
+}
+
+
+void store_export(struct store *s)
+{
+    int rc;
+    DEBUG_ENT("store_export");
+    pstfile = &s->pf;
+    rc = store_open(s);
+    s->failed = (rc != 0);
+    store_loaded(s);
+    if (!rc) {
+        process(s->root, s->top->child, s->dir);    // do the children of TOPF
+        pst_freeItem(s->root);
+        s->root = NULL;
+    }
+    DEBUG_RET();
+}
+
+
+int main(int argc, char* const* argv) {
+    char *manifest = NULL;
+    char *cwd    = NULL;
+    char *d_log  = NULL;
+    char *d_trace = NULL;
+    int c,x;
+    int failed = 0;                  // some pst file could not be converted
+    char *temp = NULL;               //temporary char pointer
+    prog_name = argv[0];
+
+    if (regcomp(&meta_charset_pattern, "<meta[^>]*content=\"[^>]*charset=([^>\";]*)[\";]", REG_ICASE | REG_EXTENDED)) {
+        printf("cannot compile regex pattern to find content charset in html bodies\n");
+        exit(3);
+    }
+
+    // command-line option handling
+#ifdef HAVE_GETOPT_LONG
+    static struct option long_options[] = {
+        {"threads",  no_argument,       NULL, OPT_THREADS},
+        {"prefetch", required_argument, NULL, OPT_PREFETCH},
+        {"manifest", required_argument, NULL, OPT_MANIFEST},
+        {"memory",   required_argument, NULL, OPT_MEMORY},
+        {"buffer",   required_argument, NULL, OPT_BUFFER},
+        {"drop-cache", no_argument,     NULL, OPT_DROP_CACHE},
+        {"gzip",     optional_argument, NULL, OPT_GZIP},
+        {"gzip-separate", no_argument,  NULL, OPT_GZIP_SEPARATE},
+        {"tar",      required_argument, NULL, OPT_TAR},
+        {"dedup",    optional_argument, NULL, OPT_DEDUP},
+        {"checkpoint", optional_argument, NULL, OPT_CHECKPOINT},
+        {"resume",   no_argument,       NULL, OPT_RESUME},
+        {"incremental", required_argument, NULL, OPT_INCREMENTAL},
+        {"json",     optional_argument, NULL, OPT_JSON},
+        {"stats",    optional_argument, NULL, OPT_STATS},
+        {"trace",    required_argument, NULL, OPT_TRACE},
+        {"read-profile", optional_argument, NULL, OPT_READ_PROFILE},
+        {"progress", optional_argument, NULL, OPT_PROGRESS},
+        {"status",   required_argument, NULL, OPT_STATUS},
+        {"limit-rate",  required_argument, NULL, OPT_LIMIT_RATE},
+        {"limit-reads", required_argument, NULL, OPT_LIMIT_READS},
+        {"filter",   required_argument, NULL, OPT_FILTER},
+        {NULL,      0,           NULL, 0}
+    };
+    while ((c = getopt_long(argc, argv, "a:bC:c:Dd:emhj:kMo:qrSt:uVwL:8", long_options, NULL))!= -1) {
+#else
     while ((c = getopt(argc, argv, "a:bC:c:Dd:emhj:kMo:qrSt:uVwL:8"))!= -1) {
+#endif
         switch (c) {
         case 'a':
             if (optarg) {
@@ -564,31 +1974,217 @@ int main(int argc, char* const* argv) {
         case '8':
             prefer_utf8 = 1;
             break;
-        default:
-            usage();
+        case OPT_THREADS:
+#ifdef HAVE_PTHREAD_H
+            use_threads = 1;
+#else
+            printf("This readpst was built without thread support, --threads is not available\n");
             exit(1);
-            break;
-        }
-    }
-
-    if (argc > optind) {
-        fname = argv[optind];
-    } else {
-        usage();
-        exit(2);
-    }
-
-#ifdef _SC_NPROCESSORS_ONLN
-    number_processors =  sysconf(_SC_NPROCESSORS_ONLN);
 #endif
-    max_children    = (max_child_specified) ? max_children : number_processors * 4;
-    active_children = 0;
+            break;
+        case OPT_PREFETCH:
+            prefetch_depth = atoi(optarg);
+            if (prefetch_depth < 0) prefetch_depth = 0;
+            break;
+        case OPT_MANIFEST:
+            manifest = optarg;
+            break;
+        case OPT_MEMORY:
+            memory_budget = (size_t)atol(optarg) * 1024 * 1024;
+            break;
+        case OPT_BUFFER:
+            output_buffer_size = (size_t)atol(optarg) * 1024 * 1024;
+            if (!output_buffer_size) output_buffer_size = 64*1024;
+            break;
+        case OPT_DROP_CACHE:
+            output_drop_cache = 1;
+            break;
+        case OPT_GZIP:
+            gzip_level = (optarg) ? atoi(optarg) : Z_DEFAULT_COMPRESSION;
+            if (gzip_level < 1 || gzip_level > 9) gzip_level = Z_DEFAULT_COMPRESSION;
+            break;
+        case OPT_GZIP_SEPARATE:
+            gzip_separate = 1;
+            break;
+        case OPT_TAR:
+            tar_name = optarg;
+            break;
+        case OPT_DEDUP:
+            if      (!optarg || !strcmp(optarg, "hard")) dedup_mode = DEDUP_HARDLINK;
+            else if (!strcmp(optarg, "sym"))             dedup_mode = DEDUP_SYMLINK;
+            else if (!strcmp(optarg, "manifest"))        dedup_mode = DEDUP_MANIFEST;
+            else {
+                usage();
+                exit(1);
+            }
+            break;
+        case OPT_CHECKPOINT:
+            checkpoint_interval = (optarg) ? atoi(optarg) : 1000;
+            if (checkpoint_interval < 1) checkpoint_interval = 1000;
+            break;
+        case OPT_RESUME:
+            resume = 1;
+            if (!checkpoint_interval) checkpoint_interval = 1000;
+            break;
+        case OPT_INCREMENTAL:
+            incremental_name = optarg;
+            break;
+        case OPT_JSON:
+            if      (!optarg)                 json_mode = JSON_META;
+            else if (!strcmp(optarg, "body")) json_mode = JSON_BODY;
+            else {
+                usage();
+                exit(1);
+            }
+            break;
+        case OPT_STATS:
+            if      (!optarg)                 stats_mode = STATS_TEXT;
+            else if (!strcmp(optarg, "json")) stats_mode = STATS_JSON;
+            else {
+                usage();
+                exit(1);
+            }
+            break;
+        case OPT_TRACE:
+            d_trace = optarg;
+            break;
+        case OPT_READ_PROFILE:
+            read_profile = (optarg) ? atoi(optarg) : 20;
+            if (read_profile < 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case OPT_PROGRESS:
+            progress_interval = (optarg) ? atoi(optarg) : 5;
+            progress_stderr   = 1;
+            if (progress_interval <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case OPT_STATUS:
+            status_name = optarg;
+            break;
+        case OPT_LIMIT_RATE:
+            limit_rate = atof(optarg);
+            if (limit_rate <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case OPT_LIMIT_READS:
+            limit_reads = atof(optarg);
+            if (limit_reads <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case OPT_FILTER:
+            if (item_filter) pst_free_filter(item_filter);
+            if (pst_parse_filter(&item_filter_local, optarg)) {
+                fprintf(stderr, "readpst: cannot understand the filter %s\n", optarg);
+                usage();
+                exit(1);
+            }
+            item_filter = &item_filter_local;
+            break;
+        default:
+            usage();
+            exit(1);
+            break;
+        }
+    }
+
+    cwd = pst_malloc(PATH_MAX+1);
+    if (!getcwd(cwd, PATH_MAX+1)) {
+        x = errno;
+        DIE(("Cannot get the current directory: %s\n", strerror(x)));
+    }
+    for (x=optind; x<argc; x++) add_store(argv[x], cwd);
+    if (manifest) read_manifest(manifest, cwd);
+    if (incremental_name && incremental_name[0] != '/') {
+        // the state file is named relative to where we started
+        char *name = pst_malloc(strlen(cwd) + strlen(incremental_name) + 2);
+        sprintf(name, "%s/%s", cwd, incremental_name);
+        incremental_name = name;
+    }
+    if (status_name) {
+        if (status_name[0] != '/') {
+            char *name = pst_malloc(strlen(cwd) + strlen(status_name) + 2);
+            sprintf(name, "%s/%s", cwd, status_name);
+            status_name = name;
+        }
+        if (!progress_interval) progress_interval = 5;
+    }
+    free(cwd);
+    if (!store_count) {
+        usage();
+        exit(2);
+    }
+#ifndef HAVE_FOPENCOOKIE
+    if (gzip_level || gzip_separate) {
+        fprintf(stderr, "readpst: --gzip is not supported on this platform, writing uncompressed output\n");
+        gzip_level = gzip_separate = 0;
+    }
+#endif
+    if (json_mode && (mode == MODE_SEPARATE || mode == MODE_KMAIL)) {
+        // one file of json lines for each folder
+        fprintf(stderr, "readpst: --json can only be used with the default output and -r\n");
+        exit(2);
+    }
+    if (tar_name && checkpoint_interval) {
+        // an archive cannot be cut back to a checkpoint
+        fprintf(stderr, "readpst: --checkpoint and --resume cannot be used with --tar\n");
+        exit(2);
+    }
+    if (tar_name) {
+#ifdef HAVE_FOPENCOOKIE
+        // the archive is compressed as a whole rather than file by file
+        if (gzip_level || gzip_separate) tar_level = (gzip_level) ? gzip_level : Z_DEFAULT_COMPRESSION;
+        gzip_level = gzip_separate = 0;
+        if (!strcmp(tar_name, "-")) {
+            tar_fd = STDOUT_FILENO;
+            output_mode = OUTPUT_QUIET;     // stdout carries the archive
+        }
+        else if ((tar_fd = open(tar_name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+            x = errno;
+            DIE(("Cannot create tar archive %s: %s\n", tar_name, strerror(x)));
+        }
+        tar_mtime = time(NULL);
+#ifdef HAVE_PTHREAD_H
+        // every entry goes to the one archive, so the -j jobs must be threads
+        use_threads = 1;
+#else
+        max_children = 0;
+        max_child_specified = 1;
+#endif
+#else
+        fprintf(stderr, "readpst: --tar is not supported on this platform\n");
+        exit(2);
+#endif
+    }
+
+#ifdef _SC_NPROCESSORS_ONLN
+    number_processors =  sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (use_threads) {
+        // one thread per cpu unless specified, -j 0 runs everything in this thread
+        max_children = (max_child_specified) ? max_children : number_processors;
+        if (!max_children) use_threads = 0;
+    }
+    else {
+        max_children = (max_child_specified) ? max_children : number_processors * 4;
+    }
+    active_children = 0;
     child_processes = (pid_t *)pst_malloc(sizeof(pid_t) * max_children);
     memset(child_processes, 0, sizeof(pid_t) * max_children);
 
 #if defined(HAVE_SEMAPHORE_H) && defined(HAVE_SYS_IPC_H) && defined(HAVE_SYS_SHM_H)
     if (max_children) {
-        shared_memory_id = shmget(IPC_PRIVATE, sizeof(sem_t)*2, 0777);
+        // two semaphores, then the counters of exited children for --stats,
+        // then the progress of all the processes, then their read limit
+        shared_memory_id = shmget(IPC_PRIVATE, sizeof(sem_t)*2 + sizeof(pst_stats) + sizeof(struct progress) + sizeof(pst_read_limit), 0777);
         if (shared_memory_id >= 0) {
             global_children = (sem_t *)shmat(shared_memory_id, NULL, 0);
             if (global_children == (sem_t *)-1) global_children = NULL;
@@ -596,12 +2192,22 @@ int main(int argc, char* const* argv) {
                 output_mutex = &(global_children[1]);
                 sem_init(global_children, 1, max_children);
                 sem_init(output_mutex, 1, 1);
+                stats_shared = (pst_stats *)&(global_children[2]);
+                memset(stats_shared, 0, sizeof(pst_stats));
+                progress_shared = (struct progress *)&(stats_shared[1]);
+                memset(progress_shared, 0, sizeof(struct progress));
+                if (limit_rate || limit_reads) read_limit = (pst_read_limit *)&(progress_shared[1]);
             }
             shmctl(shared_memory_id, IPC_RMID, NULL);
         }
     }
 #endif
 
+    if (limit_rate || limit_reads) {
+        if (!read_limit) read_limit = &read_limit_local;
+        pst_init_read_limit(read_limit, (uint64_t)(limit_rate * 1024 * 1024), (uint64_t)limit_reads);
+    }
+
     #ifdef DEBUG_ALL
         // force a log file
         if (!d_log) d_log = "readpst.log";
@@ -611,59 +2217,49 @@ int main(int argc, char* const* argv) {
     #else
         DEBUG_INIT(d_log, NULL);
     #endif
+    if (d_trace) DEBUG_TRACE(d_trace);
     DEBUG_ENT("main");
 
-    if (output_mode != OUTPUT_QUIET) printf("Opening PST file and indexes...\n");
-    RET_DERROR(pst_open(&pstfile, fname, default_charset), 1, ("Error opening File\n"));
-    RET_DERROR(pst_load_index(&pstfile), 2, ("Index Error\n"));
-
-    pst_load_extended_attributes(&pstfile);
-
     if (chdir(output_dir)) {
         x = errno;
-        pst_close(&pstfile);
         DEBUG_RET();
         DIE(("Cannot change to output dir %s: %s\n", output_dir, strerror(x)));
     }
-
-    d_ptr = pstfile.d_head; // first record is main record
-    item  = pst_parse_item(&pstfile, d_ptr, NULL);
-    if (!item || !item->message_store) {
-        if (item) pst_freeItem(item);
-        pst_close(&pstfile);
-        DEBUG_RET();
-        DIE(("Could not get root record\n"));
-    }
-
-    // default the file_as to the same as the main filename if it doesn't exist
-    if (!item->file_as.str) {
-        if (!(temp = strrchr(fname, '/')))
-            if (!(temp = strrchr(fname, '\\')))
-                temp = fname;
-            else
-                temp++; // get past the "\\"
-        else
-            temp++; // get past the "/"
-        item->file_as.str = (char*)pst_malloc(strlen(temp)+1);
-        strcpy(item->file_as.str, temp);
-        item->file_as.is_utf8 = 1;
-        DEBUG_INFO(("file_as was blank, so am using %s\n", item->file_as.str));
+    store_dirs();
+    qsort(stores, store_count, sizeof(struct store), compare_store_size);
+    progress_start();
+    if (checkpoint_interval) journal_open();
+    if (incremental_name) incremental_open();
+
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) {
+        pool_start(max_children);
+        for (x=0; x<store_count; x++) pool_queue_store(&stores[x]);
+        pool_finish(); // wait for all worker threads
+        stage_report();
     }
-    DEBUG_INFO(("Root Folder Name: %s\n", item->file_as.str));
-
-    d_ptr = pst_getTopOfFolders(&pstfile, item);
-    if (!d_ptr) {
-        pst_freeItem(item);
-        pst_close(&pstfile);
-        DEBUG_RET();
-        DIE(("Top of folders record not found. Cannot continue\n"));
+    else
+#endif
+    {
+        for (x=0; x<store_count; x++) {
+            store_export(&stores[x]);
+            store_close(&stores[x]);
+        }
     }
-
-    process(item, d_ptr->child);    // do the children of TOPF
     grim_reaper(1); // wait for all child processes
-
-    pst_freeItem(item);
-    pst_close(&pstfile);
+    progress_publish(NULL, 1);
+    stats_report();
+    if (dedup_mode) dedup_close();
+    if (journal_fd >= 0) close(journal_fd);
+    if (tar_fd >= 0) output_tar_close();
+
+    for (x=0; x<store_count; x++) {
+        if (stores[x].failed) failed = 1;
+        free(stores[x].fname);
+        free(stores[x].dir);
+    }
+    if (incremental_name) incremental_close(failed);
+    free(stores);
     DEBUG_RET();
     DEBUG_CLOSE();
 
@@ -677,26 +2273,32 @@ int main(int argc, char* const* argv) {
     free(child_processes);
 
     regfree(&meta_charset_pattern);
-    return 0;
+    return failed;
 }
 
 
-void write_email_body(FILE *f, char *body) {
-    char *n = body;
+void write_email_body(FILE *f, char *body, size_t len) {
+    // Write len bytes of body, quoting ">*From " lines (mboxrd) in the
+    // modes that produce mbox files. Unquoted runs of lines are written
+    // with a single pst_fwrite() rather than one call per line.
+    char *end = body + len;
     DEBUG_ENT("write_email_body");
     if (mode != MODE_SEPARATE) {
-        while (n) {
-            char *p = body;
-            while (*p == '>') p++;
-            if (strncmp(p, "From ", 5) == 0) fprintf(f, ">");
-            if ((n = strchr(body, '\n'))) {
-                n++;
-                pst_fwrite(body, n-body, 1, f); //write just a line
-                body = n;
+        char *line = body;
+        while (1) {
+            char *p = line;
+            while ((p < end) && (*p == '>')) p++;
+            if ((end - p >= 5) && (memcmp(p, "From ", 5) == 0)) {
+                if (line > body) pst_fwrite(body, line-body, 1, f);
+                pst_fwrite(">", 1, 1, f);
+                body = line;
             }
+            char *n = memchr(line, '\n', end-line);
+            if (!n) break;
+            line = n+1;
         }
     }
-    pst_fwrite(body, strlen(body), 1, f);
+    if (end > body) pst_fwrite(body, end-body, 1, f);
     DEBUG_RET();
 }
 
@@ -716,10 +2318,36 @@ void removeCR (char *c) {
 }
 
 
+size_t prepare_body(char *body, int *base64) {
+    // Single pass over a body that does the work of removeCR(), strlen()
+    // and test_base64(): strips \r in place, returns the new length and
+    // sets *base64 if any remaining byte forces base64 encoding.
+    uint8_t *a, *b;
+    int b64 = 0;
+    DEBUG_ENT("prepare_body");
+    a = b = (uint8_t *)body;
+    while (*a) {
+        if (*a < 32) {
+            if (*a == '\r') {
+                a++;
+                continue;
+            }
+            if ((*a != 9) && (*a != 10)) b64 = 1;
+        }
+        *b++ = *a++;
+    }
+    *b = '\0';
+    if (b64) DEBUG_INFO(("found base64 byte in body\n"));
+    *base64 = b64;
+    DEBUG_RET();
+    return (size_t)(b - (uint8_t *)body);
+}
+
+
 void usage() {
     DEBUG_ENT("usage");
     version();
-    printf("Usage: %s [OPTIONS] {PST FILENAME}\n", prog_name);
+    printf("Usage: %s [OPTIONS] {PST FILENAME}...\n", prog_name);
     printf("OPTIONS:\n");
     printf("\t-V\t- Version. Display program version\n");
     printf("\t-C charset\t- character set for items with an unspecified character set\n");
@@ -743,8 +2371,31 @@ void usage() {
     printf("\t-u\t- Thunderbird mode. Write two extra .size and .type files\n");
     printf("\t-w\t- Overwrite any output mbox files\n");
     printf("\t-8\t- Output bodies in UTF-8, rather than original encoding, if UTF-8 version is available\n");
+    printf("\t--threads\t- Run the -j parallel jobs as threads in this process rather than as child processes\n");
+    printf("\t--prefetch <n>\t- Ask for the blocks of the next n items to be read ahead of parsing, 0 for none. Default 32\n");
+    printf("\t--manifest <file>\t- Also convert the pst files named one per line in file, - for stdin\n");
+    printf("\t--memory <MB>\t- With --threads, only open more pst files while their indexes use less than this\n");
+    printf("\t--buffer <MB>\t- Size of the buffer for each output file. Default 4\n");
+    printf("\t--drop-cache\t- Drop written output from the page cache\n");
+    printf("\t--gzip[=level]\t- Write the mbox files gzip compressed, as name.gz\n");
+    printf("\t--gzip-separate\t- Also gzip the message files written by -S -M -e\n");
+    printf("\t--dedup[=hard|sym|manifest]\t- Write each distinct attachment once into .attachments, and link to it\n");
+    printf("\t--tar <file>\t- Write everything into one tar archive, - for stdout. With --gzip the archive is compressed\n");
+    printf("\t--checkpoint[=n]\t- Keep a journal in the output directory, synced every n items of a folder (default 1000)\n");
+    printf("\t--resume\t- Carry on from the journal of an earlier run that was interrupted\n");
+    printf("\t--incremental <file>\t- Only write the items that are new or changed since the run that left file\n");
+    printf("\t--json[=body]\t- Write the metadata of each item as a line of JSON, with body also the text body\n");
+    printf("\t--stats[=json]\t- Write counters of the reads, decryption, decompression and parsing done to stderr on exit\n");
+    printf("\t--trace <file>\t- Write a timeline of the functions called and items exported in chrome trace format\n");
+    printf("\t--read-profile[=n]\t- Write the bytes read from each pst file, and the n ranges read most often, to stderr. Default 20\n");
+    printf("\t--progress[=seconds]\t- Write the items and bytes done, the rate and the time left as a line of JSON to stderr. Default every 5\n");
+    printf("\t--status <file>\t- Keep the latest progress line in file\n");
+    printf("\t--limit-rate <MB/s>\t- Read the pst files no faster than this, across all jobs\n");
+    printf("\t--limit-reads <n>\t- Make no more than n reads a second from the pst files, across all jobs\n");
+    printf("\t--filter <expr>\t- Only write the messages matching expr, such as after=2019-01-01,before=2019-04-01,from=smith\n");
     printf("\n");
     printf("Only one of -M -S -e -k -m -r should be specified\n");
+    printf("With more than one pst file, each is written to a subdirectory of the output directory\n");
     DEBUG_RET();
 }
 
@@ -763,306 +2414,2369 @@ void version() {
 }
 
 
-void mk_kmail_dir(char *fname) {
-    //make a directory based on OUTPUT_KMAIL_DIR_TEMPLATE
-    //change to that directory
-    char *dir, *index;
-    int x;
-    DEBUG_ENT("mk_kmail_dir");
-    dir = pst_malloc(strlen(fname)+strlen(OUTPUT_KMAIL_DIR_TEMPLATE)+1);
-    sprintf(dir, OUTPUT_KMAIL_DIR_TEMPLATE, fname);
-    check_filename(dir);
-    if (D_MKDIR(dir)) {
-        if (errno != EEXIST) {  // not an error because it exists
-            x = errno;
-            DIE(("mk_kmail_dir: Cannot create directory %s: %s\n", dir, strerror(x)));
+char *mk_path(const char *dir, const char *name) {
+    // join an output directory (relative to output_dir) and a name
+    char *path;
+    if (!dir || !*dir) {
+        path = pst_malloc(strlen(name)+1);
+        strcpy(path, name);
+        return path;
+    }
+    path = pst_malloc(strlen(dir)+strlen(name)+2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+
+#define OUTPUT_GZIP  1           // compress the file with --gzip
+#define OUTPUT_KEEP  2           // keep the file even if nothing is written to it
+
+// Output files. The writers format into a FILE as usual, but with
+// fopencookie() the FILE hands its output to us, and we collect it in a
+// buffer of up to output_buffer_size bytes. Writes too big for the
+// buffer go out together with whatever is buffered in one writev().
+// With --drop-cache the pages we have written are dropped from the
+// page cache once they have been written back.
+//
+// With --gzip the output is compressed the way pigz does it: the data
+// is cut into blocks of GZ_BLOCK bytes, which the compression threads
+// deflate independently, each primed with the last 32kB of the block
+// before it. All but the last block end with a sync flush, so that the
+// blocks simply concatenate into one deflate stream, and the crc of the
+// whole file is combined from the crcs of the blocks as they are
+// written out in order.
+#ifdef HAVE_FOPENCOOKIE
+#define GZ_BLOCK (128*1024)
+#define GZ_DICT  (32*1024)
+
+struct gz_block {
+    struct output_cookie *c;
+    struct gz_block *next;      // next block of the same file
+    struct gz_block *queue;     // next block waiting for a compression thread
+    char           *in;
+    size_t          in_len;
+    unsigned char  *out;
+    size_t          out_len;
+    uLong           crc;        // of the uncompressed data
+    size_t          dict_len;
+    int             last;       // finish the deflate stream
+    int             done;       // compressed, ready to be written
+    unsigned char   dict[GZ_DICT];
+};
+
+struct output_cookie {
+    int     fd;
+    char   *buf;
+    size_t  len;        // bytes waiting in buf
+    size_t  size;       // allocated size of buf, grows up to output_buffer_size
+    off_t   done;       // bytes written to the file
+    off_t   dropped;    // bytes dropped from the page cache
+    int     failed;     // a write failed
+    int     flags;
+    char   *name;       // name of the tar entry, NULL for a file of its own
+    FILE   *spill;      // holds a tar entry that outgrew the buffer
+    // gzip state, only used with a non zero level
+    int     level;
+    char   *in;         // data for the next block
+    size_t  in_len;
+    unsigned char dict[GZ_DICT];    // tail of the last block submitted
+    size_t  dict_len;
+    struct gz_block *head, *tail;   // blocks submitted and not yet written
+    int     inflight;
+    int     started;    // gzip header written
+    uLong   crc;        // of the uncompressed data written so far
+    uLong   total;
+    // with a journal the open files are listed, so that they can be synced
+    FILE   *file;
+    struct output_cookie *next;
+};
+struct output_cookie *output_files = NULL;
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t output_files_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static int output_flush(struct output_cookie *c, const char *data, size_t n)
+{
+    // write out the buffer followed by data
+    struct iovec iov[2], *v = iov;
+    int cnt = 0;
+    off_t before = c->done;
+    if (c->len) {
+        iov[cnt].iov_base = c->buf;
+        iov[cnt].iov_len  = c->len;
+        cnt++;
+    }
+    if (n) {
+        iov[cnt].iov_base = (void *)data;
+        iov[cnt].iov_len  = n;
+        cnt++;
+    }
+    while (cnt) {
+        ssize_t w = writev(c->fd, v, cnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            DEBUG_WARN(("output_flush: write failed: %s\n", strerror(errno)));
+            c->failed = 1;
+            return -1;
+        }
+        c->done += w;
+        while (cnt && (size_t)w >= v->iov_len) {
+            w -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        if (cnt) {
+            v->iov_base = (char *)v->iov_base + w;
+            v->iov_len -= w;
         }
     }
-    if (chdir(dir)) {
-        x = errno;
-        DIE(("mk_kmail_dir: Cannot change to directory %s: %s\n", dir, strerror(x)));
+    c->len = 0;
+    if (output_drop_cache && !c->name) {
+        // pages that are still dirty cannot be dropped, so start writing
+        // back this flush, and drop what the last one started
+#ifdef HAVE_SYNC_FILE_RANGE
+        sync_file_range(c->fd, before, c->done - before, SYNC_FILE_RANGE_WRITE);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+        posix_fadvise(c->fd, c->dropped, before - c->dropped, POSIX_FADV_DONTNEED);
+#endif
+        c->dropped = before;
     }
-    free (dir);
+    return 0;
+}
 
-    //we should remove any existing indexes created by KMail, cause they might be different now
-    index = pst_malloc(strlen(fname)+strlen(KMAIL_INDEX)+1);
-    sprintf(index, KMAIL_INDEX, fname);
-    unlink(index);
-    free(index);
 
-    DEBUG_RET();
+static int output_put(struct output_cookie *c, const char *data, size_t n)
+{
+    if (c->len + n > output_buffer_size) {
+        if (c->name && !c->spill) {
+            // the size of a tar entry goes before its data, so keep it
+            // in a temporary file until it is complete
+            if (!(c->spill = tmpfile())) {
+                DIE(("output_put: Cannot create a temporary file for \"%s\": %s\n", c->name, strerror(errno)));
+            }
+            c->fd = fileno(c->spill);
+        }
+        return output_flush(c, data, n);
+    }
+    if (c->len + n > c->size) {
+        // start small, most separate files are only a few kB
+        size_t size = (c->size) ? c->size * 2 : 64*1024;
+        while (size < c->len + n) size *= 2;
+        if (size > output_buffer_size) size = output_buffer_size;
+        c->buf  = pst_realloc(c->buf, size);
+        c->size = size;
+    }
+    memcpy(c->buf + c->len, data, n);
+    c->len += n;
+    return 0;
 }
 
 
-int close_kmail_dir() {
-    int x;
-    DEBUG_ENT("close_kmail_dir");
-    if (chdir("..")) {
-        x = errno;
-        DIE(("close_kmail_dir: Cannot move up dir (..): %s\n", strerror(x)));
+static void gz_deflate(struct gz_block *b)
+{
+    // compress one block, runs on a compression thread
+    z_stream zs;
+    size_t size;
+    int flush = (b->last) ? Z_FINISH : Z_SYNC_FLUSH;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, b->c->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        DIE(("gz_deflate: cannot initialize zlib\n"));
+    }
+    if (b->dict_len) deflateSetDictionary(&zs, b->dict, b->dict_len);
+    size     = deflateBound(&zs, b->in_len) + 16;
+    b->out   = (unsigned char *)pst_malloc(size);
+    zs.next_in   = (Bytef *)b->in;
+    zs.avail_in  = b->in_len;
+    zs.next_out  = b->out;
+    zs.avail_out = size;
+    for (;;) {
+        int rc = deflate(&zs, flush);
+        if (zs.avail_out && (flush == Z_SYNC_FLUSH || rc == Z_STREAM_END)) break;
+        b->out = (unsigned char *)pst_realloc(b->out, size * 2);
+        zs.next_out  = b->out + size;
+        zs.avail_out = size;
+        size *= 2;
+    }
+    b->out_len = zs.total_out;
+    deflateEnd(&zs);
+    b->crc = crc32(crc32(0L, Z_NULL, 0), (Bytef *)b->in, b->in_len);
+    free(b->in);
+    b->in = NULL;
+}
+
+
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t     gz_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      gz_work  = PTHREAD_COND_INITIALIZER;   // a block was queued
+pthread_cond_t      gz_ready = PTHREAD_COND_INITIALIZER;   // a block was compressed
+struct gz_block    *gz_queue = NULL, *gz_queue_tail = NULL;
+int                 gz_threads = 0;
+
+
+static void *gz_worker(void *arg)
+{
+    for (;;) {
+        struct gz_block *b;
+        pthread_mutex_lock(&gz_mutex);
+        while (!gz_queue) pthread_cond_wait(&gz_work, &gz_mutex);
+        b = gz_queue;
+        gz_queue = b->queue;
+        if (!gz_queue) gz_queue_tail = NULL;
+        pthread_mutex_unlock(&gz_mutex);
+        gz_deflate(b);
+        pthread_mutex_lock(&gz_mutex);
+        b->done = 1;
+        pthread_cond_broadcast(&gz_ready);
+        pthread_mutex_unlock(&gz_mutex);
+    }
+    return NULL;
+}
+
+
+static void gz_start()
+{
+    // the compression threads are started with the first compressed file,
+    // and are left waiting for work until we exit
+    int i, n;
+    pthread_mutex_lock(&gz_mutex);
+    if (!gz_threads) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n < 1) n = 1;
+        for (i=0; i<n; i++) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, gz_worker, NULL)) break;
+            pthread_detach(thread);
+            gz_threads++;
+        }
+    }
+    pthread_mutex_unlock(&gz_mutex);
+}
+#endif
+
+
+void output_forked()
+{
+    // a forked child has none of the compression threads, so it needs
+    // its own. It never writes the blocks of files inherited from its
+    // parent, so those can be forgotten.
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&gz_mutex, NULL);
+    pthread_cond_init(&gz_work, NULL);
+    pthread_cond_init(&gz_ready, NULL);
+    gz_queue = gz_queue_tail = NULL;
+    gz_threads = 0;
+#endif
+}
+
+
+static void gz_put_block(struct output_cookie *c, struct gz_block *b)
+{
+    // write a compressed block, with the gzip header before the first and
+    // the trailer after the last
+    if (!c->started) {
+        static const char header[10] = {0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+        output_put(c, header, sizeof(header));
+        c->started = 1;
+    }
+    output_put(c, (char *)b->out, b->out_len);
+    c->crc    = crc32_combine(c->crc, b->crc, b->in_len);
+    c->total += b->in_len;
+    if (b->last) {
+        char trailer[8];
+        int i;
+        for (i=0; i<4; i++) {
+            trailer[i]   = (char)(c->crc   >> (8*i));
+            trailer[4+i] = (char)(c->total >> (8*i));
+        }
+        output_put(c, trailer, sizeof(trailer));
+    }
+    free(b->out);
+    free(b);
+}
+
+
+static void gz_drain(struct output_cookie *c, int all)
+{
+    // write the blocks that are done, in order. Wait for the oldest
+    // while there are too many in flight, or for all of them.
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&gz_mutex);
+    while (c->head) {
+        struct gz_block *b = c->head;
+        if (!b->done) {
+            if (!all && c->inflight < gz_threads * 2) break;
+            pthread_cond_wait(&gz_ready, &gz_mutex);
+            continue;
+        }
+        c->head = b->next;
+        if (!c->head) c->tail = NULL;
+        c->inflight--;
+        pthread_mutex_unlock(&gz_mutex);
+        gz_put_block(c, b);
+        pthread_mutex_lock(&gz_mutex);
+    }
+    pthread_mutex_unlock(&gz_mutex);
+#endif
+}
+
+
+static void gz_submit(struct output_cookie *c, int last)
+{
+    struct gz_block *b = (struct gz_block *)pst_malloc(sizeof(struct gz_block));
+    memset(b, 0, sizeof(*b));
+    b->c      = c;
+    b->in     = c->in;
+    b->in_len = c->in_len;
+    b->last   = last;
+    memcpy(b->dict, c->dict, c->dict_len);
+    b->dict_len = c->dict_len;
+    // the tail of this block primes the next one
+    if (c->in_len >= GZ_DICT) {
+        memcpy(c->dict, c->in + c->in_len - GZ_DICT, GZ_DICT);
+        c->dict_len = GZ_DICT;
+    } else if (c->in_len) {
+        size_t keep = (c->dict_len + c->in_len > GZ_DICT) ? GZ_DICT - c->in_len : c->dict_len;
+        memmove(c->dict, c->dict + c->dict_len - keep, keep);
+        memcpy(c->dict + keep, c->in, c->in_len);
+        c->dict_len = keep + c->in_len;
+    }
+    c->in     = NULL;
+    c->in_len = 0;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&gz_mutex);
+    if (gz_threads) {
+        if (c->tail) c->tail->next = b;
+        else         c->head = b;
+        c->tail = b;
+        c->inflight++;
+        if (gz_queue_tail) gz_queue_tail->queue = b;
+        else               gz_queue = b;
+        gz_queue_tail = b;
+        pthread_cond_signal(&gz_work);
+        pthread_mutex_unlock(&gz_mutex);
+        gz_drain(c, last);
+        return;
+    }
+    pthread_mutex_unlock(&gz_mutex);
+#endif
+    gz_deflate(b);
+    gz_put_block(c, b);
+}
+
+
+static ssize_t output_write(void *cookie, const char *data, size_t n)
+{
+    struct output_cookie *c = (struct output_cookie *)cookie;
+    size_t left = n;
+    if (!c->level) {
+        return (output_put(c, data, n)) ? 0 : (ssize_t)n;
+    }
+    while (left) {
+        size_t m = GZ_BLOCK - c->in_len;
+        if (m > left) m = left;
+        if (!c->in) c->in = (char *)pst_malloc(GZ_BLOCK);
+        memcpy(c->in + c->in_len, data, m);
+        c->in_len += m;
+        data      += m;
+        left      -= m;
+        if (c->in_len == GZ_BLOCK) gz_submit(c, 0);
+    }
+    return (c->failed) ? 0 : (ssize_t)n;
+}
+
+
+// With --tar all the output goes into one tar archive rather than into
+// files and directories of its own. An entry is collected by its
+// output cookie, spilling to a temporary file once it outgrows the
+// buffer, and is appended to the archive in one piece when it is
+// closed, so that threads can finish entries in any order. With --gzip
+// each entry is compressed as a gzip member of its own by the thread
+// that closes it, and gzip reads the members back as one stream.
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t     tar_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define TAR_MAX_SIZE 077777777777ULL    // largest size a ustar header can hold
+
+
+static void tar_lock()
+{
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_lock(&tar_mutex);
+#endif
+}
+
+
+static void tar_unlock()
+{
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_unlock(&tar_mutex);
+#endif
+}
+
+
+static int tar_write(const void *data, size_t n)
+{
+    const char *p = (const char *)data;
+    while (n) {
+        ssize_t w = write(tar_fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            DEBUG_WARN(("tar_write: write failed: %s\n", strerror(errno)));
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+
+static void tar_block(char *block, const char *name, size_t name_len, const char *prefix, size_t prefix_len, const char *link, char type, uint64_t size)
+{
+    // fill in one ustar header block
+    unsigned sum = 0;
+    int i;
+    memset(block, 0, 512);
+    memcpy(block, name, (name_len > 100) ? 100 : name_len);
+    if (link) strncpy(block+157, link, 100);
+    snprintf(block+100, 8,  "%07o", (type == '5') ? 0755 : 0644);
+    snprintf(block+108, 8,  "%07o", 0);
+    snprintf(block+116, 8,  "%07o", 0);
+    snprintf(block+124, 12, "%011" PRIo64, (size > TAR_MAX_SIZE) ? (uint64_t)0 : size);
+    snprintf(block+136, 12, "%011lo", (unsigned long)tar_mtime);
+    block[156] = type;
+    memcpy(block+257, "ustar", 6);
+    memcpy(block+263, "00", 2);
+    if (prefix_len) memcpy(block+345, prefix, prefix_len);
+    memset(block+148, ' ', 8);
+    for (i=0; i<512; i++) sum += (unsigned char)block[i];
+    snprintf(block+148, 8, "%06o", sum);
+}
+
+
+static size_t tar_pax_record(char *r, const char *key, const char *value)
+{
+    // "<length> <key>=<value>\n", where the length counts its own digits
+    size_t len = strlen(key) + strlen(value) + 3, digits = 1;
+    while ((size_t)snprintf(NULL, 0, "%zu", len + digits) > digits) digits++;
+    return sprintf(r, "%zu %s=%s\n", len + digits, key, value);
+}
+
+
+static size_t tar_header(char **header, const char *name, const char *link, char type, uint64_t size)
+{
+    // make the header of an entry: a single ustar block when the names and
+    // size fit, otherwise preceded by a pax extended header
+    size_t n = strlen(name), len, pax = 0;
+    const char *slash = NULL;
+    char *h, *records = NULL;
+    if (n > 100) {
+        // ustar can hold the leading directories of the name separately
+        for (slash = name + n - 101; *slash && *slash != '/'; slash++);
+        if (!*slash || slash - name > 155) slash = NULL;
+    }
+    if ((n > 100 && !slash) || size > TAR_MAX_SIZE || (link && strlen(link) > 100)) {
+        char value[24];
+        records = pst_malloc(n + ((link) ? strlen(link) : 0) + 96);
+        pax = tar_pax_record(records, "path", name);
+        snprintf(value, sizeof(value), "%" PRIu64, size);
+        if (size > TAR_MAX_SIZE) pax += tar_pax_record(records + pax, "size", value);
+        if (link && strlen(link) > 100) pax += tar_pax_record(records + pax, "linkpath", link);
+        slash = NULL;
+    }
+    len = (pax) ? 1024 + (pax + 511) / 512 * 512 : 512;
+    h = pst_malloc(len);
+    memset(h, 0, len);
+    if (pax) {
+        tar_block(h, "PaxHeader", 9, NULL, 0, NULL, 'x', pax);
+        memcpy(h+512, records, pax);
+        free(records);
+    }
+    if (slash) tar_block(h + len - 512, slash+1, n - (slash+1 - name), name, slash - name, link, type, size);
+    else       tar_block(h + len - 512, name, n, NULL, 0, link, type, size);
+    *header = h;
+    return len;
+}
+
+
+static int tar_member(const char *header, size_t header_len, const char *data, size_t data_len, int fd, uint64_t size)
+{
+    // compress one entry as a gzip member and append it to the archive.
+    // An entry held in memory is compressed before taking the lock, one
+    // read back from its temporary file is compressed as it is appended.
+    static const char pad[512];
+    z_stream zs;
+    unsigned char *out;
+    size_t out_size = 256*1024;
+    char *chunk = NULL;
+    int rc = 0, locked = 0, part;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, tar_level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        DIE(("tar_member: cannot initialize zlib\n"));
+    }
+    if (fd < 0) out_size = deflateBound(&zs, header_len + data_len + 512);
+    out = pst_malloc(out_size);
+    zs.next_out  = out;
+    zs.avail_out = out_size;
+    if (fd >= 0) {
+        chunk = pst_malloc(256*1024);
+        if (lseek(fd, 0, SEEK_SET) < 0) rc = -1;
+        tar_lock();
+        locked = 1;
+    }
+    // the entry is the header, the data and the padding to a whole block
+    for (part=0; part<3 && !rc; part++) {
+        const char *p = (part == 0) ? header : (part == 1) ? data : pad;
+        size_t n = (part == 0) ? header_len : (part == 1) ? data_len : (512 - size % 512) % 512;
+        uint64_t left = (part == 1 && fd >= 0) ? size : 0;
+        do {
+            if (left) {
+                ssize_t r = read(fd, chunk, (left > 256*1024) ? 256*1024 : left);
+                if (r <= 0) {
+                    rc = -1;
+                    break;
+                }
+                p = chunk;
+                n = r;
+                left -= r;
+            }
+            zs.next_in  = (Bytef *)p;
+            zs.avail_in = n;
+            do {
+                if (locked) {
+                    zs.next_out  = out;
+                    zs.avail_out = out_size;
+                }
+                deflate(&zs, (part == 2) ? Z_FINISH : Z_NO_FLUSH);
+                if (locked && zs.avail_out < out_size && tar_write(out, out_size - zs.avail_out)) rc = -1;
+            } while (locked && !zs.avail_out);
+        } while (left && !rc);
+    }
+    if (!locked) {
+        tar_lock();
+        if (!rc) rc = tar_write(out, zs.total_out);
+    }
+    tar_unlock();
+    deflateEnd(&zs);
+    free(chunk);
+    free(out);
+    return rc;
+}
+
+
+static int tar_add(const char *name, char type, const char *data, size_t data_len, int fd, uint64_t size)
+{
+    // append one entry, with its data either in memory or in the file fd
+    static const char pad[512];
+    char *header;
+    size_t header_len = tar_header(&header, name, NULL, type, size);
+    int rc = 0;
+    if (tar_level) {
+        rc = tar_member(header, header_len, data, data_len, fd, size);
+        free(header);
+        return rc;
+    }
+    tar_lock();
+    rc = tar_write(header, header_len);
+    if (fd < 0) {
+        if (!rc) rc = tar_write(data, data_len);
+    }
+    else if (lseek(fd, 0, SEEK_SET) < 0) {
+        rc = -1;
+    }
+    else {
+        char *chunk = pst_malloc(256*1024);
+        uint64_t left = size;
+        while (left && !rc) {
+            ssize_t r = read(fd, chunk, (left > 256*1024) ? 256*1024 : left);
+            if (r <= 0) rc = -1;
+            else        rc = tar_write(chunk, r);
+            left -= (r > 0) ? r : 0;
+        }
+        free(chunk);
+    }
+    if (!rc) rc = tar_write(pad, (512 - size % 512) % 512);
+    tar_unlock();
+    free(header);
+    if (rc) DEBUG_WARN(("tar_add: failed to add %s\n", name));
+    return rc;
+}
+
+
+static int tar_add_link(const char *name, char type, const char *link)
+{
+    // a hard ('1') or symbolic ('2') link to link
+    char *header;
+    size_t len = tar_header(&header, name, link, type, 0);
+    int rc;
+    if (tar_level) {
+        rc = tar_member(header, len, NULL, 0, -1, 0);
+    }
+    else {
+        tar_lock();
+        rc = tar_write(header, len);
+        tar_unlock();
+    }
+    free(header);
+    return rc;
+}
+
+
+static int tar_add_file(struct output_cookie *c)
+{
+    // an empty file is left out, as it would have been removed
+    if (c->spill) {
+        if (output_flush(c, NULL, 0)) return -1;
+        return tar_add(c->name, '0', NULL, 0, c->fd, c->done);
+    }
+    if (!c->len && !(c->flags & OUTPUT_KEEP)) return 0;
+    return tar_add(c->name, '0', c->buf, c->len, -1, c->len);
+}
+
+
+static void output_list(struct output_cookie *c, int add)
+{
+    struct output_cookie **p;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&output_files_mutex);
+#endif
+    if (add) {
+        c->next = output_files;
+        output_files = c;
+    }
+    else {
+        for (p=&output_files; *p; p=&(*p)->next) {
+            if (*p == c) {
+                *p = c->next;
+                break;
+            }
+        }
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&output_files_mutex);
+#endif
+}
+
+
+static struct output_cookie *output_find(FILE *f)
+{
+    struct output_cookie *c;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&output_files_mutex);
+#endif
+    for (c=output_files; c && c->file != f; c=c->next) ;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&output_files_mutex);
+#endif
+    return c;
+}
+
+
+static int output_cookie_close(void *cookie)
+{
+    struct output_cookie *c = (struct output_cookie *)cookie;
+    int rc;
+    if (c->file) output_list(c, 0);
+    // a file that got no data at all stays empty, so that it is removed
+    if (c->level && (c->in_len || c->head || c->started)) gz_submit(c, 1);
+    free(c->in);
+    if (c->name) {
+        rc = tar_add_file(c);
+        if (c->spill) fclose(c->spill);
+        free(c->name);
+        free(c->buf);
+        free(c);
+        return rc;
+    }
+    rc = (output_flush(c, NULL, 0) || c->failed) ? -1 : 0;
+#ifdef HAVE_POSIX_FADVISE
+    if (output_drop_cache) posix_fadvise(c->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    if (close(c->fd)) rc = -1;
+    free(c->buf);
+    free(c);
+    return rc;
+}
+#else
+void output_forked()
+{
+}
+#endif
+
+
+static FILE *output_file(const char *name, int flags, off_t offset)
+{
+    // open a file for output, truncated to offset, or emptied if that is
+    // negative
+#ifdef HAVE_FOPENCOOKIE
+    cookie_io_functions_t io = {NULL, output_write, NULL, output_cookie_close};
+    struct output_cookie *c;
+    FILE *f;
+    int fd = -1;
+    if (tar_fd < 0) {
+        fd = open(name, O_WRONLY | O_CREAT | ((offset < 0) ? O_TRUNC : 0), 0666);
+        if (fd < 0) return NULL;
+        if (offset >= 0 && (ftruncate(fd, offset) || lseek(fd, offset, SEEK_SET) != offset)) {
+            close(fd);
+            return NULL;
+        }
+    }
+    c = (struct output_cookie *)pst_malloc(sizeof(struct output_cookie));
+    memset(c, 0, sizeof(*c));
+    c->fd    = fd;
+    c->flags = flags;
+    if (offset > 0) c->done = c->dropped = offset;
+    if (tar_fd >= 0) {
+        // the archive as a whole is compressed, not its entries
+        c->name = strdup(name);
+        name_add(name);
+    }
+    else if (flags & OUTPUT_GZIP) {
+        c->level = (gzip_level) ? gzip_level : Z_DEFAULT_COMPRESSION;
+#ifdef HAVE_PTHREAD_H
+        gz_start();
+#endif
+    }
+    if (!(f = fopencookie(c, "w", io))) {
+        if (fd >= 0) close(fd);
+        free(c->name);
+        free(c);
+    }
+    else if (journal_fd >= 0 && fd >= 0) {
+        c->file = f;
+        output_list(c, 1);
+    }
+    return f;
+#else
+    FILE *f;
+    int fd;
+    if (offset < 0) return fopen(name, "w");
+    fd = open(name, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, offset) || !(f = fdopen(fd, "a"))) {
+        close(fd);
+        return NULL;
+    }
+    return f;
+#endif
+}
+
+
+FILE *output_open(const char *name, int flags)
+{
+    return output_file(name, flags, -1);
+}
+
+
+FILE *output_reopen(const char *name, int flags, off_t offset)
+{
+    // carry on with a file written up to offset by an earlier run
+    return output_file(name, flags, offset);
+}
+
+
+off_t output_sync(FILE *f)
+{
+    // make what has been written to f durable, and return the size of the
+    // file. A compressed file gets its gzip member finished, so that it can
+    // be cut back to this point later and carried on with a new member.
+#ifdef HAVE_FOPENCOOKIE
+    struct output_cookie *c;
+    if (fflush(f) || !(c = output_find(f))) return -1;
+    if (c->level && (c->in_len || c->head || c->started)) {
+        gz_submit(c, 1);
+        c->started  = 0;
+        c->crc      = 0;
+        c->total    = 0;
+        c->dict_len = 0;
+    }
+    if (output_flush(c, NULL, 0) || c->failed || fdatasync(c->fd)) return -1;
+    return c->done;
+#else
+    if (fflush(f) || fdatasync(fileno(f))) return -1;
+    return ftello(f);
+#endif
+}
+
+
+void output_sync_dir(const char *dir)
+{
+    // make the files written into a directory durable, for separate mode
+    // where they have already been closed
+#ifdef HAVE_SYNCFS
+    int fd = open((*dir) ? dir : ".", O_RDONLY);
+    if (fd >= 0) {
+        syncfs(fd);
+        close(fd);
+        return;
+    }
+#endif
+    sync();
+}
+
+
+int output_close(FILE *f)
+{
+#if !defined(HAVE_FOPENCOOKIE) && defined(HAVE_POSIX_FADVISE)
+    if (output_drop_cache) {
+        fflush(f);
+        posix_fadvise(fileno(f), 0, 0, POSIX_FADV_DONTNEED);
+    }
+#endif
+    return fclose(f);
+}
+
+
+// The names in use in each output directory. Separate mode only writes
+// into directories it has just created, so every name there comes from
+// us, and a unique name for an attachment can be found here rather than
+// by trying to open one candidate after another. Each name remembers
+// the last suffix handed out for it, so that the next one is found
+// without going through all of them again. With --tar this is also the
+// only record of the names in the archive.
+struct name_table {
+    struct name_node  **buckets;
+    size_t              size;
+    size_t              count;
+};
+struct name_node {
+    struct name_node   *next;
+    struct name_table  *names;      // for a directory, the names in it
+    int                 suffix;     // last suffix used to make this name unique
+    char                name[];
+};
+struct name_table   name_dirs = {NULL, 0, 0};
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t     registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static void registry_lock()
+{
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_lock(&registry_mutex);
+#endif
+}
+
+
+static void registry_unlock()
+{
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_unlock(&registry_mutex);
+#endif
+}
+
+
+static size_t name_hash(const char *name, size_t len)
+{
+    // FNV-1a
+    size_t h = 2166136261u;
+    while (len--) h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+
+static struct name_node *name_lookup(struct name_table *t, const char *name, size_t len, int *added)
+{
+    // find name in t, adding it if added is not NULL
+    struct name_node *n;
+    size_t b;
+    if (added) *added = 0;
+    if (t->size) {
+        for (n = t->buckets[name_hash(name, len) & (t->size-1)]; n; n = n->next) {
+            if (!strncmp(n->name, name, len) && !n->name[len]) return n;
+        }
+    }
+    if (!added) return NULL;
+    if (t->count >= t->size) {
+        // double the table, rehashing the names already in it
+        size_t size = (t->size) ? t->size * 2 : 16;
+        struct name_node **buckets = pst_malloc(size * sizeof(struct name_node *));
+        memset(buckets, 0, size * sizeof(struct name_node *));
+        for (b=0; b<t->size; b++) {
+            while ((n = t->buckets[b])) {
+                size_t i = name_hash(n->name, strlen(n->name)) & (size-1);
+                t->buckets[b] = n->next;
+                n->next    = buckets[i];
+                buckets[i] = n;
+            }
+        }
+        free(t->buckets);
+        t->buckets = buckets;
+        t->size    = size;
+    }
+    b = name_hash(name, len) & (t->size-1);
+    n = pst_malloc(sizeof(struct name_node) + len + 1);
+    n->names  = NULL;
+    n->suffix = 0;
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    n->next = t->buckets[b];
+    t->buckets[b] = n;
+    t->count++;
+    *added = 1;
+    return n;
+}
+
+
+static struct name_table *name_dir(const char *path, const char **base, int add)
+{
+    // the table of names in the directory of path
+    const char *slash = strrchr(path, '/');
+    size_t len = (slash) ? (size_t)(slash - path) : 0;
+    int added;
+    struct name_node *d = name_lookup(&name_dirs, path, len, (add) ? &added : NULL);
+    *base = (slash) ? slash+1 : path;
+    if (!d) return NULL;
+    if (!d->names) {
+        if (!add) return NULL;
+        d->names = pst_malloc(sizeof(struct name_table));
+        memset(d->names, 0, sizeof(struct name_table));
+    }
+    return d->names;
+}
+
+
+static int name_find(const char *path, int add)
+{
+    // return 1 if path is known, otherwise add it if asked and return 0
+    const char *base;
+    int added = 0, found;
+    struct name_table *t;
+    registry_lock();
+    t = name_dir(path, &base, add);
+    found = (t && name_lookup(t, base, strlen(base), (add) ? &added : NULL) && !added);
+    registry_unlock();
+    return found;
+}
+
+
+void name_add(const char *path)
+{
+    name_find(path, 1);
+}
+
+
+char *name_unique(const char *prefix, const char *name)
+{
+    // "prefix-name", or the first of "prefix-name-1", "prefix-name-2" ...
+    // that is not in use yet, and mark it as in use
+    char *path = pst_malloc(strlen(prefix) + strlen(name) + 15);
+    const char *base;
+    struct name_table *t;
+    struct name_node *n;
+    int added;
+    sprintf(path, "%s-%s", prefix, name);
+    registry_lock();
+    t = name_dir(path, &base, 1);
+    n = name_lookup(t, base, strlen(base), &added);
+    if (!added) {
+        size_t len = strlen(path);
+        int x = n->suffix;
+        do {
+            if (++x > 99999999) {
+                DIE(("error finding attachment name. exhausted possibilities to %s\n", path));
+            }
+            sprintf(path + len, "-%i", x);
+            name_lookup(t, base, strlen(base), &added);
+        } while (!added);
+        n->suffix = x;
+    }
+    registry_unlock();
+    return path;
+}
+
+
+void name_forget(const char *dir)
+{
+    // nothing more will be written into dir
+    struct name_node *d, *n;
+    size_t b;
+    registry_lock();
+    d = name_lookup(&name_dirs, dir, strlen(dir), NULL);
+    if (d && d->names) {
+        for (b=0; b<d->names->size; b++) {
+            while ((n = d->names->buckets[b])) {
+                d->names->buckets[b] = n->next;
+                free(n);
+            }
+        }
+        free(d->names->buckets);
+        free(d->names);
+        d->names = NULL;
+    }
+    registry_unlock();
+}
+
+
+int output_exists(const char *path)
+{
+    FILE *f;
+    if (tar_fd >= 0) return name_find(path, 0);
+    if (!(f = fopen(path, "r"))) return 0;
+    fclose(f);
+    return 1;
+}
+
+
+int output_mkdir(const char *path)
+{
+    // make a directory, or with --tar add it to the archive. Fails with
+    // EEXIST if it is already there.
+    char *dir;
+    int rc;
+    if (tar_fd < 0) return D_MKDIR(path);
+    if (name_find(path, 1)) {
+        errno = EEXIST;
+        return -1;
+    }
+    dir = pst_malloc(strlen(path)+2);
+    sprintf(dir, "%s/", path);
+#ifdef HAVE_FOPENCOOKIE
+    rc = tar_add(dir, '5', NULL, 0, -1, 0);
+#else
+    rc = 0;
+#endif
+    free(dir);
+    return rc;
+}
+
+
+void output_tar_close()
+{
+    // the archive ends with two zero blocks
+    static const char end[1024];
+#ifdef HAVE_FOPENCOOKIE
+    if (tar_level) tar_member(end, sizeof(end), NULL, 0, -1, 0);
+    else           tar_write(end, sizeof(end));
+#endif
+    if (tar_fd != STDOUT_FILENO && close(tar_fd)) {
+        DIE(("Cannot write the tar archive: %s\n", strerror(errno)));
+    }
+    tar_fd = -1;
+}
+
+
+void output_tar_file(const char *name, const char *path)
+{
+    // add a file written elsewhere by name to the archive, and remove it
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        DEBUG_WARN(("output_tar_file: Cannot read %s\n", path));
+    }
+    else {
+        name_add(name);
+#ifdef HAVE_FOPENCOOKIE
+        tar_add(name, '0', NULL, 0, fd, st.st_size);
+#endif
+    }
+    if (fd >= 0) close(fd);
+    unlink(path);
+}
+
+
+char *mk_kmail_dir(char *parent, char *fname) {
+    //make a directory based on OUTPUT_KMAIL_DIR_TEMPLATE
+    //and return the path to that directory
+    char *dir, *path, *index, *index_path;
+    int x;
+    DEBUG_ENT("mk_kmail_dir");
+    dir = pst_malloc(strlen(fname)+strlen(OUTPUT_KMAIL_DIR_TEMPLATE)+1);
+    sprintf(dir, OUTPUT_KMAIL_DIR_TEMPLATE, fname);
+    check_filename(dir);
+    path = mk_path(parent, dir);
+    if (output_mkdir(path)) {
+        if (errno != EEXIST) {  // not an error because it exists
+            x = errno;
+            DIE(("mk_kmail_dir: Cannot create directory %s: %s\n", path, strerror(x)));
+        }
+    }
+    free (dir);
+
+    //we should remove any existing indexes created by KMail, cause they might be different now
+    index = pst_malloc(strlen(fname)+strlen(KMAIL_INDEX)+1);
+    sprintf(index, KMAIL_INDEX, fname);
+    index_path = mk_path(path, index);
+    unlink(index_path);
+    free(index_path);
+    free(index);
+
+    DEBUG_RET();
+    return path;
+}
+
+
+char *item_type_to_name(int32_t item_type) {
+    char *name;
+    if (json_mode) return "json";
+    switch (item_type) {
+        case PST_TYPE_APPOINTMENT:
+            name = "calendar";
+            break;
+        case PST_TYPE_CONTACT:
+            name = "contacts";
+            break;
+        case PST_TYPE_JOURNAL:
+            name = "journal";
+            break;
+        case PST_TYPE_STICKYNOTE:
+        case PST_TYPE_TASK:
+        case PST_TYPE_NOTE:
+        case PST_TYPE_OTHER:
+        case PST_TYPE_REPORT:
+        default:
+            name = "mbox";
+            break;
+    }
+    return name;
+}
+
+
+int32_t reduced_item_type(int32_t item_type) {
+    int32_t reduced;
+    if (json_mode) return PST_TYPE_NOTE;   // every item goes to the one json file
+    switch (item_type) {
+        case PST_TYPE_APPOINTMENT:
+        case PST_TYPE_CONTACT:
+        case PST_TYPE_JOURNAL:
+            reduced = item_type;
+            break;
+        case PST_TYPE_STICKYNOTE:
+        case PST_TYPE_TASK:
+        case PST_TYPE_NOTE:
+        case PST_TYPE_OTHER:
+        case PST_TYPE_REPORT:
+        default:
+            reduced = PST_TYPE_NOTE;
+            break;
+    }
+    return reduced;
+}
+
+
+// this will create a directory by that name, and return the path to it
+char *mk_recurse_dir(char *parent, char *dir) {
+    int x;
+    char *path;
+    DEBUG_ENT("mk_recurse_dir");
+    check_filename(dir);
+    path = mk_path(parent, dir);
+    if (output_mkdir(path)) {
+        if (errno != EEXIST) {  // not an error because it exists
+            x = errno;
+            DIE(("mk_recurse_dir: Cannot create directory %s: %s\n", path, strerror(x)));
+        }
+    }
+    DEBUG_RET();
+    return path;
+}
+
+
+char *mk_separate_dir(char *parent, char *dir) {
+    size_t dirsize = strlen(dir) + 10;
+    char dir_name[dirsize];
+    char *path = NULL;
+    int x = 0, y = 0;
+
+    DEBUG_ENT("mk_separate_dir");
+    do {
+        if (y == 0)
+            snprintf(dir_name, dirsize, "%s", dir);
+        else
+            snprintf(dir_name, dirsize, "%s%i%s", dir, y, ""); // enough for 9 digits allocated above
+
+        check_filename(dir_name);
+        if (path) free(path);
+        path = mk_path(parent, dir_name);
+        DEBUG_INFO(("about to try creating %s\n", path));
+        if (output_mkdir(path)) {
+            if (errno != EEXIST) { // if there is an error, and it doesn't already exist
+                x = errno;
+                DIE(("mk_separate_dir: Cannot create directory %s: %s\n", path, strerror(x)));
+            }
+            if (journal_leftover(path)) break;
+        } else {
+            break;
+        }
+        y++;
+    } while (overwrite == 0);
+
+    if (overwrite && tar_fd < 0) {
+        // we should probably delete all files from this directory
+#if !defined(WIN32) && !defined(__CYGWIN__)
+        DIR * sdir = NULL;
+        struct dirent *dirent = NULL;
+        struct stat filestat;
+        if (!(sdir = opendir(path))) {
+            DEBUG_WARN(("mk_separate_dir: Cannot open dir \"%s\" for deletion of old contents\n", path));
+        } else {
+            while ((dirent = readdir(sdir))) {
+                char *name = mk_path(path, dirent->d_name);
+                if (lstat(name, &filestat) != -1)
+                    if (S_ISREG(filestat.st_mode)) {
+                        if (unlink(name)) {
+                            y = errno;
+                            DIE(("mk_separate_dir: unlink returned error on file %s: %s\n", name, strerror(y)));
+                        }
+                    }
+                free(name);
+            }
+            closedir(sdir);     // cppcheck detected leak
+        }
+#endif
+    }
+
+    DEBUG_RET();
+    return path;
+}
+
+
+void mk_separate_file(struct file_ll *f, int32_t t, char *extension, int openit) {
+    DEBUG_ENT("mk_separate_file");
+    DEBUG_INFO(("opening next file to save email type %s\n", item_type_to_name(t)));
+    if (f->item_count > 999999999) { // bigger than nine 9's
+        DIE(("mk_separate_file: The number of emails in this folder has become too high to handle\n"));
+    }
+    char name[file_name_len];
+    snprintf(name, sizeof(name), "%" PRIi32 "%s%s", f->item_count, extension, (openit && gzip_separate) ? ".gz" : "");
+    check_filename(name);
+    if (f->name[t]) free(f->name[t]);
+    f->name[t] = mk_path(f->dir, name);
+    name_add(f->name[t]);
+    if (openit) {
+        if (!(f->output[t] = output_open(f->name[t], (gzip_separate) ? OUTPUT_GZIP : 0))) {
+            DIE(("mk_separate_file: Cannot open file to save email \"%s\"\n", f->name[t]));
+        }
+    }
+    DEBUG_RET();
+}
+
+
+void close_separate_file(struct file_ll *f) {
+    int32_t t;
+    DEBUG_ENT("close_separate_file");
+    for (t=0; t<PST_TYPE_MAX; t++) {
+        if (f->output[t]) {
+            struct stat st;
+            output_close(f->output[t]);
+            if (!stat(f->name[t], &st) && !st.st_size) {
+                DEBUG_WARN(("removing empty output file %s\n", f->name[t]));
+                remove(f->name[t]);
+            }
+            f->output[t] = NULL;
+        }
+    }
+    DEBUG_RET();
+}
+
+
+void write_separate_email(struct file_ll *f, pst_item *item) {
+    // write one email to its own file in separate mode, numbered by f->item_count
+    char *extra_mime_headers = NULL;
+    DEBUG_ENT("write_separate_email");
+    mk_separate_file(f, PST_TYPE_NOTE, (mode_EX) ? ".eml" : "", 1);
+    if (gzip_separate) {
+        // attachments are named after the message, without the .gz
+        char *base = strdup(f->name[PST_TYPE_NOTE]);
+        base[strlen(base)-3] = '\0';
+        write_normal_email(f->output[PST_TYPE_NOTE], base, item, mode, mode_MH, pstfile, save_rtf_body, PST_TYPE_NOTE, &extra_mime_headers);
+        free(base);
+    } else {
+        write_normal_email(f->output[PST_TYPE_NOTE], f->name[PST_TYPE_NOTE], item, mode, mode_MH, pstfile, save_rtf_body, PST_TYPE_NOTE, &extra_mime_headers);
+    }
+    close_separate_file(f);
+    if (mode_MSG) {
+        mk_separate_file(f, PST_TYPE_NOTE, ".msg", 0);
+        if (tar_fd >= 0) {
+            // the .msg writer wants a file of its own, so use a temporary one
+            const char *tmp = getenv("TMPDIR");
+            char *temp = pst_malloc(strlen((tmp) ? tmp : "/tmp") + 20);
+            int fd;
+            sprintf(temp, "%s/readpst-XXXXXX", (tmp) ? tmp : "/tmp");
+            if ((fd = mkstemp(temp)) < 0) {
+                DIE(("write_separate_email: Cannot create a temporary file: %s\n", strerror(errno)));
+            }
+            close(fd);
+            write_msg_email(temp, item, pstfile);
+            output_tar_file(f->name[PST_TYPE_NOTE], temp);
+            free(temp);
+        }
+        else {
+            write_msg_email(f->name[PST_TYPE_NOTE], item, pstfile);
+        }
+    }
+    DEBUG_RET();
+}
+
+
+char *my_stristr(char *haystack, char *needle) {
+    // my_stristr varies from strstr in that its searches are case-insensitive
+    char *x=haystack, *y=needle, *z = NULL;
+    if (!haystack || !needle) {
+        return NULL;
+    }
+    while (*y != '\0' && *x != '\0') {
+        if (tolower(*y) == tolower(*x)) {
+            // move y on one
+            y++;
+            if (!z) {
+                z = x; // store first position in haystack where a match is made
+            }
+        } else {
+            y = needle; // reset y to the beginning of the needle
+            z = NULL; // reset the haystack storage point
+        }
+        x++; // advance the search in the haystack
+    }
+    // If the haystack ended before our search finished, it's not a match.
+    if (*y != '\0') return NULL;
+    return z;
+}
+
+
+void check_filename(char *fname) {
+    char *t = fname;
+    DEBUG_ENT("check_filename");
+    if (!t) {
+        DEBUG_RET();
+        return;
+    }
+    while ((t = strpbrk(t, "/\\:"))) {
+        // while there are characters in the second string that we don't want
+        *t = '_'; //replace them with an underscore
+    }
+    DEBUG_RET();
+}
+
+
+/**
+ * check if the file name extension is acceptable. If not, the attachment
+ * will be discarded
+ * @param attach  pst attachment object
+ * @return        true if the attachment filename contains an extension that we want.
+ */
+int  acceptable_ext(pst_item_attach* attach)
+{
+    if (!acceptable_extensions || *acceptable_extensions == '\0') return 1;     // acceptable list missing or empty
+    char *attach_filename = (attach->filename2.str) ? attach->filename2.str
+                                                    : attach->filename1.str;
+    if (!attach_filename) return 1; // attachment with no name is always acceptable
+    char *e = strrchr(attach_filename, '.');
+    if (!e) return 1;               // attachment with no extension is always acceptable.
+    DEBUG_ENT("acceptable_ext");
+    DEBUG_INFO(("attachment extension %s\n", e));
+    int rc = 0;
+    char *a = acceptable_extensions;
+    while (*a) {
+        if (pst_stricmp(a, e) == 0) {
+            rc = 1;
+            break;
+        }
+        a += strlen(a) + 1;
+    }
+    DEBUG_INFO(("attachment acceptable returns %d\n", rc));
+    DEBUG_RET();
+    return rc;
+}
+
+
+// With --dedup each distinct attachment is written only once, into
+// .attachments/ under a name made from the BLAKE2b digest of its content
+// and its size, and the attachment in the message directory is a hard
+// link or a symbolic link to it, or just a line in .attachments/manifest.
+// An attachment is streamed from the pst file into a temporary file and
+// hashed on the way, then linked into place. The first time a digest is
+// found in the store already, the two are compared byte for byte, and
+// different content with the same digest goes under a name with .1, .2
+// and so on added. An archive written with --tar cannot be read back, so
+// there the digest is trusted. The base64 encodings of attachments
+// embedded in messages are kept, so that an attachment sent over and over
+// is only encoded once.
+#define DEDUP_DIR         ".attachments"
+#define DEDUP_DIGEST      32                    // bytes of BLAKE2b digest
+#define DEDUP_KEY         (2*DEDUP_DIGEST + 40) // digest, size and suffix
+#define DEDUP_CACHE_MAX   (64*1024*1024)        // bytes of base64 kept
+#define DEDUP_BASE64_MAX  (4*1024*1024)         // larger attachments are encoded as they are read
+
+struct dedup_node {
+    struct dedup_node *next;
+    char   key[DEDUP_KEY];
+    char  *base64;
+    int    verified;        // compared with a later attachment of the same key
+};
+struct dedup_node  *dedup_cache[4096];
+size_t              dedup_cached = 0;
+struct dedup_path {
+    struct dedup_path *next;
+    char  *path;
+};
+struct dedup_path  *dedup_verified[4096];       // store files already compared
+int                 dedup_manifest_fd = -1;
+char               *dedup_manifest = NULL;      // the manifest for a tar archive
+size_t              dedup_manifest_len = 0;
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t     dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static void dedup_lock()
+{
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_lock(&dedup_mutex);
+#endif
+}
+
+
+static void dedup_unlock()
+{
+#ifdef HAVE_PTHREAD_H
+    if (use_threads) pthread_mutex_unlock(&dedup_mutex);
+#endif
+}
+
+
+static void dedup_key(pst_blake2b_state *hash, uint64_t size, char *key)
+{
+    // the hex digest and the size
+    unsigned char digest[DEDUP_DIGEST];
+    int i;
+    pst_blake2b_final(hash, digest);
+    for (i=0; i<DEDUP_DIGEST; i++) sprintf(key + 2*i, "%02x", digest[i]);
+    sprintf(key + 2*DEDUP_DIGEST, "-%" PRIu64, size);
+}
+
+
+#ifdef HAVE_FOPENCOOKIE
+struct dedup_writer {
+    FILE              *fp;
+    pst_blake2b_state  hash;
+    uint64_t           size;
+};
+
+
+static ssize_t dedup_write(void *cookie, const char *buf, size_t size)
+{
+    struct dedup_writer *w = (struct dedup_writer *)cookie;
+    pst_blake2b_update(&w->hash, buf, size);
+    w->size += size;
+    return (fwrite(buf, 1, size, w->fp) == size) ? (ssize_t)size : -1;
+}
+#endif
+
+
+static int dedup_spool(pst_file *pst, pst_item_attach *attach, FILE *fp, char *key, uint64_t *size)
+{
+    // copy an attachment into fp, which is open for reading too, and make
+    // its key from the bytes on their way
+    pst_blake2b_state hash;
+#ifdef HAVE_FOPENCOOKIE
+    cookie_io_functions_t io = {NULL, dedup_write, NULL, NULL};
+    struct dedup_writer w;
+    FILE *f;
+    w.fp   = fp;
+    w.size = 0;
+    pst_blake2b_init(&w.hash, DEDUP_DIGEST);
+    if (!(f = fopencookie(&w, "w", io))) return -1;
+    (void)pst_attach_to_file(pst, attach, f);
+    if (fclose(f)) return -1;
+    hash  = w.hash;
+    *size = w.size;
+#else
+    // hashed from the copy, which is still in the page cache
+    char *chunk = pst_malloc(64*1024);
+    size_t n;
+    (void)pst_attach_to_file(pst, attach, fp);
+    if (fflush(fp) || fseeko(fp, 0, SEEK_SET)) {
+        free(chunk);
+        return -1;
+    }
+    pst_blake2b_init(&hash, DEDUP_DIGEST);
+    *size = 0;
+    while ((n = fread(chunk, 1, 64*1024, fp))) {
+        pst_blake2b_update(&hash, chunk, n);
+        *size += n;
+    }
+    free(chunk);
+#endif
+    if (fflush(fp) || ferror(fp)) return -1;
+    dedup_key(&hash, *size, key);
+    return 0;
+}
+
+
+static int dedup_same(FILE *fp, const char *path)
+{
+    // whether the content spooled in fp is byte for byte that of path
+    char *a = pst_malloc(2*64*1024), *b = a + 64*1024;
+    FILE *g = fopen(path, "rb");
+    int same = (g != NULL);
+    if (fseeko(fp, 0, SEEK_SET)) same = 0;
+    while (same) {
+        size_t na = fread(a, 1, 64*1024, fp);
+        size_t nb = fread(b, 1, 64*1024, g);
+        if (na != nb || memcmp(a, b, na)) same = 0;
+        if (!na) break;
+    }
+    if (g) fclose(g);
+    free(a);
+    return same;
+}
+
+
+static int dedup_checked(const char *path, int add)
+{
+    // whether a file in the store has been compared with other content of
+    // the same key already, optionally remembering that it has
+    size_t b = name_hash(path, strlen(path)) % 4096;
+    struct dedup_path *p;
+    dedup_lock();
+    for (p = dedup_verified[b]; p && strcmp(p->path, path); p = p->next) ;
+    if (!p && add) {
+        p = pst_malloc(sizeof(struct dedup_path));
+        p->path = strdup(path);
+        p->next = dedup_verified[b];
+        dedup_verified[b] = p;
+    }
+    dedup_unlock();
+    return (p != NULL);
+}
+
+
+static void dedup_mkdir(const char *key, char *shard)
+{
+    // make the store, and the directory in it for key unless that is NULL
+    int x;
+    if (output_mkdir(DEDUP_DIR) && errno != EEXIST) {
+        x = errno;
+        DIE(("dedup_mkdir: Cannot create directory %s: %s\n", DEDUP_DIR, strerror(x)));
+    }
+    if (!key) return;
+    sprintf(shard, "%s/%.2s", DEDUP_DIR, key);
+    if (output_mkdir(shard) && errno != EEXIST) {
+        x = errno;
+        DIE(("dedup_mkdir: Cannot create directory %s: %s\n", shard, strerror(x)));
+    }
+}
+
+
+static char *dedup_store(FILE *fp, const char *temp, const char *key)
+{
+    // link the spooled content in temp into the store under its key, or
+    // find it there already, and return its path there
+    char shard[sizeof(DEDUP_DIR) + 4];
+    char *base, *path;
+    int i;
+    dedup_mkdir(key, shard);
+    base = mk_path(shard, key);
+    path = pst_malloc(strlen(base) + 12);
+    for (i=0; ; i++) {
+        if (i) sprintf(path, "%s.%d", base, i);
+        else   strcpy(path, base);
+        // a concurrent writer of the same content just makes this fail
+        if (!link(temp, path)) break;
+        if (errno != EEXIST) {
+            DEBUG_WARN(("dedup_store: Cannot link \"%s\": %s\n", path, strerror(errno)));
+            break;
+        }
+        if (dedup_checked(path, 0)) break;
+        if (dedup_same(fp, path)) {
+            dedup_checked(path, 1);
+            break;
+        }
+        WARN(("dedup_store: %s has the digest of different content, trying the next name\n", path));
+    }
+    free(base);
+    return path;
+}
+
+
+static void dedup_reference(const char *name, const char *path)
+{
+    // make name refer to path in the store
+    name_add(name);
+    if (dedup_mode == DEDUP_MANIFEST) {
+        char *line = pst_malloc(strlen(name) + strlen(path) + 3);
+        size_t n = sprintf(line, "%s\t%s\n", path, name);
+        dedup_lock();
+        if (tar_fd >= 0) {
+            dedup_manifest = pst_realloc(dedup_manifest, dedup_manifest_len + n);
+            memcpy(dedup_manifest + dedup_manifest_len, line, n);
+            dedup_manifest_len += n;
+        }
+        else {
+            if (dedup_manifest_fd < 0) {
+                char *manifest = mk_path(DEDUP_DIR, "manifest");
+                dedup_manifest_fd = open(manifest, O_WRONLY | O_CREAT | O_APPEND, 0666);
+                if (dedup_manifest_fd < 0) DIE(("dedup_reference: Cannot open %s: %s\n", manifest, strerror(errno)));
+                free(manifest);
+            }
+            // a single append, so that forked children can share the file
+            if (write(dedup_manifest_fd, line, n) != (ssize_t)n) DEBUG_WARN(("dedup_reference: Cannot write the manifest\n"));
+        }
+        dedup_unlock();
+        free(line);
+    }
+    else if (dedup_mode == DEDUP_SYMLINK) {
+        // relative to the directory of name, which is relative to the store
+        const char *p;
+        char *target;
+        int depth = 0;
+        for (p=name; *p; p++) if (*p == '/') depth++;
+        target = pst_malloc(3*depth + strlen(path) + 1);
+        target[0] = '\0';
+        while (depth--) strcat(target, "../");
+        strcat(target, path);
+#ifdef HAVE_FOPENCOOKIE
+        if (tar_fd >= 0) tar_add_link(name, '2', target);
+        else
+#endif
+        if (symlink(target, name)) DEBUG_WARN(("dedup_reference: Cannot symlink \"%s\": %s\n", name, strerror(errno)));
+        free(target);
+    }
+    else {
+#ifdef HAVE_FOPENCOOKIE
+        if (tar_fd >= 0) tar_add_link(name, '1', path);
+        else
+#endif
+        if (link(path, name)) DEBUG_WARN(("dedup_reference: Cannot link \"%s\": %s\n", name, strerror(errno)));
+    }
+}
+
+
+void dedup_attachment(pst_file *pst, pst_item_attach *attach, const char *name)
+{
+    // write an attachment into the store and refer to it from name
+    char key[DEDUP_KEY];
+    char *path = NULL, *temp = NULL;
+    uint64_t size;
+    FILE *fp = NULL;
+    DEBUG_ENT("dedup_attachment");
+    if (tar_fd >= 0) {
+        fp = tmpfile();
+    }
+    else {
+        // in the store, so that it can be linked into place
+        int fd;
+        dedup_mkdir(NULL, NULL);
+        temp = mk_path(DEDUP_DIR, "tmp.XXXXXX");
+        if ((fd = mkstemp(temp)) >= 0 && !(fp = fdopen(fd, "w+b"))) close(fd);
+    }
+    if (!fp) {
+        DEBUG_WARN(("dedup_attachment: Cannot create a temporary file for %s: %s\n", name, strerror(errno)));
+    }
+    else if (dedup_spool(pst, attach, fp, key, &size)) {
+        DEBUG_WARN(("dedup_attachment: Cannot write a temporary file for %s\n", name));
+    }
+    else if (tar_fd >= 0) {
+        char shard[sizeof(DEDUP_DIR) + 4];
+        DEBUG_INFO(("Attachment %s is %s\n", name, key));
+        dedup_mkdir(key, shard);
+        path = mk_path(shard, key);
+        // the registry knows what is in the archive already
+        if (!name_find(path, 1)) {
+#ifdef HAVE_FOPENCOOKIE
+            tar_add(path, '0', NULL, 0, fileno(fp), size);
+#endif
+        }
+    }
+    else {
+        DEBUG_INFO(("Attachment %s is %s\n", name, key));
+        path = dedup_store(fp, temp, key);
+    }
+    if (path) dedup_reference(name, path);
+    if (fp) fclose(fp);
+    if (temp) {
+        unlink(temp);
+        free(temp);
+    }
+    free(path);
+    DEBUG_RET();
+}
+
+
+void dedup_base64(pst_file *pst, pst_item_attach *attach, FILE *f_output)
+{
+    // write the base64 encoding of an attachment, encoding it only the
+    // first time that content is seen
+    char key[DEDUP_KEY];
+    char *base64 = NULL;
+    struct dedup_node *n;
+    pst_blake2b_state hash;
+    pst_binary data;
+    size_t b;
+    int owned = 0;
+    DEBUG_ENT("dedup_base64");
+    if (attach->data.data) {
+        data = attach->data;
+    }
+    else if (pst_attach_size(pst, attach) > DEDUP_BASE64_MAX) {
+        // too big to hold in memory, or to be worth keeping in the cache
+        (void)pst_attach_to_file_base64(pst, attach, f_output);
+        DEBUG_RET();
+        return;
+    }
+    else {
+        data  = pst_attach_to_mem(pst, attach);
+        owned = 1;
+    }
+    if (!data.data || !data.size) {
+        if (owned) free(data.data);
+        DEBUG_RET();
+        return;
+    }
+    pst_blake2b_init(&hash, DEDUP_DIGEST);
+    pst_blake2b_update(&hash, data.data, data.size);
+    dedup_key(&hash, data.size, key);
+    b = strtoul(key + 2*DEDUP_DIGEST - 8, NULL, 16) % 4096;
+    dedup_lock();
+    for (n = dedup_cache[b]; n; n = n->next) {
+        if (!strcmp(n->key, key)) break;
+    }
+    dedup_unlock();
+    if (n && !n->verified) {
+        // the first time this key comes round again, make sure it is the
+        // same content by encoding it once more
+        char *encoded = pst_base64_encode(data.data, data.size);
+        if (encoded && strcmp(encoded, n->base64)) {
+            WARN(("dedup_base64: two attachments of %" PRIu64 " bytes have the same digest\n", (uint64_t)data.size));
+            (void)pst_fwrite(encoded, 1, strlen(encoded), f_output);
+            free(encoded);
+            if (owned) free(data.data);
+            DEBUG_RET();
+            return;
+        }
+        free(encoded);
+        n->verified = 1;
+    }
+    if (n) {
+        (void)pst_fwrite(n->base64, 1, strlen(n->base64), f_output);
+    }
+    else {
+        base64 = pst_base64_encode(data.data, data.size);
+        if (base64) {
+            (void)pst_fwrite(base64, 1, strlen(base64), f_output);
+            dedup_lock();
+            if (dedup_cached + strlen(base64) <= DEDUP_CACHE_MAX) {
+                n = pst_malloc(sizeof(struct dedup_node));
+                strcpy(n->key, key);
+                n->base64   = base64;
+                n->verified = 0;
+                n->next     = dedup_cache[b];
+                dedup_cache[b] = n;
+                dedup_cached += strlen(base64);
+                base64 = NULL;
+            }
+            dedup_unlock();
+            free(base64);
+        }
+    }
+    if (owned) free(data.data);
+    DEBUG_RET();
+}
+
+
+void dedup_close()
+{
+    if (dedup_manifest_fd >= 0) close(dedup_manifest_fd);
+#ifdef HAVE_FOPENCOOKIE
+    if (dedup_manifest) {
+        char *manifest = mk_path(DEDUP_DIR, "manifest");
+        tar_add(manifest, '0', dedup_manifest, dedup_manifest_len, -1, dedup_manifest_len);
+        free(manifest);
+    }
+#endif
+    free(dedup_manifest);
+}
+
+
+// The checkpoint journal. Every folder gets a line when its output is
+// opened, another each time --checkpoint items of it have been written
+// and synced, and a last one when it is done. Lines are written with a
+// single write() to a file opened for appending, so threads and forked
+// children can share it. --resume reads it back, reopens the output of
+// each folder cut back to its last checkpoint, and carries on after the
+// items done by then.
+//
+//  O <parent dir> <folder id> <dir> <output file per type>
+//  P <parent dir> <folder id> <children done> <last id> <item count> <skip count> <offset per type>
+//  F <parent dir> <folder id>
+//
+// Fields are tab separated, with tab, newline and backslash escaped.
+// A folder is known by the directory of its parent, which is itself
+// taken from the journal on resume, and its descriptor id.
+#define JOURNAL_BUCKETS 4096
+struct journal_folder *journal_folders[JOURNAL_BUCKETS];
+struct name_table      journal_paths;  // every dir and file named in the journal
+
+
+static struct journal_folder *journal_find(const char *parent, uint64_t id, int add)
+{
+    struct journal_folder *j;
+    size_t h = (name_hash(parent, strlen(parent)) ^ (size_t)id) % JOURNAL_BUCKETS;
+    for (j=journal_folders[h]; j; j=j->next) {
+        if (j->id == id && !strcmp(j->parent, parent)) return j;
+    }
+    if (!add) return NULL;
+    j = (struct journal_folder *)pst_malloc(sizeof(struct journal_folder));
+    memset(j, 0, sizeof(*j));
+    j->parent = strdup(parent);
+    j->id     = id;
+    j->next   = journal_folders[h];
+    journal_folders[h] = j;
+    return j;
+}
+
+
+static char *journal_escape(char *out, const char *s)
+{
+    // append a field to a line, returns the new end of the line
+    *out++ = '\t';
+    for (; s && *s; s++) {
+        if      (*s == '\t') { *out++ = '\\'; *out++ = 't'; }
+        else if (*s == '\n') { *out++ = '\\'; *out++ = 'n'; }
+        else if (*s == '\\') { *out++ = '\\'; *out++ = '\\'; }
+        else *out++ = *s;
+    }
+    return out;
+}
+
+
+static char *journal_unescape(char *s)
+{
+    // cut the next field off a line read back, in place
+    char *in, *out, *next;
+    if (!s) return NULL;
+    next = strchr(s, '\t');
+    if (next) *next++ = '\0';
+    for (in=out=s; *in; in++) {
+        if (*in == '\\' && in[1]) {
+            in++;
+            *out++ = (*in == 't') ? '\t' : (*in == 'n') ? '\n' : *in;
+        }
+        else *out++ = *in;
+    }
+    *out = '\0';
+    return next;
+}
+
+
+static char *journal_line(char type, const char *parent, uint64_t id, size_t extra, char **end)
+{
+    // start a line for a folder, with room for extra more bytes
+    char *line = pst_malloc(2*strlen(parent) + extra + 64);
+    char *p = line;
+    *p++ = type;
+    p = journal_escape(p, parent);
+    p += sprintf(p, "\t%" PRIu64, id);
+    *end = p;
+    return line;
+}
+
+
+static void journal_write(char *line, char *end, int sync)
+{
+    char *p = line;
+    *end++ = '\n';
+    while (p < end) {
+        ssize_t w = write(journal_fd, p, end - p);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            DIE(("journal_write: Cannot write the journal: %s\n", strerror(errno)));
+        }
+        p += w;
+    }
+    free(line);
+    if (sync && fdatasync(journal_fd)) {
+        DIE(("journal_write: Cannot sync the journal: %s\n", strerror(errno)));
+    }
+}
+
+
+static void journal_sync(struct file_ll *f, off_t *offset)
+{
+    // make the output of a folder durable before the journal says so
+    int32_t t;
+    if (mode == MODE_SEPARATE) output_sync_dir(f->dir);
+    for (t=0; t<PST_TYPE_MAX; t++) {
+        offset[t] = 0;
+        if (f->output[t] && (offset[t] = output_sync(f->output[t])) < 0) {
+            DIE(("journal_sync: Cannot sync \"%s\": %s\n", f->name[t], strerror(errno)));
+        }
+    }
+}
+
+
+void journal_open()
+{
+    // start a new journal in the output directory, or with --resume read
+    // back the one an earlier run left there
+    char *buf = NULL, *line, *eol;
+    size_t len = 0;
+    FILE *f;
+    DEBUG_ENT("journal_open");
+    if (resume && (f = fopen(JOURNAL_NAME, "r"))) {
+        char chunk[8192];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f))) {
+            buf = pst_realloc(buf, len + n);
+            memcpy(buf + len, chunk, n);
+            len += n;
+        }
+        fclose(f);
+        for (line=buf; line && line < buf + len; line=eol) {
+            struct journal_folder *j;
+            char *field[7 + PST_TYPE_MAX];
+            int n = 1, t;
+            // a last line without its newline was cut short, and is ignored
+            if (!(eol = memchr(line, '\n', buf + len - line))) break;
+            *eol++ = '\0';
+            field[0] = line;
+            while (n < (int)(sizeof(field)/sizeof(field[0])) && (field[n] = journal_unescape(field[n-1]))) n++;
+            if (n < 3) continue;
+            j = journal_find(field[1], strtoull(field[2], NULL, 10), 1);
+            if (line[0] == 'O' && n >= 4 && !j->dir) {
+                int added;
+                j->dir = strdup(field[3]);
+                name_lookup(&journal_paths, j->dir, strlen(j->dir), &added);
+                for (t=0; t<PST_TYPE_MAX && 4+t<n; t++) {
+                    if (*field[4+t]) {
+                        j->name[t] = strdup(field[4+t]);
+                        name_lookup(&journal_paths, j->name[t], strlen(j->name[t]), &added);
+                    }
+                }
+            }
+            else if (line[0] == 'P' && n >= 7) {
+                j->done       = atoi(field[3]);
+                j->last       = strtoull(field[4], NULL, 10);
+                j->item_count = atoi(field[5]);
+                j->skip_count = atoi(field[6]);
+                for (t=0; t<PST_TYPE_MAX && 7+t<n; t++) j->offset[t] = (off_t)strtoll(field[7+t], NULL, 10);
+            }
+            else if (line[0] == 'F') {
+                j->complete = 1;
+            }
+        }
+        free(buf);
+    }
+    journal_fd = open(JOURNAL_NAME, O_WRONLY | O_CREAT | O_APPEND | ((resume) ? 0 : O_TRUNC), 0666);
+    if (journal_fd < 0) {
+        DIE(("journal_open: Cannot open the journal %s: %s\n", JOURNAL_NAME, strerror(errno)));
+    }
+    DEBUG_RET();
+}
+
+
+struct journal_folder *journal_resume(const char *parent, uint64_t id)
+{
+    // what an earlier run did with this folder, if it got as far as
+    // opening its output
+    struct journal_folder *j;
+    if (!resume) return NULL;
+    j = journal_find(parent, id, 0);
+    return (j && j->dir) ? j : NULL;
+}
+
+
+int journal_leftover(const char *path)
+{
+    // on resume, an empty file or directory the journal does not know is
+    // one an earlier run created just before it was stopped, and is used
+    // again rather than moved aside with a new name
+    struct stat st;
+    if (!resume || name_lookup(&journal_paths, path, strlen(path), NULL)) return 0;
+    if (stat(path, &st)) return 0;
+    if (S_ISDIR(st.st_mode)) {
+        DIR *d = opendir(path);
+        struct dirent *e;
+        int empty = 1;
+        if (!d) return 0;
+        while (empty && (e = readdir(d))) {
+            if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) empty = 0;
+        }
+        closedir(d);
+        return empty;
+    }
+    return S_ISREG(st.st_mode) && !st.st_size;
+}
+
+
+void journal_enter_dir(struct file_ll *f, pst_item *item, struct journal_folder *j)
+{
+    // create_enter_dir() for a folder an earlier run started, with the
+    // same names and the output cut back to its last checkpoint. A folder
+    // that was finished gets no output at all.
+    int32_t t;
+    memset(f, 0, sizeof(*f));
+    f->stored_count = (item->folder) ? item->folder->item_count : 0;
+    pst_convert_utf8(item, &item->file_as);
+    f->dname = strdup(item->file_as.str);
+    f->dir   = strdup(j->dir);
+    DEBUG_ENT("journal_enter_dir");
+    if (*f->dir && output_mkdir(f->dir) && errno != EEXIST) {
+        DIE(("journal_enter_dir: Cannot create directory %s: %s\n", f->dir, strerror(errno)));
+    }
+    for (t=0; t<PST_TYPE_MAX; t++) {
+        struct stat st;
+        if (!j->name[t]) continue;
+        if (j->complete) {
+            // the run may have been stopped before it removed these
+            if (!stat(j->name[t], &st) && !st.st_size) remove(j->name[t]);
+            continue;
+        }
+        f->name[t] = strdup(j->name[t]);
+        if (!(f->output[t] = output_reopen(f->name[t], (gzip_level) ? OUTPUT_GZIP : 0, j->offset[t]))) {
+            DIE(("journal_enter_dir: Could not open file \"%s\" for write\n", f->name[t]));
+        }
     }
+    f->item_count = j->item_count;
+    f->skip_count = j->skip_count;
     DEBUG_RET();
-    return 0;
 }
 
 
-char *item_type_to_name(int32_t item_type) {
-    char *name;
-    switch (item_type) {
-        case PST_TYPE_APPOINTMENT:
-            name = "calendar";
-            break;
-        case PST_TYPE_CONTACT:
-            name = "contacts";
-            break;
-        case PST_TYPE_JOURNAL:
-            name = "journal";
-            break;
-        case PST_TYPE_STICKYNOTE:
-        case PST_TYPE_TASK:
-        case PST_TYPE_NOTE:
-        case PST_TYPE_OTHER:
-        case PST_TYPE_REPORT:
-        default:
-            name = "mbox";
-            break;
+void journal_folder(struct file_ll *f, const char *parent, uint64_t id)
+{
+    // record where the output of a folder goes, as it is opened. Separate
+    // mode names its files as it goes along.
+    size_t extra = 2*strlen(f->dir) + PST_TYPE_MAX;
+    char *line, *p;
+    int32_t t;
+    for (t=0; t<PST_TYPE_MAX; t++) {
+        if (f->name[t] && mode != MODE_SEPARATE) extra += 2*strlen(f->name[t]);
     }
-    return name;
+    line = journal_line('O', parent, id, extra, &p);
+    p = journal_escape(p, f->dir);
+    for (t=0; t<PST_TYPE_MAX; t++) p = journal_escape(p, (mode != MODE_SEPARATE) ? f->name[t] : NULL);
+    journal_write(line, p, 0);
 }
 
 
-int32_t reduced_item_type(int32_t item_type) {
-    int32_t reduced;
-    switch (item_type) {
-        case PST_TYPE_APPOINTMENT:
-        case PST_TYPE_CONTACT:
-        case PST_TYPE_JOURNAL:
-            reduced = item_type;
-            break;
-        case PST_TYPE_STICKYNOTE:
-        case PST_TYPE_TASK:
-        case PST_TYPE_NOTE:
-        case PST_TYPE_OTHER:
-        case PST_TYPE_REPORT:
-        default:
-            reduced = PST_TYPE_NOTE;
-            break;
-    }
-    return reduced;
+void journal_checkpoint(struct file_ll *f, const char *parent, uint64_t id, int32_t done, uint64_t last)
+{
+    // the first done children of a folder are in its output
+    off_t offset[PST_TYPE_MAX];
+    char *line, *p;
+    int32_t t;
+    journal_sync(f, offset);
+    line = journal_line('P', parent, id, 80 + 24*PST_TYPE_MAX, &p);
+    p += sprintf(p, "\t%" PRIi32 "\t%" PRIu64 "\t%" PRIi32 "\t%" PRIi32, done, last, f->item_count, f->skip_count);
+    for (t=0; t<PST_TYPE_MAX; t++) p += sprintf(p, "\t%lld", (long long)offset[t]);
+    journal_write(line, p, 1);
 }
 
 
-// this will create a directory by that name
-void mk_recurse_dir(char *dir) {
-    int x;
-    DEBUG_ENT("mk_recurse_dir");
-    check_filename(dir);
-    if (D_MKDIR (dir)) {
-        if (errno != EEXIST) {  // not an error because it exists
-            x = errno;
-            DIE(("mk_recurse_dir: Cannot create directory %s: %s\n", dir, strerror(x)));
-        }
-    }
-    if (chdir(dir)) {
-        x = errno;
-        DIE(("mk_recurse_dir: Cannot change to directory %s: %s\n", dir, strerror(x)));
+void journal_skip(struct file_ll *f, pst_desc_tree *d_ptr, uint64_t last)
+{
+    // a child an earlier run wrote out. Only a folder is looked at again,
+    // for the subfolders that run did not finish.
+    pst_item *item;
+    int32_t items = f->item_count, skipped = f->skip_count;
+    if (last && d_ptr->d_id != last) {
+        DIE(("journal_skip: The journal does not match this pst file, item %#" PRIx64 " is not %#" PRIx64 "\n", d_ptr->d_id, last));
     }
-    DEBUG_RET();
+    if (!d_ptr->child || !(item = parse_child(d_ptr))) return;
+    if (!item->folder || !process_item(f, item, d_ptr)) pst_freeItem(item);
+    f->item_count = items;
+    f->skip_count = skipped;
 }
 
 
-int close_recurse_dir() {
-    int x;
-    DEBUG_ENT("close_recurse_dir");
-    if (chdir("..")) {
-        x = errno;
-        DIE(("close_recurse_dir: Cannot go up dir (..): %s\n", strerror(x)));
-    }
-    DEBUG_RET();
-    return 0;
+void journal_finish(struct file_ll *f, const char *parent, uint64_t id)
+{
+    // all children of a folder are in its output
+    off_t offset[PST_TYPE_MAX];
+    char *line, *p;
+    journal_sync(f, offset);
+    line = journal_line('F', parent, id, 0, &p);
+    journal_write(line, p, 1);
 }
 
 
-void mk_separate_dir(char *dir) {
-    size_t dirsize = strlen(dir) + 10;
-    char dir_name[dirsize];
-    int x = 0, y = 0;
+// Incremental export. The descriptors of the messages written by the
+// last run are kept in a state file, with the ids of their descriptor
+// and attachment blocks and the size of the descriptor block. A message
+// of a later snapshot of the same pst file whose ids and size are all
+// the same has not changed, and is skipped before it is parsed. Every
+// message written, or skipped as unchanged, is appended to <file>.new,
+// with one write() per line since forked children add to it too. One
+// that fails to parse or is not written is left out, so that a later run
+// tries it again. <file>.new replaces the state file at the end, after
+// <file>.diff lists what is new, changed or deleted.
+struct incremental_entry {
+    struct incremental_entry *next;
+    char       *dir;            // output directory of its pst file
+    uint64_t    d_id;
+    uint64_t    desc_id;
+    uint64_t    assoc_id;
+    uint64_t    size;
+    int         seen;           // by this run
+};
+struct incremental_entry  **incremental_table = NULL;
+size_t                      incremental_size  = 0;
+size_t                      incremental_count = 0;
 
-    DEBUG_ENT("mk_separate_dir");
-    do {
-        if (y == 0)
-            snprintf(dir_name, dirsize, "%s", dir);
-        else
-            snprintf(dir_name, dirsize, "%s%i%s", dir, y, ""); // enough for 9 digits allocated above
 
-        check_filename(dir_name);
-        DEBUG_INFO(("about to try creating %s\n", dir_name));
-        if (D_MKDIR(dir_name)) {
-            if (errno != EEXIST) { // if there is an error, and it doesn't already exist
-                x = errno;
-                DIE(("mk_separate_dir: Cannot create directory %s: %s\n", dir, strerror(x)));
-            }
-        } else {
-            break;
-        }
-        y++;
-    } while (overwrite == 0);
+static const char *incremental_dir()
+{
+    // the output directory of the pst file this thread is working on
+    int i;
+    for (i=0; i<store_count; i++) {
+        if (&stores[i].pf == pstfile) return stores[i].dir;
+    }
+    return "";
+}
 
-    if (chdir(dir_name)) {
-        x = errno;
-        DIE(("mk_separate_dir: Cannot change to directory %s: %s\n", dir, strerror(x)));
+
+static struct incremental_entry *incremental_find(const char *dir, uint64_t d_id)
+{
+    struct incremental_entry *e;
+    if (!incremental_size) return NULL;
+    e = incremental_table[(name_hash(dir, strlen(dir)) ^ (size_t)d_id) & (incremental_size-1)];
+    for (; e; e=e->next) {
+        if (e->d_id == d_id && !strcmp(e->dir, dir)) return e;
     }
+    return NULL;
+}
 
-    if (overwrite) {
-        // we should probably delete all files from this directory
-#if !defined(WIN32) && !defined(__CYGWIN__)
-        DIR * sdir = NULL;
-        struct dirent *dirent = NULL;
-        struct stat filestat;
-        if (!(sdir = opendir("./"))) {
-            DEBUG_WARN(("mk_separate_dir: Cannot open dir \"%s\" for deletion of old contents\n", "./"));
-        } else {
-            while ((dirent = readdir(sdir))) {
-                if (lstat(dirent->d_name, &filestat) != -1)
-                    if (S_ISREG(filestat.st_mode)) {
-                        if (unlink(dirent->d_name)) {
-                            y = errno;
-                            DIE(("mk_separate_dir: unlink returned error on file %s: %s\n", dirent->d_name, strerror(y)));
-                        }
-                    }
-            }
-            closedir(sdir);     // cppcheck detected leak
+
+static void incremental_grow()
+{
+    size_t size = (incremental_size) ? incremental_size * 2 : 16;
+    size_t b;
+    struct incremental_entry **table = (struct incremental_entry **)pst_malloc(size * sizeof(struct incremental_entry *));
+    memset(table, 0, size * sizeof(struct incremental_entry *));
+    for (b=0; b<incremental_size; b++) {
+        while (incremental_table[b]) {
+            struct incremental_entry *e = incremental_table[b];
+            size_t h = (name_hash(e->dir, strlen(e->dir)) ^ (size_t)e->d_id) & (size-1);
+            incremental_table[b] = e->next;
+            e->next  = table[h];
+            table[h] = e;
         }
-#endif
     }
+    free(incremental_table);
+    incremental_table = table;
+    incremental_size  = size;
+}
 
-    DEBUG_RET();
+
+static struct incremental_entry *incremental_add(const struct incremental_entry *e)
+{
+    struct incremental_entry *p;
+    size_t h;
+    if (incremental_count >= incremental_size) incremental_grow();
+    p = (struct incremental_entry *)pst_malloc(sizeof(struct incremental_entry));
+    *p = *e;
+    p->dir = strdup(e->dir);
+    h = (name_hash(p->dir, strlen(p->dir)) ^ (size_t)p->d_id) & (incremental_size-1);
+    p->next = incremental_table[h];
+    incremental_table[h] = p;
+    incremental_count++;
+    return p;
 }
 
 
-int close_separate_dir() {
-    int x;
-    DEBUG_ENT("close_separate_dir");
-    if (chdir("..")) {
-        x = errno;
-        DIE(("close_separate_dir: Cannot go up dir (..): %s\n", strerror(x)));
+static int incremental_parse(char *line, struct incremental_entry *e)
+{
+    // a state file line is d_id, descriptor block id, attachment block id,
+    // descriptor size and the directory, which is last as it might have
+    // any character but a newline in it
+    char *p = line;
+    int i;
+    uint64_t *v[4] = {&e->d_id, &e->desc_id, &e->assoc_id, &e->size};
+    for (i=0; i<4; i++) {
+        char *end;
+        *v[i] = strtoull(p, &end, 10);
+        if (end == p || *end != '\t') return 0;
+        p = end + 1;
     }
-    DEBUG_RET();
-    return 0;
+    e->dir = p;
+    return 1;
 }
 
 
-void mk_separate_file(struct file_ll *f, int32_t t, char *extension, int openit) {
-    DEBUG_ENT("mk_separate_file");
-    DEBUG_INFO(("opening next file to save email type %s\n", item_type_to_name(t)));
-    if (f->item_count > 999999999) { // bigger than nine 9's
-        DIE(("mk_separate_file: The number of emails in this folder has become too high to handle\n"));
-    }
-    sprintf(f->name[t], "%" PRIi32 "%s", f->item_count, extension);
-    check_filename(f->name[t]);
-    if (openit) {
-        if (!(f->output[t] = fopen(f->name[t], "w"))) {
-            DIE(("mk_separate_file: Cannot open file to save email \"%s\"\n", f->name[t]));
-        }
+static char *incremental_read(const char *name, size_t *len)
+{
+    // the whole of a state file, with a line cut short left out
+    char *buf = NULL;
+    char chunk[8192];
+    size_t n;
+    FILE *f = fopen(name, "r");
+    *len = 0;
+    if (!f) return NULL;
+    while ((n = fread(chunk, 1, sizeof(chunk), f))) {
+        buf = pst_realloc(buf, *len + n + 1);
+        memcpy(buf + *len, chunk, n);
+        *len += n;
     }
-    DEBUG_RET();
+    fclose(f);
+    while (*len && buf[*len-1] != '\n') (*len)--;
+    if (buf) buf[*len] = '\0';
+    return buf;
 }
 
 
-void close_separate_file(struct file_ll *f) {
-    int32_t t;
-    DEBUG_ENT("close_separate_file");
-    for (t=0; t<PST_TYPE_MAX; t++) {
-        if (f->output[t]) {
-            struct stat st;
-            fclose(f->output[t]);
-            stat(f->name[t], &st);
-            if (!st.st_size) {
-                DEBUG_WARN(("removing empty output file %s\n", f->name[t]));
-                remove(f->name[t]);
-            }
-            f->output[t] = NULL;
+void incremental_open()
+{
+    // load the state file of the last run and start the one for this run.
+    // A resumed run carries on with the one it was writing.
+    char *buf, *line, *eol, *next_name;
+    size_t len;
+    DEBUG_ENT("incremental_open");
+    if ((buf = incremental_read(incremental_name, &len))) {
+        for (line=buf; line < buf + len; line=eol+1) {
+            struct incremental_entry e;
+            eol = strchr(line, '\n');
+            *eol = '\0';
+            memset(&e, 0, sizeof(e));
+            if (!incremental_parse(line, &e) || incremental_find(e.dir, e.d_id)) continue;
+            incremental_add(&e);
         }
+        free(buf);
+    }
+    next_name = pst_malloc(strlen(incremental_name) + 5);
+    sprintf(next_name, "%s.new", incremental_name);
+    if (resume && (buf = incremental_read(next_name, &len))) {
+        // drop a line the stopped run did not finish
+        if (truncate(next_name, len)) DEBUG_WARN(("incremental_open: Cannot truncate %s\n", next_name));
+        free(buf);
+        incremental_fd = open(next_name, O_WRONLY | O_APPEND);
+    }
+    else {
+        incremental_fd = open(next_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    }
+    if (incremental_fd < 0) {
+        DIE(("incremental_open: Cannot create %s: %s\n", next_name, strerror(errno)));
     }
+    free(next_name);
     DEBUG_RET();
 }
 
 
-char *my_stristr(char *haystack, char *needle) {
-    // my_stristr varies from strstr in that its searches are case-insensitive
-    char *x=haystack, *y=needle, *z = NULL;
-    if (!haystack || !needle) {
-        return NULL;
-    }
-    while (*y != '\0' && *x != '\0') {
-        if (tolower(*y) == tolower(*x)) {
-            // move y on one
-            y++;
-            if (!z) {
-                z = x; // store first position in haystack where a match is made
-            }
-        } else {
-            y = needle; // reset y to the beginning of the needle
-            z = NULL; // reset the haystack storage point
-        }
-        x++; // advance the search in the haystack
-    }
-    // If the haystack ended before our search finished, it's not a match.
-    if (*y != '\0') return NULL;
-    return z;
+int incremental_unchanged(pst_desc_tree *d_ptr)
+{
+    // has this message not changed since the last run
+    struct incremental_entry *e = incremental_find(incremental_dir(), d_ptr->d_id);
+    return e && d_ptr->desc &&
+           e->desc_id  == d_ptr->desc->i_id &&
+           e->size     == d_ptr->desc->size &&
+           e->assoc_id == ((d_ptr->assoc_tree) ? d_ptr->assoc_tree->i_id : 0);
 }
 
 
-void check_filename(char *fname) {
-    char *t = fname;
-    DEBUG_ENT("check_filename");
-    if (!t) {
-        DEBUG_RET();
-        return;
-    }
-    while ((t = strpbrk(t, "/\\:"))) {
-        // while there are characters in the second string that we don't want
-        *t = '_'; //replace them with an underscore
+void incremental_record(pst_desc_tree *d_ptr)
+{
+    // add a message seen by this run to the new state file
+    const char *dir = incremental_dir();
+    char *line = pst_malloc(strlen(dir) + 100);
+    char *p = line;
+    size_t len;
+    p += sprintf(p, "%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%s\n",
+                 d_ptr->d_id, d_ptr->desc->i_id,
+                 (d_ptr->assoc_tree) ? d_ptr->assoc_tree->i_id : (uint64_t)0,
+                 d_ptr->desc->size, dir);
+    len = p - line;
+    p   = line;
+    while (len) {
+        ssize_t w = write(incremental_fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            DIE(("incremental_record: Cannot write the state file: %s\n", strerror(errno)));
+        }
+        p   += w;
+        len -= w;
     }
-    DEBUG_RET();
+    free(line);
 }
 
 
-/**
- * check if the file name extension is acceptable. If not, the attachment
- * will be discarded
- * @param attach  pst attachment object
- * @return        true if the attachment filename contains an extension that we want.
- */
-int  acceptable_ext(pst_item_attach* attach)
+void incremental_close(int failed)
 {
-    if (!acceptable_extensions || *acceptable_extensions == '\0') return 1;     // acceptable list missing or empty
-    char *attach_filename = (attach->filename2.str) ? attach->filename2.str
-                                                    : attach->filename1.str;
-    if (!attach_filename) return 1; // attachment with no name is always acceptable
-    char *e = strrchr(attach_filename, '.');
-    if (!e) return 1;               // attachment with no extension is always acceptable.
-    DEBUG_ENT("acceptable_ext");
-    DEBUG_INFO(("attachment extension %s\n", e));
-    int rc = 0;
-    char *a = acceptable_extensions;
-    while (*a) {
-        if (pst_stricmp(a, e) == 0) {
-            rc = 1;
-            break;
+    // compare this run with the last one, and make it the one the next
+    // run compares with
+    char *next_name = pst_malloc(strlen(incremental_name) + 6);
+    char *diff_name = pst_malloc(strlen(incremental_name) + 6);
+    char *buf, *line, *eol;
+    size_t len, b;
+    int32_t added = 0, changed = 0, same = 0, deleted = 0;
+    FILE *diff;
+    DEBUG_ENT("incremental_close");
+    close(incremental_fd);
+    incremental_fd = -1;
+    sprintf(next_name, "%s.new", incremental_name);
+    sprintf(diff_name, "%s.diff", incremental_name);
+    if (!(diff = fopen(diff_name, "w"))) {
+        DIE(("incremental_close: Cannot create %s: %s\n", diff_name, strerror(errno)));
+    }
+    buf = incremental_read(next_name, &len);
+    for (line=buf; buf && line < buf + len; line=eol+1) {
+        struct incremental_entry e, *old;
+        eol = strchr(line, '\n');
+        *eol = '\0';
+        memset(&e, 0, sizeof(e));
+        if (!incremental_parse(line, &e)) continue;
+        old = incremental_find(e.dir, e.d_id);
+        if (old && old->seen) continue;     // written again by a resumed run
+        if (!old) {
+            // remembered as seen, so that it is only counted once
+            incremental_add(&e)->seen = 1;
+            fprintf(diff, "new\t%" PRIu64 "\t%s\n", e.d_id, e.dir);
+            added++;
+            continue;
         }
-        a += strlen(a) + 1;
+        old->seen = 1;
+        if (old->desc_id != e.desc_id || old->assoc_id != e.assoc_id || old->size != e.size) {
+            fprintf(diff, "changed\t%" PRIu64 "\t%s\n", e.d_id, e.dir);
+            changed++;
+        }
+        else same++;
     }
-    DEBUG_INFO(("attachment acceptable returns %d\n", rc));
+    free(buf);
+    for (b=0; b<incremental_size; b++) {
+        struct incremental_entry *e;
+        for (e=incremental_table[b]; e; e=e->next) {
+            if (e->seen) continue;
+            fprintf(diff, "deleted\t%" PRIu64 "\t%s\n", e->d_id, e->dir);
+            deleted++;
+        }
+    }
+    if (fclose(diff)) {
+        DIE(("incremental_close: Cannot write %s: %s\n", diff_name, strerror(errno)));
+    }
+    if (failed) {
+        // the messages of a pst file that could not be read would all look
+        // deleted next time
+        fprintf(stderr, "readpst: not all pst files were converted, %s is left as it was\n", incremental_name);
+    }
+    else if (rename(next_name, incremental_name)) {
+        DIE(("incremental_close: Cannot replace %s: %s\n", incremental_name, strerror(errno)));
+    }
+    if (output_mode != OUTPUT_QUIET) {
+        printf("%" PRIi32 " new, %" PRIi32 " changed, %" PRIi32 " unchanged and %" PRIi32 " deleted items since the last run\n",
+               added, changed, same, deleted);
+    }
+    for (b=0; b<incremental_size; b++) {
+        while (incremental_table[b]) {
+            struct incremental_entry *e = incremental_table[b];
+            incremental_table[b] = e->next;
+            free(e->dir);
+            free(e);
+        }
+    }
+    free(incremental_table);
+    free(next_name);
+    free(diff_name);
     DEBUG_RET();
-    return rc;
 }
 
 
 void write_separate_attachment(char f_name[], pst_item_attach* attach, int attach_num, pst_file* pst)
 {
     FILE *fp = NULL;
-    int x = 0;
     char *temp = NULL;
 
     // If there is a long filename (filename2) use that, otherwise
@@ -1082,31 +4796,23 @@ void write_separate_attachment(char f_name[], pst_item_attach* attach, int attac
         }
     }
 
-    check_filename(f_name);
     if (!attach_filename) {
         // generate our own (dummy) filename for the attachment
         temp = pst_malloc(strlen(f_name)+15);
         sprintf(temp, "%s-attach%i", f_name, attach_num);
+        name_add(temp);
     } else {
         // have an attachment name, make sure it's unique
-        temp = pst_malloc(strlen(f_name)+strlen(attach_filename)+15);
-        do {
-            if (fp) fclose(fp);
-            if (x == 0)
-                sprintf(temp, "%s-%s", f_name, attach_filename);
-            else
-                sprintf(temp, "%s-%s-%i", f_name, attach_filename, x);
-        } while ((fp = fopen(temp, "r")) && ++x < 99999999);
-        if (x > 99999999) {
-            DIE(("error finding attachment name. exhausted possibilities to %s\n", temp));
-        }
+        temp = name_unique(f_name, attach_filename);
     }
     DEBUG_INFO(("Saving attachment to %s\n", temp));
-    if (!(fp = fopen(temp, "w"))) {
+    if (dedup_mode) {
+        dedup_attachment(pst, attach, temp);
+    } else if (!(fp = output_open(temp, OUTPUT_KEEP))) {
         DEBUG_WARN(("write_separate_attachment: Cannot open attachment save file \"%s\"\n", temp));
     } else {
         (void)pst_attach_to_file(pst, attach, fp);
-        fclose(fp);
+        output_close(fp);
     }
     if (temp) free(temp);
     DEBUG_RET();
@@ -1299,7 +5005,8 @@ void write_inline_attachment(FILE* f_output, pst_item_attach* attach, char *boun
         fprintf(f_output, "Content-Disposition: inline\n\n");
     }
 
-    (void)pst_attach_to_file_base64(pst, attach, f_output);
+    if (dedup_mode) dedup_base64(pst, attach, f_output);
+    else            (void)pst_attach_to_file_base64(pst, attach, f_output);
     fprintf(f_output, "\n\n");
     DEBUG_RET();
 }
@@ -1579,9 +5286,9 @@ void find_rfc822_headers(char** extra_mime_headers)
 
 void write_body_part(FILE* f_output, pst_string *body, char *mime, char *charset, char *boundary, pst_file* pst)
 {
+    int base64;
     DEBUG_ENT("write_body_part");
-    removeCR(body->str);
-    size_t body_len = strlen(body->str);
+    size_t body_len = prepare_body(body->str, &base64);
 
     if (body->is_utf8 && (strcasecmp("utf-8", charset))) {
         if (prefer_utf8) {
@@ -1606,11 +5313,11 @@ void write_body_part(FILE* f_output, pst_string *body, char *mime, char *charset
                 free(body->str);
                 body->str = newer->b;
                 body_len = newer->dlen;
+                base64 = test_base64(body->str, body_len);
             }
             free(newer);
         }
     }
-    int base64 = test_base64(body->str, body_len);
     fprintf(f_output, "\n--%s\n", boundary);
     fprintf(f_output, "Content-Type: %s; charset=\"%s\"\n", mime, charset);
     if (base64) fprintf(f_output, "Content-Transfer-Encoding: base64\n");
@@ -1619,13 +5326,13 @@ void write_body_part(FILE* f_output, pst_string *body, char *mime, char *charset
     if (base64) {
         char *enc = pst_base64_encode(body->str, body_len);
         if (enc) {
-            write_email_body(f_output, enc);
+            write_email_body(f_output, enc, strlen(enc));
             fprintf(f_output, "\n");
             free(enc);
         }
     }
     else {
-        write_email_body(f_output, body->str);
+        write_email_body(f_output, body->str, body_len);
     }
     DEBUG_RET();
 }
@@ -1686,6 +5393,7 @@ void write_normal_email(FILE* f_output, char f_name[], pst_item* item, int curre
     char *temp = NULL;
     time_t em_time;
     char *c_time = NULL;
+    char c_time_buffer[C_TIME_SIZE];
     char *headers = NULL;
     int has_from, has_subject, has_to, has_cc, has_date, has_msgid;
     has_from = has_subject = has_to = has_cc = has_date = has_msgid = 0;
@@ -1719,7 +5427,7 @@ void write_normal_email(FILE* f_output, char f_name[], pst_item* item, int curre
     // convert the sent date if it exists, or set it to a fixed date
     if (item->email->sent_date) {
         em_time = pst_fileTimeToUnixTime(item->email->sent_date);
-        c_time = ctime(&em_time);
+        c_time = ctime_r(&em_time, c_time_buffer);
         if (c_time)
             c_time[strlen(c_time)-1] = '\0'; //remove end \n
     }
@@ -1935,6 +5643,7 @@ void write_normal_email(FILE* f_output, char f_name[], pst_item* item, int curre
         attach->next = item->attach;
         item->attach = attach;
         attach->data.data         = pst_lzfu_decompress(item->email->rtf_compressed.data, item->email->rtf_compressed.size, &attach->data.size);
+        stats_lzfu(item->email->rtf_compressed.size, attach->data.size);
         attach->filename2.str     = strdup(RTF_ATTACH_NAME);
         attach->filename2.is_utf8 = 1;
         attach->mimetype.str      = strdup(RTF_ATTACH_TYPE);
@@ -2353,7 +6062,89 @@ void write_appointment(FILE* f_output, pst_item* item)
 }
 
 
-void create_enter_dir(struct file_ll* f, pst_item *item)
+// JSON Lines output, selected with --json. Every item is one line of
+// metadata taken straight from the pst_item, so nothing is rendered as
+// MIME or base64 encoded. The path of each folder is kept as the folder
+// is entered, before any of its items or subfolders are processed.
+struct json_folder {
+    struct json_folder *next;
+    pst_desc_tree      *d_ptr;
+    char               *path;
+};
+#define JSON_FOLDER_BUCKETS 1024
+struct json_folder *json_folders[JSON_FOLDER_BUCKETS];
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t     json_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static struct json_folder **json_bucket(pst_desc_tree *d_ptr)
+{
+    return &json_folders[((uintptr_t)d_ptr / sizeof(pst_desc_tree)) % JSON_FOLDER_BUCKETS];
+}
+
+
+const char *json_folder_path(pst_desc_tree *d_ptr)
+{
+    struct json_folder *j;
+    const char *path = "";
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&json_mutex);
+#endif
+    for (j=*json_bucket(d_ptr); j; j=j->next) {
+        if (j->d_ptr == d_ptr) {
+            path = j->path;
+            break;
+        }
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&json_mutex);
+#endif
+    return path;
+}
+
+
+void json_enter_folder(pst_desc_tree *d_ptr, const char *name)
+{
+    // the path of a folder is the path of its parent and its own name
+    struct json_folder *j;
+    const char *parent = (d_ptr->parent) ? json_folder_path(d_ptr->parent) : "";
+    j = (struct json_folder *)pst_malloc(sizeof(struct json_folder));
+    j->d_ptr = d_ptr;
+    j->path  = pst_malloc(strlen(parent) + strlen(name) + 2);
+    if (*parent) sprintf(j->path, "%s/%s", parent, name);
+    else         strcpy(j->path, name);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&json_mutex);
+#endif
+    j->next = *json_bucket(d_ptr);
+    *json_bucket(d_ptr) = j;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&json_mutex);
+#endif
+}
+
+
+void write_json(FILE *f_output, pst_item *item, pst_desc_tree *d_ptr)
+{
+    fputs("{\"folder\":", f_output);
+    json_escape(f_output, (d_ptr->parent) ? json_folder_path(d_ptr->parent) : "");
+    fputc(',', f_output);
+    json_item_fields(f_output, pstfile, item, d_ptr, 0);
+    if (json_mode == JSON_BODY) {
+        pst_convert_utf8_null(item, &item->body);
+        if (item->body.str) {
+            json_string(f_output, "body", item, &item->body);
+        }
+        else if (item->email) {
+            json_string(f_output, "html", item, &item->email->htmlbody);
+        }
+    }
+    fputs("}\n", f_output);
+}
+
+
+void create_enter_dir(struct file_ll* f, pst_item *item, char *parent_dir)
 {
     memset(f, 0, sizeof(*f));
     f->stored_count = (item->folder) ? item->folder->item_count : 0;
@@ -2364,7 +6155,7 @@ void create_enter_dir(struct file_ll* f, pst_item *item)
     DEBUG_ENT("create_enter_dir");
     if (mode == MODE_KMAIL) {
         int32_t t;
-        mk_kmail_dir(item->file_as.str);
+        f->dir = mk_kmail_dir(parent_dir, item->file_as.str);
         for (t=0; t<PST_TYPE_MAX; t++) {
             if (t == reduced_item_type(t)) {
                 f->name[t] = (char*) pst_malloc(strlen(item->file_as.str)+strlen(OUTPUT_TEMPLATE)+30);
@@ -2373,34 +6164,31 @@ void create_enter_dir(struct file_ll* f, pst_item *item)
         }
     } else if (mode == MODE_RECURSE) {
         int32_t t;
-        mk_recurse_dir(item->file_as.str);
+        f->dir = mk_recurse_dir(parent_dir, item->file_as.str);
         for (t=0; t<PST_TYPE_MAX; t++) {
             if (t == reduced_item_type(t)) {
                 f->name[t] = strdup(item_type_to_name(t));
             }
         }
         if (mode_thunder) {
-            FILE *type_file = fopen(".type", "w");
+            char *type_name = mk_path(f->dir, ".type");
+            FILE *type_file = output_open(type_name, OUTPUT_KEEP);
             if (type_file) {
                 fprintf(type_file, "%d\n", item->type);
-                fclose(type_file);
+                output_close(type_file);
             } else {
                 DEBUG_WARN(("could not write .type file: %d\n", item->type));
             }
+            free(type_name);
         }
     } else if (mode == MODE_SEPARATE) {
         // do similar stuff to recurse here.
-        int32_t t;
-        mk_separate_dir(item->file_as.str);
-        for (t=0; t<PST_TYPE_MAX; t++) {
-            if (t == reduced_item_type(t)) {
-                f->name[t] = (char*) pst_malloc(file_name_len);
-                memset(f->name[t], 0, file_name_len);
-            }
-        }
+        // the file names are set by mk_separate_file()
+        f->dir = mk_separate_dir(parent_dir, item->file_as.str);
     } else {
         // MODE_NORMAL
         int32_t t;
+        f->dir = strdup(parent_dir);
         for (t=0; t<PST_TYPE_MAX; t++) {
             if (t == reduced_item_type(t)) {
                 f->name[t] = (char*) pst_malloc(strlen(item->file_as.str)+strlen(OUTPUT_TEMPLATE)+30);
@@ -2411,38 +6199,47 @@ void create_enter_dir(struct file_ll* f, pst_item *item)
 
     if (mode != MODE_SEPARATE) {
         int32_t t;
+        output_name_lock();
         for (t=0; t<PST_TYPE_MAX; t++) {
             if (f->name[t]) {
+                char *path;
+                const char *suffix = (gzip_level) ? ".gz" : "";
                 if (!overwrite) {
                     int x = 0;
-                    char *temp = (char*) pst_malloc (strlen(f->name[t])+10); //enough room for 10 digits
+                    char *temp = (char*) pst_malloc (strlen(f->name[t])+13); //enough room for 10 digits and .gz
 
-                    sprintf(temp, "%s", f->name[t]);
+                    sprintf(temp, "%s%s", f->name[t], suffix);
                     check_filename(temp);
-                    while ((f->output[t] = fopen(temp, "r"))) {
+                    path = mk_path(f->dir, temp);
+                    while (output_exists(path) && !journal_leftover(path)) {
                         DEBUG_INFO(("need to increase filename because one already exists with that name\n"));
                         x++;
-                        sprintf(temp, "%s%08d", f->name[t], x);
+                        sprintf(temp, "%s%08d%s", f->name[t], x, suffix);
                         DEBUG_INFO(("- bump file name and try \"%s\"\n", temp));
                         if (x == 99999999) {
                             DIE(("create_enter_dir: Why can I not create a folder %s? I have tried %i extensions...\n", f->name[t], x));
                         }
-                        fclose(f->output[t]);
-                    }
-                    if (x > 0) { //then the f->name should change
-                        free (f->name[t]);
-                        f->name[t] = temp;
-                    } else {
-                        free(temp);
+                        free(path);
+                        path = mk_path(f->dir, temp);
                     }
+                    free(path);
+                    free (f->name[t]);
+                    f->name[t] = temp;
+                } else if (*suffix) {
+                    f->name[t] = pst_realloc(f->name[t], strlen(f->name[t])+4);
+                    strcat(f->name[t], suffix);
                 }
                 check_filename(f->name[t]);
-                if (!(f->output[t] = fopen(f->name[t], "w"))) {
+                path = mk_path(f->dir, f->name[t]);
+                free(f->name[t]);
+                f->name[t] = path;
+                if (!(f->output[t] = output_open(f->name[t], (gzip_level) ? OUTPUT_GZIP : 0))) {
                     DIE(("create_enter_dir: Could not open file \"%s\" for write\n", f->name[t]));
                 }
                 DEBUG_INFO(("f->name = %s\nitem->folder_name = %s\n", f->name[t], item->file_as.str));
             }
         }
+        output_name_unlock();
     }
     DEBUG_RET();
 }
@@ -2462,13 +6259,12 @@ void close_enter_dir(struct file_ll *f)
     for (t=0; t<PST_TYPE_MAX; t++) {
         if (f->output[t]) {
             if (mode == MODE_SEPARATE) DEBUG_WARN(("close_enter_dir finds open separate file\n"));
-            fclose(f->output[t]);
+            output_close(f->output[t]);
             f->output[t] = NULL;
         }
         if (f->name[t]) {
             struct stat st;
-            stat(f->name[t], &st);
-            if (!st.st_size) {
+            if (!stat(f->name[t], &st) && !st.st_size) {
                 DEBUG_WARN(("removing empty output file %s\n", f->name[t]));
                 remove(f->name[t]);
             }
@@ -2477,21 +6273,19 @@ void close_enter_dir(struct file_ll *f)
         }
     }
     free(f->dname);
-
-    if (mode == MODE_KMAIL)
-        close_kmail_dir();
-    else if (mode == MODE_RECURSE) {
-        if (mode_thunder) {
-            FILE *type_file = fopen(".size", "w");
-            if (type_file) {
-                fprintf(type_file, "%" PRIi32 " %" PRIi32 "\n", f->item_count, f->stored_count);
-                fclose(type_file);
-            } else {
-                DEBUG_WARN(("could not write .size file: %" PRIi32 " %" PRIi32 "\n", f->item_count, f->stored_count));
-            }
+    if (mode == MODE_SEPARATE && tar_fd < 0) name_forget(f->dir);
+
+    if (mode == MODE_RECURSE && mode_thunder) {
+        char *size_name = mk_path(f->dir, ".size");
+        FILE *type_file = output_open(size_name, OUTPUT_KEEP);
+        if (type_file) {
+            fprintf(type_file, "%" PRIi32 " %" PRIi32 "\n", f->item_count, f->stored_count);
+            output_close(type_file);
+        } else {
+            DEBUG_WARN(("could not write .size file: %" PRIi32 " %" PRIi32 "\n", f->item_count, f->stored_count));
         }
-        close_recurse_dir();
-    } else if (mode == MODE_SEPARATE)
-        close_separate_dir();
+        free(size_name);
+    }
+    free(f->dir);
 }
 
@@ -1,13 +1,24 @@
 
 #include "define.h"
 
-static int unicode_up = 0;
-static iconv_t i16to8;
-static const char *target_charset = NULL;
-static int         target_open_from = 0;
-static int         target_open_to   = 0;
-static iconv_t     i8totarget = (iconv_t)-1;
-static iconv_t     target2i8  = (iconv_t)-1;
+// iconv descriptors carry conversion state, so each thread has its own
+// set. They are opened on first use, and closed when the thread exits.
+struct pst_unicode {
+    int         up;
+    iconv_t     i16to8;
+    const char *target_charset;
+    int         target_open_from;
+    int         target_open_to;
+    iconv_t     i8totarget;
+    iconv_t     target2i8;
+};
+
+#ifdef HAVE_PTHREAD_H
+    static pthread_key_t  unicode_key;
+    static pthread_once_t unicode_once = PTHREAD_ONCE_INIT;
+#else
+    static struct pst_unicode unicode_global;
+#endif
 
 
 #define ASSERT(x,...) { if( !(x) ) DIE(( __VA_ARGS__)); }
@@ -38,32 +49,96 @@ static size_t pst_vbavail(pst_vbuf * vb)
 }
 
 
-static void open_targets(const char* charset);
-static void open_targets(const char* charset)
+static void unicode_open(struct pst_unicode *u);
+static void unicode_open(struct pst_unicode *u)
 {
-    if (!target_charset || strcasecmp(target_charset, charset)) {
-        if (target_open_from) iconv_close(i8totarget);
-        if (target_open_to)   iconv_close(target2i8);
-        if (target_charset)   free((char *)target_charset);
-        target_charset   = strdup(charset);
-        target_open_from = 1;
-        target_open_to   = 1;
-        i8totarget = iconv_open(target_charset, "utf-8");
-        if (i8totarget == (iconv_t)-1) {
-            target_open_from = 0;
-            DEBUG_WARN(("Couldn't open iconv descriptor for utf-8 to %s.\n", target_charset));
+    u->i16to8 = iconv_open("utf-8", "utf-16le");
+    if (u->i16to8 == (iconv_t)-1) {
+        DEBUG_WARN(("Couldn't open iconv descriptor for utf-16le to utf-8.\n"));
+    }
+    u->up = 1;
+}
+
+
+static void unicode_close(struct pst_unicode *u);
+static void unicode_close(struct pst_unicode *u)
+{
+    if (u->up && u->i16to8 != (iconv_t)-1) iconv_close(u->i16to8);
+    if (u->target_open_from) iconv_close(u->i8totarget);
+    if (u->target_open_to)   iconv_close(u->target2i8);
+    if (u->target_charset)   free((char *)u->target_charset);
+    u->target_charset   = NULL;
+    u->target_open_from = 0;
+    u->target_open_to   = 0;
+    u->up = 0;
+}
+
+
+#ifdef HAVE_PTHREAD_H
+static void unicode_free(void *arg);
+static void unicode_free(void *arg)
+{
+    unicode_close((struct pst_unicode *)arg);
+    free(arg);
+}
+
+
+static void unicode_key_init(void);
+static void unicode_key_init(void)
+{
+    pthread_key_create(&unicode_key, unicode_free);
+}
+#endif
+
+
+/** the conversion state of the calling thread, opened if need be
+ */
+static struct pst_unicode *unicode_get(void);
+static struct pst_unicode *unicode_get(void)
+{
+    struct pst_unicode *u;
+#ifdef HAVE_PTHREAD_H
+    pthread_once(&unicode_once, unicode_key_init);
+    u = (struct pst_unicode *)pthread_getspecific(unicode_key);
+    if (!u) {
+        u = pst_malloc(sizeof(struct pst_unicode));
+        memset(u, 0, sizeof(struct pst_unicode));
+        pthread_setspecific(unicode_key, u);
+    }
+#else
+    u = &unicode_global;
+#endif
+    if (!u->up) unicode_open(u);
+    return u;
+}
+
+
+static void open_targets(struct pst_unicode *u, const char* charset);
+static void open_targets(struct pst_unicode *u, const char* charset)
+{
+    if (!u->target_charset || strcasecmp(u->target_charset, charset)) {
+        if (u->target_open_from) iconv_close(u->i8totarget);
+        if (u->target_open_to)   iconv_close(u->target2i8);
+        if (u->target_charset)   free((char *)u->target_charset);
+        u->target_charset   = strdup(charset);
+        u->target_open_from = 1;
+        u->target_open_to   = 1;
+        u->i8totarget = iconv_open(u->target_charset, "utf-8");
+        if (u->i8totarget == (iconv_t)-1) {
+            u->target_open_from = 0;
+            DEBUG_WARN(("Couldn't open iconv descriptor for utf-8 to %s.\n", u->target_charset));
         }
-        target2i8 = iconv_open("utf-8", target_charset);
-        if (target2i8 == (iconv_t)-1) {
-            target_open_to = 0;
-            DEBUG_WARN(("Couldn't open iconv descriptor for %s to utf-8.\n", target_charset));
+        u->target2i8 = iconv_open("utf-8", u->target_charset);
+        if (u->target2i8 == (iconv_t)-1) {
+            u->target_open_to = 0;
+            DEBUG_WARN(("Couldn't open iconv descriptor for %s to utf-8.\n", u->target_charset));
         }
     }
 }
 
 
-static size_t sbcs_conversion(pst_vbuf *dest, const char *inbuf, int iblen, iconv_t conversion);
-static size_t sbcs_conversion(pst_vbuf *dest, const char *inbuf, int iblen, iconv_t conversion)
+static size_t sbcs_conversion(struct pst_unicode *u, pst_vbuf *dest, const char *inbuf, int iblen, iconv_t conversion);
+static size_t sbcs_conversion(struct pst_unicode *u, pst_vbuf *dest, const char *inbuf, int iblen, iconv_t conversion)
 {
     size_t inbytesleft  = iblen;
     size_t icresult     = (size_t)-1;
@@ -85,7 +160,8 @@ static size_t sbcs_conversion(pst_vbuf *dest, const char *inbuf, int iblen, icon
 
     if (icresult == (size_t)-1) {
         DEBUG_WARN(("iconv failure: %s\n", strerror(myerrno)));
-        pst_unicode_init();
+        unicode_close(u);
+        unicode_open(u);
         DEBUG_RET();
         return (size_t)-1;
     }
@@ -94,17 +170,21 @@ static size_t sbcs_conversion(pst_vbuf *dest, const char *inbuf, int iblen, icon
 }
 
 
-void pst_unicode_close();
 void pst_unicode_close()
 {
-    iconv_close(i16to8);
-    if (target_open_from) iconv_close(i8totarget);
-    if (target_open_to)   iconv_close(target2i8);
-    if (target_charset)   free((char *)target_charset);
-    target_charset   = NULL;
-    target_open_from = 0;
-    target_open_to   = 0;
-    unicode_up = 0;
+    // close the state of the calling thread only if it has one, rather
+    // than opening it to close it
+#ifdef HAVE_PTHREAD_H
+    struct pst_unicode *u;
+    pthread_once(&unicode_once, unicode_key_init);
+    u = (struct pst_unicode *)pthread_getspecific(unicode_key);
+    if (u) {
+        unicode_free(u);
+        pthread_setspecific(unicode_key, NULL);
+    }
+#else
+    unicode_close(&unicode_global);
+#endif
 }
 
 
@@ -201,24 +281,22 @@ void pst_vbappend(pst_vbuf *vb, void *b, size_t len)
 
 void pst_unicode_init()
 {
-    if (unicode_up) pst_unicode_close();
-    i16to8 = iconv_open("utf-8", "utf-16le");
-    if (i16to8 == (iconv_t)-1) {
-        DEBUG_WARN(("Couldn't open iconv descriptor for utf-16le to utf-8.\n"));
-    }
-    unicode_up = 1;
+    struct pst_unicode *u = unicode_get();
+    unicode_close(u);
+    unicode_open(u);
 }
 
 
 size_t pst_vb_utf16to8(pst_vbuf *dest, const char *inbuf, int iblen)
 {
+    struct pst_unicode *u = unicode_get();
     size_t inbytesleft  = iblen;
     size_t icresult     = (size_t)-1;
     size_t outbytesleft = 0;
     char *outbuf        = NULL;
     int   myerrno;
 
-    if (!unicode_up) return (size_t)-1;   // failure to open iconv
+    if (u->i16to8 == (iconv_t)-1) return (size_t)-1;   // failure to open iconv
     pst_vbresize(dest, iblen);
 
     //Bad Things can happen if a non-zero-terminated utf16 string comes through here
@@ -228,7 +306,7 @@ size_t pst_vb_utf16to8(pst_vbuf *dest, const char *inbuf, int iblen)
     do {
         outbytesleft = dest->blen - dest->dlen;
         outbuf = dest->b + dest->dlen;
-        icresult = iconv(i16to8, (ICONV_CONST char**)&inbuf, &inbytesleft, &outbuf, &outbytesleft);
+        icresult = iconv(u->i16to8, (ICONV_CONST char**)&inbuf, &inbytesleft, &outbuf, &outbytesleft);
         myerrno  = errno;
         dest->dlen = outbuf - dest->b;
         if (inbytesleft) pst_vbgrow(dest, inbytesleft);
@@ -236,7 +314,8 @@ size_t pst_vb_utf16to8(pst_vbuf *dest, const char *inbuf, int iblen)
 
     if (icresult == (size_t)-1) {
         DEBUG_WARN(("iconv failure: %s\n", strerror(myerrno)));
-        pst_unicode_init();
+        unicode_close(u);
+        unicode_open(u);
         return (size_t)-1;
     }
     return (icresult) ? (size_t)-1 : 0;
@@ -245,16 +324,18 @@ size_t pst_vb_utf16to8(pst_vbuf *dest, const char *inbuf, int iblen)
 
 size_t pst_vb_utf8to8bit(pst_vbuf *dest, const char *inbuf, int iblen, const char* charset)
 {
-    open_targets(charset);
-    if (!target_open_from) return (size_t)-1;   // failure to open the target
-    return sbcs_conversion(dest, inbuf, iblen, i8totarget);
+    struct pst_unicode *u = unicode_get();
+    open_targets(u, charset);
+    if (!u->target_open_from) return (size_t)-1;    // failure to open the target
+    return sbcs_conversion(u, dest, inbuf, iblen, u->i8totarget);
 }
 
 
 size_t pst_vb_8bit2utf8(pst_vbuf *dest, const char *inbuf, int iblen, const char* charset)
 {
-    open_targets(charset);
-    if (!target_open_to) return (size_t)-1;     // failure to open the target
-    return sbcs_conversion(dest, inbuf, iblen, target2i8);
+    struct pst_unicode *u = unicode_get();
+    open_targets(u, charset);
+    if (!u->target_open_to) return (size_t)-1;      // failure to open the target
+    return sbcs_conversion(u, dest, inbuf, iblen, u->target2i8);
 }
 
@@ -23,8 +23,8 @@ pst_vbuf  *pst_vballoc(size_t len);
 void       pst_vbgrow(pst_vbuf *vb, size_t len);    // grow buffer by len bytes, data are preserved
 void       pst_vbset(pst_vbuf *vb, void *data, size_t len);
 void       pst_vbappend(pst_vbuf *vb, void *data, size_t length);
-void       pst_unicode_init();
-void       pst_unicode_close();
+void       pst_unicode_init();     // reset the conversion state of the calling thread
+void       pst_unicode_close();    // release the conversion state of the calling thread
 size_t     pst_vb_utf16to8(pst_vbuf *dest, const char *inbuf, int iblen);
 size_t     pst_vb_utf8to8bit(pst_vbuf *dest, const char *inbuf, int iblen, const char* charset);
 size_t     pst_vb_8bit2utf8(pst_vbuf *dest, const char *inbuf, int iblen, const char* charset);